@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,6 +17,39 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/route.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#ifdef __APPLE__
+#include <libproc.h>
+#include <mach/mach_time.h>
+#include <mach-o/dyld.h>
+#include <sys/sysctl.h>
+#include <net/if_dl.h>
+#include <netinet/if_ether.h>
+#include <sys/event.h>
+#include <sys/clonefile.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #define MAX_PATH 1024
 #define MAX_LINE 4096
@@ -28,6 +62,103 @@
 #define DEFAULT_MEMORY "4096"
 #define DEFAULT_CPUS "4"
 #define DEFAULT_DISK_SIZE "20G"
+#define DEFAULT_METRICS_LISTEN "127.0.0.1:9464"
+#define DEFAULT_METRICS_INTERVAL 10
+
+#define QMP_BUF_SIZE 32768
+#define QMP_TIMEOUT_MS 2000
+#define LIFECYCLE_OPS 5
+#define LIFECYCLE_BUCKETS 8
+#define TOP_COLUMNS 7
+#define BOOT_MAX_PHASES 64
+#define BOOT_READY_TIMEOUT 300
+#define TRACE_BUFFER_EVENTS 4096
+#define JSON_MAX_DEPTH 64
+#define VM_INFO_SCHEMA 2
+#define STATE_INDEX_HEADER "# v4m vm index 1\n"
+#define REAPER_TRUNCATE_STEP (256LL * 1024 * 1024)
+#define REAPER_STEP_PAUSE_US 20000
+#define STOP_POWERDOWN_TIMEOUT 30
+#define STOP_QUIT_TIMEOUT 10
+#define STOP_KILL_TIMEOUT 5
+#define SUPERVISE_BACKOFF_MIN 1
+#define SUPERVISE_BACKOFF_MAX 300
+#define SUPERVISE_STABLE_SECONDS 60
+#define SUPERVISE_POLL_MS 1000
+#define AUTOSTART_STAGGER 1
+#define DEFAULT_BOOT_SLOTS 4
+#define BOOT_PSI_LOW 10.0
+#define BOOT_PSI_HIGH 40.0
+#define BOOT_QUEUE_POLL_MS 250
+#define CDC_MIN_SIZE (16 * 1024)
+#define CDC_AVG_SIZE (64 * 1024)
+#define CDC_MAX_SIZE (256 * 1024)
+#define CDC_MASK_SMALL 0xffffc00000000000ULL
+#define CDC_MASK_LARGE 0xfffc000000000000ULL
+#define LZ_HASH_BITS 14
+#define STORE_IO_BUFFER (8 * 1024 * 1024)
+#define STORE_CHUNK_MAGIC "V4MC"
+#define STORE_CHUNK_HEADER 16
+#define STORE_MANIFEST_HEADER "# v4m image manifest 1\n"
+#define IMAGE_SUMS_HEADER "# v4m block sums 1\n"
+#define IMAGE_SUMS_BLOCK (64 * 1024)
+#define WEAK_MOD 65536
+#define DELTA_MERGE_BLOCKS 4
+#define HTTP_VALIDATORS_HEADER "# v4m http validators 1\n"
+#define HTTP_PROBE_TIMEOUT 30
+#define MAX_MIRRORS 8
+#define MIRROR_RACE_TIMEOUT 5
+#define IMAGE_CONVERT_COROUTINES 16
+#define IMAGE_TUNED_OPTIONS "cluster_size=128k,extended_l2=on,lazy_refcounts=on"
+#define IMAGE_BENCH_BLOCK 65536
+#define IMAGE_BENCH_DEPTH 16
+#define MIRROR_SPEED_MIN_BYTES (1024 * 1024)
+#define QCOW2_MAGIC 0x514649fbU
+#define QCOW2_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW2_COMPRESSED (1ULL << 62)
+#define QCOW2_MAX_L1_ENTRIES (32 * 1024 * 1024)
+#ifdef __linux__
+#define QEMU_L2_CACHE_MAX (32ULL * 1024 * 1024)
+#else
+#define QEMU_L2_CACHE_MAX (8ULL * 1024 * 1024)
+#endif
+#define DEFRAG_JOB "v4m-defrag"
+#define VM_DISK_DRIVE "disk0"
+#define DEFRAG_POLL_MS 200
+#define RECLAIM_TRIM_FIRST 600
+#define RECLAIM_TRIM_INTERVAL (24 * 3600)
+#define RECLAIM_TRIM_TIMEOUT_MS 300000
+#define RECLAIM_PUNCH_BLOCK (64 * 1024)
+#define MAX_POOLS 16
+#define POOL_MIN_FREE (4ULL * 1024 * 1024 * 1024)
+#define POOL_PROBE_BLOCK 4096
+#define POOL_PROBE_SAMPLES 5
+#define MOVE_JOB "v4m-move"
+#define EPHEMERAL_DEFAULT_CAP (4ULL * 1024 * 1024 * 1024)
+#define EPHEMERAL_TMPFS "/dev/shm"
+#define RUN_AGENT_TIMEOUT 900
+#define RUN_POLL_MS 20
+#define RUN_CHUNK (16 * 1024)
+#define RUN_WORKDIR "/tmp"
+#define RUN_WARM_PREFIX "warm-"
+#define RUN_MAX_WARM 32
+#define RUN_MAX_COPIES 32
+#define DEFAULT_NETWORK "bridged"
+#define FLEET_MAX_VMS 256
+#define FLEET_DEFAULT_PARALLEL 4
+#define FLEET_EST_CREATE 20
+#define FLEET_EST_BOOT 60
+#define FLEET_EST_STOP 5
+#define EVENTS_LOG_MAX (4 * 1024 * 1024)
+#define EVENTS_MAX_CLIENTS 64
+#define EVENTS_POLL_MS 100
+#define EVENTS_HELLO_MS 250
+#define EVENTS_BOOT_POLL_MS 250
+#define EVENTS_AGENT_TIMEOUT_MS 1000
+#define EVENTS_IP_RETRY 2
+#define EVENTS_IP_RECHECK 60
+// Every guest runs under qemu-system-aarch64
+#define GUEST_ARCH "aarch64"
 
 // Colors
 #define RED     "\033[0;31m"
@@ -35,44 +166,852 @@
 #define YELLOW  "\033[1;33m"
 #define BLUE    "\033[0;34m"
 #define CYAN    "\033[0;36m"
+#define GRAY    "\033[0;90m"
 #define NC      "\033[0m"
 
+// vm-info.json. Schema history:
+//   1  no "schema" key, every value a string (shell script and early C builds)
+//   2  "schema": 2, memory (MB) and cpus stored as numbers
+// Keys added since default when absent: autostart (false), pool ("default"),
+// network ("bridged"), fleet ("", not in a fleet), disk_format ("qcow2",
+// what every disk was before the raw layout)
 typedef struct {
+    int schema;
     char name[MAX_NAME];
     char distro[MAX_NAME];
     char username[MAX_NAME];
     char password[MAX_NAME];
     char mac[18];
-    char memory[16];
-    char cpus[16];
+    int memory_mb;
+    int cpus;
     char disk_size[16];
     char created[64];
+    int autostart;
+    char pool[MAX_NAME];
+    char network[32];
+    char fleet[MAX_NAME];
+    char disk_format[8];
 } VMInfo;
 
+typedef enum {
+    JSON_NULL,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct {
+    JsonType type;
+    const char *key;
+    const char *string;
+    double number;
+    int child;
+    int next;
+} JsonNode;
+
+typedef struct {
+    char *text;
+    JsonNode *nodes;
+    int count;
+    int capacity;
+    size_t error_offset;
+} JsonDoc;
+
+typedef struct {
+    char name[MAX_NAME];
+    char dir[MAX_PATH];
+} VMEntry;
+
+typedef struct {
+    VMEntry *items;
+    int count;
+    int capacity;
+} VMList;
+
+typedef struct {
+    char ip[64];
+    unsigned char mac[6];
+} ArpEntry;
+
+// argv for a directly exec'd program; items are malloc'd and NULL terminated.
+// env entries are added to the child's environment; max_file_size, when
+// set, becomes its RLIMIT_FSIZE
+typedef struct {
+    char *items[64];
+    int count;
+    char *env[4];
+    int env_count;
+    uint64_t max_file_size;
+} ArgList;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// Newline-delimited JSON connection (QMP monitor or guest agent)
+typedef struct {
+    int fd;
+    int inflight;
+    int missed;
+    size_t len;
+    char buf[QMP_BUF_SIZE];
+} QMPConn;
+
+// One VM being shut down by stop_vms(): ACPI powerdown, then QMP quit, then
+// SIGKILL, each stage with its own deadline
+typedef enum {
+    STOP_POWERDOWN,
+    STOP_QUIT,
+    STOP_KILL,
+    STOP_DONE
+} StopStage;
+
+typedef struct {
+    char name[MAX_NAME];
+    char vm_dir[MAX_PATH];
+    pid_t pid;
+    int watch_fd;        // pidfd (Linux) or kqueue (macOS); -1 means poll with kill(pid, 0)
+    int qmp_fd;
+    StopStage stage;
+    double deadline;
+    double seconds;      // powerdown request to exit
+    const char *result;  // "powerdown", "quit", "killed", "not running" or "failed"
+} StopTarget;
+
+typedef struct {
+    int running;
+    double timestamp;
+    double cpu_seconds;
+    double steal_seconds;
+    int has_steal;
+    uint64_t rss_bytes;
+    uint64_t rd_bytes;
+    uint64_t wr_bytes;
+    uint64_t rd_ops;
+    uint64_t wr_ops;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    int has_net;
+    uint64_t balloon_actual;
+    int64_t balloon_free;
+    int64_t balloon_total;
+    uint64_t disk_size;
+    uint64_t disk_allocated;
+} VMSample;
+
+typedef struct {
+    char name[MAX_NAME];
+    char vm_dir[MAX_PATH];
+    pid_t pid;
+    int seen;
+    QMPConn qmp;
+    QMPConn qga;
+    VMSample sample;
+    VMSample prev;
+} VMMonitor;
+
+typedef struct {
+    VMMonitor *vms;
+    int count;
+    int capacity;
+} MonitorTable;
+
+typedef struct {
+    uint64_t counts[LIFECYCLE_OPS][LIFECYCLE_BUCKETS + 1];
+    uint64_t total[LIFECYCLE_OPS];
+    double sum[LIFECYCLE_OPS];
+    long offset;
+} LifecycleStats;
+
+// One rendered row of `v4m top`, rates computed from consecutive samples
+typedef struct {
+    const char *name;
+    int running;
+    double cpu_pct;
+    double steal_pct;
+    double mem_bytes;
+    double iops;
+    double disk_bps;
+    double net_bps;
+    int has_steal;
+    int has_net;
+} TopRow;
+
+// A timed step of create-to-ready; guest milestones are instants until the
+// next milestone closes them
+typedef struct {
+    char name[64];
+    char category[16];
+    double start;
+    double duration;
+} BootPhase;
+
+typedef struct {
+    int enabled;
+    double origin;
+    int count;
+    BootPhase phases[BOOT_MAX_PHASES];
+} BootProfile;
+
+// Incremental scan of a VM's serial log for the cloud-init ready line
+typedef struct {
+    char serial_log[MAX_PATH + 16];
+    long offset;
+    char line[MAX_LINE];
+    size_t line_len;
+} BootWatch;
+
+// One VM waiting for, or holding, a boot slot
+typedef struct {
+    int vm;              // index into the caller's VM list
+    int slot_fd;         // -1 until admitted
+    double waited;       // time queued
+    double admitted;
+    BootWatch watch;
+} BootTicket;
+
+// Tracing: spans are recorded into per-thread buffers that are only linked
+// (lock-free) into a global list, and dumped as Chrome trace JSON at exit
+typedef struct {
+    const char *name;
+    const char *detail;
+    uint64_t start_ns;
+    uint32_t id;
+    uint32_t parent;
+} TraceSpan;
+
+typedef struct {
+    const char *name;
+    char detail[64];
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t id;
+    uint32_t parent;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int tid;
+    int count;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+#define TRACE_SCOPE(name, detail) \
+    TraceSpan trace_scope_ __attribute__((cleanup(trace_scope_end))) = trace_begin(name, detail)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+// Image store counters. For an ingest, new_* are chunks written and dup_*
+// chunks already present; for a store walk, new_* are the live chunks and
+// dup_* what gc removed
+typedef struct {
+    int images;
+    int chunks;
+    int new_chunks;
+    int dup_chunks;
+    uint64_t logical_bytes;
+    uint64_t zero_bytes;
+    uint64_t new_bytes;
+    uint64_t dup_bytes;
+    uint64_t stored_bytes;
+} StoreStats;
+
+// Published block sums of an image, see block_sums_write()
+typedef struct {
+    uint64_t size;
+    uint32_t block;
+    int count;
+    char sha256[65];
+    uint32_t *weak;
+    char (*strong)[65];
+} BlockSums;
+
+// One distro/arch pair of the registry, see default_registry
+typedef struct {
+    char distro[MAX_NAME];
+    char arch[32];
+    char format[16];
+    char boot[16];
+    char sha256[65];
+    int mirror_count;
+    char mirrors[MAX_MIRRORS][MAX_URL];
+} DistroEntry;
+
+typedef struct {
+    DistroEntry *items;
+    int count;
+    int loaded;
+    char source[MAX_PATH];
+} DistroRegistry;
+
+typedef struct {
+    int index;
+    int local;
+    int ok;
+    double latency;
+    double speed;
+    FILE *fp;
+    StrBuf headers;
+} MirrorProbe;
+
+// HTTP validators of a cached image as last seen, kept in IMAGE.http.
+// Header values longer than MAX_NAME - 1 are dropped, never truncated
+typedef struct {
+    char url[MAX_URL];
+    char etag[MAX_NAME];
+    char last_modified[MAX_NAME];
+    long long content_length;
+    long checked;
+    int stale;
+} HttpValidators;
+
+typedef struct {
+    char distro[MAX_NAME];
+    char image[MAX_PATH];
+    HttpValidators known;
+    HttpValidators seen;
+    FILE *probe;
+    int status;
+    int stale;
+    int error;
+    const char *reason;
+} ImageCheck;
+
+typedef struct {
+    uint64_t reused_bytes;
+    uint64_t zero_bytes;
+    uint64_t fetched_bytes;
+    int requests;
+    int range_ignored;
+    int verify_failed;
+} DeltaStats;
+
+// What the qcow2 metadata of a disk says about its layout on the host
+typedef struct {
+    int version;
+    int cluster_bits;
+    int extended_l2;
+    int compression_type;
+    uint64_t virtual_size;
+    uint64_t file_size;
+    uint64_t host_allocated;
+    uint64_t l2_tables;
+    uint64_t data_clusters;
+    uint64_t zero_clusters;
+    uint64_t compressed_clusters;
+    uint64_t compressed_bytes;
+    uint64_t unallocated_clusters;
+    uint64_t fragments;
+    uint64_t discontinuities;
+} Qcow2Stats;
+
+// Space given back by trims and compactions, per VM and summed for the fleet
+typedef struct {
+    uint64_t allocated;
+    uint64_t trimmed;
+    uint64_t compacted;
+    long last;
+    int trims;
+    int vms;
+} ReclaimTotals;
+
+typedef struct {
+    uint64_t reclaimed;
+    int failures;
+} ReclaimPass;
+
+// A storage pool as configured, plus what a survey found
+typedef struct {
+    char name[MAX_NAME];
+    char path[MAX_PATH];
+    uint64_t capacity;
+    uint64_t free;
+    double latency_ms;
+    int offline;
+    int disks;
+    int active;
+} StoragePool;
+
+typedef struct {
+    StoragePool *pools;
+    int count;
+} PoolUsage;
+
+typedef struct {
+    char root[MAX_PATH];
+    char device[64];
+    char base[MAX_PATH];
+    uint64_t cap;
+    int snapshot;
+} EphemeralStore;
+
+typedef struct {
+    const char *distro;
+    int take;
+    int idle;
+    char name[MAX_NAME];
+    char vm_dir[MAX_PATH];
+} RunClaim;
+
+typedef enum {
+    FLEET_NONE,
+    FLEET_CREATE,
+    FLEET_UPDATE,
+    FLEET_REPLACE,
+    FLEET_DELETE,
+    FLEET_CONFLICT
+} FleetAction;
+
+typedef enum {
+    FLEET_PENDING,
+    FLEET_RUNNING,
+    FLEET_DONE,
+    FLEET_FAILED,
+    FLEET_SKIPPED
+} FleetStatus;
+
+// One line of a fleet file, and what apply does about it
+typedef struct {
+    char name[MAX_NAME];
+    char distro[MAX_NAME];
+    int memory_mb;
+    int cpus;
+    char disk_size[16];
+    char pool[MAX_NAME];
+    char network[32];
+    int autostart;
+    int running;            // desired state
+    char after[MAX_LINE];   // comma-separated VMs this one waits for
+    int wave;
+    FleetAction action;
+    char changes[MAX_LINE];
+    int restart;            // a running VM must restart to pick the changes up
+    int was_running;
+    double estimate;
+    FleetStatus status;
+    pid_t pid;
+    double started;
+} FleetVM;
+
+typedef struct {
+    char name[MAX_NAME];
+    FleetVM *vms;
+    int count;
+    int prune;           // may delete VMs (unlisted ones, or to recreate one)
+} Fleet;
+
+// What a supervisor follows to turn a running QEMU into events
+typedef struct {
+    char vm_name[MAX_NAME];
+    char vm_dir[MAX_PATH];
+    char events_sock[MAX_PATH + 16];
+    QMPConn qmp;            // the events monitor, fd -1 until connected
+    BootWatch boot;
+    int ready;
+    char ip[64];
+    double started;
+    double next_connect;
+    double next_ip_check;
+} EventWatch;
+
+// Subscriber of the event stream; until STREAMING it is waiting for its
+// optional {"since": N} line
+typedef struct {
+    int fd;
+    int streaming;
+    uint64_t since;         // last sequence number it has
+    double deadline;
+    char hello[128];
+    size_t hello_len;
+} EventClient;
+
+// Server's read position in the journal
+typedef struct {
+    int fd;
+    ino_t inode;
+    uint64_t latest;
+    char line[MAX_LINE];
+    size_t len;
+} EventTail;
+
+typedef int (*vm_visit_fn)(const char *vm_name, const char *vm_dir, void *ctx);
+
 // Function prototypes
 void log_info(const char *message);
 void log_success(const char *message);
 void log_warning(const char *message);
 void log_error(const char *message);
 int check_root();
+void show_help(const char *program);
 void init_dirs();
 void generate_vm_name(char *name, size_t size);
 void generate_password(char *password, size_t size);
 const char *get_distro_url(const char *distro);
+void registry_path(char *path, size_t size);
+int registry_parse(const char *text, const char *source, DistroRegistry *reg);
+DistroRegistry *registry_get();
+const DistroEntry *registry_find(const char *distro);
+void registry_names(char *out, size_t size);
+double mirror_speed_get(const char *url);
+void mirror_speed_record(const char *url, double bytes_per_sec);
+int mirror_race(const DistroEntry *entry, int *order);
+int compare_mirror_probes(const void *a, const void *b);
+int image_registry_command(int argc, char *argv[]);
 int ensure_distro(const char *distro, char *distro_path, size_t size);
+int distro_fetch(const char *url, const char *image, const char *sha256, char *distro_path, size_t size);
+void distro_part_path(const char *image, const char *url, char *out, size_t size);
 void generate_mac(char *mac, size_t size);
 int hash_password(const char *password, char *hashed, size_t size);
 int create_cloud_init(const char *vm_name, const char *username, 
                      const char *password, const char *vm_dir);
 int create_vm(const char *vm_name, const char *distro, 
              const char *username, const char *password);
+int provision_vm(const char *vm_name, const char *distro, const char *username,
+                 const char *password, char *vm_mac, size_t mac_size);
 int start_vm(const char *vm_name, const char *vm_mac, const char *vm_dir);
+int spawn_vm(const char *vm_name, const char *vm_mac, const char *vm_dir);
 void show_vm_info(const char *vm_name, const char *vm_dir);
 int execute_command(const char *command, char *output, size_t output_size);
 int file_exists(const char *path);
 int dir_exists(const char *path);
 int copy_file(const char *src, const char *dest);
+int create_sparse_file(const char *path, off_t size);
+int remove_tree(const char *path);
+int stop_vm(const char *vm_dir, int timeout_sec);
+int self_executable_path(char *path, size_t size);
 int get_default_interface(char *interface, size_t size);
+double now_monotonic();
+int compare_doubles(const void *a, const void *b);
+void sb_printf(StrBuf *sb, const char *fmt, ...);
+void sb_free(StrBuf *sb);
+int for_each_vm(vm_visit_fn fn, void *ctx);
+pid_t read_vm_pid(const char *vm_dir);
+int vm_is_active(const char *vm_dir);
+int process_start_time(pid_t pid, uint64_t *start);
+int write_pid_file(const char *path, pid_t pid);
+pid_t read_pid_file(const char *path);
+void arg_add(ArgList *args, const char *fmt, ...);
+void arg_env(ArgList *args, const char *fmt, ...);
+void arg_free(ArgList *args);
+int read_process_stats(pid_t pid, double *cpu_seconds, uint64_t *rss_bytes);
+int read_process_steal(pid_t pid, double *steal_seconds);
+void record_lifecycle(const char *op, double seconds);
+
+// QMP / guest agent
+int unix_connect(const char *sock_path);
+int qmp_open(QMPConn *conn, const char *sock_path, int handshake);
+void qmp_close(QMPConn *conn);
+int qmp_send(QMPConn *conn, const char *json);
+int qmp_fill(QMPConn *conn);
+int qmp_next_message(QMPConn *conn, char *msg, size_t size);
+int qmp_execute(QMPConn *conn, const char *json, char *resp, size_t size, int timeout_ms);
+const char *json_find_key(const char *json, const char *end, const char *key);
+int json_number_in(const char *json, const char *end, const char *key, double *value);
+int json_string_in(const char *json, const char *end, const char *key, char *out, size_t size);
+
+// Shutdown
+int proc_watch_open(pid_t pid);
+void stop_finish(StopTarget *t, double started, double now, const char *result);
+void stop_escalate(StopTarget *t, double now, double quit_timeout);
+int stop_vms(StopTarget *targets, int count, double powerdown_timeout, double quit_timeout);
+
+// Supervisor
+int supervise_spawn(const char *vm_dir, ArgList *args, const char *log_file);
+void supervise_run(const char *vm_dir, ArgList *args, const char *log_file, int ready_fd);
+pid_t supervise_exec(ArgList *args, const char *log_file, int *error);
+int supervise_should_stop(const char *vm_dir);
+void supervise_request_stop(const char *vm_dir);
+void supervise_log(const char *vm_dir, const char *fmt, ...);
+void close_inherited_fds(int keep);
+
+// JSON documents
+int json_parse(JsonDoc *doc, const char *text, size_t len);
+void json_free(JsonDoc *doc);
+int json_get(const JsonDoc *doc, int object, const char *key);
+const char *json_get_string(const JsonDoc *doc, int object, const char *key, const char *fallback);
+double json_get_number(const JsonDoc *doc, int object, const char *key, double fallback);
+void json_write_string(StrBuf *sb, const char *value);
+int write_file_atomic(const char *path, const char *data, size_t len);
+int read_file(const char *path, char **data, size_t *len);
+
+// VM metadata and CLI commands
+int load_vm_info(const char *vm_dir, VMInfo *info);
+int save_vm_info(const char *vm_dir, const VMInfo *info);
+unsigned int vm_shard(const char *vm_name);
+void vm_dir_path(const char *vm_name, char *vm_dir, size_t size);
+int index_read(StrBuf *names);
+int index_rebuild();
+int index_update(const char *vm_name, int add);
+int vm_dir_create(const char *vm_name);
+int vm_tombstone(const char *vm_name, char *tombstone, size_t size);
+int vm_destroy(const char *vm_name);
+int reaper_spawn();
+void reaper_run();
+int reindex_command();
+void sanitize_vm_name(const char *name, char *out, size_t size);
+int name_is_safe(const char *name);
+int collect_vms(VMList *list);
+void free_vm_list(VMList *list);
+int disk_virtual_size(const char *path, uint64_t *size);
+int arp_table_load(ArpEntry **entries);
+int arp_lookup(const ArpEntry *entries, int count, const char *mac, char *ip, size_t size);
+int get_vm_ip(const char *vm_name, const char *mac, char *ip, size_t size);
+int confirm(const char *prompt, const char *expected);
+int require_vm(int argc, char *argv[], char *vm_dir, size_t size);
+int vm_list_command();
+int vm_start_command(int argc, char *argv[]);
+int vm_stop_command(int argc, char *argv[]);
+int vm_delete_command(int argc, char *argv[]);
+int vm_ip_command(int argc, char *argv[]);
+int vm_console_command(int argc, char *argv[]);
+int vm_autostart_command(int argc, char *argv[]);
+int autostart_command(int argc, char *argv[]);
+int image_command(int argc, char *argv[]);
+int image_store_command(int argc, char *argv[]);
+int distro_download_busy(const char *distro_dir);
+int find_distro_image(const char *distro_dir, char *path, size_t size);
+int purge_command();
+
+// Image store
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, char hex[65]);
+void sha256_block(Sha256 *ctx, const unsigned char *block);
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity);
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t out_len);
+size_t cdc_next(const unsigned char *data, size_t len);
+int is_zero_block(const unsigned char *data, size_t len);
+void store_path(char *path, size_t size, const char *sub);
+void store_chunk_path(const char *hex, char *path, size_t size);
+int store_lock(int operation);
+int store_put_chunk(const char *hex, const unsigned char *data, size_t len, unsigned char *scratch, StoreStats *stats);
+ssize_t store_get_chunk(const char *hex, unsigned char *out, unsigned char *scratch);
+int store_ingest(const char *src, const char *manifest, StoreStats *stats);
+int store_manifest_read(const char *manifest, char **text, char **body, uint64_t *size, char id[65]);
+int store_materialize(const char *manifest, const char *dest, double *bytes_per_sec);
+int reflink_file(const char *src, const char *dest);
+int compare_hashes(const void *a, const void *b);
+int store_references(char (**hashes)[64], int *image_count, StrBuf *ids, uint64_t *logical, uint64_t *zero);
+int store_walk(int collect, StoreStats *stats);
+
+// Image updates
+uint32_t weak_checksum(const unsigned char *data, size_t len, uint32_t *a_out, uint32_t *b_out);
+int block_sums_write(const char *image, const char *out);
+int block_sums_read(const char *path, BlockSums *sums);
+void block_sums_free(BlockSums *sums);
+int fetch_range(const char *url, uint64_t start, uint64_t len, int fd, unsigned char *buf, size_t buf_size);
+int delta_rebuild(const char *url, const BlockSums *sums, const char *old, const char *out, DeltaStats *stats);
+int image_update_command(int argc, char *argv[]);
+int image_update(const char *distro, const char *url_override, const char *sums_override);
+int http_validators_parse(const char *headers, HttpValidators *validators);
+int http_validators_load(const char *image, HttpValidators *validators);
+int http_validators_save(const char *image, const HttpValidators *validators);
+FILE *http_probe_start(const char *url, const HttpValidators *known, int timeout);
+int http_probe_finish(FILE *fp, HttpValidators *validators);
+int image_check_command(int argc, char *argv[]);
+int image_sums_command(int argc, char *argv[]);
+
+// Image layouts
+extern const char *image_layouts[];
+extern char pull_layout[16];
+int image_layout_valid(const char *layout);
+void image_layout_get(const char *image, char *layout, size_t size);
+int image_layout_set(const char *image, const char *layout);
+const char *disk_format(const char *path);
+const char *vm_disk_format(const char *vm_dir);
+int image_convert(const char *path, const char *layout);
+int image_relayout(const char *distro, const char *layout);
+int image_bench_command(int argc, char *argv[]);
+
+// Disk maintenance
+uint32_t read_be32(const unsigned char *p);
+uint64_t read_be64(const unsigned char *p);
+int qcow2_analyze(const char *path, Qcow2Stats *stats);
+void qcow2_create_options(const Qcow2Stats *source, char *out, size_t size);
+int vm_disk_stats_command(const char *vm_name, const char *vm_dir);
+int disk_defrag_offline(const char *disk, const char *format);
+int disk_defrag_online(const char *vm_dir, const char *disk);
+int vm_disk_defrag_command(const char *vm_name, const char *vm_dir, int offline_only);
+int vm_disk_command(int argc, char *argv[]);
+uint64_t disk_allocated_bytes(const char *path);
+void reclaim_record(const char *vm_dir, const char *kind, uint64_t bytes);
+int punch_hole(int fd, off_t offset, off_t len);
+int disk_punch_zeroes(const char *path, uint64_t *reclaimed);
+int vm_trim(const char *vm_dir, uint64_t *trimmed, uint64_t *reclaimed);
+void supervise_trim(const char *vm_dir);
+int vm_disk_trim_one(const char *vm_name, const char *vm_dir, void *ctx);
+int vm_disk_compact_one(const char *vm_name, const char *vm_dir, void *ctx);
+int vm_disk_reclaim_row(const char *vm_name, const char *vm_dir, void *ctx);
+int vm_disk_reclaim_command(void);
+int vm_disk_reclaim_action(const char *action, const char *target);
+int qmp_block_job_run(QMPConn *conn, const char *job, char *resp, size_t size);
+int qmp_disk_node(QMPConn *conn, char *node, size_t size, char *resp, size_t resp_size);
+
+// Storage pools
+extern char create_pool[MAX_NAME];
+int pool_load(StoragePool *pools, int max);
+int pool_save(const StoragePool *pools, int count);
+int pool_find(const StoragePool *pools, int count, const char *name);
+double pool_latency_get(const char *name);
+void pool_latency_record(const char *name, double ms);
+int pool_probe(StoragePool *pool);
+int pool_usage_visit(const char *vm_name, const char *vm_dir, void *ctx);
+int pool_survey(StoragePool *pools, int max);
+int pool_select(char *name, size_t size);
+int pool_disk_path(const char *pool_name, const char *vm_name, char *path, size_t size);
+int vm_disk_link(const char *vm_dir, const char *target);
+void vm_disk_real_path(const char *vm_dir, char *path, size_t size);
+int vm_move_command(int argc, char *argv[]);
+int pool_command(int argc, char *argv[]);
+
+// Ephemeral VMs
+extern int create_ephemeral;
+extern int create_snapshot;
+extern uint64_t ephemeral_cap;
+int parse_size(const char *text, uint64_t *bytes);
+int ephemeral_load(const char *vm_dir, EphemeralStore *store);
+int ephemeral_save(const EphemeralStore *store);
+int ephemeral_dir_create(const char *vm_name, uint64_t cap, EphemeralStore *store);
+void ephemeral_release(const char *vm_dir);
+void ephemeral_store_free(const EphemeralStore *store);
+int ephemeral_base(const char *distro_path, char *base, size_t size);
+int ephemeral_base_visit(const char *vm_name, const char *vm_dir, void *ctx);
+int ephemeral_disk_create(EphemeralStore *store, const char *base, int snapshot);
+
+// One-shot runs
+void run_handle_signal(int sig);
+void base64_encode(const unsigned char *data, size_t len, StrBuf *sb);
+ssize_t base64_decode(const char *text, unsigned char *out, size_t size);
+int run_agent_connect(const char *vm_dir, QMPConn *conn, double deadline);
+int run_file_open(QMPConn *conn, const char *path, const char *mode, int *handle);
+void run_file_close(QMPConn *conn, int handle);
+int run_copy_in(QMPConn *conn, const char *src, const char *dest);
+ssize_t run_drain(QMPConn *conn, int handle, int fd);
+int run_exec(QMPConn *conn, char **argv, int argc, const char *out_path, const char *err_path, int *pid);
+int run_exec_status(QMPConn *conn, int pid, int *status);
+int run_claim_visit(const char *vm_name, const char *vm_dir, void *ctx);
+int run_vm_create(const char *vm_name, const char *distro);
+void run_vm_discard(const char *vm_name, const char *vm_dir);
+int run_prewarm(const char *distro, int count);
+int run_in_vm(QMPConn *conn, const char **copies, int copy_count, char **argv, int argc, double timeout, int out_fd);
+int oneshot_command(int argc, char *argv[]);
+
+// Fleets
+extern const char *fleet_action_names[];
+int fleet_parse_memory(const char *text, int *memory_mb);
+int fleet_parse(const char *text, const char *source, Fleet *fleet);
+int fleet_find(const Fleet *fleet, const char *name);
+int fleet_each_dependency(Fleet *fleet, FleetVM *vm, int (*fn)(Fleet *fleet, FleetVM *vm, FleetVM *dep));
+int fleet_wave_visit(Fleet *fleet, FleetVM *vm, FleetVM *dep);
+int fleet_waves(Fleet *fleet);
+void fleet_note(FleetVM *vm, const char *fmt, ...);
+void fleet_plan_vm(Fleet *fleet, FleetVM *vm);
+int fleet_orphan_visit(const char *vm_name, const char *vm_dir, void *ctx);
+double fleet_estimate_op(const LifecycleStats *stats, const char *op, double fallback);
+void fleet_estimate(Fleet *fleet);
+int fleet_dependency_pending(Fleet *fleet, FleetVM *vm, FleetVM *dep);
+int fleet_dependency_failed(Fleet *fleet, FleetVM *vm, FleetVM *dep);
+int fleet_converge(const char *fleet_name, FleetVM *vm);
+pid_t fleet_spawn(const char *fleet_name, FleetVM *vm);
+double fleet_run(Fleet *fleet, int parallel, int simulate);
+void fleet_print_plan(const Fleet *fleet);
+int apply_command(int argc, char *argv[]);
+
+// Events
+void events_handle_signal(int sig);
+uint64_t event_record(const char *vm_name, const char *event, const char *extra_fmt, ...);
+uint64_t event_seq_of(const char *line);
+int event_guest_ip(const char *vm_dir, char *ip, size_t size);
+void event_watch_init(EventWatch *watch, const char *vm_dir);
+void event_watch_close(EventWatch *watch);
+void event_watch_poll(EventWatch *watch, int exit_fd, int timeout_ms);
+int events_replay_file(const char *path, int fd, uint64_t *since, uint64_t *oldest);
+int events_replay(EventClient *client);
+void events_tail(EventTail *tail, EventClient *clients, int *count);
+void events_broadcast(const char *line, size_t len, uint64_t seq, EventClient *clients, int *count);
+int events_client_ready(EventClient *client, uint64_t latest, double now);
+int events_serve(const char *sock_path);
+int events_follow(const char *sock_path, const char *since);
+int events_command(int argc, char *argv[]);
+
+// Metrics exporter
+int metrics_command(int argc, char *argv[]);
+int metrics_listen(const char *address);
+void monitor_refresh(MonitorTable *table);
+void monitor_sample(MonitorTable *table, int timeout_ms);
+void monitor_free(MonitorTable *table);
+void lifecycle_stats_update(LifecycleStats *stats);
+void metrics_render(StrBuf *page, MonitorTable *table, LifecycleStats *lifecycle, double collect_seconds);
+
+// Tracing
+extern int trace_enabled;
+int trace_start(const char *path);
+TraceSpan trace_start_span(const char *name, const char *detail);
+void trace_finish_span(TraceSpan *span);
+void trace_flush();
+int run_command(const char *command);
+
+static inline TraceSpan trace_begin(const char *name, const char *detail) {
+    if (__builtin_expect(!trace_enabled, 1)) {
+        TraceSpan none = {0};
+        return none;
+    }
+    return trace_start_span(name, detail);
+}
+
+static inline void trace_scope_end(TraceSpan *span) {
+    if (__builtin_expect(span->id != 0, 0)) {
+        trace_finish_span(span);
+    }
+}
+
+// Boot profiler
+extern BootProfile boot_profile;
+int boot_phase_begin(const char *name);
+void boot_phase_end(int phase);
+void boot_mark(const char *name);
+int wait_for_boot(const char *vm_dir, int timeout_sec);
+int boot_profile_save(const char *vm_dir);
+int boot_profile_load(const char *vm_dir, BootProfile *profile);
+void boot_profile_print(BootProfile *profile);
+int boot_profile_write_trace(BootProfile *profile, const char *vm_name, const char *path);
+int boot_report_command(int argc, char *argv[]);
+
+// Boot scheduler
+extern int boot_slots;
+int parse_count(const char *text, int *count);
+void boot_watch_init(BootWatch *watch, const char *vm_dir);
+int boot_watch_poll(BootWatch *watch);
+int io_pressure(double *some_avg10);
+int boot_slot_limit(double *pressure);
+int boot_slot_try(int *booting, int *limit, double *pressure);
+int boot_slot_acquire(double *waited);
+void boot_slot_release(int slot_fd);
+
+// Benchmark harness and QEMU stand-ins (built with -DV4M_BENCH)
+#ifdef V4M_BENCH
+int bench_command(int argc, char *argv[]);
+int stub_qemu_main(int argc, char *argv[]);
+int stub_qemu_img_main(int argc, char *argv[]);
+int stub_hdiutil_main(int argc, char *argv[]);
+#endif
+
+// Top dashboard
+int top_command(int argc, char *argv[]);
+void top_compute_rows(MonitorTable *table, TopRow *rows);
+void top_sort_rows(TopRow *rows, int count, int column, int reverse);
+void top_draw(StrBuf *frame, TopRow *rows, int count, int column, int reverse, double interval);
+void format_size(double bytes, char *out, size_t size);
 
 int main(int argc, char *argv[]) {
     char vm_name[MAX_NAME] = "";
@@ -80,8 +1019,115 @@ int main(int argc, char *argv[]) {
     char username[MAX_NAME] = DEFAULT_USER;
     char password[MAX_NAME] = "";
     
-    // Parse command line arguments
+#ifdef V4M_BENCH
+    // Multi-call: the benchmark links this binary in as QEMU and friends.
+    // Only benchmark builds carry the stand-ins, so an installed v4m can
+    // never turn into a fake hypervisor through a link name
+    const char *program = strrchr(argv[0], '/');
+    program = program ? program + 1 : argv[0];
+    if (strcmp(program, "qemu-system-aarch64") == 0) {
+        return stub_qemu_main(argc, argv);
+    }
+    if (strcmp(program, "qemu-img") == 0) {
+        return stub_qemu_img_main(argc, argv);
+    }
+    if (strcmp(program, "hdiutil") == 0) {
+        return stub_hdiutil_main(argc, argv);
+    }
+#endif
+    
+    // --trace=FILE may appear anywhere before "--" and applies to every
+    // command; what follows "--" belongs to the command being run
+    int kept = 1;
+    int passthrough = 0;
     for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) passthrough = 1;
+        if (!passthrough && strncmp(argv[i], "--trace=", 8) == 0) {
+            if (trace_start(argv[i] + 8) != 0) {
+                log_error("Failed to open trace file");
+                return 1;
+            }
+            continue;
+        }
+        argv[kept++] = argv[i];
+    }
+    argc = kept;
+    argv[argc] = NULL;
+    
+    if (argc > 1 && strcmp(argv[1], "metrics") == 0) {
+        return metrics_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "top") == 0) {
+        return top_command(argc - 1, argv + 1);
+    }
+#ifdef V4M_BENCH
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench_command(argc - 1, argv + 1);
+    }
+#endif
+    if (argc > 1 && strcmp(argv[1], "image") == 0) {
+        return image_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "pool") == 0) {
+        return pool_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "run") == 0) {
+        return oneshot_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "apply") == 0) {
+        return apply_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "events") == 0) {
+        return events_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "purge") == 0) {
+        return purge_command();
+    }
+    if (argc > 1 && strcmp(argv[1], "reindex") == 0) {
+        return reindex_command();
+    }
+    if (argc > 1 && strcmp(argv[1], "autostart") == 0) {
+        return autostart_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        show_help(argv[0]);
+        return 0;
+    }
+    
+    // "vm create [OPTIONS]" and bare options both create a VM
+    int first_option = 1;
+    if (argc > 1 && strcmp(argv[1], "vm") == 0) {
+        const char *command = argc > 2 ? argv[2] : "";
+        if (strcmp(command, "list") == 0) {
+            return vm_list_command();
+        } else if (strcmp(command, "start") == 0) {
+            return vm_start_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "stop") == 0) {
+            return vm_stop_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "delete") == 0) {
+            return vm_delete_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "ip") == 0) {
+            return vm_ip_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "console") == 0) {
+            return vm_console_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "boot-report") == 0) {
+            return boot_report_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "autostart") == 0) {
+            return vm_autostart_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "disk") == 0) {
+            return vm_disk_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "move") == 0) {
+            return vm_move_command(argc - 2, argv + 2);
+        } else if (strcmp(command, "create") != 0) {
+            log_error("Unknown vm command");
+            show_help(argv[0]);
+            return 1;
+        }
+        first_option = 3;
+    }
+    
+    // Parse command line arguments
+    for (int i = first_option; i < argc; i++) {
         if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
             strncpy(vm_name, argv[i + 1], sizeof(vm_name) - 1);
             i++;
@@ -94,18 +1140,28 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--pass") == 0 && i + 1 < argc) {
             strncpy(password, argv[i + 1], sizeof(password) - 1);
             i++;
+        } else if (strcmp(argv[i], "--profile-boot") == 0) {
+            boot_profile.enabled = 1;
+        } else if (strcmp(argv[i], "--max-booting") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &boot_slots) != 0) {
+                log_error("Invalid --max-booting (a positive number)");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+            snprintf(create_pool, sizeof(create_pool), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--ephemeral") == 0) {
+            create_ephemeral = 1;
+        } else if (strcmp(argv[i], "--ephemeral-size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &ephemeral_cap) != 0) {
+                log_error("Invalid --ephemeral-size (e.g. 2G, 512M)");
+                return 1;
+            }
+            create_ephemeral = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            create_ephemeral = 1;
+            create_snapshot = 1;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
-            printf("Usage: sudo %s [OPTIONS]\n\n", argv[0]);
-            printf("Options:\n");
-            printf("  --name NAME     VM name (default: random)\n");
-            printf("  --distro DIST   Distribution (default: debian12)\n");
-            printf("  --user USER     Username (default: user01)\n");
-            printf("  --pass PASS     Password (default: auto-generated)\n\n");
-            printf("Available distros: debian12, ubuntu22, ubuntu24\n\n");
-            printf("Examples:\n");
-            printf("  sudo %s                                    # Create VM with all defaults\n", argv[0]);
-            printf("  sudo %s --name myvm --user john            # Create VM 'myvm' with user 'john'\n", argv[0]);
-            printf("  sudo %s --distro ubuntu22 --pass secret123 # Create Ubuntu VM with custom password\n", argv[0]);
+            show_help(argv[0]);
             return 0;
         } else {
             log_error("Unknown option");
@@ -116,6 +1172,19 @@ int main(int argc, char *argv[]) {
     // Generate defaults if not provided
     if (strlen(vm_name) == 0) {
         generate_vm_name(vm_name, sizeof(vm_name));
+    } else {
+        char sanitized[MAX_NAME];
+        sanitize_vm_name(vm_name, sanitized, sizeof(sanitized));
+        if (sanitized[0] == '\0') {
+            log_error("Invalid VM name");
+            return 1;
+        }
+        if (strcmp(sanitized, vm_name) != 0) {
+            char message[MAX_LINE];
+            snprintf(message, sizeof(message), "VM name sanitized: '%s' -> '%s'", vm_name, sanitized);
+            log_warning(message);
+            snprintf(vm_name, sizeof(vm_name), "%s", sanitized);
+        }
     }
     
     if (strlen(password) == 0) {
@@ -130,7 +1199,7 @@ int main(int argc, char *argv[]) {
     init_dirs();
     
     // Check if QEMU is available
-    if (system("command -v qemu-system-aarch64 >/dev/null 2>&1") != 0) {
+    if (run_command("command -v qemu-system-aarch64 >/dev/null 2>&1") != 0) {
         log_error("QEMU not found. Please install QEMU:");
         log_error("  brew install qemu");
         return 1;
@@ -169,6 +1238,103 @@ int check_root() {
     return 0;
 }
 
+void show_help(const char *program) {
+    printf("v4m - VM Manager for macOS\n\n");
+    printf("Usage: %s <command> [options]\n\n", program);
+    printf("VM Commands:\n");
+    printf("  vm create [--name NAME] [--distro DISTRO] [--user USER] [--pass PASS] [--profile-boot] [--max-booting N] [--pool POOL]\n");
+    printf("            [--ephemeral] [--ephemeral-size SIZE] [--snapshot]\n");
+    printf("                              Ephemeral: disk, NVRAM and logs in RAM (at most SIZE,\n");
+    printf("                              default 4G), deleted when the VM stops; --snapshot\n");
+    printf("                              runs the base image directly with snapshot=on\n");
+    printf("  vm list                     List all VMs with status and IPs\n");
+    printf("  vm start <name> [--max-booting N]\n");
+    printf("                              Start a VM, queued behind other first boots\n");
+    printf("  vm stop <name>... | --all [--timeout SEC] [--quit-timeout SEC]\n");
+    printf("                              Stop VMs in parallel (ACPI powerdown, then quit, then kill)\n");
+    printf("  vm delete <name>            Delete a VM\n");
+    printf("  vm ip <name>                Get VM IP address\n");
+    printf("  vm console <name>           Connect to VM console (Ctrl+] to exit)\n");
+    printf("  vm boot-report <name> [--trace FILE]\n");
+    printf("  vm autostart <name> on|off  Start the VM with 'v4m autostart' at host boot\n");
+    printf("  vm disk stats <name>        Allocation, fragmentation and L2 cache coverage of the disk\n");
+    printf("  vm disk defrag <name> [--offline]\n");
+    printf("                              Rewrite the disk contiguously (mirrored live if the VM runs)\n");
+    printf("  vm disk trim <name>|--all   fstrim running guests through the guest agent\n");
+    printf("  vm disk compact <name>|--all\n");
+    printf("                              Punch out zeroed blocks of stopped VMs' disks\n");
+    printf("  vm disk reclaim             Space reclaimed per VM and across the fleet\n");
+    printf("  vm move <name> --pool POOL  Move the disk to another storage pool (live if running)\n\n");
+    printf("Storage Pools:\n");
+    printf("  pool list                   Pools with capacity, free space, sync latency and disks\n");
+    printf("  pool add <name> <path>      Add a directory (e.g. a mount point) as a pool\n");
+    printf("  pool remove <name>          Remove an empty pool\n\n");
+    printf("One-shot Runs:\n");
+    printf("  run [--distro D] [--copy SRC[:DEST]]... [--timeout SEC] -- CMD [ARGS...]\n");
+    printf("                              Run CMD in a throwaway VM via the guest agent, stream its\n");
+    printf("                              output and exit with its status (inputs land in %s)\n", RUN_WORKDIR);
+    printf("  run --prewarm N [--distro D]\n");
+    printf("                              Keep N booted VMs ready so runs skip the boot\n\n");
+    printf("Fleets:\n");
+    printf("  apply <file> [--dry-run] [--parallel N] [--prune]\n");
+    printf("                              Create and update VMs to match a fleet file, N at a time in\n");
+    printf("                              dependency order; --prune also deletes VMs it no longer\n");
+    printf("                              lists; --dry-run shows the plan and ETA\n\n");
+    printf("Image Commands:\n");
+    printf("  image list                  List available images\n");
+    printf("  image pull <distro>         Download a distro image\n");
+    printf("        [--layout upstream|tuned|raw]   convert the base once for faster VM disks\n");
+    printf("  image delete <distro>       Delete a distro image\n");
+    printf("  image update <distro>       Fetch only the blocks that changed upstream\n");
+    printf("        [--url URL] [--sums URL]\n");
+    printf("  image check [--refresh]     Report images that changed upstream\n");
+    printf("  image bench <distro>        Compare read throughput of the base layouts\n");
+    printf("        [--count N] [--output FILE]\n");
+    printf("  image registry [init]       Show the distro registry, or write it to ~/.v4m/distros.conf\n");
+    printf("  image sums <file> [out]     Write the block sums a mirror serves for updates\n");
+    printf("  image store [stats]         Show store size and dedup/compression ratios\n");
+    printf("  image store import          Move plain image files into the store\n");
+    printf("  image store gc              Remove chunks no image references\n\n");
+    printf("Monitoring Commands:\n");
+    printf("  metrics [--listen ADDR] [--interval SECONDS]\n");
+    printf("  top [--sort COLUMN] [--interval SECONDS]\n");
+    printf("  events --listen [PATH]      Stream lifecycle events as NDJSON on a Unix socket\n");
+    printf("                              (default ~/.v4m/events.sock)\n");
+    printf("  events [--since SEQ] [--socket PATH]\n");
+    printf("                              Follow the stream, first replaying events after SEQ\n");
+#ifdef V4M_BENCH
+    printf("  bench [--scales 1,10,100,1000] [--boot-ms MS] [--metadata-files N] [--output FILE]\n");
+    printf("        [--baseline FILE] [--threshold PCT] [--keep]\n");
+#endif
+    printf("\n");
+    printf("Host Commands:\n");
+    printf("  autostart [--max-booting N] [--stagger SEC]\n");
+    printf("                              Start every autostart VM through the boot queue (run from launchd/systemd)\n\n");
+    printf("At most N VMs boot at once across all v4m processes (default %d, or V4M_MAX_BOOTING);\n", DEFAULT_BOOT_SLOTS);
+    printf("on Linux fewer are admitted while host I/O pressure (PSI) is high.\n");
+    printf("Running VMs are supervised: a QEMU crash is restarted with backoff (see supervisor.log).\n\n");
+    printf("Cleanup Commands:\n");
+    printf("  purge                       Delete ALL VMs and images (requires confirmation)\n");
+    printf("  reindex                     Rebuild the VM index from the state directories\n\n");
+    printf("Any command accepts --trace=FILE (before any \"--\") to write a Chrome/Perfetto trace of its own steps.\n");
+    printf("Bare create options (without 'vm create') are still accepted.\n\n");
+    char names[MAX_LINE];
+    registry_names(names, sizeof(names));
+    printf("Available distros: %s\n\n", names);
+    printf("Examples:\n");
+    printf("  sudo %s vm create                          # Create VM with all defaults\n", program);
+    printf("  sudo %s vm create --name myvm --user john  # Create VM 'myvm' with user 'john'\n", program);
+    printf("  sudo %s vm create --profile-boot           # Create VM and break down create-to-ready time\n", program);
+    printf("  %s vm list                                 # List all VMs with IPs\n", program);
+    printf("  %s vm console myvm                         # Connect to VM console\n", program);
+    printf("  %s metrics --listen unix:/tmp/v4m.sock     # Serve Prometheus metrics on a Unix socket\n", program);
+    printf("  %s top --sort disk                         # Live per-VM resource usage, busiest disk first\n", program);
+#ifdef V4M_BENCH
+    printf("  %s bench --scales 1,10 --output b.json     # Lifecycle benchmark against a stub QEMU\n", program);
+#endif
+    printf("  %s purge                                   # Delete everything (requires 'DELETE ALL')\n", program);
+}
+
 void init_dirs() {
     char v4m_dir[MAX_PATH];
     char distros_dir[MAX_PATH];
@@ -181,6 +1347,16 @@ void init_dirs() {
     mkdir(v4m_dir, 0755);
     mkdir(distros_dir, 0755);
     mkdir(vms_dir, 0755);
+    
+    char path[MAX_PATH + 16];
+    snprintf(path, sizeof(path), "%s/tombstones", v4m_dir);
+    mkdir(path, 0755);
+    
+    // First run on this layout (or a lost index): build it from the shards
+    snprintf(path, sizeof(path), "%s/index", vms_dir);
+    if (!file_exists(path)) {
+        index_rebuild();
+    }
 }
 
 void generate_vm_name(char *name, size_t size) {
@@ -198,6 +1374,7 @@ void generate_vm_name(char *name, size_t size) {
 }
 
 void generate_password(char *password, size_t size) {
+    TRACE_SCOPE("spawn", "openssl rand");
     FILE *fp = popen("openssl rand -base64 12 | tr -d \"=+/\" | cut -c1-12", "r");
     if (fp != NULL) {
         if (fgets(password, size, fp) != NULL) {
@@ -216,23 +1393,324 @@ void generate_password(char *password, size_t size) {
     }
 }
 
-const char *get_distro_url(const char *distro) {
-    if (strcmp(distro, "debian12") == 0) {
-        return "https://cloud.debian.org/images/cloud/bookworm/latest/debian-12-generic-arm64.qcow2";
-    } else if (strcmp(distro, "ubuntu22") == 0) {
-        return "https://cloud-images.ubuntu.com/releases/22.04/release/ubuntu-22.04-server-cloudimg-arm64.img";
-    } else if (strcmp(distro, "ubuntu24") == 0) {
-        return "https://cloud-images.ubuntu.com/releases/24.04/release/ubuntu-24.04-server-cloudimg-arm64.img";
+// Distro registry: ~/.v4m/distros.conf when present, else the built-in
+// table below (`image registry init` writes it out for editing). One image
+// source per line; repeating a distro/arch pair adds a mirror, and the first
+// line of a pair supplies its format, boot mode and checksum.
+//   <distro> <arch> <qcow2|raw> <boot> <sha256|-> <url>
+const char *default_registry =
+    "# v4m distro registry\n"
+    "# distro  arch     format  boot  sha256  url (repeat a distro/arch line to add mirrors, file:// works)\n"
+    "debian12  aarch64  qcow2   uefi  -  https://cloud.debian.org/images/cloud/bookworm/latest/debian-12-generic-arm64.qcow2\n"
+    "debian12  x86_64   qcow2   uefi  -  https://cloud.debian.org/images/cloud/bookworm/latest/debian-12-generic-amd64.qcow2\n"
+    "ubuntu22  aarch64  qcow2   uefi  -  https://cloud-images.ubuntu.com/releases/22.04/release/ubuntu-22.04-server-cloudimg-arm64.img\n"
+    "ubuntu22  x86_64   qcow2   uefi  -  https://cloud-images.ubuntu.com/releases/22.04/release/ubuntu-22.04-server-cloudimg-amd64.img\n"
+    "ubuntu24  aarch64  qcow2   uefi  -  https://cloud-images.ubuntu.com/releases/24.04/release/ubuntu-24.04-server-cloudimg-arm64.img\n"
+    "ubuntu24  x86_64   qcow2   uefi  -  https://cloud-images.ubuntu.com/releases/24.04/release/ubuntu-24.04-server-cloudimg-amd64.img\n";
+
+DistroRegistry registry = {0};
+
+void registry_path(char *path, size_t size) {
+    snprintf(path, size, "%s/.v4m/distros.conf", getenv("HOME"));
+}
+
+int registry_parse(const char *text, const char *source, DistroRegistry *reg) {
+    char message[MAX_LINE];
+    int line_number = 0;
+    for (const char *line = text; line && *line; ) {
+        const char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        char buf[MAX_LINE];
+        if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        line = end ? end + 1 : NULL;
+        line_number++;
+
+        DistroEntry e;
+        char url[MAX_URL];
+        memset(&e, 0, sizeof(e));
+        char *p = buf + strspn(buf, " \t");
+        if (*p == '\0' || *p == '#') continue;
+        if (sscanf(p, "%255s %31s %15s %15s %64s %511s", e.distro, e.arch, e.format, e.boot, e.sha256, url) != 6 ||
+            (strcmp(e.format, "qcow2") != 0 && strcmp(e.format, "raw") != 0) ||
+            (strlen(e.sha256) != 64 && strcmp(e.sha256, "-") != 0)) {
+            snprintf(message, sizeof(message), "%s:%d: expected 'distro arch qcow2|raw boot sha256|- url', skipped", source, line_number);
+            log_warning(message);
+            continue;
+        }
+        if (strcmp(e.sha256, "-") == 0) e.sha256[0] = '\0';
+
+        DistroEntry *existing = NULL;
+        for (int i = 0; i < reg->count; i++) {
+            if (strcmp(reg->items[i].distro, e.distro) == 0 && strcmp(reg->items[i].arch, e.arch) == 0) {
+                existing = &reg->items[i];
+            }
+        }
+        if (existing == NULL) {
+            DistroEntry *grown = realloc(reg->items, (reg->count + 1) * sizeof(*reg->items));
+            if (grown == NULL) return 1;
+            reg->items = grown;
+            existing = &reg->items[reg->count++];
+            *existing = e;
+        }
+        if (existing->mirror_count < MAX_MIRRORS) {
+            snprintf(existing->mirrors[existing->mirror_count++], MAX_URL, "%s", url);
+        }
+    }
+    return 0;
+}
+
+DistroRegistry *registry_get() {
+    if (registry.loaded) {
+        return &registry;
+    }
+    char path[MAX_PATH];
+    char *text;
+    size_t len;
+    registry_path(path, sizeof(path));
+    if (read_file(path, &text, &len) == 0) {
+        registry_parse(text, path, &registry);
+        free(text);
+        snprintf(registry.source, sizeof(registry.source), "%s", path);
+    } else {
+        registry_parse(default_registry, "built-in", &registry);
+        snprintf(registry.source, sizeof(registry.source), "built-in");
+    }
+    registry.loaded = 1;
+    return &registry;
+}
+
+// Entry for DISTRO on the architecture v4m runs guests as
+const DistroEntry *registry_find(const char *distro) {
+    DistroRegistry *reg = registry_get();
+    for (int i = 0; i < reg->count; i++) {
+        if (strcmp(reg->items[i].distro, distro) == 0 && strcmp(reg->items[i].arch, GUEST_ARCH) == 0 &&
+            reg->items[i].mirror_count > 0) {
+            return &reg->items[i];
+        }
     }
     return NULL;
 }
 
+// First mirror; its file name is the name of the cached image
+const char *get_distro_url(const char *distro) {
+    const DistroEntry *entry = registry_find(distro);
+    return entry ? entry->mirrors[0] : NULL;
+}
+
+void registry_names(char *out, size_t size) {
+    DistroRegistry *reg = registry_get();
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < reg->count && len < size; i++) {
+        if (strcmp(reg->items[i].arch, GUEST_ARCH) != 0) continue;
+        len += snprintf(out + len, size - len, "%s%s", len ? ", " : "", reg->items[i].distro);
+    }
+}
+
+// ~/.v4m/mirrors: "<bytes/s> <url>" per mirror, smoothed over pulls
+double mirror_speed_get(const char *url) {
+    char path[MAX_PATH];
+    char *text;
+    size_t len;
+    double speed = 0;
+    snprintf(path, sizeof(path), "%s/.v4m/mirrors", getenv("HOME"));
+    if (read_file(path, &text, &len) != 0) {
+        return 0;
+    }
+    for (char *line = text; line && *line; ) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+        char *space = strchr(line, ' ');
+        if (space && strcmp(space + 1, url) == 0) speed = atof(line);
+        line = end ? end + 1 : NULL;
+    }
+    free(text);
+    return speed;
+}
+
+void mirror_speed_record(const char *url, double bytes_per_sec) {
+    char path[MAX_PATH];
+    char *text = NULL;
+    size_t len;
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s/.v4m/mirrors", getenv("HOME"));
+    double previous = 0;
+    if (read_file(path, &text, &len) == 0) {
+        for (char *line = text; *line; ) {
+            char *end = strchr(line, '\n');
+            if (end) *end = '\0';
+            char *space = strchr(line, ' ');
+            if (space && strcmp(space + 1, url) == 0) {
+                previous = atof(line);
+            } else if (space) {
+                sb_printf(&sb, "%s\n", line);
+            }
+            if (end == NULL) break;
+            line = end + 1;
+        }
+        free(text);
+    }
+    // Half the old estimate, half the new: one slow pull does not bury a mirror
+    double speed = previous > 0 ? (previous + bytes_per_sec) / 2 : bytes_per_sec;
+    sb_printf(&sb, "%.0f %s\n", speed, url);
+    write_file_atomic(path, sb.data, sb.len);
+    sb_free(&sb);
+}
+
+// Order the mirrors of ENTRY for a download. All of them are probed at once
+// (HEAD, or a stat for file://) and the unreachable ones dropped; then local
+// mirrors come first, then those with a recorded download speed, fastest
+// first, then the rest by probe latency. Returns the number in ORDER
+int mirror_race(const DistroEntry *entry, int *order) {
+    MirrorProbe probes[MAX_MIRRORS];
+    int count = entry->mirror_count;
+    if (count == 1) {
+        order[0] = 0;
+        return 1;
+    }
+
+    double started = now_monotonic();
+    struct pollfd fds[MAX_MIRRORS];
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        MirrorProbe *p = &probes[i];
+        memset(p, 0, sizeof(*p));
+        p->index = i;
+        p->speed = mirror_speed_get(entry->mirrors[i]);
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+        if (strncmp(entry->mirrors[i], "file://", 7) == 0) {
+            struct stat st;
+            p->local = 1;
+            p->ok = stat(entry->mirrors[i] + 7, &st) == 0 && S_ISREG(st.st_mode);
+            p->latency = now_monotonic() - started;
+            continue;
+        }
+        p->fp = http_probe_start(entry->mirrors[i], NULL, MIRROR_RACE_TIMEOUT);
+        if (p->fp != NULL) {
+            fds[i].fd = fileno(p->fp);
+            pending++;
+        }
+    }
+
+    // Time each probe to its own end of output
+    while (pending > 0) {
+        for (int i = 0; i < count; i++) fds[i].revents = 0;
+        if (poll(fds, count, 100) < 0 && errno != EINTR) break;
+        for (int i = 0; i < count; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+            char buf[4096];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf) - 1);
+            if (n > 0) {
+                buf[n] = '\0';
+                sb_printf(&probes[i].headers, "%s", buf);
+                continue;
+            }
+            HttpValidators seen;
+            memset(&seen, 0, sizeof(seen));
+            int status = probes[i].headers.data ? http_validators_parse(probes[i].headers.data, &seen) : 0;
+            probes[i].ok = status >= 200 && status < 300;
+            probes[i].latency = now_monotonic() - started;
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (probes[i].fp) pclose(probes[i].fp);
+        sb_free(&probes[i].headers);
+    }
+
+    int usable = 0;
+    for (int i = 0; i < count; i++) {
+        if (probes[i].ok) {
+            probes[usable++] = probes[i];
+            continue;
+        }
+        char message[MAX_LINE];
+        snprintf(message, sizeof(message), "  mirror %s: unreachable", entry->mirrors[i]);
+        log_info(message);
+    }
+    qsort(probes, usable, sizeof(MirrorProbe), compare_mirror_probes);
+    for (int i = 0; i < usable; i++) {
+        char speed[16] = "-";
+        char message[MAX_LINE];
+        if (probes[i].speed > 0) {
+            format_size(probes[i].speed, speed, sizeof(speed));
+            strncat(speed, "/s", sizeof(speed) - strlen(speed) - 1);
+        }
+        snprintf(message, sizeof(message), "  mirror %s: %.0fms, last pull %s", entry->mirrors[probes[i].index],
+                 probes[i].latency * 1000, speed);
+        log_info(message);
+        order[i] = probes[i].index;
+    }
+    return usable;
+}
+
+int compare_mirror_probes(const void *a, const void *b) {
+    const MirrorProbe *x = a;
+    const MirrorProbe *y = b;
+    if (x->local != y->local) return y->local - x->local;
+    if ((x->speed > 0) != (y->speed > 0)) return x->speed > 0 ? -1 : 1;
+    if (x->speed != y->speed) return x->speed > y->speed ? -1 : 1;
+    return x->latency < y->latency ? -1 : x->latency > y->latency;
+}
+
+// image registry [init]
+int image_registry_command(int argc, char *argv[]) {
+    char path[MAX_PATH];
+    char message[MAX_LINE];
+    registry_path(path, sizeof(path));
+    if (argc > 1 && strcmp(argv[1], "init") == 0) {
+        init_dirs();
+        if (file_exists(path)) {
+            snprintf(message, sizeof(message), "%s already exists", path);
+            log_error(message);
+            return 1;
+        }
+        if (write_file_atomic(path, default_registry, strlen(default_registry)) != 0) {
+            log_error("Failed to write the registry");
+            return 1;
+        }
+        snprintf(message, sizeof(message), "Wrote %s", path);
+        log_success(message);
+        return 0;
+    }
+    if (argc > 1) {
+        log_error("Usage: image registry [init]");
+        return 1;
+    }
+
+    DistroRegistry *reg = registry_get();
+    printf(YELLOW "Distro registry" NC " (%s):\n", reg->source);
+    printf("%-12s %-8s %-6s %-5s %-8s %s\n", "DISTRO", "ARCH", "FORMAT", "BOOT", "SHA256", "MIRRORS");
+    for (int i = 0; i < reg->count; i++) {
+        const DistroEntry *e = &reg->items[i];
+        for (int m = 0; m < e->mirror_count; m++) {
+            if (m == 0) {
+                printf("%-12s %-8s %-6s %-5s %-8.8s %s\n", e->distro, e->arch, e->format, e->boot,
+                       e->sha256[0] ? e->sha256 : "-", e->mirrors[m]);
+            } else {
+                printf("%-42s %s\n", "", e->mirrors[m]);
+            }
+        }
+    }
+    return 0;
+}
+
 int ensure_distro(const char *distro, char *distro_path, size_t size) {
-    const char *url = get_distro_url(distro);
-    if (url == NULL) {
-        log_error("Unknown distro");
+    TRACE_SCOPE("ensure_distro", distro);
+    const DistroEntry *entry = registry_find(distro);
+    if (entry == NULL) {
+        char names[MAX_LINE];
+        char message[MAX_LINE * 2];
+        registry_names(names, sizeof(names));
+        snprintf(message, sizeof(message), "Unknown distro '%s' (available: %s)", distro, names);
+        log_error(message);
         return 1;
     }
+    const char *url = entry->mirrors[0];
     
     char v4m_dir[MAX_PATH];
     char distro_dir[MAX_PATH];
@@ -243,38 +1721,249 @@ int ensure_distro(const char *distro, char *distro_path, size_t size) {
     if (filename == NULL) filename = url;
     else filename++;
     
+    // Pulled images live in the chunk store and are described by
+    // FILENAME.manifest; a whole FILENAME is an image from an older v4m
+    char manifest[MAX_PATH];
     snprintf(distro_path, size, "%s/%s", distro_dir, filename);
+    snprintf(manifest, sizeof(manifest), "%s.manifest", distro_path);
     
+    if (file_exists(manifest)) {
+        snprintf(distro_path, size, "%s", manifest);
+        return 0;
+    }
     if (file_exists(distro_path)) {
         return 0;
     }
-    
-    log_info("Downloading distro...");
     mkdir(distro_dir, 0755);
     
-    char command[MAX_PATH * 3];
-    snprintf(command, sizeof(command), "curl -L -o \"%s\" \"%s\" --progress-bar", distro_path, url);
+    // Single flight: one process downloads, concurrent ones wait on the lock
+    // and reuse its result. curl writes a .part file per mirror (resumable
+    // after an interrupted run) which is renamed into place only when complete
+    char lock_path[MAX_PATH + MAX_URL + 16];
+    char message[MAX_LINE];
+    snprintf(lock_path, sizeof(lock_path), "%s/.%s.lock", distro_dir, filename);
     
-    if (system(command) != 0) {
-        log_error("Failed to download distro");
-        remove(distro_path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) {
+        log_error("Failed to create the download lock");
         return 1;
     }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        log_info("Another v4m is downloading this distro, waiting for it...");
+        while (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+            off_t largest = -1;
+            for (int i = 0; i < entry->mirror_count && isatty(STDOUT_FILENO); i++) {
+                char part_path[MAX_PATH + 32];
+                struct stat st;
+                distro_part_path(distro_path, entry->mirrors[i], part_path, sizeof(part_path));
+                if (stat(part_path, &st) == 0 && st.st_size > largest) largest = st.st_size;
+            }
+            if (largest >= 0) {
+                char done[16];
+                format_size((double)largest, done, sizeof(done));
+                printf("\r  %s downloaded so far   ", done);
+                fflush(stdout);
+            }
+            usleep(500000);
+        }
+        if (isatty(STDOUT_FILENO)) printf("\n");
+    }
     
-    log_success("Downloaded distro");
-    return 0;
-}
-
-void generate_mac(char *mac, size_t size) {
-    srand(time(NULL));
-    snprintf(mac, size, "52:54:00:%02x:%02x:%02x", 
-             rand() % 256, rand() % 256, rand() % 256);
+    // Whoever held the lock may have finished the job
+    if (file_exists(manifest) || file_exists(distro_path)) {
+        close(lock_fd);
+        if (file_exists(manifest)) snprintf(distro_path, size, "%s", manifest);
+        log_success("Distro downloaded by another v4m process");
+        return 0;
+    }
+    
+    // Try mirrors in race order until one delivers
+    char image[MAX_PATH];
+    int order[MAX_MIRRORS];
+    snprintf(image, sizeof(image), "%s", distro_path);
+    int usable = mirror_race(entry, order);
+    int result = 1;
+    for (int i = 0; i < usable && result != 0; i++) {
+        if (entry->mirror_count > 1) {
+            snprintf(message, sizeof(message), "Downloading %s from %s...", distro, entry->mirrors[order[i]]);
+        } else {
+            snprintf(message, sizeof(message), "Downloading %s...", distro);
+        }
+        log_info(message);
+        result = distro_fetch(entry->mirrors[order[i]], image, entry->sha256, distro_path, size);
+    }
+    if (usable == 0) {
+        log_error("No mirror of this distro is reachable");
+    }
+    close(lock_fd);
+    return result;
+}
+
+// In-flight download of IMAGE from URL: IMAGE.<url hash>.part, so mirrors
+// never append to each other's bytes
+void distro_part_path(const char *image, const char *url, char *out, size_t size) {
+    Sha256 ctx;
+    char hex[65];
+    sha256_init(&ctx);
+    sha256_update(&ctx, url, strlen(url));
+    sha256_final(&ctx, hex);
+    snprintf(out, size, "%s.%.8s.part", image, hex);
+}
+
+// Download URL as IMAGE (a .part file while in flight, resumable), check
+// it against SHA256 when the registry has one and add it to the store. The
+// caller holds the download lock. On success DISTRO_PATH names the manifest,
+// or the plain file if the store refused it
+int distro_fetch(const char *url, const char *image, const char *sha256, char *distro_path, size_t size) {
+    char part_path[MAX_PATH + 32];
+    char first_path[MAX_PATH + 48];
+    char headers_path[MAX_PATH + 48];
+    char manifest[MAX_PATH + 16];
+    char message[MAX_LINE];
+    distro_part_path(image, url, part_path, sizeof(part_path));
+    snprintf(first_path, sizeof(first_path), "%s.headers", part_path);
+    snprintf(headers_path, sizeof(headers_path), "%s.resumed", part_path);
+    snprintf(manifest, sizeof(manifest), "%s.manifest", image);
+    
+    // A partial file is resumed only against the response that started it
+    // (its headers are kept next to it). With If-Range a changed file comes
+    // back whole, which curl refuses to append to
+    char command[MAX_PATH * 4];
+    char *headers;
+    size_t headers_len;
+    struct stat st;
+    HttpValidators first;
+    memset(&first, 0, sizeof(first));
+    off_t resumed_at = stat(part_path, &st) == 0 ? st.st_size : 0;
+    if (resumed_at > 0 && read_file(first_path, &headers, &headers_len) == 0) {
+        http_validators_parse(headers, &first);
+        free(headers);
+    }
+    // A weak ETag cannot be used in If-Range
+    const char *if_range = first.etag[0] && strncmp(first.etag, "W/", 2) != 0 ? first.etag : first.last_modified;
+    if (resumed_at > 0 && (!if_range[0] || strchr(if_range, '\'') != NULL)) {
+        log_info("Discarding a partial download that cannot be validated");
+        resumed_at = 0;
+    }
+    if (resumed_at > 0) {
+        snprintf(command, sizeof(command), "curl -fL -C - -H 'If-Range: %s' -D \"%s\" -o \"%s\" \"%s\" --progress-bar",
+                 if_range, headers_path, part_path, url);
+    } else {
+        unlink(part_path);
+        snprintf(command, sizeof(command), "curl -fL -D \"%s\" -o \"%s\" \"%s\" --progress-bar", first_path, part_path, url);
+    }
+    
+    double started = now_monotonic();
+    int failed = run_command(command) != 0;
+    
+    // Validators of the response that finished the file
+    HttpValidators validators;
+    memset(&validators, 0, sizeof(validators));
+    int status = 0;
+    if (read_file(resumed_at > 0 ? headers_path : first_path, &headers, &headers_len) == 0) {
+        status = http_validators_parse(headers, &validators);
+        free(headers);
+    }
+    unlink(headers_path);
+    // A server that ignores If-Range still names the version it sent
+    int changed = status == 206 && ((first.etag[0] && strcmp(first.etag, validators.etag) != 0) ||
+        (first.last_modified[0] && strcmp(first.last_modified, validators.last_modified) != 0));
+    if (resumed_at > 0 && (status == 200 || status == 416 || changed)) {
+        log_info("The file changed on the server since the partial download; starting over");
+        unlink(part_path);
+        unlink(first_path);
+        return distro_fetch(url, image, sha256, distro_path, size);
+    }
+    if (failed) {
+        log_error("Failed to download distro");
+        return 1;
+    }
+    
+    // Remember how fast this mirror was so the next race can prefer it
+    double elapsed = now_monotonic() - started;
+    if (stat(part_path, &st) == 0 && st.st_size - resumed_at > MIRROR_SPEED_MIN_BYTES && elapsed > 0) {
+        mirror_speed_record(url, (st.st_size - resumed_at) / elapsed);
+    }
+    
+    if (sha256 != NULL && sha256[0]) {
+        char actual[65] = "";
+        int fd = open(part_path, O_RDONLY | O_CLOEXEC);
+        unsigned char *buf = malloc(STORE_IO_BUFFER);
+        if (fd >= 0 && buf != NULL) {
+            Sha256 ctx;
+            ssize_t n;
+            sha256_init(&ctx);
+            while ((n = read(fd, buf, STORE_IO_BUFFER)) > 0) sha256_update(&ctx, buf, n);
+            sha256_final(&ctx, actual);
+        }
+        if (fd >= 0) close(fd);
+        free(buf);
+        if (strcmp(actual, sha256) != 0) {
+            unlink(part_path);
+            unlink(first_path);
+            snprintf(message, sizeof(message), "Checksum mismatch for %s (expected %.12s..., got %.12s...)", url, sha256, actual);
+            log_error(message);
+            return 1;
+        }
+    }
+    
+    // Validators for `image check`
+    unlink(first_path);
+    snprintf(validators.url, sizeof(validators.url), "%s", url);
+    validators.checked = time(NULL);
+    
+    // The checksum is of the published file, so convert only after it
+    const char *layout = pull_layout[0] ? pull_layout : "upstream";
+    if (image_convert(part_path, layout) != 0) {
+        log_warning("Keeping the upstream layout");
+        layout = "upstream";
+    }
+    image_layout_set(image, layout);
+    
+    StoreStats stats;
+    log_info("Adding the image to the store...");
+    if (store_ingest(part_path, manifest, &stats) == 0) {
+        unlink(part_path);
+        unlink(image);
+        http_validators_save(image, &validators);
+        snprintf(distro_path, size, "%s", manifest);
+        char logical[16];
+        char added[16];
+        format_size((double)stats.logical_bytes, logical, sizeof(logical));
+        format_size((double)stats.stored_bytes, added, sizeof(added));
+        snprintf(message, sizeof(message), "Downloaded distro (%s image, %s added to the store, %d of %d chunks already present)",
+                 logical, added, stats.dup_chunks, stats.new_chunks + stats.dup_chunks);
+        log_success(message);
+        return 0;
+    }
+    log_warning("Could not add the image to the store; keeping it as a plain file");
+    
+    int fd = open(part_path, O_RDONLY);
+    int synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!synced || rename(part_path, image) != 0) {
+        log_error("Failed to move the downloaded distro into place");
+        return 1;
+    }
+    unlink(manifest);
+    http_validators_save(image, &validators);
+    snprintf(distro_path, size, "%s", image);
+    
+    log_success("Downloaded distro");
+    return 0;
+}
+
+void generate_mac(char *mac, size_t size) {
+    srand(time(NULL));
+    snprintf(mac, size, "52:54:00:%02x:%02x:%02x", 
+             rand() % 256, rand() % 256, rand() % 256);
 }
 
 int hash_password(const char *password, char *hashed, size_t size) {
     char command[MAX_PATH * 2];
     snprintf(command, sizeof(command), "openssl passwd -6 \"%s\"", password);
     
+    TRACE_SCOPE("spawn", "openssl passwd");
     FILE *fp = popen(command, "r");
     if (fp == NULL) {
         return 1;
@@ -293,6 +1982,7 @@ int hash_password(const char *password, char *hashed, size_t size) {
 
 int create_cloud_init(const char *vm_name, const char *username, 
                      const char *password, const char *vm_dir) {
+    TRACE_SCOPE("create_cloud_init", vm_name);
     char user_data_path[MAX_PATH];
     char meta_data_path[MAX_PATH];
     char hashed_pass[MAX_PATH];
@@ -348,13 +2038,15 @@ int create_cloud_init(const char *vm_name, const char *username,
     fprintf(user_data, "  - net-tools\n");
     fprintf(user_data, "  - htop\n");
     fprintf(user_data, "  - avahi-daemon\n");
-    fprintf(user_data, "  - avahi-utils\n\n");
+    fprintf(user_data, "  - avahi-utils\n");
+    fprintf(user_data, "  - qemu-guest-agent\n\n");
     fprintf(user_data, "# Commands to run after boot\n");
     fprintf(user_data, "runcmd:\n");
     fprintf(user_data, "  - systemctl enable ssh\n");
     fprintf(user_data, "  - systemctl start ssh\n");
     fprintf(user_data, "  - systemctl enable avahi-daemon\n");
     fprintf(user_data, "  - systemctl start avahi-daemon\n");
+    fprintf(user_data, "  - systemctl enable --now qemu-guest-agent\n");
     fprintf(user_data, "  - echo \"VM is ready!\" > /tmp/vm-ready\n\n");
     fprintf(user_data, "# Final message\n");
     fprintf(user_data, "final_message: \"VM %s is ready! SSH available on port 22.\"\n", vm_name);
@@ -377,12 +2069,30 @@ int create_cloud_init(const char *vm_name, const char *username,
 
 int create_vm(const char *vm_name, const char *distro, 
              const char *username, const char *password) {
+    char vm_dir[MAX_PATH];
+    char vm_mac[18];
+    
+    if (provision_vm(vm_name, distro, username, password, vm_mac, sizeof(vm_mac)) != 0) {
+        return 1;
+    }
+    
+    // Start VM
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    return start_vm(vm_name, vm_mac, vm_dir);
+}
+
+int provision_vm(const char *vm_name, const char *distro, const char *username,
+                 const char *password, char *vm_mac, size_t mac_size) {
     char distro_path[MAX_PATH];
     char vm_dir[MAX_PATH];
     char vm_disk[MAX_PATH];
-    char vm_mac[18];
+    double create_start = now_monotonic();
+    TRACE_SCOPE("create_vm", vm_name);
+    int phase;
     
-    snprintf(vm_dir, sizeof(vm_dir), "%s/.v4m/vms/%s", getenv("HOME"), vm_name);
+    boot_profile.origin = create_start;
+    
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
     snprintf(vm_disk, sizeof(vm_disk), "%s/disk.qcow2", vm_dir);
     
     log_info("Creating VM...");
@@ -393,44 +2103,119 @@ int create_vm(const char *vm_name, const char *distro,
         return 1;
     }
     
-    mkdir(vm_dir, 0755);
-    
-    // Ensure distro is available
-    if (ensure_distro(distro, distro_path, sizeof(distro_path)) != 0) {
+    EphemeralStore store;
+    if (create_ephemeral ? ephemeral_dir_create(vm_name, ephemeral_cap, &store) != 0 : vm_dir_create(vm_name) != 0) {
+        log_error("Failed to create VM directory");
         return 1;
     }
     
-    // Copy and resize disk
-    log_info("Setting up VM disk...");
-    if (copy_file(distro_path, vm_disk) != 0) {
-        log_error("Failed to copy disk image");
+    // Ensure distro is available
+    phase = boot_phase_begin("ensure-distro");
+    if (ensure_distro(distro, distro_path, sizeof(distro_path)) != 0) {
+        vm_destroy(vm_name);
         return 1;
     }
+    boot_phase_end(phase);
     
-    char resize_cmd[MAX_PATH * 2];
-    snprintf(resize_cmd, sizeof(resize_cmd), "qemu-img resize \"%s\" %s >/dev/null", 
-             vm_disk, DEFAULT_DISK_SIZE);
-    if (system(resize_cmd) != 0) {
-        log_error("Failed to resize disk");
-        return 1;
+    // An ephemeral disk is an overlay in RAM on the read-only base, so
+    // there is no pool, copy or resize
+    char pool[MAX_NAME] = "ephemeral";
+    const char *format = "qcow2";
+    if (create_ephemeral) {
+        char base[MAX_PATH];
+        log_info("Setting up ephemeral disk...");
+        phase = boot_phase_begin("copy-disk");
+        if (ephemeral_base(distro_path, base, sizeof(base)) != 0 ||
+            ephemeral_disk_create(&store, base, create_snapshot) != 0) {
+            log_error("Failed to set up the ephemeral disk");
+            vm_destroy(vm_name);
+            return 1;
+        }
+        boot_phase_end(phase);
+    } else {
+        // Pick a pool; off the default pool the disk is written there and
+        // linked into the VM directory
+        char pool_disk[MAX_PATH];
+        if (create_pool[0]) {
+            StoragePool pools[MAX_POOLS];
+            if (pool_find(pools, pool_load(pools, MAX_POOLS), create_pool) < 0) {
+                char message[MAX_LINE];
+                snprintf(message, sizeof(message), "Unknown pool '%s' (see v4m pool list)", create_pool);
+                log_error(message);
+                vm_destroy(vm_name);
+                return 1;
+            }
+            snprintf(pool, sizeof(pool), "%s", create_pool);
+        } else if (pool_select(pool, sizeof(pool)) != 0) {
+            vm_destroy(vm_name);
+            return 1;
+        }
+        if (pool_disk_path(pool, vm_name, pool_disk, sizeof(pool_disk)) != 0) {
+            log_error("Failed to prepare the storage pool");
+            vm_destroy(vm_name);
+            return 1;
+        }
+        
+        // Copy and resize disk
+        log_info("Setting up VM disk...");
+        phase = boot_phase_begin("copy-disk");
+        size_t path_len = strlen(distro_path);
+        if (strcmp(pool_disk, vm_disk) != 0 && vm_disk_link(vm_dir, pool_disk) != 0) {
+            log_error("Failed to link the disk into the VM directory");
+            vm_destroy(vm_name);
+            return 1;
+        }
+        if (path_len > 9 && strcmp(distro_path + path_len - 9, ".manifest") == 0) {
+            double rate;
+            if (store_materialize(distro_path, pool_disk, &rate) != 0) {
+                log_error("Failed to materialize disk image from the store");
+                vm_destroy(vm_name);
+                return 1;
+            }
+            char message[MAX_LINE];
+            snprintf(message, sizeof(message), "Disk materialized at %.0f MB/s", rate / (1024 * 1024));
+            log_info(message);
+        } else if (copy_file(distro_path, pool_disk) != 0) {
+            log_error("Failed to copy disk image");
+            vm_destroy(vm_name);
+            return 1;
+        }
+        boot_phase_end(phase);
+        
+        // No guest has touched the copy yet, so this is the base's format
+        format = disk_format(vm_disk);
+        char resize_cmd[MAX_PATH * 2];
+        snprintf(resize_cmd, sizeof(resize_cmd), "qemu-img resize -f %s \"%s\" %s >/dev/null", 
+                 format, vm_disk, DEFAULT_DISK_SIZE);
+        phase = boot_phase_begin("resize-disk");
+        if (run_command(resize_cmd) != 0) {
+            log_error("Failed to resize disk");
+            vm_destroy(vm_name);
+            return 1;
+        }
+        boot_phase_end(phase);
     }
     
     // Generate MAC address
-    generate_mac(vm_mac, sizeof(vm_mac));
+    generate_mac(vm_mac, mac_size);
     
     // Create EFI vars (simplified version)
     char efi_vars[MAX_PATH];
     snprintf(efi_vars, sizeof(efi_vars), "%s/efi-vars.fd", vm_dir);
     
-    char efi_cmd[MAX_PATH];
-    snprintf(efi_cmd, sizeof(efi_cmd), "dd if=/dev/zero of=\"%s\" bs=1M count=64 >/dev/null 2>&1", efi_vars);
-    system(efi_cmd);
+    // A sparse file reads back as zeros, same as dd from /dev/zero, without writing 64 MB
+    phase = boot_phase_begin("efi-vars");
+    create_sparse_file(efi_vars, 64 * 1024 * 1024);
+    boot_phase_end(phase);
     
     // Create cloud-init files
     log_info("Configuring cloud-init...");
+    phase = boot_phase_begin("cloud-init-config");
     if (create_cloud_init(vm_name, username, password, vm_dir) != 0) {
+        vm_destroy(vm_name);
         return 1;
     }
+    boot_phase_end(phase);
     
     // Create cloud-init ISO
     char cloud_init_iso[MAX_PATH];
@@ -456,58 +2241,61 @@ int create_vm(const char *vm_name, const char *distro,
              "hdiutil makehybrid -iso -joliet -default-volume-name \"cidata\" -o \"%s\" \"%s\" >/dev/null 2>&1", 
              cloud_init_iso, temp_dir);
     
-    if (system(iso_cmd) != 0) {
+    phase = boot_phase_begin("cloud-init-iso");
+    int iso_result = run_command(iso_cmd);
+    boot_phase_end(phase);
+    if (iso_result != 0) {
         log_error("Failed to create cloud-init ISO");
-        char rm_cmd[MAX_PATH * 2];
-        snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf \"%s\" \"%s\"", temp_dir, vm_dir);
-        system(rm_cmd);
+        remove_tree(temp_dir);
+        vm_destroy(vm_name);
         return 1;
     }
     
     // Clean up temp directory
     char rm_temp_cmd[MAX_PATH];
     snprintf(rm_temp_cmd, sizeof(rm_temp_cmd), "rm -rf \"%s\"", temp_dir);
-    system(rm_temp_cmd);
+    run_command(rm_temp_cmd);
     
     // Save VM info
-    char vm_info_path[MAX_PATH];
-    snprintf(vm_info_path, sizeof(vm_info_path), "%s/vm-info.json", vm_dir);
-    
-    FILE *vm_info = fopen(vm_info_path, "w");
-    if (vm_info != NULL) {
-        time_t now = time(NULL);
-        struct tm *tm_info = gmtime(&now);
-        char created[64];
-        strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", tm_info);
-        
-        fprintf(vm_info, "{\n");
-        fprintf(vm_info, "    \"name\": \"%s\",\n", vm_name);
-        fprintf(vm_info, "    \"distro\": \"%s\",\n", distro);
-        fprintf(vm_info, "    \"username\": \"%s\",\n", username);
-        fprintf(vm_info, "    \"password\": \"%s\",\n", password);
-        fprintf(vm_info, "    \"mac\": \"%s\",\n", vm_mac);
-        fprintf(vm_info, "    \"memory\": \"%s\",\n", DEFAULT_MEMORY);
-        fprintf(vm_info, "    \"cpus\": \"%s\",\n", DEFAULT_CPUS);
-        fprintf(vm_info, "    \"disk_size\": \"%s\",\n", DEFAULT_DISK_SIZE);
-        fprintf(vm_info, "    \"created\": \"%s\"\n", created);
-        fprintf(vm_info, "}\n");
-        
-        fclose(vm_info);
+    VMInfo info;
+    time_t now = time(NULL);
+    memset(&info, 0, sizeof(info));
+    snprintf(info.name, sizeof(info.name), "%s", vm_name);
+    snprintf(info.distro, sizeof(info.distro), "%s", distro);
+    snprintf(info.username, sizeof(info.username), "%s", username);
+    snprintf(info.password, sizeof(info.password), "%s", password);
+    snprintf(info.mac, sizeof(info.mac), "%s", vm_mac);
+    info.memory_mb = atoi(DEFAULT_MEMORY);
+    info.cpus = atoi(DEFAULT_CPUS);
+    snprintf(info.disk_size, sizeof(info.disk_size), "%s", DEFAULT_DISK_SIZE);
+    snprintf(info.pool, sizeof(info.pool), "%s", pool);
+    snprintf(info.network, sizeof(info.network), "%s", DEFAULT_NETWORK);
+    snprintf(info.disk_format, sizeof(info.disk_format), "%s", format);
+    strftime(info.created, sizeof(info.created), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    if (save_vm_info(vm_dir, &info) != 0) {
+        log_error("Failed to write VM info");
+        vm_destroy(vm_name);
+        return 1;
     }
     
     log_success("VM created successfully");
-    
-    // Start VM
-    return start_vm(vm_name, vm_mac, vm_dir);
+    record_lifecycle("create", now_monotonic() - create_start);
+    event_record(vm_name, "created", ", \"distro\": \"%s\"", distro);
+    return 0;
 }
 
-int start_vm(const char *vm_name, const char *vm_mac, const char *vm_dir) {
+// Launch QEMU under a supervisor and return once it is running; the guest
+// is still booting
+int spawn_vm(const char *vm_name, const char *vm_mac, const char *vm_dir) {
+    TRACE_SCOPE("spawn_vm", vm_name);
     char vm_disk[MAX_PATH];
     char cloud_init_iso[MAX_PATH];
     char efi_vars[MAX_PATH];
     char log_file[MAX_PATH];
     char monitor_socket[MAX_PATH];
+    char qmp_socket[MAX_PATH];
     char pid_file[MAX_PATH];
+    char stop_file[MAX_PATH];
     char bridge_interface[16] = "en0"; // Default
     
     snprintf(vm_disk, sizeof(vm_disk), "%s/disk.qcow2", vm_dir);
@@ -515,108 +2303,210 @@ int start_vm(const char *vm_name, const char *vm_mac, const char *vm_dir) {
     snprintf(efi_vars, sizeof(efi_vars), "%s/efi-vars.fd", vm_dir);
     snprintf(log_file, sizeof(log_file), "%s/console.log", vm_dir);
     snprintf(monitor_socket, sizeof(monitor_socket), "%s/monitor.sock", vm_dir);
+    snprintf(qmp_socket, sizeof(qmp_socket), "%s/qmp.sock", vm_dir);
     snprintf(pid_file, sizeof(pid_file), "%s/vm.pid", vm_dir);
+    snprintf(stop_file, sizeof(stop_file), "%s/stop-requested", vm_dir);
     
-    // Try to get default interface
-    get_default_interface(bridge_interface, sizeof(bridge_interface));
+    VMInfo info;
+    if (load_vm_info(vm_dir, &info) != 0) {
+        log_error("Failed to read VM info");
+        return 1;
+    }
+    
+    // "bridged:IFACE" pins the interface; plain "bridged" uses the default one
+    if (strncmp(info.network, "bridged:", 8) == 0) {
+        if (snprintf(bridge_interface, sizeof(bridge_interface), "%s", info.network + 8) >= (int)sizeof(bridge_interface)) {
+            log_error("Bridge interface name is too long");
+            return 1;
+        }
+    } else {
+        get_default_interface(bridge_interface, sizeof(bridge_interface));
+    }
+    if (info.schema < VM_INFO_SCHEMA) {
+        save_vm_info(vm_dir, &info);
+    }
     
-    log_info("Starting VM...");
+    char message[MAX_LINE];
+    snprintf(message, sizeof(message), "Starting VM '%s'...", vm_name);
+    log_info(message);
     
     // Clean up old files
     FILE *log_fp = fopen(log_file, "w");
     if (log_fp != NULL) fclose(log_fp);
     remove(monitor_socket);
+    remove(qmp_socket);
+    remove(pid_file);
+    remove(stop_file);
     
-    // Build QEMU command
-    char qemu_cmd[MAX_PATH * 10];
-    snprintf(qemu_cmd, sizeof(qemu_cmd),
-        "nohup qemu-system-aarch64 "
-        "-machine virt "
-        "-cpu host "
-        "-accel hvf "
-        "-smp %s "
-        "-m %s "
-        "-drive if=pflash,format=raw,file=/opt/homebrew/share/qemu/edk2-aarch64-code.fd,readonly=on "
-        "-drive if=pflash,format=raw,file=\"%s\" "
-        "-drive file=\"%s\",format=qcow2,if=virtio "
-        "-drive file=\"%s\",media=cdrom,if=virtio,readonly=on "
-        "-netdev vmnet-bridged,id=net0,ifname=%s "
-        "-device virtio-net,netdev=net0,mac=%s "
-        "-global PIIX4_PM.disable_s3=1 "
-        "-monitor unix:\"%s\",server,nowait "
-        "-serial unix:\"%s/console.sock\",server,nowait "
-        "-device virtio-serial "
-        "-chardev socket,path=\"%s/qga.sock\",server=on,wait=off,id=qga0 "
-        "-device virtserialport,chardev=qga0,name=org.qemu.guest_agent.0 "
-        "-nographic > \"%s\" 2>&1 &",
-        DEFAULT_CPUS, DEFAULT_MEMORY, efi_vars, vm_disk, cloud_init_iso,
-        bridge_interface, vm_mac, monitor_socket, vm_dir, vm_dir, log_file);
-    
-    int result = system(qemu_cmd);
+    char serial_log[MAX_PATH];
+    snprintf(serial_log, sizeof(serial_log), "%s/serial.log", vm_dir);
+    remove(serial_log);
+    
+    // Exec'd directly by the supervisor, so no shell quoting
+    ArgList args = {0};
+    arg_add(&args, "qemu-system-aarch64");
+    arg_add(&args, "-machine");
+    arg_add(&args, "virt");
+    arg_add(&args, "-cpu");
+    arg_add(&args, "host");
+    arg_add(&args, "-accel");
+    arg_add(&args, "hvf");
+    arg_add(&args, "-smp");
+    arg_add(&args, "%d", info.cpus);
+    arg_add(&args, "-m");
+    arg_add(&args, "%d", info.memory_mb);
+    arg_add(&args, "-drive");
+    arg_add(&args, "if=pflash,format=raw,file=/opt/homebrew/share/qemu/edk2-aarch64-code.fd,readonly=on");
+    arg_add(&args, "-drive");
+    arg_add(&args, "if=pflash,format=raw,file=%s", efi_vars);
+    EphemeralStore store;
+    arg_add(&args, "-drive");
+    if (ephemeral_load(vm_dir, &store) != 0) {
+        arg_add(&args, "id=%s,file=%s,format=%s,if=virtio,discard=unmap,detect-zeroes=unmap", VM_DISK_DRIVE, vm_disk,
+                info.disk_format);
+    } else {
+        // Host page cache would double the RAM an ephemeral disk costs, and
+        // there is nothing to flush for; QEMU's own temp files go there too
+        if (store.snapshot) {
+            arg_add(&args, "id=%s,file=%s,format=%s,if=virtio,snapshot=on,cache=unsafe", VM_DISK_DRIVE, store.base,
+                    disk_format(store.base));
+        } else {
+            arg_add(&args, "id=%s,file=%s,format=%s,if=virtio,cache=unsafe,discard=unmap,detect-zeroes=unmap", VM_DISK_DRIVE,
+                    vm_disk, info.disk_format);
+        }
+        arg_env(&args, "TMPDIR=%s", store.root);
+        args.max_file_size = store.cap;
+    }
+    arg_add(&args, "-drive");
+    arg_add(&args, "file=%s,media=cdrom,if=virtio,readonly=on", cloud_init_iso);
+    arg_add(&args, "-netdev");
+    if (strcmp(info.network, "shared") == 0) {
+        arg_add(&args, "vmnet-shared,id=net0");
+    } else if (strcmp(info.network, "user") == 0) {
+        arg_add(&args, "user,id=net0");
+    } else {
+        arg_add(&args, "vmnet-bridged,id=net0,ifname=%s", bridge_interface);
+    }
+    arg_add(&args, "-device");
+    arg_add(&args, "virtio-net,netdev=net0,mac=%s", vm_mac);
+    arg_add(&args, "-global");
+    arg_add(&args, "PIIX4_PM.disable_s3=1");
+    arg_add(&args, "-monitor");
+    arg_add(&args, "unix:%s,server,nowait", monitor_socket);
+    arg_add(&args, "-qmp");
+    arg_add(&args, "unix:%s,server,nowait", qmp_socket);
+    arg_add(&args, "-qmp");
+    arg_add(&args, "unix:%s/events.sock,server,nowait", vm_dir);
+    // A monitor serves one client at a time; the exporter's long-lived
+    // connection gets its own so qmp.sock stays free for stop, move, defrag
+    arg_add(&args, "-qmp");
+    arg_add(&args, "unix:%s/metrics.sock,server,nowait", vm_dir);
+    arg_add(&args, "-device");
+    arg_add(&args, "virtio-balloon,id=balloon0");
+    arg_add(&args, "-chardev");
+    arg_add(&args, "socket,id=serial0,path=%s/console.sock,server=on,wait=off,logfile=%s/serial.log", vm_dir, vm_dir);
+    arg_add(&args, "-serial");
+    arg_add(&args, "chardev:serial0");
+    arg_add(&args, "-device");
+    arg_add(&args, "virtio-serial");
+    arg_add(&args, "-chardev");
+    arg_add(&args, "socket,path=%s/qga.sock,server=on,wait=off,id=qga0", vm_dir);
+    arg_add(&args, "-device");
+    arg_add(&args, "virtserialport,chardev=qga0,name=org.qemu.guest_agent.0");
+    arg_add(&args, "-nographic");
+    
+    double start_time = now_monotonic();
+    int phase = boot_phase_begin("qemu-spawn");
+    int result = supervise_spawn(vm_dir, &args, log_file);
+    arg_free(&args);
+    boot_phase_end(phase);
     if (result != 0) {
-        log_error("Failed to start QEMU");
+        snprintf(message, sizeof(message), "Failed to start QEMU: %s", strerror(errno));
+        log_error(message);
         return 1;
     }
+    record_lifecycle("start", now_monotonic() - start_time);
+    return 0;
+}
+
+int start_vm(const char *vm_name, const char *vm_mac, const char *vm_dir) {
+    TRACE_SCOPE("start_vm", vm_name);
+    char message[MAX_LINE];
     
-    // Get PID (simplified)
-    char pid_cmd[MAX_PATH];
-    snprintf(pid_cmd, sizeof(pid_cmd), "echo $! > \"%s\"", pid_file);
-    system(pid_cmd);
+    // Queue behind other first boots; the slot is held until the guest is ready
+    double queued = 0;
+    int phase = boot_phase_begin("boot-queue");
+    int slot = boot_slot_acquire(&queued);
+    boot_phase_end(phase);
+    record_lifecycle("queue", queued);
     
+    double start_time = now_monotonic();
+    if (spawn_vm(vm_name, vm_mac, vm_dir) != 0) {
+        boot_slot_release(slot);
+        return 1;
+    }
     log_success("VM started");
     
-    // Wait for VM to boot (simplified)
+    // Wait until cloud-init reports the boot finished on the serial console
     log_info("Waiting for VM to boot...");
-    sleep(60);
+    int boot_result = wait_for_boot(vm_dir, BOOT_READY_TIMEOUT);
+    boot_slot_release(slot);
+    if (boot_result == 1) {
+        log_error("VM stopped unexpectedly");
+        log_info("Check the serial log in the VM directory");
+        return 1;
+    }
+    if (boot_result == 2) {
+        log_warning("Timed out waiting for cloud-init to finish");
+    } else {
+        double booted = now_monotonic() - start_time;
+        record_lifecycle("ready", booted);
+        snprintf(message, sizeof(message), "VM ready: queued %.1fs, boot %.1fs", queued, booted);
+        log_info(message);
+    }
+    
+    if (boot_profile.enabled) {
+        boot_profile_save(vm_dir);
+        boot_profile_print(&boot_profile);
+        
+        char trace_path[MAX_PATH];
+        snprintf(trace_path, sizeof(trace_path), "%s/boot-trace.json", vm_dir);
+        if (boot_profile_write_trace(&boot_profile, vm_name, trace_path) == 0) {
+            snprintf(message, sizeof(message), "Boot trace written to %s", trace_path);
+            log_info(message);
+        }
+    }
     
     show_vm_info(vm_name, vm_dir);
     return 0;
 }
 
 void show_vm_info(const char *vm_name, const char *vm_dir) {
-    char vm_info_path[MAX_PATH];
-    snprintf(vm_info_path, sizeof(vm_info_path), "%s/vm-info.json", vm_dir);
-    
-    FILE *fp = fopen(vm_info_path, "r");
-    if (fp == NULL) {
+    VMInfo info;
+    if (load_vm_info(vm_dir, &info) != 0) {
         return;
     }
     
-    char line[MAX_LINE];
-    char username[MAX_NAME] = "";
-    char password[MAX_NAME] = "";
-    char mac[18] = "";
-    
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "\"username\"")) {
-            sscanf(line, "    \"username\": \"%[^\"]\",", username);
-        } else if (strstr(line, "\"password\"")) {
-            sscanf(line, "    \"password\": \"%[^\"]\",", password);
-        } else if (strstr(line, "\"mac\"")) {
-            sscanf(line, "    \"mac\": \"%[^\"]\",", mac);
-        }
-    }
-    fclose(fp);
-    
     printf("\n" CYAN "═══════════════════════════════════════════════════════════" NC "\n");
     printf(CYAN "                        VM READY                            " NC "\n");
     printf(CYAN "═══════════════════════════════════════════════════════════" NC "\n\n");
     printf(YELLOW "VM Information:" NC "\n");
     printf("  Name: %s\n", vm_name);
-    printf("  Memory: %sMB\n", DEFAULT_MEMORY);
-    printf("  CPUs: %s\n", DEFAULT_CPUS);
+    printf("  Memory: %dMB\n", info.memory_mb);
+    printf("  CPUs: %d\n", info.cpus);
     printf("\n" YELLOW "Login Credentials:" NC "\n");
-    printf("  Username: %s\n", username);
-    printf("  Password: %s\n", password);
-    printf("  Root password: %s (same as user)\n", password);
-    printf("  SSH: ssh %s@%s.local\n", username, vm_name);
+    printf("  Username: %s\n", info.username);
+    printf("  Password: %s\n", info.password);
+    printf("  Root password: %s (same as user)\n", info.password);
+    printf("  SSH: ssh %s@%s.local\n", info.username, vm_name);
     printf("\n" YELLOW "VM Management:" NC "\n");
-    printf("  Stop: kill $(cat %s/vm.pid)\n", vm_dir);
+    printf("  Stop: v4m vm stop %s\n", vm_name);
     printf("\n");
 }
 
 // Utility functions
 int execute_command(const char *command, char *output, size_t output_size) {
+    TRACE_SCOPE("spawn", command);
     FILE *fp = popen(command, "r");
     if (fp == NULL) {
         return -1;
@@ -645,10 +2535,70 @@ int dir_exists(const char *path) {
     return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
+int create_sparse_file(const char *path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    int result = ftruncate(fd, size) == 0 ? 0 : 1;
+    close(fd);
+    return result;
+}
+
+int remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path) == 0 ? 0 : 1;
+    }
+    
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        result |= remove_tree(child);
+    }
+    closedir(dir);
+    return (rmdir(path) == 0 ? 0 : 1) | result;
+}
+
+int stop_vm(const char *vm_dir, int timeout_sec) {
+    TRACE_SCOPE("stop_vm", vm_dir);
+    StopTarget target;
+    memset(&target, 0, sizeof(target));
+    const char *name = strrchr(vm_dir, '/');
+    snprintf(target.name, sizeof(target.name), "%s", name != NULL ? name + 1 : vm_dir);
+    snprintf(target.vm_dir, sizeof(target.vm_dir), "%s", vm_dir);
+    return stop_vms(&target, 1, timeout_sec, STOP_QUIT_TIMEOUT) != 0 ? 1 : 0;
+}
+
+int self_executable_path(char *path, size_t size) {
+#ifdef __APPLE__
+    uint32_t len = size;
+    return _NSGetExecutablePath(path, &len) == 0 ? 0 : 1;
+#else
+    ssize_t len = readlink("/proc/self/exe", path, size - 1);
+    if (len < 0) {
+        return 1;
+    }
+    path[len] = '\0';
+    return 0;
+#endif
+}
+
 int copy_file(const char *src, const char *dest) {
+    TRACE_SCOPE("copy_file", dest);
     char command[MAX_PATH * 3];
     snprintf(command, sizeof(command), "cp \"%s\" \"%s\"", src, dest);
-    return system(command);
+    return run_command(command);
 }
 
 int get_default_interface(char *interface, size_t size) {
@@ -656,4 +2606,10014 @@ int get_default_interface(char *interface, size_t size) {
     // In a real implementation, you'd use getifaddrs() or similar
     strncpy(interface, "en0", size);
     return 0;
-}
\ No newline at end of file
+}
+double now_monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+void sb_printf(StrBuf *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (needed < 0) return;
+    
+    if (sb->len + needed + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 4096;
+        while (cap < sb->len + needed + 1) cap *= 2;
+        char *data = realloc(sb->data, cap);
+        if (data == NULL) return;
+        sb->data = data;
+        sb->cap = cap;
+    }
+    
+    va_start(args, fmt);
+    vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, args);
+    va_end(args);
+    sb->len += needed;
+}
+
+void sb_free(StrBuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
+
+// Walks the index, so enumeration costs one file read however many shards exist
+int for_each_vm(vm_visit_fn fn, void *ctx) {
+    StrBuf names;
+    if (index_read(&names) != 0) {
+        if (index_rebuild() < 0 || index_read(&names) != 0) {
+            return 0;
+        }
+    }
+    
+    int count = 0;
+    char *line = names.data;
+    while (line < names.data + names.len) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) break;
+        *end = '\0';
+        if (*line != '\0') {
+            char vm_dir[MAX_PATH];
+            vm_dir_path(line, vm_dir, sizeof(vm_dir));
+            count++;
+            if (fn(line, vm_dir, ctx) != 0) break;
+        }
+        line = end + 1;
+    }
+    sb_free(&names);
+    return count;
+}
+
+pid_t read_vm_pid(const char *vm_dir) {
+    char pid_file[MAX_PATH + 16];
+    snprintf(pid_file, sizeof(pid_file), "%s/vm.pid", vm_dir);
+    return read_pid_file(pid_file);
+}
+
+// QEMU runs, or its supervisor does (possibly sitting out a crash backoff
+// with no QEMU at the moment)
+int vm_is_active(const char *vm_dir) {
+    char supervisor_file[MAX_PATH + 16];
+    snprintf(supervisor_file, sizeof(supervisor_file), "%s/supervisor.pid", vm_dir);
+    return read_vm_pid(vm_dir) > 0 || read_pid_file(supervisor_file) > 0;
+}
+
+// Kernel-recorded start time of PID in an opaque per-OS unit; together with
+// the PID it names one process even after the PID is reused
+int process_start_time(pid_t pid, uint64_t *start) {
+#ifdef __APPLE__
+    struct proc_bsdinfo info;
+    if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &info, sizeof(info)) != (int)sizeof(info)) {
+        return 1;
+    }
+    *start = (uint64_t)info.pbi_start_tvsec * 1000000 + info.pbi_start_tvusec;
+    return 0;
+#else
+    char path[64];
+    char line[MAX_LINE];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    
+    // Field 22, counted after the command name like read_process_stats()
+    char *fields = strrchr(line, ')');
+    unsigned long long ticks;
+    if (fields == NULL ||
+        sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+               "%*d %*d %*d %*d %*d %*d %llu", &ticks) != 1) {
+        return 1;
+    }
+    *start = ticks;
+    return 0;
+#endif
+}
+
+// "PID START\n"; START is omitted when the OS will not say
+int write_pid_file(const char *path, pid_t pid) {
+    char line[64];
+    uint64_t start;
+    int len;
+    if (process_start_time(pid, &start) == 0) {
+        len = snprintf(line, sizeof(line), "%d %llu\n", (int)pid, (unsigned long long)start);
+    } else {
+        len = snprintf(line, sizeof(line), "%d\n", (int)pid);
+    }
+    return write_file_atomic(path, line, len);
+}
+
+// PID from PATH if that process is still the one that was recorded, else -1.
+// Plain "PID" files (QEMU -pidfile, older v4m) only get the kill(pid, 0) check
+pid_t read_pid_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    
+    int pid = -1;
+    unsigned long long recorded = 0;
+    int fields = fscanf(fp, "%d %llu", &pid, &recorded);
+    fclose(fp);
+    
+    if (fields < 1 || pid <= 0 || (kill(pid, 0) != 0 && errno != EPERM)) {
+        return -1;
+    }
+    uint64_t start;
+    if (fields == 2 && process_start_time(pid, &start) == 0 && start != recorded) {
+        return -1;
+    }
+    return pid;
+}
+
+void arg_add(ArgList *args, const char *fmt, ...) {
+    char value[MAX_LINE];
+    va_list ap;
+    if (args->count >= (int)(sizeof(args->items) / sizeof(args->items[0])) - 1) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+    args->items[args->count++] = strdup(value);
+    args->items[args->count] = NULL;
+}
+
+void arg_env(ArgList *args, const char *fmt, ...) {
+    char value[MAX_LINE];
+    va_list ap;
+    if (args->env_count >= (int)(sizeof(args->env) / sizeof(args->env[0]))) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+    args->env[args->env_count++] = strdup(value);
+}
+
+void arg_free(ArgList *args) {
+    for (int i = 0; i < args->count; i++) {
+        free(args->items[i]);
+    }
+    for (int i = 0; i < args->env_count; i++) {
+        free(args->env[i]);
+    }
+    args->count = 0;
+    args->env_count = 0;
+    args->items[0] = NULL;
+}
+
+int read_process_stats(pid_t pid, double *cpu_seconds, uint64_t *rss_bytes) {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    struct proc_taskinfo info;
+    
+    if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &info, sizeof(info)) != (int)sizeof(info)) {
+        return 1;
+    }
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    // Task times are reported in Mach absolute time units
+    uint64_t ticks = info.pti_total_user + info.pti_total_system;
+    *cpu_seconds = (double)ticks * timebase.numer / timebase.denom / 1e9;
+    *rss_bytes = info.pti_resident_size;
+    return 0;
+#else
+    char path[64];
+    char line[MAX_LINE];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    
+    // The command name may contain spaces, so parse after the last ')'
+    char *fields = strrchr(line, ')');
+    unsigned long utime, stime;
+    long rss;
+    if (fields == NULL ||
+        sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+               "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, &rss) != 3) {
+        return 1;
+    }
+    
+    *cpu_seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    *rss_bytes = (uint64_t)rss * sysconf(_SC_PAGESIZE);
+    return 0;
+#endif
+}
+
+int read_process_steal(pid_t pid, double *steal_seconds) {
+#ifdef __linux__
+    // Sum run-queue wait time of every QEMU thread (vCPUs waiting for a host CPU)
+    char task_dir[64];
+    snprintf(task_dir, sizeof(task_dir), "/proc/%d/task", (int)pid);
+    
+    DIR *dir = opendir(task_dir);
+    if (dir == NULL) {
+        return 1;
+    }
+    
+    unsigned long long total_ns = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        
+        char path[sizeof(task_dir) + sizeof(entry->d_name) + 16];
+        unsigned long long run_ns, wait_ns;
+        snprintf(path, sizeof(path), "%s/%s/schedstat", task_dir, entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) continue;
+        if (fscanf(fp, "%llu %llu", &run_ns, &wait_ns) == 2) total_ns += wait_ns;
+        fclose(fp);
+    }
+    closedir(dir);
+    
+    *steal_seconds = total_ns / 1e9;
+    return 0;
+#else
+    (void)pid;
+    (void)steal_seconds;
+    return 1;
+#endif
+}
+
+const char *lifecycle_ops[LIFECYCLE_OPS] = {"create", "queue", "start", "ready", "stop"};
+const double lifecycle_buckets[LIFECYCLE_BUCKETS] = {1, 2, 5, 10, 30, 60, 120, 300};
+
+void record_lifecycle(const char *op, double seconds) {
+    char log_path[MAX_PATH];
+    char line[128];
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/lifecycle.log", getenv("HOME"));
+    
+    // Single short O_APPEND write keeps concurrent writers from interleaving
+    int len = snprintf(line, sizeof(line), "%ld %s %.3f\n", (long)time(NULL), op, seconds);
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return;
+    if (write(fd, line, len) != len) {
+        // Metrics are best effort
+    }
+    close(fd);
+}
+
+// Shutdown
+// A descriptor that becomes readable once PID exits, so many processes can be
+// waited on in one poll(); works for processes that are not our children.
+// Returns -1 with errno ESRCH if PID is already gone, or -1 with another errno
+// when the kernel has no such facility (callers fall back to kill(pid, 0))
+int proc_watch_open(pid_t pid) {
+#ifdef __APPLE__
+    int kq = kqueue();
+    if (kq < 0) {
+        return -1;
+    }
+    struct kevent change;
+    EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+    if (kevent(kq, &change, 1, NULL, 0, NULL) != 0) {
+        int saved = errno;
+        close(kq);
+        errno = saved;
+        return -1;
+    }
+    fcntl(kq, F_SETFD, FD_CLOEXEC);
+    return kq;
+#elif defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void stop_finish(StopTarget *t, double started, double now, const char *result) {
+    if (t->watch_fd >= 0) close(t->watch_fd);
+    if (t->qmp_fd >= 0) close(t->qmp_fd);
+    t->watch_fd = -1;
+    t->qmp_fd = -1;
+    t->stage = STOP_DONE;
+    t->seconds = now - started;
+    t->result = result;
+    
+    if (strcmp(result, "failed") == 0) {
+        return;
+    }
+    char pid_file[MAX_PATH + 16];
+    snprintf(pid_file, sizeof(pid_file), "%s/vm.pid", t->vm_dir);
+    remove(pid_file);
+    if (strcmp(result, "not running") != 0) {
+        record_lifecycle("stop", t->seconds);
+    }
+}
+
+// Move T to its next stage. The QMP socket is written blind: QEMU queues
+// commands sent ahead of the greeting, so there is no round trip to wait for
+void stop_escalate(StopTarget *t, double now, double quit_timeout) {
+    static const char quit[] = "{\"execute\": \"quit\"}\n";
+    if (t->stage == STOP_POWERDOWN) {
+        if (t->qmp_fd < 0 || send(t->qmp_fd, quit, sizeof(quit) - 1, MSG_NOSIGNAL) < 0) {
+            kill(t->pid, SIGTERM);
+        }
+        t->stage = STOP_QUIT;
+        t->deadline = now + quit_timeout;
+    } else {
+        kill(t->pid, SIGKILL);
+        t->stage = STOP_KILL;
+        t->deadline = now + STOP_KILL_TIMEOUT;
+    }
+}
+
+// Shut down every target at once and wait for all of them in a single poll
+// loop, so the total time is that of the slowest guest rather than the sum.
+// Each VM gets POWERDOWN_TIMEOUT seconds of ACPI powerdown (0 skips straight
+// to quit), QUIT_TIMEOUT seconds after a QMP quit, then SIGKILL. Fills in
+// result and seconds per target; returns how many are still running
+int stop_vms(StopTarget *targets, int count, double powerdown_timeout, double quit_timeout) {
+    static const char powerdown[] = "{\"execute\": \"qmp_capabilities\"}\n{\"execute\": \"system_powerdown\"}\n";
+    static const char quit[] = "{\"execute\": \"qmp_capabilities\"}\n{\"execute\": \"quit\"}\n";
+    double started = now_monotonic();
+    int pending = 0;
+    
+    for (int i = 0; i < count; i++) {
+        StopTarget *t = &targets[i];
+        t->watch_fd = -1;
+        t->qmp_fd = -1;
+        // Also keeps a supervisor from restarting it, even mid-backoff
+        supervise_request_stop(t->vm_dir);
+        t->pid = read_vm_pid(t->vm_dir);
+        if (t->pid <= 0) {
+            stop_finish(t, started, started, "not running");
+            continue;
+        }
+        t->watch_fd = proc_watch_open(t->pid);
+        if (t->watch_fd < 0 && errno == ESRCH) {
+            stop_finish(t, started, started, "powerdown");
+            continue;
+        }
+        
+        char sock_path[MAX_PATH];
+        snprintf(sock_path, sizeof(sock_path), "%s/qmp.sock", t->vm_dir);
+        t->qmp_fd = unix_connect(sock_path);
+        const char *request = powerdown_timeout > 0 ? powerdown : quit;
+        size_t request_len = powerdown_timeout > 0 ? sizeof(powerdown) - 1 : sizeof(quit) - 1;
+        if (t->qmp_fd >= 0) {
+            fcntl(t->qmp_fd, F_SETFL, fcntl(t->qmp_fd, F_GETFL) | O_NONBLOCK);
+            if (send(t->qmp_fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len) {
+                close(t->qmp_fd);
+                t->qmp_fd = -1;
+            }
+        }
+        if (powerdown_timeout > 0) {
+            t->stage = STOP_POWERDOWN;
+            t->deadline = started + powerdown_timeout;
+            if (t->qmp_fd < 0) {
+                // No monitor: SIGTERM is the nearest thing QEMU has to a clean stop
+                kill(t->pid, SIGTERM);
+            }
+        } else {
+            t->stage = STOP_QUIT;
+            t->deadline = started + quit_timeout;
+            if (t->qmp_fd < 0) {
+                kill(t->pid, SIGTERM);
+            }
+        }
+        pending++;
+    }
+    
+    struct pollfd *fds = calloc(count * 2 + 1, sizeof(struct pollfd));
+    int *owner = calloc(count * 2 + 1, sizeof(int));
+    while (pending > 0 && fds != NULL && owner != NULL) {
+        double now = now_monotonic();
+        double next = now + 3600;
+        int nfds = 0;
+        int need_tick = 0;
+        for (int i = 0; i < count; i++) {
+            StopTarget *t = &targets[i];
+            if (t->stage == STOP_DONE) continue;
+            if (t->deadline < next) next = t->deadline;
+            if (t->watch_fd >= 0) {
+                fds[nfds].fd = t->watch_fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                owner[nfds++] = i;
+            } else {
+                need_tick = 1;
+            }
+            // Replies and events are drained only so QEMU never blocks on a full socket
+            if (t->qmp_fd >= 0) {
+                fds[nfds].fd = t->qmp_fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                owner[nfds++] = -1 - i;
+            }
+        }
+        
+        int timeout_ms = next > now ? (int)((next - now) * 1000) + 1 : 0;
+        if (need_tick && timeout_ms > 10) timeout_ms = 10;
+        poll(fds, nfds, timeout_ms);
+        now = now_monotonic();
+        
+        for (int j = 0; j < nfds; j++) {
+            if (fds[j].revents == 0) continue;
+            if (owner[j] >= 0) {
+                // Watch descriptor fired: the process has exited
+                targets[owner[j]].pid = 0;
+                continue;
+            }
+            StopTarget *t = &targets[-1 - owner[j]];
+            char drain[4096];
+            ssize_t n = recv(t->qmp_fd, drain, sizeof(drain), 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(t->qmp_fd);
+                t->qmp_fd = -1;
+            }
+        }
+        
+        pending = 0;
+        for (int i = 0; i < count; i++) {
+            StopTarget *t = &targets[i];
+            if (t->stage == STOP_DONE) continue;
+            if (t->pid == 0 || (t->watch_fd < 0 && kill(t->pid, 0) != 0 && errno == ESRCH)) {
+                static const char *results[] = {"powerdown", "quit", "killed"};
+                stop_finish(t, started, now, results[t->stage]);
+                continue;
+            }
+            if (now >= t->deadline) {
+                if (t->stage == STOP_KILL) {
+                    stop_finish(t, started, now, "failed");
+                    continue;
+                }
+                stop_escalate(t, now, quit_timeout);
+            }
+            pending++;
+        }
+    }
+    free(fds);
+    free(owner);
+    
+    // Supervisors leave within a poll interval of seeing the stop request;
+    // wait for them too, so a start or delete right after finds the VM idle
+    double until = now_monotonic() + STOP_KILL_TIMEOUT;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (targets[i].stage != STOP_DONE) {
+            stop_finish(&targets[i], started, now_monotonic(), "failed");
+        }
+        while (vm_is_active(targets[i].vm_dir) && now_monotonic() < until) {
+            usleep(100000);
+        }
+        if (vm_is_active(targets[i].vm_dir)) {
+            targets[i].result = "failed";
+        }
+        if (strcmp(targets[i].result, "failed") == 0) failed++;
+    }
+    return failed;
+}
+
+// Supervisor: each VM's QEMU is the child of a small detached v4m process
+// that reaps it, keeps vm.pid current and restarts it after a crash with
+// exponential backoff. A clean exit (guest poweroff, QMP quit) or a
+// stop-requested marker from stop_vms() ends supervision. While QEMU runs
+// the supervisor is also the source of the VM's lifecycle events (see
+// event_watch_poll()).
+//   <vm>/supervisor.pid   supervisor "PID START"
+//   <vm>/supervisor.log   one line per crash, restart and scheduled trim
+//   <vm>/stop-requested   written by stop_vms(), removed by the supervisor
+
+// Detach a supervisor for ARGS and return once QEMU has been exec'd (0) or
+// could not be (1, errno set)
+int supervise_spawn(const char *vm_dir, ArgList *args, const char *log_file) {
+    int ready[2];
+    if (pipe(ready) != 0) {
+        return 1;
+    }
+    // QEMU must not inherit the write end, or the starter could wait on it
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(ready[0]);
+        close(ready[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+        // Drop everything else the starter had open: a boot-slot flock
+        // inherited here would stay held for the life of the VM
+        close_inherited_fds(ready[1]);
+        supervise_run(vm_dir, args, log_file, ready[1]);
+        _exit(0);
+    }
+    close(ready[1]);
+    waitpid(pid, NULL, 0);
+    
+    int error = 0;
+    ssize_t n;
+    do {
+        n = read(ready[0], &error, sizeof(error));
+    } while (n < 0 && errno == EINTR);
+    close(ready[0]);
+    if (n != sizeof(error)) {
+        errno = ECHILD;
+        return 1;
+    }
+    if (error != 0) {
+        errno = error;
+        return 1;
+    }
+    return 0;
+}
+
+// Fork and exec ARGS with output appended to LOG_FILE. A close-on-exec pipe
+// reports exec failures, so a missing binary is an error here rather than an
+// instant "crash" later
+pid_t supervise_exec(ArgList *args, const char *log_file, int *error) {
+    int status_pipe[2];
+    if (pipe(status_pipe) != 0) {
+        *error = errno;
+        return -1;
+    }
+    fcntl(status_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(status_pipe[1], F_SETFD, FD_CLOEXEC);
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        *error = errno;
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(status_pipe[0]);
+        int fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            if (fd > STDERR_FILENO) close(fd);
+        }
+        for (int i = 0; i < args->env_count; i++) {
+            putenv(args->env[i]);
+        }
+        if (args->max_file_size > 0) {
+            // Past the limit a write fails with EFBIG instead of killing QEMU
+            struct rlimit limit = {(rlim_t)args->max_file_size, (rlim_t)args->max_file_size};
+            signal(SIGXFSZ, SIG_IGN);
+            setrlimit(RLIMIT_FSIZE, &limit);
+        }
+        execvp(args->items[0], args->items);
+        int err = errno;
+        if (write(status_pipe[1], &err, sizeof(err)) != sizeof(err)) {
+            // Parent sees EOF and assumes success; the exit status tells it otherwise
+        }
+        _exit(127);
+    }
+    close(status_pipe[1]);
+    
+    int err = 0;
+    ssize_t n;
+    do {
+        n = read(status_pipe[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    close(status_pipe[0]);
+    if (n == sizeof(err)) {
+        waitpid(pid, NULL, 0);
+        *error = err;
+        return -1;
+    }
+    return pid;
+}
+
+void close_inherited_fds(int keep) {
+    int fds[256];
+    int count = 0;
+    DIR *dir = opendir("/dev/fd");
+    if (dir == NULL) {
+        return;
+    }
+    // Collect first: closing while reading would close the directory's own fd
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < (int)(sizeof(fds) / sizeof(fds[0]))) {
+        int fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir)) fds[count++] = fd;
+    }
+    closedir(dir);
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+int supervise_should_stop(const char *vm_dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/stop-requested", vm_dir);
+    if (file_exists(path)) {
+        return 1;
+    }
+    // Deleted (renamed to a tombstone) while we were not looking
+    snprintf(path, sizeof(path), "%s/vm-info.json", vm_dir);
+    return !file_exists(path);
+}
+
+void supervise_request_stop(const char *vm_dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/stop-requested", vm_dir);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+}
+
+void supervise_log(const char *vm_dir, const char *fmt, ...) {
+    char path[MAX_PATH];
+    char line[MAX_LINE];
+    va_list ap;
+    snprintf(path, sizeof(path), "%s/supervisor.log", vm_dir);
+    
+    int len = snprintf(line, sizeof(line), "%ld ", (long)time(NULL));
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len - 1, fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return;
+    if (write(fd, line, len) != len) {
+        // Best effort, like the lifecycle log
+    }
+    close(fd);
+}
+
+// Supervision loop; READY_FD gets 0 once the first exec succeeded, or the
+// errno if it failed (in which case there is nothing to supervise)
+void supervise_run(const char *vm_dir, ArgList *args, const char *log_file, int ready_fd) {
+    char pid_file[MAX_PATH];
+    char supervisor_file[MAX_PATH];
+    char stop_file[MAX_PATH];
+    snprintf(pid_file, sizeof(pid_file), "%s/vm.pid", vm_dir);
+    snprintf(supervisor_file, sizeof(supervisor_file), "%s/supervisor.pid", vm_dir);
+    snprintf(stop_file, sizeof(stop_file), "%s/stop-requested", vm_dir);
+    const char *vm_name = strrchr(vm_dir, '/');
+    vm_name = vm_name ? vm_name + 1 : vm_dir;
+    write_pid_file(supervisor_file, getpid());
+    signal(SIGPIPE, SIG_IGN);
+    
+    double backoff = SUPERVISE_BACKOFF_MIN;
+    int restarts = 0;
+    for (;;) {
+        int error = 0;
+        pid_t pid = supervise_exec(args, log_file, &error);
+        if (pid < 0 && ready_fd >= 0) {
+            if (write(ready_fd, &error, sizeof(error)) != sizeof(error)) {
+                // The starter sees EOF and reports the failure anyway
+            }
+            break;
+        }
+        if (pid < 0) {
+            supervise_log(vm_dir, "restart %d failed: %s", restarts, strerror(error));
+        } else {
+            write_pid_file(pid_file, pid);
+            if (ready_fd >= 0) {
+                if (write(ready_fd, &error, sizeof(error)) != sizeof(error)) {
+                    // Starter is gone; keep supervising
+                }
+                close(ready_fd);
+                ready_fd = -1;
+            }
+            
+            // QEMU is our child, so waitpid() both reaps it and gives the
+            // status; between checks the event watch waits on its exit
+            // descriptor (a plain timeout where there is none) and on QMP
+            double started = now_monotonic();
+            double next_trim = started + RECLAIM_TRIM_FIRST;
+            int status = 0;
+            int exit_fd = proc_watch_open(pid);
+            EventWatch watch;
+            event_watch_init(&watch, vm_dir);
+            event_record(vm_name, "starting", ", \"pid\": %d, \"restart\": %d", (int)pid, restarts);
+            for (;;) {
+                pid_t reaped = waitpid(pid, &status, WNOHANG);
+                if (reaped == pid || (reaped < 0 && errno != EINTR)) break;
+                if (now_monotonic() >= next_trim) {
+                    supervise_trim(vm_dir);
+                    next_trim = now_monotonic() + RECLAIM_TRIM_INTERVAL;
+                }
+                event_watch_poll(&watch, exit_fd, SUPERVISE_POLL_MS);
+            }
+            event_watch_close(&watch);
+            if (exit_fd >= 0) close(exit_fd);
+            double ran = now_monotonic() - started;
+            remove(pid_file);
+            
+            if (supervise_should_stop(vm_dir) || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+                event_record(vm_name, "stopped", ", \"uptime\": %.1f", ran);
+                break;
+            }
+            if (ran >= SUPERVISE_STABLE_SECONDS) {
+                backoff = SUPERVISE_BACKOFF_MIN;
+            }
+            if (WIFSIGNALED(status)) {
+                supervise_log(vm_dir, "qemu killed by signal %d after %.1fs, restarting in %.0fs",
+                              WTERMSIG(status), ran, backoff);
+                event_record(vm_name, "crashed", ", \"signal\": %d, \"uptime\": %.1f, \"restart_in\": %.0f",
+                             WTERMSIG(status), ran, backoff);
+            } else {
+                supervise_log(vm_dir, "qemu exited with status %d after %.1fs, restarting in %.0fs",
+                              WEXITSTATUS(status), ran, backoff);
+                event_record(vm_name, "crashed", ", \"status\": %d, \"uptime\": %.1f, \"restart_in\": %.0f",
+                             WEXITSTATUS(status), ran, backoff);
+            }
+        }
+        
+        // Sit out the backoff, but let `vm stop` or `vm delete` end it early
+        double until = now_monotonic() + backoff;
+        while (now_monotonic() < until && !supervise_should_stop(vm_dir)) {
+            usleep(100000);
+        }
+        if (supervise_should_stop(vm_dir)) {
+            event_record(vm_name, "stopped", NULL);
+            break;
+        }
+        backoff = backoff * 2 > SUPERVISE_BACKOFF_MAX ? SUPERVISE_BACKOFF_MAX : backoff * 2;
+        restarts++;
+    }
+    
+    remove(stop_file);
+    remove(supervisor_file);
+    if (ready_fd >= 0) close(ready_fd);
+    
+    // An ephemeral VM does not outlive its QEMU
+    EphemeralStore store;
+    if (ephemeral_load(vm_dir, &store) == 0) {
+        vm_destroy(vm_name);
+    }
+}
+
+// QMP / guest agent
+int unix_connect(const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    return fd;
+}
+
+int qmp_open(QMPConn *conn, const char *sock_path, int handshake) {
+    conn->fd = -1;
+    conn->len = 0;
+    conn->inflight = 0;
+    conn->missed = 0;
+    
+    int fd = unix_connect(sock_path);
+    if (fd < 0) {
+        return 1;
+    }
+    conn->fd = fd;
+    
+    if (handshake) {
+        // QMP greets first, then requires capabilities negotiation
+        char msg[QMP_BUF_SIZE];
+        double deadline = now_monotonic() + QMP_TIMEOUT_MS / 1000.0;
+        int greeted = 0;
+        while (!greeted) {
+            int wait_ms = (int)((deadline - now_monotonic()) * 1000);
+            if (wait_ms <= 0) break;
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, wait_ms) <= 0 || qmp_fill(conn) != 0) break;
+            while (qmp_next_message(conn, msg, sizeof(msg))) {
+                if (strstr(msg, "\"QMP\"")) greeted = 1;
+            }
+        }
+        if (!greeted ||
+            qmp_execute(conn, "{\"execute\": \"qmp_capabilities\"}", msg, sizeof(msg), QMP_TIMEOUT_MS) != 0) {
+            qmp_close(conn);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void qmp_close(QMPConn *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->len = 0;
+    conn->inflight = 0;
+    conn->missed = 0;
+}
+
+int qmp_send(QMPConn *conn, const char *json) {
+    size_t len = strlen(json);
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(conn->fd, json + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        sent += n;
+    }
+    return send(conn->fd, "\n", 1, MSG_NOSIGNAL) == 1 ? 0 : 1;
+}
+
+int qmp_fill(QMPConn *conn) {
+    if (conn->len >= sizeof(conn->buf) - 1) {
+        // Oversized message: drop it rather than wedge the connection
+        conn->len = 0;
+    }
+    ssize_t n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if (n <= 0) return 1;
+    conn->len += n;
+    return 0;
+}
+
+int qmp_next_message(QMPConn *conn, char *msg, size_t size) {
+    char *newline = memchr(conn->buf, '\n', conn->len);
+    if (newline == NULL) {
+        return 0;
+    }
+    
+    size_t line_len = newline - conn->buf;
+    size_t copy_len = line_len < size - 1 ? line_len : size - 1;
+    memcpy(msg, conn->buf, copy_len);
+    msg[copy_len] = '\0';
+    if (copy_len > 0 && msg[copy_len - 1] == '\r') msg[copy_len - 1] = '\0';
+    
+    memmove(conn->buf, newline + 1, conn->len - line_len - 1);
+    conn->len -= line_len + 1;
+    return 1;
+}
+
+int qmp_execute(QMPConn *conn, const char *json, char *resp, size_t size, int timeout_ms) {
+    TRACE_SCOPE("qmp", json);
+    if (conn->fd < 0 || qmp_send(conn, json) != 0) {
+        return 1;
+    }
+    
+    double deadline = now_monotonic() + timeout_ms / 1000.0;
+    for (;;) {
+        while (qmp_next_message(conn, resp, size)) {
+            // Skip asynchronous events until the command reply arrives
+            if (strncmp(resp, "{\"event\"", 8) == 0 || strncmp(resp, "{\"timestamp\"", 12) == 0) continue;
+            return json_find_key(resp, NULL, "return") != NULL ? 0 : 1;
+        }
+        
+        int wait_ms = (int)((deadline - now_monotonic()) * 1000);
+        if (wait_ms <= 0) return 1;
+        struct pollfd pfd = {conn->fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0 || qmp_fill(conn) != 0) return 1;
+    }
+}
+
+// Minimal JSON scanning helpers for QMP replies
+const char *json_find_key(const char *json, const char *end, const char *key) {
+    size_t key_len = strlen(key);
+    const char *p = json;
+    
+    while ((p = strchr(p, '"')) != NULL && (end == NULL || p < end)) {
+        if (strncmp(p + 1, key, key_len) == 0 && p[key_len + 1] == '"') {
+            const char *value = p + key_len + 2;
+            while (*value == ' ') value++;
+            if (*value == ':') {
+                value++;
+                while (*value == ' ') value++;
+                return (end == NULL || value < end) ? value : NULL;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int json_number_in(const char *json, const char *end, const char *key, double *value) {
+    const char *p = json_find_key(json, end, key);
+    if (p == NULL) {
+        return 1;
+    }
+    char *num_end;
+    double v = strtod(p, &num_end);
+    if (num_end == p) {
+        return 1;
+    }
+    *value = v;
+    return 0;
+}
+
+int json_string_in(const char *json, const char *end, const char *key, char *out, size_t size) {
+    const char *p = json_find_key(json, end, key);
+    if (p == NULL || *p != '"') {
+        return 1;
+    }
+    p++;
+    size_t i = 0;
+    while (*p && *p != '"' && i < size - 1) {
+        if (*p == '\\' && p[1]) p++;
+        out[i++] = *p++;
+    }
+    out[i] = '\0';
+    return 0;
+}
+
+// JSON document parser: one pass over a private copy of the input, strings
+// unescaped in place, nodes in a flat array linked by index
+int json_new_node(JsonDoc *doc, JsonType type) {
+    if (doc->count == doc->capacity) {
+        int capacity = doc->capacity ? doc->capacity * 2 : 32;
+        JsonNode *nodes = realloc(doc->nodes, capacity * sizeof(JsonNode));
+        if (nodes == NULL) return -1;
+        doc->nodes = nodes;
+        doc->capacity = capacity;
+    }
+    JsonNode *node = &doc->nodes[doc->count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->child = -1;
+    node->next = -1;
+    return doc->count++;
+}
+
+void json_skip_space(char **pos) {
+    while (**pos == ' ' || **pos == '\t' || **pos == '\n' || **pos == '\r') (*pos)++;
+}
+
+int json_hex4(const char *p, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') *value |= c - '0';
+        else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+        else return 1;
+    }
+    return 0;
+}
+
+// Decode the string starting at the opening quote; the result never grows,
+// so it is written back over the input
+char *json_parse_string(char **pos) {
+    char *r = *pos + 1;
+    char *w = r;
+    char *start = r;
+    
+    while (*r != '"') {
+        if (*r == '\0' || (unsigned char)*r < 0x20) return NULL;
+        if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        r++;
+        switch (*r) {
+            case '"': case '\\': case '/': *w++ = *r; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                unsigned int cp;
+                if (json_hex4(r + 1, &cp) != 0) return NULL;
+                r += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && r[1] == '\\' && r[2] == 'u') {
+                    unsigned int low;
+                    if (json_hex4(r + 3, &low) == 0 && low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        r += 6;
+                    }
+                }
+                if (cp < 0x80) {
+                    *w++ = (char)cp;
+                } else if (cp < 0x800) {
+                    *w++ = (char)(0xC0 | (cp >> 6));
+                    *w++ = (char)(0x80 | (cp & 0x3F));
+                } else if (cp < 0x10000) {
+                    *w++ = (char)(0xE0 | (cp >> 12));
+                    *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    *w++ = (char)(0x80 | (cp & 0x3F));
+                } else {
+                    *w++ = (char)(0xF0 | (cp >> 18));
+                    *w++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+                    *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    *w++ = (char)(0x80 | (cp & 0x3F));
+                }
+                break;
+            }
+            default:
+                return NULL;
+        }
+        r++;
+    }
+    *w = '\0';
+    *pos = r + 1;
+    return start;
+}
+
+int json_parse_value(JsonDoc *doc, char **pos, int depth) {
+    json_skip_space(pos);
+    char *p = *pos;
+    int node;
+    
+    if (depth > JSON_MAX_DEPTH) {
+        return -1;
+    }
+    
+    if (*p == '{' || *p == '[') {
+        int is_object = *p == '{';
+        char close = is_object ? '}' : ']';
+        node = json_new_node(doc, is_object ? JSON_OBJECT : JSON_ARRAY);
+        if (node < 0) return -1;
+        *pos = p + 1;
+        json_skip_space(pos);
+        if (**pos == close) {
+            (*pos)++;
+            return node;
+        }
+        
+        int last = -1;
+        for (;;) {
+            char *key = NULL;
+            json_skip_space(pos);
+            if (is_object) {
+                if (**pos != '"' || (key = json_parse_string(pos)) == NULL) return -1;
+                json_skip_space(pos);
+                if (**pos != ':') return -1;
+                (*pos)++;
+            }
+            int child = json_parse_value(doc, pos, depth + 1);
+            if (child < 0) return -1;
+            doc->nodes[child].key = key;
+            if (last < 0) doc->nodes[node].child = child;
+            else doc->nodes[last].next = child;
+            last = child;
+            
+            json_skip_space(pos);
+            if (**pos == ',') {
+                (*pos)++;
+                continue;
+            }
+            if (**pos == close) {
+                (*pos)++;
+                return node;
+            }
+            return -1;
+        }
+    }
+    
+    if (*p == '"') {
+        char *value = json_parse_string(pos);
+        if (value == NULL || (node = json_new_node(doc, JSON_STRING)) < 0) return -1;
+        doc->nodes[node].string = value;
+        return node;
+    }
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0 || strncmp(p, "null", 4) == 0) {
+        JsonType type = *p == 't' ? JSON_TRUE : *p == 'f' ? JSON_FALSE : JSON_NULL;
+        *pos = p + (*p == 'f' ? 5 : 4);
+        return json_new_node(doc, type);
+    }
+    if (*p == '-' || isdigit((unsigned char)*p)) {
+        char *end;
+        double value = strtod(p, &end);
+        if (end == p || (node = json_new_node(doc, JSON_NUMBER)) < 0) return -1;
+        doc->nodes[node].number = value;
+        *pos = end;
+        return node;
+    }
+    return -1;
+}
+
+int json_parse(JsonDoc *doc, const char *text, size_t len) {
+    memset(doc, 0, sizeof(*doc));
+    doc->text = malloc(len + 1);
+    if (doc->text == NULL) {
+        return 1;
+    }
+    memcpy(doc->text, text, len);
+    doc->text[len] = '\0';
+    
+    char *pos = doc->text;
+    if (json_parse_value(doc, &pos, 0) != 0) {
+        doc->error_offset = pos - doc->text;
+        return 1;
+    }
+    json_skip_space(&pos);
+    if (*pos != '\0') {
+        doc->error_offset = pos - doc->text;
+        return 1;
+    }
+    return 0;
+}
+
+void json_free(JsonDoc *doc) {
+    free(doc->text);
+    free(doc->nodes);
+    memset(doc, 0, sizeof(*doc));
+}
+
+int json_get(const JsonDoc *doc, int object, const char *key) {
+    if (object < 0 || object >= doc->count || doc->nodes[object].type != JSON_OBJECT) {
+        return -1;
+    }
+    for (int i = doc->nodes[object].child; i >= 0; i = doc->nodes[i].next) {
+        if (strcmp(doc->nodes[i].key, key) == 0) return i;
+    }
+    return -1;
+}
+
+const char *json_get_string(const JsonDoc *doc, int object, const char *key, const char *fallback) {
+    int node = json_get(doc, object, key);
+    if (node < 0 || doc->nodes[node].type != JSON_STRING) {
+        return fallback;
+    }
+    return doc->nodes[node].string;
+}
+
+double json_get_number(const JsonDoc *doc, int object, const char *key, double fallback) {
+    int node = json_get(doc, object, key);
+    if (node < 0 || doc->nodes[node].type != JSON_NUMBER) {
+        return fallback;
+    }
+    return doc->nodes[node].number;
+}
+
+void json_write_string(StrBuf *sb, const char *value) {
+    sb_printf(sb, "\"");
+    const char *run = value;
+    for (const char *p = value; ; p++) {
+        unsigned char c = *p;
+        if (c != '\0' && c != '"' && c != '\\' && c >= 0x20) continue;
+        
+        // Copy the plain run in one go, then the escape
+        if (p > run) sb_printf(sb, "%.*s", (int)(p - run), run);
+        if (c == '\0') break;
+        if (c == '"' || c == '\\') sb_printf(sb, "\\%c", c);
+        else if (c == '\n') sb_printf(sb, "\\n");
+        else if (c == '\r') sb_printf(sb, "\\r");
+        else if (c == '\t') sb_printf(sb, "\\t");
+        else sb_printf(sb, "\\u%04x", c);
+        run = p + 1;
+    }
+    sb_printf(sb, "\"");
+}
+
+// Replace PATH with DATA so readers see either the old or the new file,
+// never a partial one
+int write_file_atomic(const char *path, const char *data, size_t len) {
+    char tmp_path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += n;
+    }
+    int ok = written == len && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return 1;
+    }
+    return 0;
+}
+
+// Image store: distro images split by content-defined chunking, each unique
+// chunk kept once (LZ-compressed when that pays) under its SHA-256.
+//   ~/.v4m/store/chunks/<xx>/<sha256>   chunk files, see STORE_CHUNK_MAGIC
+//   ~/.v4m/store/cache/<id>.img          materialized image, only where it can be reflinked
+//   ~/.v4m/store/cache/<id>.base         read-only base shared by ephemeral VMs
+//   ~/.v4m/distros/<distro>/<file>.manifest   "offset length sha256|zero" per chunk
+// Ingest holds the store lock shared and gc holds it exclusive, so gc never
+// sees chunks of a manifest that is still being written
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 64) return;
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256_block(ctx, p);
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+void sha256_final(Sha256 *ctx, char hex[65]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256_update(ctx, &pad, 1);
+    }
+    unsigned char length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = bits >> (56 - i * 8);
+    }
+    sha256_update(ctx, length, 8);
+    for (int i = 0; i < 8; i++) {
+        snprintf(hex + i * 8, 9, "%08x", ctx->state[i]);
+    }
+}
+
+// LZ77 block codec in the LZ4 sequence layout: token (literal length << 4 |
+// match length - 4), extra length bytes when a nibble is 15, literals, 16-bit
+// offset. The last sequence carries literals only. Returns the compressed
+// size, or 0 when the output would not fit in CAPACITY
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity) {
+    static uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    while (len >= 12 && ip < len - 12) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t slot = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[slot];
+        table[slot] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 65535 || memcmp(src + ref - 1, src + ip, 4) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t match = 4;
+        while (ip + match < len && src[ref + match] == src[ip + match]) match++;
+
+        size_t literals = ip - anchor;
+        if (op + literals + literals / 255 + match / 255 + 8 > capacity) {
+            return 0;
+        }
+        unsigned char *token = dst + op++;
+        *token = (literals >= 15 ? 15 : literals) << 4;
+        if (literals >= 15) {
+            size_t rest = literals - 15;
+            for (; rest >= 255; rest -= 255) dst[op++] = 255;
+            dst[op++] = rest;
+        }
+        memcpy(dst + op, src + anchor, literals);
+        op += literals;
+        dst[op++] = (ip - ref) & 0xff;
+        dst[op++] = (ip - ref) >> 8;
+        size_t extra = match - 4;
+        *token |= extra >= 15 ? 15 : extra;
+        if (extra >= 15) {
+            size_t rest = extra - 15;
+            for (; rest >= 255; rest -= 255) dst[op++] = 255;
+            dst[op++] = rest;
+        }
+        ip += match;
+        anchor = ip;
+    }
+
+    size_t literals = len - anchor;
+    if (op + literals + literals / 255 + 2 > capacity) {
+        return 0;
+    }
+    dst[op++] = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) {
+        size_t rest = literals - 15;
+        for (; rest >= 255; rest -= 255) dst[op++] = 255;
+        dst[op++] = rest;
+    }
+    memcpy(dst + op, src + anchor, literals);
+    return op + literals;
+}
+
+// Inverse of lz_compress(); fails unless the output is exactly OUT_LEN bytes
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t out_len) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        unsigned int token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return 1;
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > len - ip || literals > out_len - op) {
+            return 1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) return 1;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return 1;
+                b = src[ip++];
+                match += b;
+            } while (b == 255);
+        }
+        match += 4;
+        if (offset == 0 || offset > op || match > out_len - op) {
+            return 1;
+        }
+        if (offset >= match) {
+            memcpy(dst + op, dst + op - offset, match);
+        } else {
+            for (size_t i = 0; i < match; i++) dst[op + i] = dst[op + i - offset];
+        }
+        op += match;
+    }
+    return op == out_len ? 0 : 1;
+}
+
+// Gear rolling hash, FastCDC style: cuts are harder to hit before the
+// average size and easier after it, which narrows the size spread
+uint64_t cdc_gear[256];
+
+size_t cdc_next(const unsigned char *data, size_t len) {
+    if (cdc_gear[0] == 0) {
+        uint64_t seed = 0x76346d2d63646331ULL;
+        for (int i = 0; i < 256; i++) {
+            // splitmix64, so every build cuts at the same places
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            cdc_gear[i] = z ^ (z >> 31);
+        }
+    }
+    if (len <= CDC_MIN_SIZE) {
+        return len;
+    }
+    size_t max = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    size_t normal = max < CDC_AVG_SIZE ? max : CDC_AVG_SIZE;
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + cdc_gear[data[i]];
+        if ((hash & CDC_MASK_SMALL) == 0) return i + 1;
+    }
+    for (; i < max; i++) {
+        hash = (hash << 1) + cdc_gear[data[i]];
+        if ((hash & CDC_MASK_LARGE) == 0) return i + 1;
+    }
+    return max;
+}
+
+int is_zero_block(const unsigned char *data, size_t len) {
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+void store_path(char *path, size_t size, const char *sub) {
+    snprintf(path, size, "%s/.v4m/store%s%s", getenv("HOME"), sub[0] ? "/" : "", sub);
+}
+
+void store_chunk_path(const char *hex, char *path, size_t size) {
+    snprintf(path, size, "%s/.v4m/store/chunks/%.2s/%s", getenv("HOME"), hex, hex);
+}
+
+// fd holding the store lock (LOCK_SH for writers of new content, LOCK_EX for gc)
+int store_lock(int operation) {
+    char path[MAX_PATH];
+    store_path(path, sizeof(path), "");
+    mkdir(path, 0755);
+    store_path(path, sizeof(path), "chunks");
+    mkdir(path, 0755);
+    store_path(path, sizeof(path), "cache");
+    mkdir(path, 0755);
+    store_path(path, sizeof(path), ".lock");
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, operation) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Store DATA under HEX unless it is already there. SCRATCH must hold LEN bytes
+int store_put_chunk(const char *hex, const unsigned char *data, size_t len, unsigned char *scratch, StoreStats *stats) {
+    char path[MAX_PATH];
+    char tmp[MAX_PATH + 32];
+    store_chunk_path(hex, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        stats->dup_chunks++;
+        stats->dup_bytes += len;
+        return 0;
+    }
+
+    // Keep the compressed form only when it saves at least 1/16th
+    size_t packed = lz_compress(data, len, scratch, len - len / 16);
+    unsigned char header[STORE_CHUNK_HEADER];
+    memset(header, 0, sizeof(header));
+    memcpy(header, STORE_CHUNK_MAGIC, 4);
+    header[4] = packed > 0 ? 1 : 0;
+    uint32_t raw_len = len;
+    uint32_t stored_len = packed > 0 ? packed : len;
+    for (int i = 0; i < 4; i++) {
+        header[8 + i] = raw_len >> (i * 8);
+        header[12 + i] = stored_len >> (i * 8);
+    }
+
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    const unsigned char *payload = packed > 0 ? scratch : data;
+    int ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+             write(fd, payload, stored_len) == (ssize_t)stored_len && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 1;
+    }
+    stats->new_chunks++;
+    stats->new_bytes += len;
+    stats->stored_bytes += sizeof(header) + stored_len;
+    return 0;
+}
+
+// Read chunk HEX into OUT (at least CDC_MAX_SIZE bytes); returns its length or -1
+ssize_t store_get_chunk(const char *hex, unsigned char *out, unsigned char *scratch) {
+    char path[MAX_PATH];
+    unsigned char header[STORE_CHUNK_HEADER];
+    store_chunk_path(hex, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t result = -1;
+    if (read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) && memcmp(header, STORE_CHUNK_MAGIC, 4) == 0) {
+        uint32_t raw_len = 0;
+        uint32_t stored_len = 0;
+        for (int i = 0; i < 4; i++) {
+            raw_len |= (uint32_t)header[8 + i] << (i * 8);
+            stored_len |= (uint32_t)header[12 + i] << (i * 8);
+        }
+        unsigned char *target = header[4] == 1 ? scratch : out;
+        if (raw_len <= CDC_MAX_SIZE && stored_len <= CDC_MAX_SIZE &&
+            read(fd, target, stored_len) == (ssize_t)stored_len) {
+            if (header[4] == 0 && stored_len == raw_len) {
+                result = raw_len;
+            } else if (header[4] == 1 && lz_decompress(scratch, stored_len, out, raw_len) == 0) {
+                result = raw_len;
+            }
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// Split SRC into the store and write its manifest to MANIFEST
+int store_ingest(const char *src, const char *manifest, StoreStats *stats) {
+    TRACE_SCOPE("store_ingest", src);
+    memset(stats, 0, sizeof(*stats));
+    int fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    int lock_fd = store_lock(LOCK_SH);
+    size_t capacity = STORE_IO_BUFFER;
+    unsigned char *buf = malloc(capacity);
+    unsigned char *scratch = malloc(CDC_MAX_SIZE);
+    if (lock_fd < 0 || buf == NULL || scratch == NULL) {
+        free(buf);
+        free(scratch);
+        close(fd);
+        if (lock_fd >= 0) close(lock_fd);
+        return 1;
+    }
+
+    StrBuf body = {0};
+    size_t filled = 0;
+    uint64_t offset = 0;
+    int eof = 0;
+    int failed = 0;
+    while (!failed) {
+        while (!eof && filled < capacity) {
+            ssize_t n = read(fd, buf + filled, capacity - filled);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) failed = 1;
+            if (n <= 0) {
+                eof = 1;
+                break;
+            }
+            filled += n;
+        }
+
+        // Boundaries depend only on content, so a chunk is cut only with a
+        // full CDC_MAX_SIZE window ahead of it (or at end of file)
+        size_t pos = 0;
+        while (!failed && filled - pos > 0 && (eof || filled - pos >= CDC_MAX_SIZE)) {
+            size_t len = cdc_next(buf + pos, filled - pos);
+            if (is_zero_block(buf + pos, len)) {
+                sb_printf(&body, "%llu %zu zero\n", (unsigned long long)offset, len);
+                stats->zero_bytes += len;
+            } else {
+                Sha256 ctx;
+                char hex[65];
+                sha256_init(&ctx);
+                sha256_update(&ctx, buf + pos, len);
+                sha256_final(&ctx, hex);
+                failed = store_put_chunk(hex, buf + pos, len, scratch, stats) != 0;
+                sb_printf(&body, "%llu %zu %s\n", (unsigned long long)offset, len, hex);
+            }
+            stats->chunks++;
+            offset += len;
+            pos += len;
+        }
+        memmove(buf, buf + pos, filled - pos);
+        filled -= pos;
+        if (eof && filled == 0) break;
+    }
+    close(fd);
+    free(buf);
+    free(scratch);
+    stats->logical_bytes = offset;
+
+    // The image id names the chunk list, so identical images share a cache entry
+    Sha256 ctx;
+    char id[65];
+    sha256_init(&ctx);
+    sha256_update(&ctx, body.data ? body.data : "", body.len);
+    sha256_final(&ctx, id);
+    StrBuf text = {0};
+    sb_printf(&text, "%ssize %llu\nid %s\n%s", STORE_MANIFEST_HEADER, (unsigned long long)offset, id, body.data ? body.data : "");
+    if (!failed) {
+        failed = write_file_atomic(manifest, text.data, text.len) != 0;
+    }
+    sb_free(&text);
+    sb_free(&body);
+    close(lock_fd);
+    return failed;
+}
+
+// Header fields of MANIFEST; the chunk lines start at *BODY inside *TEXT
+int store_manifest_read(const char *manifest, char **text, char **body, uint64_t *size, char id[65]) {
+    size_t len;
+    if (read_file(manifest, text, &len) != 0) {
+        return 1;
+    }
+    unsigned long long value;
+    size_t header_len = strlen(STORE_MANIFEST_HEADER);
+    if (strncmp(*text, STORE_MANIFEST_HEADER, header_len) != 0 ||
+        sscanf(*text + header_len, "size %llu\nid %64s", &value, id) != 2) {
+        free(*text);
+        return 1;
+    }
+    *size = value;
+    *body = strstr(*text + header_len, "\nid ");
+    *body = *body ? strchr(*body + 1, '\n') : NULL;
+    if (*body == NULL) {
+        free(*text);
+        return 1;
+    }
+    (*body)++;
+    return 0;
+}
+
+// Clone SRC to DEST sharing its blocks; fails where the filesystem cannot
+int reflink_file(const char *src, const char *dest) {
+#ifdef __APPLE__
+    unlink(dest);
+    return clonefile(src, dest, 0) == 0 ? 0 : 1;
+#elif defined(FICLONE)
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 1;
+    }
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return 1;
+    }
+    int result = ioctl(out, FICLONE, in) == 0 ? 0 : 1;
+    close(in);
+    close(out);
+    if (result != 0) unlink(dest);
+    return result;
+#else
+    (void)src;
+    (void)dest;
+    return 1;
+#endif
+}
+
+// Write the image described by MANIFEST to DEST: a reflink of the cached
+// copy when one exists, otherwise chunk by chunk into a sparse file (zero
+// chunks stay holes) with adjacent chunks coalesced into large writes.
+// Holds the store lock shared, so gc cannot take chunks out from under it
+int store_materialize(const char *manifest, const char *dest, double *bytes_per_sec) {
+    TRACE_SCOPE("store_materialize", dest);
+    char *text;
+    char *body;
+    uint64_t size;
+    char id[65];
+    char cache[MAX_PATH];
+    double started = now_monotonic();
+
+    *bytes_per_sec = 0;
+    int lock_fd = store_lock(LOCK_SH);
+    if (lock_fd < 0) {
+        return 1;
+    }
+    if (store_manifest_read(manifest, &text, &body, &size, id) != 0) {
+        close(lock_fd);
+        return 1;
+    }
+    snprintf(cache, sizeof(cache), "%s/.v4m/store/cache/%s.img", getenv("HOME"), id);
+    if (file_exists(cache) && reflink_file(cache, dest) == 0) {
+        close(lock_fd);
+        free(text);
+        *bytes_per_sec = size / (now_monotonic() - started + 1e-9);
+        return 0;
+    }
+
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unsigned char *out = malloc(STORE_IO_BUFFER);
+    unsigned char *scratch = malloc(CDC_MAX_SIZE);
+    int failed = fd < 0 || out == NULL || scratch == NULL || ftruncate(fd, size) != 0;
+    size_t pending = 0;
+    uint64_t pending_at = 0;
+
+    for (char *line = body; !failed && *line; ) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) break;
+        *end = '\0';
+        unsigned long long offset;
+        size_t len;
+        char hex[65];
+        if (sscanf(line, "%llu %zu %64s", &offset, &len, hex) != 3 || len > CDC_MAX_SIZE) {
+            failed = 1;
+            break;
+        }
+        line = end + 1;
+
+        int zero = strcmp(hex, "zero") == 0;
+        if (pending > 0 && (zero || pending + len > STORE_IO_BUFFER || pending_at + pending != offset)) {
+            failed = pwrite(fd, out, pending, pending_at) != (ssize_t)pending;
+            pending = 0;
+        }
+        if (zero || failed) continue;
+        if (pending == 0) pending_at = offset;
+        if (store_get_chunk(hex, out + pending, scratch) != (ssize_t)len) {
+            failed = 1;
+            break;
+        }
+        pending += len;
+    }
+    if (!failed && pending > 0) {
+        failed = pwrite(fd, out, pending, pending_at) != (ssize_t)pending;
+    }
+    if (fd >= 0) close(fd);
+    free(out);
+    free(scratch);
+    free(text);
+    if (failed) {
+        close(lock_fd);
+        unlink(dest);
+        return 1;
+    }
+    *bytes_per_sec = size / (now_monotonic() - started + 1e-9);
+
+    // Where the filesystem clones, keep a copy so later VMs share its blocks
+    char tmp[MAX_PATH + 32];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", cache, (int)getpid());
+    if (!file_exists(cache) && reflink_file(dest, tmp) == 0 && rename(tmp, cache) != 0) {
+        unlink(tmp);
+    }
+    close(lock_fd);
+    return 0;
+}
+
+int compare_hashes(const void *a, const void *b) {
+    return memcmp(a, b, 64);
+}
+
+// Hashes (64 hex chars each, sorted) and image ids referenced by every
+// manifest under distros/. Returns the number of hashes, or -1
+int store_references(char (**hashes)[64], int *image_count, StrBuf *ids, uint64_t *logical, uint64_t *zero) {
+    char distros_dir[MAX_PATH];
+    snprintf(distros_dir, sizeof(distros_dir), "%s/.v4m/distros", getenv("HOME"));
+    int count = 0;
+    int capacity = 0;
+    *hashes = NULL;
+    *image_count = 0;
+    *logical = 0;
+    *zero = 0;
+
+    DIR *dir = opendir(distros_dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char distro_dir[MAX_PATH + sizeof(entry->d_name)];
+        snprintf(distro_dir, sizeof(distro_dir), "%s/%s", distros_dir, entry->d_name);
+        DIR *sub = opendir(distro_dir);
+        struct dirent *file;
+        while (sub != NULL && (file = readdir(sub)) != NULL) {
+            size_t len = strlen(file->d_name);
+            if (len < 10 || strcmp(file->d_name + len - 9, ".manifest") != 0) continue;
+            char path[sizeof(distro_dir) + sizeof(file->d_name)];
+            char *text;
+            char *body;
+            uint64_t size;
+            char id[65];
+            snprintf(path, sizeof(path), "%s/%s", distro_dir, file->d_name);
+            if (store_manifest_read(path, &text, &body, &size, id) != 0) continue;
+
+            (*image_count)++;
+            *logical += size;
+            sb_printf(ids, "%s\n", id);
+            for (char *line = body; *line; ) {
+                char *end = strchr(line, '\n');
+                if (end == NULL) break;
+                unsigned long long offset;
+                size_t chunk_len;
+                char hex[65];
+                if (sscanf(line, "%llu %zu %64s", &offset, &chunk_len, hex) == 3) {
+                    if (strcmp(hex, "zero") == 0) {
+                        *zero += chunk_len;
+                    } else {
+                        if (count == capacity) {
+                            capacity = capacity ? capacity * 2 : 4096;
+                            char (*grown)[64] = realloc(*hashes, capacity * sizeof(**hashes));
+                            if (grown == NULL) {
+                                free(text);
+                                closedir(sub);
+                                closedir(dir);
+                                return -1;
+                            }
+                            *hashes = grown;
+                        }
+                        memcpy((*hashes)[count++], hex, 64);
+                    }
+                }
+                line = end + 1;
+            }
+            free(text);
+        }
+        if (sub != NULL) closedir(sub);
+    }
+    if (dir != NULL) closedir(dir);
+    if (count > 0) qsort(*hashes, count, sizeof(**hashes), compare_hashes);
+    return count;
+}
+
+// Walk the store: unreferenced chunks and cache entries are removed when
+// COLLECT is set, the rest are added up into STATS
+int store_walk(int collect, StoreStats *stats) {
+    char (*hashes)[64];
+    StrBuf ids = {0};
+    int images;
+    uint64_t logical, zero;
+    int lock_fd = store_lock(collect ? LOCK_EX : LOCK_SH);
+    if (lock_fd < 0) {
+        return 1;
+    }
+    int count = store_references(&hashes, &images, &ids, &logical, &zero);
+    if (count < 0) {
+        close(lock_fd);
+        return 1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->images = images;
+    stats->logical_bytes = logical;
+    stats->zero_bytes = zero;
+
+    char chunks_dir[MAX_PATH];
+    store_path(chunks_dir, sizeof(chunks_dir), "chunks");
+    DIR *dir = opendir(chunks_dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char shard[MAX_PATH + sizeof(entry->d_name)];
+        snprintf(shard, sizeof(shard), "%s/%s", chunks_dir, entry->d_name);
+        DIR *sub = opendir(shard);
+        struct dirent *file;
+        while (sub != NULL && (file = readdir(sub)) != NULL) {
+            if (strlen(file->d_name) != 64) continue;
+            char path[sizeof(shard) + sizeof(file->d_name)];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", shard, file->d_name);
+            if (stat(path, &st) != 0) continue;
+
+            if (count == 0 || bsearch(file->d_name, hashes, count, sizeof(*hashes), compare_hashes) == NULL) {
+                if (collect && unlink(path) == 0) {
+                    stats->dup_chunks++;
+                    stats->dup_bytes += st.st_size;
+                }
+                continue;
+            }
+            unsigned char header[STORE_CHUNK_HEADER];
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0 && read(fd, header, sizeof(header)) == (ssize_t)sizeof(header)) {
+                stats->new_bytes += (uint32_t)header[8] | (uint32_t)header[9] << 8 |
+                                    (uint32_t)header[10] << 16 | (uint32_t)header[11] << 24;
+            }
+            if (fd >= 0) close(fd);
+            stats->new_chunks++;
+            stats->stored_bytes += st.st_size;
+        }
+        if (sub != NULL) closedir(sub);
+    }
+    if (dir != NULL) closedir(dir);
+
+    // An ephemeral VM keeps reading its base after the image is deleted
+    StrBuf bases = {0};
+    if (collect) {
+        for_each_vm(ephemeral_base_visit, &bases);
+    }
+    char cache_dir[MAX_PATH];
+    store_path(cache_dir, sizeof(cache_dir), "cache");
+    dir = opendir(cache_dir);
+    while (collect && dir != NULL && (entry = readdir(dir)) != NULL) {
+        char id[65];
+        char suffix[8];
+        if (strlen(entry->d_name) < 68 || sscanf(entry->d_name, "%64[0-9a-f]%7s", id, suffix) != 2) continue;
+        if (strcmp(suffix, ".img") != 0 && strcmp(suffix, ".base") != 0) continue;
+        if (ids.data != NULL && strstr(ids.data, id) != NULL) continue;
+        char path[MAX_PATH + sizeof(entry->d_name)];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        if (bases.data != NULL && strstr(bases.data, path) != NULL) continue;
+        unlink(path);
+    }
+    if (dir != NULL) closedir(dir);
+
+    free(hashes);
+    sb_free(&ids);
+    sb_free(&bases);
+    close(lock_fd);
+    return 0;
+}
+
+// Delta updates, zsync style: the mirror publishes IMAGE.blocksums (a weak
+// rolling checksum and a SHA-256 per fixed-size block of the new image), the
+// client slides a window over its old image looking for those blocks, copies
+// every block it finds and fetches only the rest with HTTP range requests.
+//   # v4m block sums 1
+//   size <bytes>
+//   block <bytes>
+//   sha256 <whole image>
+//   <weak hex> <sha256 hex>        one line per block
+
+// rsync's weak checksum: a = sum of bytes, b = sum of prefix sums, mod 2^16
+uint32_t weak_checksum(const unsigned char *data, size_t len, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    a %= WEAK_MOD;
+    b %= WEAK_MOD;
+    if (a_out) *a_out = a;
+    if (b_out) *b_out = b;
+    return a | b << 16;
+}
+
+int block_sums_write(const char *image, const char *out) {
+    int fd = open(image, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    unsigned char *buf = malloc(IMAGE_SUMS_BLOCK);
+    StrBuf body = {0};
+    Sha256 whole;
+    uint64_t size = 0;
+    int failed = buf == NULL;
+    sha256_init(&whole);
+    while (!failed) {
+        size_t filled = 0;
+        while (filled < IMAGE_SUMS_BLOCK) {
+            ssize_t n = read(fd, buf + filled, IMAGE_SUMS_BLOCK - filled);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) failed = 1;
+            if (n <= 0) break;
+            filled += n;
+        }
+        if (filled == 0) break;
+        Sha256 ctx;
+        char hex[65];
+        sha256_init(&ctx);
+        sha256_update(&ctx, buf, filled);
+        sha256_final(&ctx, hex);
+        sha256_update(&whole, buf, filled);
+        sb_printf(&body, "%08x %s\n", weak_checksum(buf, filled, NULL, NULL), hex);
+        size += filled;
+        if (filled < IMAGE_SUMS_BLOCK) break;
+    }
+    close(fd);
+    free(buf);
+
+    char whole_hex[65];
+    sha256_final(&whole, whole_hex);
+    StrBuf text = {0};
+    sb_printf(&text, "%ssize %llu\nblock %d\nsha256 %s\n%s", IMAGE_SUMS_HEADER, (unsigned long long)size,
+              IMAGE_SUMS_BLOCK, whole_hex, body.data ? body.data : "");
+    if (!failed) {
+        failed = write_file_atomic(out, text.data, text.len) != 0;
+    }
+    sb_free(&text);
+    sb_free(&body);
+    return failed;
+}
+
+int block_sums_read(const char *path, BlockSums *sums) {
+    char *text;
+    size_t len;
+    memset(sums, 0, sizeof(*sums));
+    if (read_file(path, &text, &len) != 0) {
+        return 1;
+    }
+    unsigned long long size;
+    unsigned int block;
+    size_t header_len = strlen(IMAGE_SUMS_HEADER);
+    if (strncmp(text, IMAGE_SUMS_HEADER, header_len) != 0 ||
+        sscanf(text + header_len, "size %llu\nblock %u\nsha256 %64s", &size, &block, sums->sha256) != 3 ||
+        block == 0 || block > STORE_IO_BUFFER) {
+        free(text);
+        return 1;
+    }
+    sums->size = size;
+    sums->block = block;
+    sums->count = (size + block - 1) / block;
+    sums->weak = calloc(sums->count + 1, sizeof(*sums->weak));
+    sums->strong = calloc(sums->count + 1, sizeof(*sums->strong));
+    if (sums->weak == NULL || sums->strong == NULL) {
+        free(text);
+        block_sums_free(sums);
+        return 1;
+    }
+
+    // Skip the four header lines, then one line per block
+    char *line = text + header_len;
+    for (int i = 0; i < 3 && line; i++) {
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    int parsed = 0;
+    while (line && *line && parsed < sums->count) {
+        if (sscanf(line, "%x %64s", &sums->weak[parsed], sums->strong[parsed]) != 2) break;
+        parsed++;
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    free(text);
+    if (parsed != sums->count) {
+        block_sums_free(sums);
+        return 1;
+    }
+    return 0;
+}
+
+void block_sums_free(BlockSums *sums) {
+    free(sums->weak);
+    free(sums->strong);
+    sums->weak = NULL;
+    sums->strong = NULL;
+}
+
+// Fetch bytes [START, START+LEN) of URL into FD at the same offset. A server
+// that ignores the Range header sends the whole file, which shows up as a
+// length mismatch and returns 2
+int fetch_range(const char *url, uint64_t start, uint64_t len, int fd, unsigned char *buf, size_t buf_size) {
+    char command[MAX_URL + 128];
+    snprintf(command, sizeof(command), "curl -fsSL -r %llu-%llu \"%s\"",
+             (unsigned long long)start, (unsigned long long)(start + len - 1), url);
+    TRACE_SCOPE("spawn", "curl range");
+    FILE *fp = popen(command, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    uint64_t got = 0;
+    int failed = 0;
+    size_t n;
+    while ((n = fread(buf, 1, buf_size, fp)) > 0) {
+        if (got + n > len) {
+            pclose(fp);
+            return 2;
+        }
+        if (pwrite(fd, buf, n, start + got) != (ssize_t)n) {
+            failed = 1;
+            break;
+        }
+        got += n;
+    }
+    int status = pclose(fp);
+    return failed || status != 0 || got != len;
+}
+
+// Rebuild the image at URL into OUT from the blocks of OLD (may be NULL)
+// that it still contains, fetching the others. Fills the byte counters
+int delta_rebuild(const char *url, const BlockSums *sums, const char *old, const char *out, DeltaStats *stats) {
+    TRACE_SCOPE("delta_rebuild", out);
+    memset(stats, 0, sizeof(*stats));
+    int64_t *source = malloc(sums->count * sizeof(int64_t));
+    int *next = malloc(sums->count * sizeof(int));
+    int buckets = 1;
+    while (buckets < sums->count * 2) buckets <<= 1;
+    int *head = malloc(buckets * sizeof(int));
+    unsigned char *buf = malloc(STORE_IO_BUFFER);
+    if (source == NULL || next == NULL || head == NULL || buf == NULL) {
+        free(source);
+        free(next);
+        free(head);
+        free(buf);
+        return 1;
+    }
+
+    // Blocks of zeroes never need fetching: the output is sparse
+    char zero_hex[65];
+    Sha256 ctx;
+    memset(buf, 0, sums->block);
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, sums->block);
+    sha256_final(&ctx, zero_hex);
+
+    for (int i = 0; i < buckets; i++) head[i] = -1;
+    for (int i = sums->count - 1; i >= 0; i--) {
+        uint32_t len = i == sums->count - 1 ? sums->size - (uint64_t)i * sums->block : sums->block;
+        source[i] = -1;
+        if (len == sums->block && strcmp(sums->strong[i], zero_hex) == 0) {
+            source[i] = -2;
+            continue;
+        }
+        int slot = (sums->weak[i] * 2654435761u) & (buckets - 1);
+        next[i] = head[slot];
+        head[slot] = i;
+    }
+
+    // Slide a block-sized window over the old image one byte at a time,
+    // jumping a whole block after every match
+    int old_fd = old ? open(old, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    unsigned char *map = MAP_FAILED;
+    if (old_fd >= 0 && fstat(old_fd, &st) == 0 && (uint64_t)st.st_size >= sums->block) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, old_fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        uint64_t old_size = st.st_size;
+        uint32_t block = sums->block;
+        uint64_t pos = 0;
+        uint32_t a, b;
+        weak_checksum(map, block, &a, &b);
+        madvise(map, old_size, MADV_SEQUENTIAL);
+        for (;;) {
+            uint32_t weak = a | b << 16;
+            int matched = 0;
+            char hex[65] = "";
+            for (int j = head[(weak * 2654435761u) & (buckets - 1)]; j >= 0; j = next[j]) {
+                if (sums->weak[j] != weak || source[j] != -1) continue;
+                if (j == sums->count - 1 && sums->size - (uint64_t)j * block != block) continue;
+                if (hex[0] == '\0') {
+                    sha256_init(&ctx);
+                    sha256_update(&ctx, map + pos, block);
+                    sha256_final(&ctx, hex);
+                }
+                if (strcmp(hex, sums->strong[j]) == 0) {
+                    source[j] = pos;
+                    matched = 1;
+                }
+            }
+            if (matched) {
+                pos += block;
+                if (pos + block > old_size) break;
+                weak_checksum(map + pos, block, &a, &b);
+                continue;
+            }
+            if (pos + block >= old_size) break;
+            unsigned char leaving = map[pos];
+            unsigned char entering = map[pos + block];
+            a = (a - leaving + entering) % WEAK_MOD;
+            b = (b - (uint32_t)block * leaving + a) % WEAK_MOD;
+            pos++;
+        }
+    }
+
+    int out_fd = open(out, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int failed = out_fd < 0 || ftruncate(out_fd, sums->size) != 0;
+    for (int i = 0; !failed && i < sums->count; i++) {
+        uint32_t len = i == sums->count - 1 ? sums->size - (uint64_t)i * sums->block : sums->block;
+        if (source[i] == -2) {
+            stats->zero_bytes += len;
+        } else if (source[i] >= 0) {
+            failed = pwrite(out_fd, map + source[i], len, (uint64_t)i * sums->block) != (ssize_t)len;
+            stats->reused_bytes += len;
+        }
+    }
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    if (old_fd >= 0) close(old_fd);
+
+    // Missing blocks become ranges; short gaps are fetched along with their
+    // neighbours since one request costs more than a few blocks of transfer
+    for (int i = 0; !failed && i < sums->count; ) {
+        if (source[i] != -1) {
+            i++;
+            continue;
+        }
+        int end = i + 1;
+        for (int j = end; j < sums->count && j - end <= DELTA_MERGE_BLOCKS; j++) {
+            if (source[j] == -1) end = j + 1;
+        }
+        uint64_t start = (uint64_t)i * sums->block;
+        uint64_t stop = (uint64_t)end * sums->block < sums->size ? (uint64_t)end * sums->block : sums->size;
+        failed = fetch_range(url, start, stop - start, out_fd, buf, STORE_IO_BUFFER);
+        stats->range_ignored = failed == 2;
+        stats->fetched_bytes += stop - start;
+        stats->requests++;
+        i = end;
+    }
+
+    // The assembled file must be exactly the published image
+    if (!failed) {
+        char whole_hex[65];
+        ssize_t n;
+        uint64_t offset = 0;
+        sha256_init(&ctx);
+        while ((n = pread(out_fd, buf, STORE_IO_BUFFER, offset)) > 0) {
+            sha256_update(&ctx, buf, n);
+            offset += n;
+        }
+        sha256_final(&ctx, whole_hex);
+        failed = offset != sums->size || strcmp(whole_hex, sums->sha256) != 0;
+        stats->verify_failed = failed;
+    }
+    if (out_fd >= 0) {
+        if (!failed) failed = fsync(out_fd) != 0;
+        close(out_fd);
+    }
+    if (failed) unlink(out);
+    free(source);
+    free(next);
+    free(head);
+    free(buf);
+    return failed;
+}
+
+// image update <distro> [--url URL] [--sums URL]
+int image_update_command(int argc, char *argv[]) {
+    const char *distro = NULL;
+    const char *url_override = NULL;
+    const char *sums_override = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--url") == 0 && i + 1 < argc) {
+            url_override = argv[++i];
+        } else if (strcmp(argv[i], "--sums") == 0 && i + 1 < argc) {
+            sums_override = argv[++i];
+        } else if (argv[i][0] != '-' && distro == NULL) {
+            distro = argv[i];
+        } else {
+            log_error("Usage: image update <distro> [--url URL] [--sums URL]");
+            return 1;
+        }
+    }
+    if (distro == NULL || registry_find(distro) == NULL) {
+        char names[MAX_LINE];
+        char message[MAX_LINE * 2];
+        registry_names(names, sizeof(names));
+        snprintf(message, sizeof(message), "Distro name required (%s)", names);
+        log_error(message);
+        return 1;
+    }
+    init_dirs();
+    return image_update(distro, url_override, sums_override);
+}
+
+// Bring the cached image of DISTRO up to date with URL (default: the
+// distro's own) by delta transfer, or by a full download when the mirror
+// publishes no block sums or the base was converted from the upstream layout
+int image_update(const char *distro, const char *url_override, const char *sums_override) {
+    const DistroEntry *entry = registry_find(distro);
+    const char *default_url = entry->mirrors[0];
+    const char *url = url_override;
+    if (url == NULL) {
+        int order[MAX_MIRRORS];
+        url = mirror_race(entry, order) > 0 ? entry->mirrors[order[0]] : default_url;
+    }
+    char message[MAX_LINE];
+    char sums_url[MAX_URL + 16];
+    snprintf(sums_url, sizeof(sums_url), "%s.blocksums", url);
+    if (sums_override) snprintf(sums_url, sizeof(sums_url), "%s", sums_override);
+
+    char distro_dir[MAX_PATH];
+    char image[MAX_PATH + MAX_URL];
+    char manifest[sizeof(image) + 16];
+    char lock_path[sizeof(image) + 16];
+    snprintf(distro_dir, sizeof(distro_dir), "%s/.v4m/distros/%s", getenv("HOME"), distro);
+    const char *filename = strrchr(default_url, '/') + 1;
+    snprintf(image, sizeof(image), "%s/%s", distro_dir, filename);
+    snprintf(manifest, sizeof(manifest), "%s.manifest", image);
+    snprintf(lock_path, sizeof(lock_path), "%s/.%s.lock", distro_dir, filename);
+    char layout[16];
+    image_layout_get(image, layout, sizeof(layout));
+
+    // Same lock as ensure_distro(), so a pull and an update never overlap
+    mkdir(distro_dir, 0755);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        log_error("Image is being downloaded or updated by another v4m process");
+        if (lock_fd >= 0) close(lock_fd);
+        return 1;
+    }
+
+    char sums_path[sizeof(image) + 16];
+    char old_path[sizeof(image) + 16];
+    char new_path[sizeof(image) + 16];
+    char command[sizeof(sums_path) + sizeof(sums_url) + 64];
+    snprintf(sums_path, sizeof(sums_path), "%s.blocksums", image);
+    snprintf(old_path, sizeof(old_path), "%s.old", image);
+    snprintf(new_path, sizeof(new_path), "%s.update", image);
+    snprintf(command, sizeof(command), "curl -fsL -o \"%s\" \"%s\"", sums_path, sums_url);
+
+    // Block sums describe the upstream file. A base converted at pull time
+    // (tuned qcow2 or raw) shares no blocks with it, so a delta would
+    // fetch everything while claiming a saving
+    int converted = strcmp(layout, "upstream") != 0;
+    BlockSums sums;
+    if (converted || run_command(command) != 0 || block_sums_read(sums_path, &sums) != 0) {
+        unlink(sums_path);
+        if (converted) {
+            snprintf(message, sizeof(message), "%s was converted to the %s layout when pulled, so it cannot be "
+                     "delta-updated; downloading the whole image...", distro, layout);
+        } else if (sums_override) {
+            close(lock_fd);
+            snprintf(message, sizeof(message), "No usable block sums at %s", sums_url);
+            log_error(message);
+            return 1;
+        } else {
+            snprintf(message, sizeof(message), "No block sums published for %s, downloading the whole image...", distro);
+        }
+        log_info(message);
+        char part_path[MAX_PATH + 32];
+        char distro_path[MAX_PATH + 16];
+        distro_part_path(image, url, part_path, sizeof(part_path));
+        unlink(part_path);
+        snprintf(pull_layout, sizeof(pull_layout), "%s", layout);
+        int result = distro_fetch(url, image, entry->sha256, distro_path, sizeof(distro_path));
+        close(lock_fd);
+        StoreStats gc_stats;
+        if (result == 0) store_walk(1, &gc_stats);
+        return result;
+    }
+    unlink(sums_path);
+
+    // Store images are scanned from a sparse materialized copy. With no
+    // local copy every non-zero block is fetched
+    const char *old = file_exists(image) ? image : NULL;
+    double rate;
+    if (file_exists(manifest)) {
+        old = store_materialize(manifest, old_path, &rate) == 0 ? old_path : NULL;
+    }
+    if (old == NULL) {
+        log_info("No local copy to update from, fetching the whole image");
+    }
+
+    snprintf(message, sizeof(message), "Updating %s from %s...", distro, url);
+    log_info(message);
+    double started = now_monotonic();
+    DeltaStats stats;
+    int failed = delta_rebuild(url, &sums, old, new_path, &stats);
+    if (old == old_path) unlink(old_path);
+    block_sums_free(&sums);
+    if (failed) {
+        close(lock_fd);
+        log_error(stats.verify_failed ? "Updated image does not match the published checksum" :
+                  stats.range_ignored ? "The server does not support range requests; use image delete and pull" :
+                  "Failed to fetch the changed blocks");
+        return 1;
+    }
+
+    StoreStats store_stats;
+    if (store_ingest(new_path, manifest, &store_stats) != 0) {
+        unlink(new_path);
+        close(lock_fd);
+        log_error("Failed to add the updated image to the store");
+        return 1;
+    }
+    unlink(new_path);
+    unlink(image);
+    
+    // Record what the server now says about the image for `image check`
+    HttpValidators validators;
+    memset(&validators, 0, sizeof(validators));
+    FILE *probe = http_probe_start(url, NULL, HTTP_PROBE_TIMEOUT);
+    if (probe != NULL) {
+        http_probe_finish(probe, &validators);
+    }
+    snprintf(validators.url, sizeof(validators.url), "%s", url);
+    validators.checked = time(NULL);
+    http_validators_save(image, &validators);
+    close(lock_fd);
+    store_walk(1, &store_stats);
+
+    char fetched[16];
+    char total[16];
+    char saved[16];
+    format_size((double)stats.fetched_bytes, fetched, sizeof(fetched));
+    format_size((double)sums.size, total, sizeof(total));
+    format_size((double)(sums.size - stats.fetched_bytes), saved, sizeof(saved));
+    snprintf(message, sizeof(message), "Updated %s in %.1fs: fetched %s of %s in %d request(s), %s saved (%.1f%%)",
+             distro, now_monotonic() - started, fetched, total, stats.requests, saved,
+             sums.size ? 100.0 * (sums.size - stats.fetched_bytes) / sums.size : 100.0);
+    log_success(message);
+    return 0;
+}
+
+// IMAGE.http:
+//   # v4m http validators 1
+//   url, etag, last-modified, content-length, checked (epoch), stale (0/1)
+// one "key value" line each
+int http_validators_load(const char *image, HttpValidators *validators) {
+    char path[MAX_PATH + 16];
+    char *text;
+    size_t len;
+    memset(validators, 0, sizeof(*validators));
+    snprintf(path, sizeof(path), "%s.http", image);
+    if (read_file(path, &text, &len) != 0) {
+        return 1;
+    }
+    for (char *line = text; line && *line; ) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+        char *value = strchr(line, ' ');
+        if (value != NULL) {
+            *value++ = '\0';
+            if (strcmp(line, "url") == 0) snprintf(validators->url, sizeof(validators->url), "%s", value);
+            else if (strcmp(line, "etag") == 0) snprintf(validators->etag, sizeof(validators->etag), "%s", value);
+            else if (strcmp(line, "last-modified") == 0) snprintf(validators->last_modified, sizeof(validators->last_modified), "%s", value);
+            else if (strcmp(line, "content-length") == 0) validators->content_length = atoll(value);
+            else if (strcmp(line, "checked") == 0) validators->checked = atol(value);
+            else if (strcmp(line, "stale") == 0) validators->stale = atoi(value);
+        }
+        line = end ? end + 1 : NULL;
+    }
+    free(text);
+    return 0;
+}
+
+int http_validators_save(const char *image, const HttpValidators *validators) {
+    char path[MAX_PATH + 16];
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s.http", image);
+    sb_printf(&sb, "%surl %s\n", HTTP_VALIDATORS_HEADER, validators->url);
+    if (validators->etag[0]) sb_printf(&sb, "etag %s\n", validators->etag);
+    if (validators->last_modified[0]) sb_printf(&sb, "last-modified %s\n", validators->last_modified);
+    if (validators->content_length > 0) sb_printf(&sb, "content-length %lld\n", validators->content_length);
+    sb_printf(&sb, "checked %ld\nstale %d\n", validators->checked, validators->stale);
+    int result = sb.data == NULL || write_file_atomic(path, sb.data, sb.len) != 0;
+    sb_free(&sb);
+    return result;
+}
+
+// Validators from a curl header dump. Redirects produce several responses;
+// only the last one describes the image. For a 206 the length is the total
+// from Content-Range, not the remainder. Returns its status code, or 0
+int http_validators_parse(const char *headers, HttpValidators *validators) {
+    int status = 0;
+    int ranged = 0;
+    const char *line = headers;
+    while (line && *line) {
+        const char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ')) len--;
+        // A cut-off validator would never match again, so an oversized
+        // value reads as absent
+        char value[MAX_NAME];
+        const char *colon = memchr(line, ':', len);
+        size_t value_len = 0;
+        if (colon != NULL) {
+            const char *v = colon + 1;
+            while (v < line + len && *v == ' ') v++;
+            value_len = line + len - v;
+            if (value_len >= sizeof(value)) value_len = 0;
+            memcpy(value, v, value_len);
+        }
+        value[value_len] = '\0';
+
+        if (len > 5 && strncmp(line, "HTTP/", 5) == 0) {
+            const char *code = memchr(line, ' ', len);
+            status = code ? atoi(code + 1) : 0;
+            validators->etag[0] = '\0';
+            validators->last_modified[0] = '\0';
+            validators->content_length = 0;
+            ranged = 0;
+        } else if (colon != NULL && colon - line == 4 && strncasecmp(line, "etag", 4) == 0) {
+            snprintf(validators->etag, sizeof(validators->etag), "%s", value);
+        } else if (colon != NULL && colon - line == 13 && strncasecmp(line, "last-modified", 13) == 0) {
+            snprintf(validators->last_modified, sizeof(validators->last_modified), "%s", value);
+        } else if (colon != NULL && colon - line == 14 && strncasecmp(line, "content-length", 14) == 0) {
+            if (!ranged) validators->content_length = atoll(value);
+        } else if (colon != NULL && colon - line == 13 && strncasecmp(line, "content-range", 13) == 0) {
+            // bytes FIRST-LAST/TOTAL; TOTAL may be "*"
+            const char *total = strchr(value, '/');
+            if (total != NULL && isdigit((unsigned char)total[1])) {
+                validators->content_length = atoll(total + 1);
+                ranged = 1;
+            }
+        }
+        line = end ? end + 1 : NULL;
+    }
+    return status;
+}
+
+// Start a HEAD request for URL, conditional on KNOWN when given. Probes run
+// as separate curl processes, so starting several before finishing any
+// checks them concurrently
+FILE *http_probe_start(const char *url, const HttpValidators *known, int timeout) {
+    char command[MAX_URL + 2 * MAX_NAME + 256];
+    int len = snprintf(command, sizeof(command), "curl -sSIL --max-time %d", timeout);
+    // Values go inside single quotes, so skip any that contain one
+    if (known != NULL && known->etag[0] && strchr(known->etag, '\'') == NULL) {
+        len += snprintf(command + len, sizeof(command) - len, " -H 'If-None-Match: %s'", known->etag);
+    }
+    if (known != NULL && known->last_modified[0] && strchr(known->last_modified, '\'') == NULL) {
+        len += snprintf(command + len, sizeof(command) - len, " -H 'If-Modified-Since: %s'", known->last_modified);
+    }
+    snprintf(command + len, sizeof(command) - len, " \"%s\" 2>/dev/null", url);
+    fflush(stdout);
+    return popen(command, "r");
+}
+
+// Collect a probe's response into VALIDATORS; returns the HTTP status or 0
+int http_probe_finish(FILE *fp, HttpValidators *validators) {
+    StrBuf headers = {0};
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf) - 1, fp)) > 0) {
+        buf[n] = '\0';
+        sb_printf(&headers, "%s", buf);
+    }
+    pclose(fp);
+    int status = headers.data ? http_validators_parse(headers.data, validators) : 0;
+    sb_free(&headers);
+    return status;
+}
+
+// image check [--refresh]: ask the server about every pulled image at once
+// and report which changed upstream. Nothing is downloaded; --refresh
+// updates the stale ones from a background process
+int image_check_command(int argc, char *argv[]) {
+    int refresh = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--refresh") == 0) {
+            refresh = 1;
+        } else {
+            log_error("Usage: image check [--refresh]");
+            return 1;
+        }
+    }
+    init_dirs();
+
+    char distros_dir[MAX_PATH];
+    snprintf(distros_dir, sizeof(distros_dir), "%s/.v4m/distros", getenv("HOME"));
+    ImageCheck *checks = NULL;
+    int count = 0;
+    DIR *dir = opendir(distros_dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char distro_dir[MAX_PATH + sizeof(entry->d_name)];
+        char image[MAX_PATH];
+        if (entry->d_name[0] == '.' || get_distro_url(entry->d_name) == NULL) continue;
+        snprintf(distro_dir, sizeof(distro_dir), "%s/%s", distros_dir, entry->d_name);
+        if (find_distro_image(distro_dir, image, sizeof(image)) != 0) continue;
+        ImageCheck *grown = realloc(checks, (count + 1) * sizeof(*checks));
+        if (grown == NULL) break;
+        checks = grown;
+        ImageCheck *c = &checks[count++];
+        memset(c, 0, sizeof(*c));
+        size_t len = strlen(image);
+        if (len > 9 && strcmp(image + len - 9, ".manifest") == 0) image[len - 9] = '\0';
+        snprintf(c->distro, sizeof(c->distro), "%s", entry->d_name);
+        snprintf(c->image, sizeof(c->image), "%s", image);
+        if (http_validators_load(image, &c->known) != 0 || c->known.url[0] == '\0') {
+            snprintf(c->known.url, sizeof(c->known.url), "%s", get_distro_url(entry->d_name));
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    if (count == 0) {
+        log_info("No images to check");
+        free(checks);
+        return 0;
+    }
+
+    double started = now_monotonic();
+    for (int i = 0; i < count; i++) {
+        checks[i].probe = http_probe_start(checks[i].known.url, &checks[i].known, HTTP_PROBE_TIMEOUT);
+    }
+    int stale = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        ImageCheck *c = &checks[i];
+        c->status = c->probe ? http_probe_finish(c->probe, &c->seen) : 0;
+        HttpValidators *k = &c->known;
+        if (c->status == 304) {
+            c->reason = "not modified";
+        } else if (c->status == 0) {
+            c->reason = "unreachable";
+            c->error = 1;
+        } else if (c->status < 200 || c->status >= 300) {
+            c->reason = "upstream error";
+            c->error = 1;
+        } else if (!k->etag[0] && !k->last_modified[0] && k->content_length == 0) {
+            c->reason = "no validators recorded";
+            c->stale = 1;
+        } else if (k->etag[0] && c->seen.etag[0] && strcmp(k->etag, c->seen.etag) != 0) {
+            c->reason = "ETag changed";
+            c->stale = 1;
+        } else if (k->last_modified[0] && c->seen.last_modified[0] && strcmp(k->last_modified, c->seen.last_modified) != 0) {
+            c->reason = "Last-Modified changed";
+            c->stale = 1;
+        } else if (k->content_length > 0 && c->seen.content_length > 0 && k->content_length != c->seen.content_length) {
+            c->reason = "Content-Length changed";
+            c->stale = 1;
+        } else {
+            c->reason = "validators match";
+        }
+        stale += c->stale;
+        failed += c->error;
+
+        // Only the verdict is recorded; the validators stay those of the
+        // copy on disk until it is refreshed. An error is no verdict
+        if (!c->error) {
+            k->checked = time(NULL);
+            k->stale = c->stale;
+            http_validators_save(c->image, k);
+        }
+    }
+
+    printf("%-12s %-8s %s\n", "DISTRO", "STATUS", "DETAIL");
+    for (int i = 0; i < count; i++) {
+        ImageCheck *c = &checks[i];
+        const char *color = c->stale ? YELLOW : c->error ? RED : GREEN;
+        const char *label = c->stale ? "stale" : c->error ? "error" : "fresh";
+        char detail[64];
+        if (c->status != 0) {
+            snprintf(detail, sizeof(detail), "%s (HTTP %d)", c->reason, c->status);
+        } else {
+            snprintf(detail, sizeof(detail), "%s", c->reason);
+        }
+        printf("%-12s %s%-8s" NC " %s\n", c->distro, color, label, detail);
+    }
+    char message[MAX_LINE];
+    snprintf(message, sizeof(message), "Checked %d image(s) in %.1fs: %d stale", count, now_monotonic() - started, stale);
+    log_info(message);
+
+    if (refresh && stale > 0) {
+        char log_path[MAX_PATH];
+        snprintf(log_path, sizeof(log_path), "%s/.v4m/image-refresh.log", getenv("HOME"));
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0) {
+            setsid();
+            if (fork() != 0) {
+                _exit(0);
+            }
+            int devnull = open("/dev/null", O_RDONLY);
+            int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+            if (log_fd >= 0) {
+                dup2(log_fd, STDOUT_FILENO);
+                dup2(log_fd, STDERR_FILENO);
+            }
+            int result = 0;
+            for (int i = 0; i < count; i++) {
+                if (!checks[i].stale) continue;
+                printf("%ld refreshing %s\n", (long)time(NULL), checks[i].distro);
+                fflush(stdout);
+                result |= image_update(checks[i].distro, checks[i].known.url, NULL);
+                fflush(stdout);
+            }
+            _exit(result);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+        snprintf(message, sizeof(message), "Refreshing %d image(s) in the background; see %s", stale, log_path);
+        log_info(message);
+    }
+    free(checks);
+    return failed > 0 ? 1 : 0;
+}
+
+// image sums <file> [out]: publish block sums next to an image on a mirror
+int image_sums_command(int argc, char *argv[]) {
+    char out[MAX_PATH + 16];
+    char message[MAX_LINE];
+    if (argc < 2) {
+        log_error("Usage: image sums <file> [out]");
+        return 1;
+    }
+    snprintf(out, sizeof(out), "%s.blocksums", argv[1]);
+    if (argc > 2) snprintf(out, sizeof(out), "%s", argv[2]);
+    if (block_sums_write(argv[1], out) != 0) {
+        snprintf(message, sizeof(message), "Failed to write block sums for %s", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Wrote %s", out);
+    log_success(message);
+    return 0;
+}
+
+// Base image layouts. Upstream cloud images are qcow2 with 64K clusters,
+// compressed clusters and no preallocation, which VMs inherit: every first
+// read of a compressed cluster is decompressed, and growth fragments.
+//   upstream  as published
+//   tuned     qcow2, 128K clusters with extended L2 (4K subclusters),
+//             lazy refcounts, nothing compressed
+//   raw       plain sparse file; VM disks built from it are raw too
+// The layout of a cached base is kept in IMAGE.layout (absent = upstream)
+const char *image_layouts[] = {"upstream", "tuned", "raw", NULL};
+char pull_layout[16] = "";
+
+int image_layout_valid(const char *layout) {
+    for (int i = 0; image_layouts[i]; i++) {
+        if (strcmp(image_layouts[i], layout) == 0) return 1;
+    }
+    return 0;
+}
+
+void image_layout_get(const char *image, char *layout, size_t size) {
+    char path[MAX_PATH + 16];
+    char *text;
+    size_t len;
+    snprintf(layout, size, "upstream");
+    snprintf(path, sizeof(path), "%s.layout", image);
+    if (read_file(path, &text, &len) == 0) {
+        text[strcspn(text, "\n")] = '\0';
+        if (image_layout_valid(text)) snprintf(layout, size, "%s", text);
+        free(text);
+    }
+}
+
+int image_layout_set(const char *image, const char *layout) {
+    char path[MAX_PATH + 16];
+    char line[32];
+    snprintf(path, sizeof(path), "%s.layout", image);
+    if (strcmp(layout, "upstream") == 0) {
+        return unlink(path) == 0 || errno == ENOENT ? 0 : 1;
+    }
+    int len = snprintf(line, sizeof(line), "%s\n", layout);
+    return write_file_atomic(path, line, len);
+}
+
+// Format of a disk file by its header, for -drive and qemu-img
+// Sniffs the header, so only for images no guest writes to: bases in the
+// cache and a VM disk freshly copied from one. A guest can put a qcow2
+// header (backing file included) into a raw disk; see vm_disk_format()
+const char *disk_format(const char *path) {
+    unsigned char magic[4];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, magic, sizeof(magic)) : -1;
+    if (fd >= 0) close(fd);
+    return n == 4 && memcmp(magic, "QFI\xfb", 4) == 0 ? "qcow2" : "raw";
+}
+
+// Format of a VM's disk as recorded when it was provisioned
+const char *vm_disk_format(const char *vm_dir) {
+    VMInfo info;
+    if (load_vm_info(vm_dir, &info) != 0) {
+        return "qcow2";
+    }
+    return strcmp(info.disk_format, "raw") == 0 ? "raw" : "qcow2";
+}
+
+// Rewrite the qcow2/raw file PATH in LAYOUT. qemu-img runs the copy as a
+// pipeline of IMAGE_CONVERT_COROUTINES parallel requests, so reads of the
+// source overlap writes of the target. Writes go out of order (-W) only for
+// raw, where offsets are fixed; a qcow2 target allocates clusters in write
+// order and would come out scattered
+int image_convert(const char *path, const char *layout) {
+    TRACE_SCOPE("image_convert", layout);
+    char target[MAX_PATH + 16];
+    char command[MAX_PATH * 3];
+    char message[MAX_LINE];
+    if (strcmp(layout, "upstream") == 0) {
+        return 0;
+    }
+    snprintf(target, sizeof(target), "%s.convert", path);
+    int raw = strcmp(layout, "raw") == 0;
+    snprintf(command, sizeof(command), "qemu-img convert %s%s-m %d -f %s %s \"%s\" \"%s\"",
+             isatty(STDOUT_FILENO) ? "-p " : "", raw ? "-W " : "", IMAGE_CONVERT_COROUTINES, disk_format(path),
+             raw ? "-O raw" : "-O qcow2 -o " IMAGE_TUNED_OPTIONS, path, target);
+    snprintf(message, sizeof(message), "Converting to the %s layout...", layout);
+    log_info(message);
+    double started = now_monotonic();
+    if (run_command(command) != 0 || rename(target, path) != 0) {
+        unlink(target);
+        log_error("qemu-img convert failed");
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Converted in %.1fs", now_monotonic() - started);
+    log_info(message);
+    return 0;
+}
+
+// Convert the cached base of DISTRO in place (image pull --layout on an
+// image that is already there)
+int image_relayout(const char *distro, const char *layout) {
+    char distro_path[MAX_PATH];
+    char current[16];
+    char message[MAX_LINE];
+    if (ensure_distro(distro, distro_path, sizeof(distro_path)) != 0) {
+        return 1;
+    }
+    char image[MAX_PATH];
+    snprintf(image, sizeof(image), "%s", distro_path);
+    size_t len = strlen(image);
+    int stored = len > 9 && strcmp(image + len - 9, ".manifest") == 0;
+    if (stored) image[len - 9] = '\0';
+    image_layout_get(image, current, sizeof(current));
+    if (strcmp(current, layout) == 0) {
+        snprintf(message, sizeof(message), "%s already has the %s layout", distro, layout);
+        log_info(message);
+        return 0;
+    }
+    if (strcmp(current, "upstream") != 0) {
+        snprintf(message, sizeof(message), "%s has the %s layout; delete and pull it again to change it", distro, current);
+        log_error(message);
+        return 1;
+    }
+
+    char lock_path[MAX_PATH + 16];
+    char work[MAX_PATH + 16];
+    char manifest[MAX_PATH + 16];
+    const char *slash = strrchr(image, '/');
+    snprintf(lock_path, sizeof(lock_path), "%.*s/.%s.lock", (int)(slash - image), image, slash + 1);
+    snprintf(work, sizeof(work), "%s.relayout", image);
+    snprintf(manifest, sizeof(manifest), "%s.manifest", image);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (lock_fd >= 0) close(lock_fd);
+        log_error("Image is being downloaded or updated by another v4m process");
+        return 1;
+    }
+
+    double rate;
+    StoreStats stats;
+    int failed = (stored ? store_materialize(manifest, work, &rate) : copy_file(image, work)) != 0 ||
+                 image_convert(work, layout) != 0 || store_ingest(work, manifest, &stats) != 0;
+    unlink(work);
+    if (!failed) {
+        unlink(image);
+        image_layout_set(image, layout);
+    }
+    close(lock_fd);
+    if (failed) {
+        log_error("Failed to convert the image");
+        return 1;
+    }
+    store_walk(1, &stats);
+    snprintf(message, sizeof(message), "%s now has the %s layout", distro, layout);
+    log_success(message);
+    return 0;
+}
+
+// image bench <distro> [--count N] [--output FILE]: sequential 64K reads
+// through QEMU's block layer (qemu-img bench, host cache bypassed) of the
+// cached base and of each other layout converted from it. These are the
+// driver paths a guest's reads take, without booting one
+int image_bench_command(int argc, char *argv[]) {
+    const char *distro = NULL;
+    const char *output = NULL;
+    int count = 0;
+    char message[MAX_LINE];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && distro == NULL) {
+            distro = argv[i];
+        } else {
+            log_error("Usage: image bench <distro> [--count N] [--output FILE]");
+            return 1;
+        }
+    }
+    if (distro == NULL) {
+        log_error("Usage: image bench <distro> [--count N] [--output FILE]");
+        return 1;
+    }
+    init_dirs();
+
+    char distro_path[MAX_PATH];
+    if (ensure_distro(distro, distro_path, sizeof(distro_path)) != 0) {
+        return 1;
+    }
+    char image[MAX_PATH];
+    char base_layout[16];
+    snprintf(image, sizeof(image), "%s", distro_path);
+    size_t len = strlen(image);
+    int stored = len > 9 && strcmp(image + len - 9, ".manifest") == 0;
+    if (stored) image[len - 9] = '\0';
+    image_layout_get(image, base_layout, sizeof(base_layout));
+
+    char work_dir[MAX_PATH];
+    snprintf(work_dir, sizeof(work_dir), "%s/.v4m/tmp-bench.%d", getenv("HOME"), (int)getpid());
+    mkdir(work_dir, 0755);
+
+    // The base first, then every layout that can be derived from it
+    char paths[3][MAX_PATH + 32];
+    const char *labels[3];
+    double seconds[3] = {0};
+    int variants = 0;
+    double rate;
+    snprintf(paths[0], sizeof(paths[0]), "%s/%s.img", work_dir, base_layout);
+    labels[variants++] = base_layout;
+    int failed = (stored ? store_materialize(distro_path, paths[0], &rate) : copy_file(distro_path, paths[0])) != 0;
+    for (int i = 1; !failed && image_layouts[i]; i++) {
+        if (strcmp(image_layouts[i], base_layout) == 0) continue;
+        snprintf(paths[variants], sizeof(paths[variants]), "%s/%s.img", work_dir, image_layouts[i]);
+        failed = copy_file(paths[0], paths[variants]) != 0 || image_convert(paths[variants], image_layouts[i]) != 0;
+        labels[variants++] = image_layouts[i];
+    }
+
+    uint64_t virtual_size = 0;
+    if (!failed && disk_virtual_size(paths[0], &virtual_size) != 0) {
+        failed = 1;
+    }
+    if (count <= 0) {
+        count = virtual_size / IMAGE_BENCH_BLOCK;
+        if (count <= 0) count = 1;
+    }
+    for (int i = 0; !failed && i < variants; i++) {
+        char command[sizeof(paths[0]) + 128];
+        if (snprintf(command, sizeof(command), "qemu-img bench -f %s -t none -d %d -c %d -s %d -S %d \"%s\" >/dev/null",
+                     disk_format(paths[i]), IMAGE_BENCH_DEPTH, count, IMAGE_BENCH_BLOCK, IMAGE_BENCH_BLOCK,
+                     paths[i]) >= (int)sizeof(command)) {
+            failed = 1;
+            break;
+        }
+        snprintf(message, sizeof(message), "Reading the %s base...", labels[i]);
+        log_info(message);
+        double started = now_monotonic();
+        failed = run_command(command) != 0;
+        seconds[i] = now_monotonic() - started;
+    }
+    remove_tree(work_dir);
+    if (failed) {
+        log_error("Image benchmark failed");
+        return 1;
+    }
+
+    StrBuf json = {0};
+    double bytes = (double)count * IMAGE_BENCH_BLOCK;
+    printf("%-10s %10s %12s\n", "LAYOUT", "TIME", "READ");
+    sb_printf(&json, "{\n  \"version\": 1,\n  \"distro\": \"%s\",\n  \"block\": %d,\n  \"depth\": %d,\n  \"count\": %d,\n  \"results\": [\n",
+              distro, IMAGE_BENCH_BLOCK, IMAGE_BENCH_DEPTH, count);
+    for (int i = 0; i < variants; i++) {
+        double mbps = seconds[i] > 0 ? bytes / seconds[i] / (1024 * 1024) : 0;
+        printf("%-10s %9.2fs %8.0f MB/s\n", labels[i], seconds[i], mbps);
+        sb_printf(&json, "    {\"layout\": \"%s\", \"seconds\": %.6f, \"read_mb_per_s\": %.1f}%s\n",
+                  labels[i], seconds[i], mbps, i + 1 < variants ? "," : "");
+    }
+    sb_printf(&json, "  ]\n}\n");
+    if (output != NULL && write_file_atomic(output, json.data, json.len) != 0) {
+        log_error("Failed to write the benchmark results");
+        sb_free(&json);
+        return 1;
+    }
+    sb_free(&json);
+    return 0;
+}
+
+// Disk maintenance: qcow2 metadata is read directly. Header fields are
+// big-endian; the L1 table points at L2 tables, whose entries map each
+// guest cluster to a host offset (or mark it compressed, zero or absent).
+// With extended L2 each entry is followed by a subcluster bitmap
+uint32_t read_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+uint64_t read_be64(const unsigned char *p) {
+    return (uint64_t)read_be32(p) << 32 | read_be32(p + 4);
+}
+
+int qcow2_analyze(const char *path, Qcow2Stats *stats) {
+    TRACE_SCOPE("qcow2_analyze", path);
+    unsigned char header[112];
+    struct stat st;
+    memset(stats, 0, sizeof(*stats));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    memset(header, 0, sizeof(header));
+    if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) < 72 || read_be32(header) != QCOW2_MAGIC) {
+        close(fd);
+        return 1;
+    }
+    stats->file_size = st.st_size;
+    stats->host_allocated = (uint64_t)st.st_blocks * 512;
+    stats->version = read_be32(header + 4);
+    stats->cluster_bits = read_be32(header + 20);
+    stats->virtual_size = read_be64(header + 24);
+    uint32_t l1_size = read_be32(header + 36);
+    uint64_t l1_offset = read_be64(header + 40);
+    if (stats->version >= 3) {
+        uint64_t incompatible = read_be64(header + 72);
+        stats->extended_l2 = (incompatible >> 4) & 1;
+        stats->compression_type = read_be32(header + 100) > 104 ? header[104] : 0;
+    }
+    if (stats->cluster_bits < 9 || stats->cluster_bits > 21 || l1_size > QCOW2_MAX_L1_ENTRIES) {
+        close(fd);
+        return 1;
+    }
+
+    uint64_t cluster_size = 1ULL << stats->cluster_bits;
+    int entry_size = stats->extended_l2 ? 16 : 8;
+    uint64_t l2_entries = cluster_size / entry_size;
+    unsigned char *l1 = malloc((size_t)l1_size * 8 + 1);
+    unsigned char *l2 = malloc(cluster_size);
+    if (l1 == NULL || l2 == NULL || pread(fd, l1, (size_t)l1_size * 8, l1_offset) != (ssize_t)l1_size * 8) {
+        free(l1);
+        free(l2);
+        close(fd);
+        return 1;
+    }
+
+    // Walk guest clusters in order; a fragment is a run whose host offsets
+    // follow on from each other
+    uint64_t guest_clusters = (stats->virtual_size + cluster_size - 1) / cluster_size;
+    uint64_t previous_host = 0;
+    int compressed_shift = 62 - (stats->cluster_bits - 8);
+    int failed = 0;
+    for (uint32_t i = 0; i < l1_size && !failed; i++) {
+        uint64_t first = (uint64_t)i * l2_entries;
+        if (first >= guest_clusters) break;
+        uint64_t count = guest_clusters - first < l2_entries ? guest_clusters - first : l2_entries;
+        uint64_t l2_offset = read_be64(l1 + (size_t)i * 8) & QCOW2_OFFSET_MASK;
+        if (l2_offset == 0) {
+            stats->unallocated_clusters += count;
+            continue;
+        }
+        if (pread(fd, l2, cluster_size, l2_offset) != (ssize_t)cluster_size) {
+            failed = 1;
+            break;
+        }
+        stats->l2_tables++;
+        for (uint64_t j = 0; j < count; j++) {
+            uint64_t entry = read_be64(l2 + j * entry_size);
+            uint64_t bitmap = stats->extended_l2 ? read_be64(l2 + j * entry_size + 8) : 0;
+            if (entry & QCOW2_COMPRESSED) {
+                uint64_t sectors = ((entry >> compressed_shift) & ((1ULL << (62 - compressed_shift)) - 1)) + 1;
+                stats->compressed_clusters++;
+                stats->compressed_bytes += sectors * 512;
+                continue;
+            }
+            uint64_t host = entry & QCOW2_OFFSET_MASK;
+            int zero = stats->extended_l2 ? (bitmap >> 32) == 0xffffffffULL : (entry & 1);
+            if (zero) {
+                stats->zero_clusters++;
+            } else if (host == 0 || (stats->extended_l2 && (bitmap & 0xffffffffULL) == 0)) {
+                stats->unallocated_clusters++;
+            } else {
+                stats->data_clusters++;
+                if (previous_host == 0 || host != previous_host + cluster_size) {
+                    stats->fragments++;
+                    if (previous_host != 0) stats->discontinuities++;
+                }
+                previous_host = host;
+            }
+        }
+    }
+    free(l1);
+    free(l2);
+    close(fd);
+    return failed;
+}
+
+// vm disk stats NAME
+int vm_disk_stats_command(const char *vm_name, const char *vm_dir) {
+    char disk[MAX_PATH + 16];
+    char message[MAX_LINE];
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    if (strcmp(vm_disk_format(vm_dir), "qcow2") != 0) {
+        struct stat st;
+        char apparent[16], allocated[16];
+        if (stat(disk, &st) != 0) {
+            log_error("VM has no disk");
+            return 1;
+        }
+        format_size((double)st.st_size, apparent, sizeof(apparent));
+        format_size((double)st.st_blocks * 512, allocated, sizeof(allocated));
+        printf(YELLOW "Disk of '%s'" NC " (raw)\n", vm_name);
+        printf("  Virtual size:    %s\n  Allocated:       %s\n", apparent, allocated);
+        return 0;
+    }
+
+    Qcow2Stats s;
+    if (qcow2_analyze(disk, &s) != 0) {
+        snprintf(message, sizeof(message), "Could not read the qcow2 metadata of %s", disk);
+        log_error(message);
+        return 1;
+    }
+    uint64_t cluster_size = 1ULL << s.cluster_bits;
+    uint64_t mapped = s.data_clusters + s.compressed_clusters;
+    char virtual_size[16], file_size[16], host[16], data[16], compressed[16], cluster[16], l2[16];
+    char cache[16], covered[16];
+    format_size((double)s.virtual_size, virtual_size, sizeof(virtual_size));
+    format_size((double)s.file_size, file_size, sizeof(file_size));
+    format_size((double)s.host_allocated, host, sizeof(host));
+    format_size((double)s.data_clusters * cluster_size, data, sizeof(data));
+    format_size((double)s.compressed_bytes, compressed, sizeof(compressed));
+    format_size((double)cluster_size, cluster, sizeof(cluster));
+    format_size((double)s.l2_tables * cluster_size, l2, sizeof(l2));
+
+    // QEMU sizes its L2 cache to the image, up to a platform maximum; each
+    // cached entry maps one cluster
+    int entry_size = s.extended_l2 ? 16 : 8;
+    uint64_t needed = (s.virtual_size + cluster_size - 1) / cluster_size * entry_size;
+    uint64_t cache_bytes = needed < QEMU_L2_CACHE_MAX ? needed : QEMU_L2_CACHE_MAX;
+    uint64_t coverage = cache_bytes / entry_size * cluster_size;
+    format_size((double)cache_bytes, cache, sizeof(cache));
+    format_size((double)coverage, covered, sizeof(covered));
+
+    printf(YELLOW "Disk of '%s'" NC " (qcow2 v%d, %s clusters%s%s)\n", vm_name, s.version, cluster,
+           s.extended_l2 ? ", extended L2" : "", s.compression_type == 1 ? ", zstd" : "");
+    printf("  Virtual size:    %s\n", virtual_size);
+    printf("  File:            %s (%s allocated on the host)\n", file_size, host);
+    printf("  Data clusters:   %llu (%s)\n", (unsigned long long)s.data_clusters, data);
+    printf("  Compressed:      %llu clusters, %s on disk (%.1f%% of mapped clusters)\n",
+           (unsigned long long)s.compressed_clusters, compressed, mapped ? 100.0 * s.compressed_clusters / mapped : 0.0);
+    printf("  Zero clusters:   %llu\n", (unsigned long long)s.zero_clusters);
+    printf("  Unallocated:     %llu clusters\n", (unsigned long long)s.unallocated_clusters);
+    printf("  Fragmentation:   %llu fragment(s), %.1f%% of data clusters not contiguous with the previous one\n",
+           (unsigned long long)s.fragments, s.data_clusters > 1 ? 100.0 * s.discontinuities / (s.data_clusters - 1) : 0.0);
+    printf("  L2 tables:       %llu (%s)\n", (unsigned long long)s.l2_tables, l2);
+    printf("  L2 cache:        %s covers %s of %s (%.0f%%)\n", cache, covered, virtual_size,
+           s.virtual_size ? (coverage >= s.virtual_size ? 100.0 : 100.0 * coverage / s.virtual_size) : 100.0);
+    if (read_vm_pid(vm_dir) > 0) {
+        printf("  " GRAY "VM is running; figures are a snapshot of changing metadata" NC "\n");
+    }
+    return 0;
+}
+
+// qemu-img -o options that keep the geometry of SOURCE
+void qcow2_create_options(const Qcow2Stats *source, char *out, size_t size) {
+    snprintf(out, size, "cluster_size=%llu,lazy_refcounts=on%s", 1ULL << source->cluster_bits,
+             source->extended_l2 ? ",extended_l2=on" : "");
+}
+
+// Stopped VM: stream the image into a fresh file in guest order and
+// swap it in. Compressed clusters come out uncompressed. No -W for qcow2:
+// out-of-order writes would allocate the clusters out of order again
+int disk_defrag_offline(const char *disk, const char *format) {
+    TRACE_SCOPE("disk_defrag_offline", disk);
+    char target[MAX_PATH + 16];
+    char options[128] = "";
+    char command[MAX_PATH * 3];
+    Qcow2Stats source;
+    if (strcmp(format, "qcow2") == 0) {
+        if (qcow2_analyze(disk, &source) != 0) {
+            return 1;
+        }
+        qcow2_create_options(&source, options, sizeof(options));
+    }
+    snprintf(target, sizeof(target), "%s.defrag", disk);
+    snprintf(command, sizeof(command), "qemu-img convert %s%s-m %d -f %s -O %s%s%s \"%s\" \"%s\"",
+             isatty(STDOUT_FILENO) ? "-p " : "", strcmp(format, "raw") == 0 ? "-W " : "", IMAGE_CONVERT_COROUTINES,
+             format, format, options[0] ? " -o " : "", options, disk, target);
+    int fd = -1;
+    if (run_command(command) != 0 || (fd = open(target, O_RDONLY | O_CLOEXEC)) < 0 || fsync(fd) != 0 ||
+        rename(target, disk) != 0) {
+        if (fd >= 0) close(fd);
+        unlink(target);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Run the mirror job JOB of CONN to completion: wait until the target is in
+// sync, pivot the guest onto it, and wait for the job to go away
+int qmp_block_job_run(QMPConn *conn, const char *job, char *resp, size_t size) {
+    char request[MAX_LINE];
+    char quoted[MAX_NAME + 2];
+    int completing = 0;
+    int shown = 0;
+    int failed = 0;
+    snprintf(quoted, sizeof(quoted), "\"%s\"", job);
+    for (;;) {
+        if (qmp_execute(conn, "{\"execute\": \"query-block-jobs\"}", resp, size, QMP_TIMEOUT_MS) != 0) {
+            failed = 1;
+            break;
+        }
+        if (strstr(resp, quoted) == NULL) {
+            failed = !completing;
+            break;
+        }
+        double offset = 0, len = 0;
+        json_number_in(resp, NULL, "offset", &offset);
+        json_number_in(resp, NULL, "len", &len);
+        if (isatty(STDOUT_FILENO) && len > 0) {
+            printf("\r  mirrored %.0f%%   ", 100.0 * offset / len);
+            fflush(stdout);
+            shown = 1;
+        }
+        const char *ready = json_find_key(resp, NULL, "ready");
+        if (!completing && ready != NULL && strncmp(ready, "true", 4) == 0) {
+            snprintf(request, sizeof(request), "{\"execute\": \"block-job-complete\", \"arguments\": {\"device\": \"%s\"}}", job);
+            if (qmp_execute(conn, request, resp, size, QMP_TIMEOUT_MS) != 0) {
+                failed = 1;
+                break;
+            }
+            completing = 1;
+            continue;
+        }
+        usleep(DEFRAG_POLL_MS * 1000);
+    }
+    if (shown) printf("\n");
+    if (failed) {
+        snprintf(request, sizeof(request), "{\"execute\": \"block-job-cancel\", \"arguments\": {\"device\": \"%s\", \"force\": true}}", job);
+        char scratch[256];
+        qmp_execute(conn, request, scratch, sizeof(scratch), QMP_TIMEOUT_MS);
+    }
+    return failed;
+}
+
+// Root block node behind the VM's disk drive, from query-block. A mirror
+// pivot swaps the node (and its file name) but never the drive, so this
+// stays right across defrags and live moves. QEMUs started before the drive
+// had an id know it as virtio0, the first if=virtio drive
+int qmp_disk_node(QMPConn *conn, char *node, size_t size, char *resp, size_t resp_size) {
+    node[0] = '\0';
+    if (qmp_execute(conn, "{\"execute\": \"query-block\"}", resp, resp_size, QMP_TIMEOUT_MS) != 0) {
+        return 1;
+    }
+    JsonDoc doc;
+    if (json_parse(&doc, resp, strlen(resp)) != 0) {
+        return 1;
+    }
+    int drives = json_get(&doc, 0, "return");
+    const char *fallback = NULL;
+    if (drives >= 0 && doc.nodes[drives].type == JSON_ARRAY) {
+        for (int i = doc.nodes[drives].child; i >= 0; i = doc.nodes[i].next) {
+            const char *device = json_get_string(&doc, i, "device", "");
+            const char *name = json_get_string(&doc, json_get(&doc, i, "inserted"), "node-name", NULL);
+            if (name == NULL) continue;
+            if (strcmp(device, VM_DISK_DRIVE) == 0) {
+                snprintf(node, size, "%s", name);
+                break;
+            }
+            if (strcmp(device, "virtio0") == 0) fallback = name;
+        }
+    }
+    if (node[0] == '\0' && fallback != NULL) {
+        snprintf(node, size, "%s", fallback);
+    }
+    json_free(&doc);
+    return node[0] == '\0';
+}
+
+// Running VM: mirror the disk onto a fresh image while the guest keeps
+// writing, then pivot QEMU onto it (QMP blockdev-mirror + block-job-complete)
+int disk_defrag_online(const char *vm_dir, const char *disk) {
+    TRACE_SCOPE("disk_defrag_online", disk);
+    char sock_path[MAX_PATH + 16];
+    char target[MAX_PATH + 16];
+    char message[MAX_LINE];
+    char *resp = malloc(QMP_BUF_SIZE);
+    QMPConn conn;
+    snprintf(sock_path, sizeof(sock_path), "%s/qmp.sock", vm_dir);
+    snprintf(target, sizeof(target), "%s.defrag", disk);
+    if (resp == NULL || qmp_open(&conn, sock_path, 1) != 0) {
+        free(resp);
+        log_error("Cannot reach the VM's QMP socket");
+        return 1;
+    }
+
+    // The node QEMU reads the disk through
+    char node[MAX_NAME] = "";
+    qmp_disk_node(&conn, node, sizeof(node), resp, QMP_BUF_SIZE);
+    Qcow2Stats source;
+    char options[128];
+    char command[MAX_PATH * 3];
+    if (node[0] == '\0' || qcow2_analyze(disk, &source) != 0) {
+        qmp_close(&conn);
+        free(resp);
+        log_error("QEMU does not report the disk as a qcow2 block node");
+        return 1;
+    }
+    qcow2_create_options(&source, options, sizeof(options));
+    snprintf(command, sizeof(command), "qemu-img create -q -f qcow2 -o %s \"%s\" %llu", options, target,
+             (unsigned long long)source.virtual_size);
+    if (run_command(command) != 0) {
+        qmp_close(&conn);
+        free(resp);
+        log_error("Failed to create the defrag target");
+        return 1;
+    }
+
+    // The target outlives this run as the disk's node, so every run needs a
+    // name of its own; it takes over the drive's discard handling too
+    char target_node[MAX_NAME];
+    EphemeralStore store;
+    snprintf(target_node, sizeof(target_node), "%s-%d-%ld", DEFRAG_JOB, (int)getpid(), (long)time(NULL));
+    StrBuf sb = {0};
+    sb_printf(&sb, "{\"execute\": \"blockdev-add\", \"arguments\": {\"driver\": \"qcow2\", \"node-name\": \"%s\", "
+              "\"discard\": \"unmap\", \"detect-zeroes\": \"unmap\", ", target_node);
+    if (ephemeral_load(vm_dir, &store) == 0) {
+        sb_printf(&sb, "\"cache\": {\"direct\": false, \"no-flush\": true}, ");
+    }
+    sb_printf(&sb, "\"file\": {\"driver\": \"file\", \"discard\": \"unmap\", \"filename\": ");
+    json_write_string(&sb, target);
+    sb_printf(&sb, "}}}");
+    int failed = qmp_execute(&conn, sb.data, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0;
+    int added = !failed;
+    if (!failed) {
+        sb_free(&sb);
+        sb_printf(&sb, "{\"execute\": \"blockdev-mirror\", \"arguments\": {\"job-id\": \"%s\", \"device\": ", DEFRAG_JOB);
+        json_write_string(&sb, node);
+        sb_printf(&sb, ", \"target\": \"%s\", \"sync\": \"full\"}}", target_node);
+        failed = qmp_execute(&conn, sb.data, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0;
+    }
+    sb_free(&sb);
+
+    if (!failed) {
+        failed = qmp_block_job_run(&conn, DEFRAG_JOB, resp, QMP_BUF_SIZE);
+    }
+
+    // After a pivot the target node is the disk; otherwise clean it up
+    if (failed) {
+        char request[MAX_LINE];
+        if (added) {
+            snprintf(request, sizeof(request), "{\"execute\": \"blockdev-del\", \"arguments\": {\"node-name\": \"%s\"}}", target_node);
+            qmp_execute(&conn, request, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS);
+        }
+        unlink(target);
+        snprintf(message, sizeof(message), "Mirror job failed: %.200s", resp);
+        log_error(message);
+    } else if (rename(target, disk) != 0) {
+        // QEMU already runs on the target; it only keeps its temporary name
+        failed = 1;
+        log_error("Disk was defragmented but could not be renamed; it is running from disk.qcow2.defrag");
+    }
+    qmp_close(&conn);
+    free(resp);
+    return failed;
+}
+
+// vm disk defrag NAME [--offline]. The rewrite happens next to the disk,
+// on whichever pool holds it
+int vm_disk_defrag_command(const char *vm_name, const char *vm_dir, int offline_only) {
+    char disk[MAX_PATH];
+    char message[MAX_LINE];
+    vm_disk_real_path(vm_dir, disk, sizeof(disk));
+    int running = read_vm_pid(vm_dir) > 0;
+    if (running && offline_only) {
+        snprintf(message, sizeof(message), "VM '%s' is running; stop it first or drop --offline", vm_name);
+        log_error(message);
+        return 1;
+    }
+    // Between restarts there is no QEMU to drive, but the supervisor will
+    // boot one on top of the rewrite
+    if (!running && vm_is_active(vm_dir)) {
+        snprintf(message, sizeof(message), "VM '%s' is restarting; stop it first", vm_name);
+        log_error(message);
+        return 1;
+    }
+    const char *format = vm_disk_format(vm_dir);
+    if (running && strcmp(format, "qcow2") != 0) {
+        log_error("Online defrag needs a qcow2 disk; stop the VM to defrag a raw one");
+        return 1;
+    }
+
+    // The rewrite needs room for a second copy of the allocated data
+    Qcow2Stats before;
+    struct statvfs fs;
+    struct stat st;
+    int have_stats = qcow2_analyze(disk, &before) == 0;
+    if (stat(disk, &st) != 0) {
+        log_error("VM has no disk");
+        return 1;
+    }
+    char disk_dir[MAX_PATH];
+    snprintf(disk_dir, sizeof(disk_dir), "%s", disk);
+    *strrchr(disk_dir, '/') = '\0';
+    if (statvfs(disk_dir, &fs) == 0 && (uint64_t)fs.f_bavail * fs.f_frsize < (uint64_t)st.st_blocks * 512) {
+        log_error("Not enough free space for a second copy of the disk");
+        return 1;
+    }
+
+    snprintf(message, sizeof(message), "Defragmenting the disk of '%s' %s...", vm_name, running ? "online" : "offline");
+    log_info(message);
+    double started = now_monotonic();
+    if ((running ? disk_defrag_online(vm_dir, disk) : disk_defrag_offline(disk, format)) != 0) {
+        if (!running) log_error("Defragmentation failed; the original disk is unchanged");
+        return 1;
+    }
+
+    Qcow2Stats after;
+    if (have_stats && qcow2_analyze(disk, &after) == 0) {
+        char old_size[16], new_size[16];
+        format_size((double)before.host_allocated, old_size, sizeof(old_size));
+        format_size((double)after.host_allocated, new_size, sizeof(new_size));
+        snprintf(message, sizeof(message), "Defragmented in %.1fs: %llu -> %llu fragment(s), %s -> %s on the host",
+                 now_monotonic() - started, (unsigned long long)before.fragments, (unsigned long long)after.fragments,
+                 old_size, new_size);
+    } else {
+        snprintf(message, sizeof(message), "Defragmented in %.1fs", now_monotonic() - started);
+    }
+    log_success(message);
+    return 0;
+}
+
+// vm disk stats|defrag|trim|compact NAME, vm disk reclaim
+int vm_disk_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    if (argc == 2 && strcmp(argv[1], "reclaim") == 0) {
+        init_dirs();
+        return vm_disk_reclaim_command();
+    }
+    if (argc < 3) {
+        log_error("Usage: v4m vm disk stats|defrag|trim|compact|reclaim <name> [--offline]");
+        return 1;
+    }
+    const char *action = argv[1];
+    if (strcmp(action, "trim") == 0 || strcmp(action, "compact") == 0) {
+        init_dirs();
+        return vm_disk_reclaim_action(action, argv[2]);
+    }
+    // The name and --offline may come in either order
+    char *vm_name = NULL;
+    int offline_only = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--offline") == 0) {
+            offline_only = 1;
+        } else if (argv[i][0] == '-' || vm_name != NULL) {
+            vm_name = NULL;
+            break;
+        } else {
+            vm_name = argv[i];
+        }
+    }
+    char *target[] = {argv[1], vm_name};
+    if (vm_name == NULL || (offline_only && strcmp(action, "defrag") != 0)) {
+        log_error("Usage: v4m vm disk stats|defrag|trim|compact|reclaim <name> [--offline]");
+        return 1;
+    }
+    if (require_vm(2, target, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    if (strcmp(action, "stats") == 0) {
+        return vm_disk_stats_command(vm_name, vm_dir);
+    }
+    if (strcmp(action, "defrag") == 0) {
+        return vm_disk_defrag_command(vm_name, vm_dir, offline_only);
+    }
+    log_error("Usage: v4m vm disk stats|defrag|trim|compact|reclaim <name> [--offline]");
+    return 1;
+}
+
+// Space reclamation. Guest discards pass through to the host file
+// (discard=unmap, zero writes become unmaps with detect-zeroes=unmap), the
+// supervisor trims the guest's filesystems through the guest agent, and
+// `vm disk compact` punches out all-zero blocks of a stopped VM's disk.
+// Every pass appends "TIME KIND BYTES" to <vm>/reclaim.log
+uint64_t disk_allocated_bytes(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+}
+
+void reclaim_record(const char *vm_dir, const char *kind, uint64_t bytes) {
+    char path[MAX_PATH + 16];
+    char line[128];
+    snprintf(path, sizeof(path), "%s/reclaim.log", vm_dir);
+    int len = snprintf(line, sizeof(line), "%ld %s %llu\n", (long)time(NULL), kind, (unsigned long long)bytes);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (write(fd, line, len) != len) {
+        // Best effort; the report only undercounts
+    }
+    close(fd);
+}
+
+// Deallocate LEN bytes at OFFSET, keeping the file size; reads return zeros
+int punch_hole(int fd, off_t offset, off_t len) {
+#ifdef __APPLE__
+    fpunchhole_t punch = {0};
+    punch.fp_offset = offset;
+    punch.fp_length = len;
+    return fcntl(fd, F_PUNCHHOLE, &punch) == 0 ? 0 : 1;
+#elif defined(__linux__)
+    return syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0 ? 0 : 1;
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    errno = ENOTSUP;
+    return 1;
+#endif
+}
+
+// Punch every allocated, all-zero RECLAIM_PUNCH_BLOCK of PATH. A hole reads
+// back as zeros, so this is safe under any format, qcow2 metadata included,
+// as long as nothing writes the file meanwhile
+int disk_punch_zeroes(const char *path, uint64_t *reclaimed) {
+    TRACE_SCOPE("disk_punch_zeroes", path);
+    *reclaimed = 0;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    unsigned char *block = malloc(RECLAIM_PUNCH_BLOCK);
+    struct stat st;
+    if (fd < 0 || block == NULL || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        free(block);
+        return 1;
+    }
+    uint64_t before = (uint64_t)st.st_blocks * 512;
+    off_t offset = 0;
+    int failed = 0;
+    while (offset < st.st_size && !failed) {
+#ifdef SEEK_DATA
+        // Skip what is already a hole
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) break;
+        offset = data - data % RECLAIM_PUNCH_BLOCK;
+#endif
+        ssize_t n = pread(fd, block, RECLAIM_PUNCH_BLOCK, offset);
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+        if (n == RECLAIM_PUNCH_BLOCK && is_zero_block(block, n) && punch_hole(fd, offset, n) != 0) {
+            failed = 1;
+        }
+        offset += n;
+    }
+    if (!failed && fsync(fd) == 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_blocks * 512 < before) {
+        *reclaimed = before - (uint64_t)st.st_blocks * 512;
+    }
+    free(block);
+    close(fd);
+    return failed;
+}
+
+// Trim the filesystems of a running guest. TRIMMED is what the guest
+// reported, RECLAIMED what the host file actually shrank by
+int vm_trim(const char *vm_dir, uint64_t *trimmed, uint64_t *reclaimed) {
+    TRACE_SCOPE("vm_trim", vm_dir);
+    char sock_path[MAX_PATH + 16];
+    char disk[MAX_PATH + 16];
+    char *resp = malloc(QMP_BUF_SIZE);
+    QMPConn conn;
+    *trimmed = 0;
+    *reclaimed = 0;
+    snprintf(sock_path, sizeof(sock_path), "%s/qga.sock", vm_dir);
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    if (resp == NULL || qmp_open(&conn, sock_path, 0) != 0) {
+        free(resp);
+        return 1;
+    }
+    // A quick ping first: without an agent in the guest, fstrim's long
+    // timeout would be spent waiting for nothing
+    uint64_t before = disk_allocated_bytes(disk);
+    int failed = qmp_execute(&conn, "{\"execute\": \"guest-ping\"}", resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0 ||
+                 qmp_execute(&conn, "{\"execute\": \"guest-fstrim\"}", resp, QMP_BUF_SIZE, RECLAIM_TRIM_TIMEOUT_MS) != 0;
+    qmp_close(&conn);
+    if (!failed) {
+        const char *p = resp;
+        while ((p = strstr(p, "\"trimmed\"")) != NULL) {
+            double value = 0;
+            json_number_in(p, NULL, "trimmed", &value);
+            *trimmed += (uint64_t)value;
+            p++;
+        }
+        uint64_t after = disk_allocated_bytes(disk);
+        *reclaimed = after < before ? before - after : 0;
+        reclaim_record(vm_dir, "trim", *reclaimed);
+    }
+    free(resp);
+    return failed;
+}
+
+// Supervisor side of the schedule: a trim per RECLAIM_TRIM_INTERVAL while
+// QEMU runs, logged with the crashes
+void supervise_trim(const char *vm_dir) {
+    uint64_t trimmed, reclaimed;
+    char trimmed_size[16], reclaimed_size[16];
+    if (vm_trim(vm_dir, &trimmed, &reclaimed) != 0) {
+        supervise_log(vm_dir, "scheduled fstrim failed (no guest agent?)");
+        return;
+    }
+    format_size((double)trimmed, trimmed_size, sizeof(trimmed_size));
+    format_size((double)reclaimed, reclaimed_size, sizeof(reclaimed_size));
+    supervise_log(vm_dir, "scheduled fstrim: guest trimmed %s, host reclaimed %s", trimmed_size, reclaimed_size);
+}
+
+int vm_disk_trim_one(const char *vm_name, const char *vm_dir, void *ctx) {
+    ReclaimPass *pass = ctx;
+    uint64_t trimmed, reclaimed;
+    char trimmed_size[16], reclaimed_size[16];
+    char message[MAX_LINE];
+    if (read_vm_pid(vm_dir) <= 0) {
+        return 0;
+    }
+    if (vm_trim(vm_dir, &trimmed, &reclaimed) != 0) {
+        snprintf(message, sizeof(message), "%s: the guest agent did not answer guest-fstrim", vm_name);
+        log_warning(message);
+        pass->failures++;
+        return 0;
+    }
+    format_size((double)trimmed, trimmed_size, sizeof(trimmed_size));
+    format_size((double)reclaimed, reclaimed_size, sizeof(reclaimed_size));
+    snprintf(message, sizeof(message), "%s: guest trimmed %s, host reclaimed %s", vm_name, trimmed_size, reclaimed_size);
+    log_success(message);
+    pass->reclaimed += reclaimed;
+    return 0;
+}
+
+int vm_disk_compact_one(const char *vm_name, const char *vm_dir, void *ctx) {
+    ReclaimPass *pass = ctx;
+    uint64_t reclaimed;
+    char disk[MAX_PATH + 16];
+    char size[16];
+    char message[MAX_LINE];
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    if (vm_is_active(vm_dir)) {
+        snprintf(message, sizeof(message), "%s: running; stop it to compact (or use vm disk trim)", vm_name);
+        log_warning(message);
+        return 0;
+    }
+    if (!file_exists(disk)) {
+        return 0;
+    }
+    if (disk_punch_zeroes(disk, &reclaimed) != 0) {
+        snprintf(message, sizeof(message), "%s: compaction failed: %s", vm_name, strerror(errno));
+        log_error(message);
+        pass->failures++;
+        return 0;
+    }
+    reclaim_record(vm_dir, "compact", reclaimed);
+    format_size((double)reclaimed, size, sizeof(size));
+    snprintf(message, sizeof(message), "%s: reclaimed %s", vm_name, size);
+    log_success(message);
+    pass->reclaimed += reclaimed;
+    return 0;
+}
+
+int vm_disk_reclaim_row(const char *vm_name, const char *vm_dir, void *ctx) {
+    ReclaimTotals *fleet = ctx;
+    char path[MAX_PATH + 16];
+    char line[128];
+    ReclaimTotals vm = {0};
+    snprintf(path, sizeof(path), "%s/disk.qcow2", vm_dir);
+    vm.allocated = disk_allocated_bytes(path);
+    snprintf(path, sizeof(path), "%s/reclaim.log", vm_dir);
+    FILE *fp = fopen(path, "r");
+    while (fp != NULL && fgets(line, sizeof(line), fp)) {
+        long when;
+        char kind[16];
+        unsigned long long bytes;
+        if (sscanf(line, "%ld %15s %llu", &when, kind, &bytes) != 3) continue;
+        if (strcmp(kind, "trim") == 0) {
+            vm.trimmed += bytes;
+            vm.trims++;
+        } else if (strcmp(kind, "compact") == 0) {
+            vm.compacted += bytes;
+        }
+        if (when > vm.last) vm.last = when;
+    }
+    if (fp != NULL) fclose(fp);
+
+    char allocated[16], trimmed[16], compacted[16], total[16], last[32] = "never";
+    format_size((double)vm.allocated, allocated, sizeof(allocated));
+    format_size((double)vm.trimmed, trimmed, sizeof(trimmed));
+    format_size((double)vm.compacted, compacted, sizeof(compacted));
+    format_size((double)(vm.trimmed + vm.compacted), total, sizeof(total));
+    if (vm.last > 0) {
+        struct tm tm;
+        time_t t = vm.last;
+        localtime_r(&t, &tm);
+        strftime(last, sizeof(last), "%Y-%m-%d %H:%M", &tm);
+    }
+    printf("%-20s %-8s %10s %10s %10s %10s  %s\n", vm_name, read_vm_pid(vm_dir) > 0 ? "running" : "stopped",
+           allocated, trimmed, compacted, total, last);
+    fleet->allocated += vm.allocated;
+    fleet->trimmed += vm.trimmed;
+    fleet->compacted += vm.compacted;
+    fleet->trims += vm.trims;
+    fleet->vms++;
+    return 0;
+}
+
+// vm disk reclaim: what each VM's disk holds on the host and what trims and
+// compactions have given back, with fleet totals
+int vm_disk_reclaim_command(void) {
+    ReclaimTotals fleet = {0};
+    printf("%-20s %-8s %10s %10s %10s %10s  %s\n", "NAME", "STATE", "ALLOCATED", "TRIMMED", "COMPACTED", "RECLAIMED", "LAST");
+    for_each_vm(vm_disk_reclaim_row, &fleet);
+    char allocated[16], trimmed[16], compacted[16], total[16], label[32];
+    format_size((double)fleet.allocated, allocated, sizeof(allocated));
+    format_size((double)fleet.trimmed, trimmed, sizeof(trimmed));
+    format_size((double)fleet.compacted, compacted, sizeof(compacted));
+    format_size((double)(fleet.trimmed + fleet.compacted), total, sizeof(total));
+    snprintf(label, sizeof(label), "fleet (%d VMs)", fleet.vms);
+    printf("%-20s %-8s %10s %10s %10s %10s  %d trim(s)\n", label, "", allocated, trimmed, compacted, total, fleet.trims);
+    return 0;
+}
+
+// vm disk trim|compact <name> | --all
+int vm_disk_reclaim_action(const char *action, const char *target) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    char size[16];
+    ReclaimPass pass = {0};
+    vm_visit_fn fn = strcmp(action, "trim") == 0 ? vm_disk_trim_one : vm_disk_compact_one;
+    if (strcmp(target, "--all") == 0) {
+        for_each_vm(fn, &pass);
+        format_size((double)pass.reclaimed, size, sizeof(size));
+        snprintf(message, sizeof(message), "Reclaimed %s across the fleet", size);
+        log_info(message);
+        return pass.failures > 0;
+    }
+    vm_dir_path(target, vm_dir, sizeof(vm_dir));
+    if (!name_is_safe(target) || !dir_exists(vm_dir)) {
+        snprintf(message, sizeof(message), "VM '%s' not found", target);
+        log_error(message);
+        return 1;
+    }
+    // Trim needs a QEMU to talk to; compaction needs no supervisor either
+    int running = strcmp(action, "trim") == 0 ? read_vm_pid(vm_dir) > 0 : vm_is_active(vm_dir);
+    if (strcmp(action, "trim") == 0 ? !running : running) {
+        snprintf(message, sizeof(message), running ? "VM '%s' is running; stop it to compact (or use vm disk trim)" :
+                 "VM '%s' is not running; use vm disk compact", target);
+        log_error(message);
+        return 1;
+    }
+    fn(target, vm_dir, &pass);
+    return pass.failures > 0;
+}
+
+// Storage pools: named directories (typically one per drive) that VM disks
+// are placed on. VM metadata stays in the central tree; a disk on another
+// pool is <pool>/v4m/<name>.qcow2 with <vm>/disk.qcow2 a symlink to it, and
+// vm-info.json names the pool.
+//   ~/.v4m/pools          "NAME PATH" per line; "default" is ~/.v4m/vms
+//   ~/.v4m/pool-latency   "MS NAME" per line, smoothed sync-write latency
+char create_pool[MAX_NAME] = "";
+
+int pool_load(StoragePool *pools, int max) {
+    char path[MAX_PATH];
+    char *text;
+    size_t len;
+    int count = 0;
+    memset(&pools[0], 0, sizeof(pools[0]));
+    snprintf(pools[0].name, sizeof(pools[0].name), "default");
+    snprintf(pools[0].path, sizeof(pools[0].path), "%s/.v4m/vms", getenv("HOME"));
+    count++;
+    snprintf(path, sizeof(path), "%s/.v4m/pools", getenv("HOME"));
+    if (read_file(path, &text, &len) != 0) {
+        return count;
+    }
+    for (char *line = text; line && *line && count < max; ) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+        char *space = strchr(line, ' ');
+        if (line[0] != '#' && space != NULL) {
+            *space = '\0';
+            memset(&pools[count], 0, sizeof(pools[count]));
+            snprintf(pools[count].name, sizeof(pools[count].name), "%s", line);
+            snprintf(pools[count].path, sizeof(pools[count].path), "%s", space + 1);
+            count++;
+        }
+        line = end ? end + 1 : NULL;
+    }
+    free(text);
+    return count;
+}
+
+int pool_save(const StoragePool *pools, int count) {
+    char path[MAX_PATH];
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s/.v4m/pools", getenv("HOME"));
+    sb_printf(&sb, "# v4m storage pools: NAME PATH\n");
+    for (int i = 1; i < count; i++) {
+        sb_printf(&sb, "%s %s\n", pools[i].name, pools[i].path);
+    }
+    int result = write_file_atomic(path, sb.data, sb.len);
+    sb_free(&sb);
+    return result;
+}
+
+int pool_find(const StoragePool *pools, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(pools[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+double pool_latency_get(const char *name) {
+    char path[MAX_PATH];
+    char *text;
+    size_t len;
+    double latency = 0;
+    snprintf(path, sizeof(path), "%s/.v4m/pool-latency", getenv("HOME"));
+    if (read_file(path, &text, &len) != 0) {
+        return 0;
+    }
+    for (char *line = text; line && *line; ) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+        char *space = strchr(line, ' ');
+        if (space && strcmp(space + 1, name) == 0) latency = atof(line);
+        line = end ? end + 1 : NULL;
+    }
+    free(text);
+    return latency;
+}
+
+void pool_latency_record(const char *name, double ms) {
+    char path[MAX_PATH];
+    char *text = NULL;
+    size_t len;
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s/.v4m/pool-latency", getenv("HOME"));
+    double previous = 0;
+    if (read_file(path, &text, &len) == 0) {
+        for (char *line = text; *line; ) {
+            char *end = strchr(line, '\n');
+            if (end) *end = '\0';
+            char *space = strchr(line, ' ');
+            if (space && strcmp(space + 1, name) == 0) {
+                previous = atof(line);
+            } else if (space) {
+                sb_printf(&sb, "%s\n", line);
+            }
+            if (end == NULL) break;
+            line = end + 1;
+        }
+        free(text);
+    }
+    // Smoothed like mirror speeds: one probe during a burst does not condemn a drive
+    double latency = previous > 0 ? (previous + ms) / 2 : ms;
+    sb_printf(&sb, "%.3f %s\n", latency, name);
+    write_file_atomic(path, sb.data, sb.len);
+    sb_free(&sb);
+}
+
+// Capacity from statvfs, and the latency of a small synchronous write: the
+// cost a guest's flush pays on that drive, which rises with its load
+int pool_probe(StoragePool *pool) {
+    TRACE_SCOPE("pool_probe", pool->name);
+    struct statvfs fs;
+    char probe[MAX_PATH + 32];
+    unsigned char block[POOL_PROBE_BLOCK];
+    if (statvfs(pool->path, &fs) != 0) {
+        return 1;
+    }
+    pool->capacity = (uint64_t)fs.f_blocks * fs.f_frsize;
+    pool->free = (uint64_t)fs.f_bavail * fs.f_frsize;
+
+    snprintf(probe, sizeof(probe), "%s/.v4m-probe.%d", pool->path, (int)getpid());
+    int fd = open(probe, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    memset(block, 0xa5, sizeof(block));
+    double samples[POOL_PROBE_SAMPLES];
+    int failed = 0;
+    for (int i = 0; i < POOL_PROBE_SAMPLES && !failed; i++) {
+        double started = now_monotonic();
+        failed = pwrite(fd, block, sizeof(block), (off_t)i * sizeof(block)) != (ssize_t)sizeof(block) || fsync(fd) != 0;
+        samples[i] = (now_monotonic() - started) * 1000;
+    }
+    close(fd);
+    unlink(probe);
+    if (failed) {
+        return 1;
+    }
+    qsort(samples, POOL_PROBE_SAMPLES, sizeof(double), compare_doubles);
+    pool_latency_record(pool->name, samples[POOL_PROBE_SAMPLES / 2]);
+    pool->latency_ms = pool_latency_get(pool->name);
+    return 0;
+}
+
+int pool_usage_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    PoolUsage *usage = ctx;
+    VMInfo info;
+    (void)vm_name;
+    if (load_vm_info(vm_dir, &info) != 0) {
+        return 0;
+    }
+    int index = pool_find(usage->pools, usage->count, info.pool);
+    if (index < 0) {
+        // Ephemeral VMs live in RAM, not on a pool
+        return 0;
+    }
+    usage->pools[index].disks++;
+    if (read_vm_pid(vm_dir) > 0) usage->pools[index].active++;
+    return 0;
+}
+
+// Probe every pool and count the VM disks on it
+int pool_survey(StoragePool *pools, int max) {
+    int count = pool_load(pools, max);
+    PoolUsage usage = {pools, count};
+    for (int i = 0; i < count; i++) {
+        if (pool_probe(&pools[i]) != 0) {
+            pools[i].offline = 1;
+        }
+    }
+    for_each_vm(pool_usage_visit, &usage);
+    return count;
+}
+
+// Where a new disk goes: among pools with POOL_MIN_FREE to spare, the one
+// whose flushes are cheapest once shared with the VMs already running
+// there; free space breaks ties
+int pool_select(char *name, size_t size) {
+    StoragePool pools[MAX_POOLS];
+    char message[MAX_LINE];
+    int count = pool_survey(pools, MAX_POOLS);
+    int best = -1;
+    double best_score = 0;
+    for (int i = 0; i < count; i++) {
+        if (pools[i].offline || pools[i].free < POOL_MIN_FREE) continue;
+        double score = pools[i].latency_ms * (1 + pools[i].active);
+        if (best < 0 || score < best_score || (score == best_score && pools[i].free > pools[best].free)) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best < 0) {
+        log_error("No storage pool has enough free space for a new disk");
+        return 1;
+    }
+    snprintf(name, size, "%s", pools[best].name);
+    if (count > 1) {
+        char free_size[16];
+        format_size((double)pools[best].free, free_size, sizeof(free_size));
+        snprintf(message, sizeof(message), "Placing the disk on pool '%s' (%s free, %.2f ms sync latency, %d running)",
+                 pools[best].name, free_size, pools[best].latency_ms, pools[best].active);
+        log_info(message);
+    }
+    return 0;
+}
+
+// Path of the disk of VM_NAME on POOL ("default" keeps it in the VM directory)
+int pool_disk_path(const char *pool_name, const char *vm_name, char *path, size_t size) {
+    StoragePool pools[MAX_POOLS];
+    char vm_dir[MAX_PATH];
+    int count = pool_load(pools, MAX_POOLS);
+    int index = pool_find(pools, count, pool_name);
+    if (index < 0) {
+        return 1;
+    }
+    if (index == 0) {
+        vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+        snprintf(path, size, "%s/disk.qcow2", vm_dir);
+        return 0;
+    }
+    char dir[MAX_PATH + 8];
+    snprintf(dir, sizeof(dir), "%s/v4m", pools[index].path);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return 1;
+    }
+    snprintf(path, size, "%s/%s.qcow2", dir, vm_name);
+    return 0;
+}
+
+// Point <vm>/disk.qcow2 at TARGET, atomically
+int vm_disk_link(const char *vm_dir, const char *target) {
+    char disk[MAX_PATH + 16];
+    char link[MAX_PATH + 16];
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    snprintf(link, sizeof(link), "%s/disk.qcow2.link", vm_dir);
+    unlink(link);
+    if (symlink(target, link) != 0 || rename(link, disk) != 0) {
+        unlink(link);
+        return 1;
+    }
+    return 0;
+}
+
+// The file behind <vm>/disk.qcow2, wherever its pool is
+void vm_disk_real_path(const char *vm_dir, char *path, size_t size) {
+    char disk[MAX_PATH + 16];
+    char resolved[PATH_MAX];
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    if (realpath(disk, resolved) == NULL || snprintf(path, size, "%s", resolved) >= (int)size) {
+        snprintf(path, size, "%s", disk);
+    }
+}
+
+// vm move <name> --pool POOL: copy the disk to POOL and repoint the VM at it.
+// A running VM is moved live with drive-mirror, so the guest never stops
+int vm_move_command(int argc, char *argv[]) {
+    const char *vm_name = NULL;
+    const char *pool_name = NULL;
+    char message[MAX_LINE];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+            pool_name = argv[++i];
+        } else if (argv[i][0] != '-' && vm_name == NULL) {
+            vm_name = argv[i];
+        } else {
+            vm_name = NULL;
+            break;
+        }
+    }
+    if (vm_name == NULL || pool_name == NULL) {
+        log_error("Usage: v4m vm move <name> --pool <pool>");
+        return 1;
+    }
+    init_dirs();
+
+    char vm_dir[MAX_PATH];
+    VMInfo info;
+    EphemeralStore store;
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    if (!name_is_safe(vm_name) || load_vm_info(vm_dir, &info) != 0) {
+        snprintf(message, sizeof(message), "VM '%s' not found", vm_name);
+        log_error(message);
+        return 1;
+    }
+    if (ephemeral_load(vm_dir, &store) == 0) {
+        snprintf(message, sizeof(message), "VM '%s' is ephemeral; its disk stays in RAM", vm_name);
+        log_error(message);
+        return 1;
+    }
+    StoragePool pools[MAX_POOLS];
+    int count = pool_load(pools, MAX_POOLS);
+    int index = pool_find(pools, count, pool_name);
+    if (index < 0) {
+        snprintf(message, sizeof(message), "Unknown pool '%s' (see v4m pool list)", pool_name);
+        log_error(message);
+        return 1;
+    }
+    if (strcmp(info.pool, pool_name) == 0) {
+        snprintf(message, sizeof(message), "'%s' is already on pool '%s'", vm_name, pool_name);
+        log_info(message);
+        return 0;
+    }
+
+    char source[MAX_PATH];
+    char dest[MAX_PATH];
+    char copy[MAX_PATH + 16];
+    vm_disk_real_path(vm_dir, source, sizeof(source));
+    if (pool_probe(&pools[index]) != 0 || pool_disk_path(pool_name, vm_name, dest, sizeof(dest)) != 0) {
+        snprintf(message, sizeof(message), "Pool '%s' is not usable", pool_name);
+        log_error(message);
+        return 1;
+    }
+    if (pools[index].free < disk_allocated_bytes(source) + POOL_MIN_FREE) {
+        snprintf(message, sizeof(message), "Not enough free space on pool '%s'", pool_name);
+        log_error(message);
+        return 1;
+    }
+    // Onto the default pool the copy lands next to the link it replaces
+    snprintf(copy, sizeof(copy), "%s%s", dest, index == 0 ? ".move" : "");
+
+    int running = read_vm_pid(vm_dir) > 0;
+    if (!running && vm_is_active(vm_dir)) {
+        snprintf(message, sizeof(message), "VM '%s' is restarting; stop it or wait for it to boot", vm_name);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Moving the disk of '%s' to pool '%s' %s...", vm_name, pool_name,
+             running ? "live" : "offline");
+    log_info(message);
+    double started = now_monotonic();
+    int failed;
+    if (running) {
+        char sock_path[MAX_PATH + 16];
+        char node[MAX_NAME];
+        char *resp = malloc(QMP_BUF_SIZE);
+        QMPConn conn;
+        snprintf(sock_path, sizeof(sock_path), "%s/qmp.sock", vm_dir);
+        failed = resp == NULL || qmp_open(&conn, sock_path, 1) != 0;
+        if (!failed) {
+            StrBuf sb = {0};
+            failed = qmp_disk_node(&conn, node, sizeof(node), resp, QMP_BUF_SIZE) != 0;
+            if (!failed) {
+                // absolute-paths: QEMU creates the target in the source's format
+                sb_printf(&sb, "{\"execute\": \"drive-mirror\", \"arguments\": {\"job-id\": \"%s\", \"device\": ", MOVE_JOB);
+                json_write_string(&sb, node);
+                sb_printf(&sb, ", \"format\": \"%s\", \"sync\": \"full\", \"mode\": \"absolute-paths\", \"target\": ",
+                          info.disk_format);
+                json_write_string(&sb, copy);
+                sb_printf(&sb, "}}");
+                failed = qmp_execute(&conn, sb.data, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0 ||
+                         qmp_block_job_run(&conn, MOVE_JOB, resp, QMP_BUF_SIZE) != 0;
+                sb_free(&sb);
+            }
+            qmp_close(&conn);
+        }
+        free(resp);
+    } else {
+        int fd = -1;
+        failed = copy_file(source, copy) != 0 || (fd = open(copy, O_RDONLY | O_CLOEXEC)) < 0 || fsync(fd) != 0;
+        if (fd >= 0) close(fd);
+    }
+
+    // Repoint the VM; only then is the old copy garbage
+    char disk[MAX_PATH + 16];
+    snprintf(disk, sizeof(disk), "%s/disk.qcow2", vm_dir);
+    if (!failed) {
+        failed = index == 0 ? rename(copy, disk) != 0 : vm_disk_link(vm_dir, dest) != 0;
+    }
+    if (failed) {
+        unlink(copy);
+        log_error(running ? "Live move failed; the VM keeps its disk where it was" : "Move failed; the disk is unchanged");
+        return 1;
+    }
+    if (strcmp(source, disk) != 0) {
+        unlink(source);
+    }
+    snprintf(info.pool, sizeof(info.pool), "%s", pool_name);
+    if (save_vm_info(vm_dir, &info) != 0) {
+        log_warning("Disk moved, but vm-info.json could not be updated");
+    }
+    snprintf(message, sizeof(message), "Moved to pool '%s' in %.1fs", pool_name, now_monotonic() - started);
+    log_success(message);
+    return 0;
+}
+
+// pool list | add NAME PATH | remove NAME
+int pool_command(int argc, char *argv[]) {
+    StoragePool pools[MAX_POOLS];
+    char message[MAX_LINE];
+    init_dirs();
+    if (argc < 2 || strcmp(argv[1], "list") == 0) {
+        int count = pool_survey(pools, MAX_POOLS);
+        printf("%-12s %-36s %10s %10s %10s %6s %8s\n", "NAME", "PATH", "SIZE", "FREE", "LATENCY", "DISKS", "RUNNING");
+        for (int i = 0; i < count; i++) {
+            char capacity[16] = "-", free_size[16] = "-", latency[16] = "offline";
+            if (!pools[i].offline) {
+                format_size((double)pools[i].capacity, capacity, sizeof(capacity));
+                format_size((double)pools[i].free, free_size, sizeof(free_size));
+                snprintf(latency, sizeof(latency), "%.2fms", pools[i].latency_ms);
+            }
+            printf("%-12s %-36s %10s %10s %10s %6d %8d\n", pools[i].name, pools[i].path, capacity, free_size,
+                   latency, pools[i].disks, pools[i].active);
+        }
+        return 0;
+    }
+    int count = pool_load(pools, MAX_POOLS);
+    if (strcmp(argv[1], "add") == 0 && argc == 4) {
+        char resolved[PATH_MAX];
+        if (pool_find(pools, count, argv[2]) >= 0 || count == MAX_POOLS || strchr(argv[2], ' ') != NULL) {
+            log_error("Pool name in use, invalid, or too many pools");
+            return 1;
+        }
+        if (realpath(argv[3], resolved) == NULL || !dir_exists(resolved)) {
+            snprintf(message, sizeof(message), "%s is not a directory", argv[3]);
+            log_error(message);
+            return 1;
+        }
+        memset(&pools[count], 0, sizeof(pools[count]));
+        snprintf(pools[count].name, sizeof(pools[count].name), "%s", argv[2]);
+        if (snprintf(pools[count].path, sizeof(pools[count].path), "%s", resolved) >= (int)sizeof(pools[count].path)) {
+            log_error("Pool path is too long");
+            return 1;
+        }
+        if (pool_probe(&pools[count]) != 0) {
+            snprintf(message, sizeof(message), "Cannot write to %s", pools[count].path);
+            log_error(message);
+            return 1;
+        }
+        if (pool_save(pools, count + 1) != 0) {
+            log_error("Failed to save the pool list");
+            return 1;
+        }
+        snprintf(message, sizeof(message), "Pool '%s' added (%.2f ms sync latency)", argv[2], pools[count].latency_ms);
+        log_success(message);
+        return 0;
+    }
+    if (strcmp(argv[1], "remove") == 0 && argc == 3) {
+        count = pool_survey(pools, MAX_POOLS);
+        int index = pool_find(pools, count, argv[2]);
+        if (index <= 0) {
+            log_error(index == 0 ? "The default pool cannot be removed" : "Unknown pool");
+            return 1;
+        }
+        if (pools[index].disks > 0) {
+            snprintf(message, sizeof(message), "Pool '%s' still holds %d disk(s); vm move them first", argv[2], pools[index].disks);
+            log_error(message);
+            return 1;
+        }
+        memmove(&pools[index], &pools[index + 1], (count - index - 1) * sizeof(pools[0]));
+        if (pool_save(pools, count - 1) != 0) {
+            log_error("Failed to save the pool list");
+            return 1;
+        }
+        snprintf(message, sizeof(message), "Pool '%s' removed", argv[2]);
+        log_success(message);
+        return 0;
+    }
+    log_error("Usage: v4m pool list | add <name> <path> | remove <name>");
+    return 1;
+}
+
+// Ephemeral VMs: the whole VM directory lives in RAM and the VM is
+// destroyed when its QEMU exits. <vm dir> is a symlink into per-VM RAM
+// storage (a RAM disk sized to the cap on macOS, a directory on tmpfs
+// elsewhere) that holds the overlay, NVRAM, ISO, logs and sockets; the
+// index entry is the only persistent write. The base image is the backing
+// file of the overlay, or with --snapshot the drive itself (snapshot=on,
+// QEMU's temporary overlay in the same RAM storage); either way it is only
+// read. QEMU runs with RLIMIT_FSIZE at the cap, so a guest that fills its
+// allowance gets write errors instead of eating host memory.
+//   <root>/ephemeral   "root PATH", "device DEV", "cap BYTES", "base PATH",
+//                      "snapshot 0|1"
+int create_ephemeral = 0;
+int create_snapshot = 0;
+uint64_t ephemeral_cap = EPHEMERAL_DEFAULT_CAP;
+
+// "512M", "4G", "1T" or plain bytes
+int parse_size(const char *text, uint64_t *bytes) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) {
+        return 1;
+    }
+    switch (toupper((unsigned char)*end)) {
+        case 'T': value *= 1024;  // fall through
+        case 'G': value *= 1024;  // fall through
+        case 'M': value *= 1024;  // fall through
+        case 'K': value *= 1024; end++; break;
+        case '\0': break;
+        default: return 1;
+    }
+    if (*end != '\0' && strcasecmp(end, "B") != 0 && strcasecmp(end, "iB") != 0) {
+        return 1;
+    }
+    *bytes = (uint64_t)value;
+    return 0;
+}
+
+int ephemeral_load(const char *vm_dir, EphemeralStore *store) {
+    char path[MAX_PATH + 16];
+    char line[MAX_PATH + 32];
+    memset(store, 0, sizeof(*store));
+    snprintf(path, sizeof(path), "%s/ephemeral", vm_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *value = strchr(line, ' ');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        if (strcmp(line, "root") == 0) {
+            snprintf(store->root, sizeof(store->root), "%s", value);
+        } else if (strcmp(line, "device") == 0) {
+            snprintf(store->device, sizeof(store->device), "%s", value);
+        } else if (strcmp(line, "base") == 0) {
+            snprintf(store->base, sizeof(store->base), "%s", value);
+        } else if (strcmp(line, "cap") == 0) {
+            store->cap = strtoull(value, NULL, 10);
+        } else if (strcmp(line, "snapshot") == 0) {
+            store->snapshot = atoi(value);
+        }
+    }
+    fclose(fp);
+    return store->root[0] ? 0 : 1;
+}
+
+int ephemeral_save(const EphemeralStore *store) {
+    char path[MAX_PATH + 16];
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s/ephemeral", store->root);
+    sb_printf(&sb, "root %s\n", store->root);
+    if (store->device[0]) sb_printf(&sb, "device %s\n", store->device);
+    if (store->base[0]) sb_printf(&sb, "base %s\n", store->base);
+    sb_printf(&sb, "cap %llu\nsnapshot %d\n", (unsigned long long)store->cap, store->snapshot);
+    int result = write_file_atomic(path, sb.data, sb.len);
+    sb_free(&sb);
+    return result;
+}
+
+// Allocate CAP bytes of RAM storage for VM_NAME and put its VM directory there
+int ephemeral_dir_create(const char *vm_name, uint64_t cap, EphemeralStore *store) {
+    TRACE_SCOPE("ephemeral_dir_create", vm_name);
+    char message[MAX_LINE];
+    char vm_dir[MAX_PATH];
+    memset(store, 0, sizeof(*store));
+    store->cap = cap;
+#ifdef __APPLE__
+    // A RAM disk of exactly CAP bytes, formatted and mounted under /Volumes
+    char command[MAX_PATH];
+    snprintf(command, sizeof(command), "hdiutil attach -nomount ram://%llu", (unsigned long long)(cap / 512));
+    FILE *fp = popen(command, "r");
+    if (fp == NULL || fgets(store->device, sizeof(store->device), fp) == NULL) {
+        if (fp) pclose(fp);
+        log_error("Failed to allocate a RAM disk");
+        return 1;
+    }
+    pclose(fp);
+    store->device[strcspn(store->device, " \t\n")] = '\0';
+    snprintf(store->root, sizeof(store->root), "/Volumes/v4m-%s", vm_name);
+    snprintf(command, sizeof(command), "diskutil quiet erasevolume HFS+ \"v4m-%s\" %s", vm_name, store->device);
+    if (run_command(command) != 0) {
+        snprintf(command, sizeof(command), "hdiutil detach -force %s >/dev/null 2>&1", store->device);
+        run_command(command);
+        log_error("Failed to format the RAM disk");
+        return 1;
+    }
+#else
+    // tmpfs has no per-directory quota; the cap is RLIMIT_FSIZE on QEMU,
+    // checked against what the filesystem can still hold
+    struct statvfs fs;
+    char parent[sizeof(EPHEMERAL_TMPFS) + 32];
+    snprintf(parent, sizeof(parent), "%s/v4m-%d", EPHEMERAL_TMPFS, (int)getuid());
+    if (mkdir(parent, 0700) != 0 && errno != EEXIST) {
+        snprintf(message, sizeof(message), "No tmpfs at %s for ephemeral storage", EPHEMERAL_TMPFS);
+        log_error(message);
+        return 1;
+    }
+    if (statvfs(parent, &fs) == 0 && (uint64_t)fs.f_bavail * fs.f_frsize < cap) {
+        char cap_size[16];
+        format_size((double)cap, cap_size, sizeof(cap_size));
+        snprintf(message, sizeof(message), "Not enough free RAM in %s for %s of ephemeral storage", EPHEMERAL_TMPFS, cap_size);
+        log_error(message);
+        return 1;
+    }
+    snprintf(store->root, sizeof(store->root), "%s/%s", parent, vm_name);
+    if (mkdir(store->root, 0755) != 0) {
+        log_error("Failed to create the ephemeral VM directory");
+        return 1;
+    }
+#endif
+    char shard[MAX_PATH];
+    snprintf(shard, sizeof(shard), "%s/.v4m/vms/%02x", getenv("HOME"), vm_shard(vm_name));
+    mkdir(shard, 0755);
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    if (ephemeral_save(store) != 0 || symlink(store->root, vm_dir) != 0) {
+        ephemeral_store_free(store);
+        return 1;
+    }
+    if (index_update(vm_name, 1) != 0) {
+        unlink(vm_dir);
+        ephemeral_store_free(store);
+        return 1;
+    }
+    return 0;
+}
+
+// Give the RAM back. Safe on a VM that is not ephemeral or already released
+void ephemeral_release(const char *vm_dir) {
+    EphemeralStore store;
+    if (ephemeral_load(vm_dir, &store) != 0) {
+        return;
+    }
+    ephemeral_store_free(&store);
+}
+
+void ephemeral_store_free(const EphemeralStore *store) {
+    TRACE_SCOPE("ephemeral_release", store->root);
+#ifdef __APPLE__
+    if (store->device[0]) {
+        char command[MAX_PATH];
+        snprintf(command, sizeof(command), "hdiutil detach -force %s >/dev/null 2>&1", store->device);
+        run_command(command);
+        return;
+    }
+#endif
+    remove_tree(store->root);
+}
+
+// The base an ephemeral VM reads from must be a plain file. Images kept in
+// the store are materialized once per image id into the store cache, shared
+// by every ephemeral VM of that image and collected with the image
+int ephemeral_base(const char *distro_path, char *base, size_t size) {
+    size_t len = strlen(distro_path);
+    if (len <= 9 || strcmp(distro_path + len - 9, ".manifest") != 0) {
+        snprintf(base, size, "%s", distro_path);
+        return 0;
+    }
+    char *text;
+    char *body;
+    uint64_t image_size;
+    char id[65];
+    if (store_manifest_read(distro_path, &text, &body, &image_size, id) != 0) {
+        return 1;
+    }
+    free(text);
+    char dir[MAX_PATH];
+    store_path(dir, sizeof(dir), "cache");
+    mkdir(dir, 0755);
+    snprintf(base, size, "%s/%s.base", dir, id);
+    if (file_exists(base)) {
+        return 0;
+    }
+    char work[MAX_PATH + 16];
+    double rate;
+    snprintf(work, sizeof(work), "%s.%d", base, (int)getpid());
+    if (store_materialize(distro_path, work, &rate) != 0 || chmod(work, 0444) != 0 || rename(work, base) != 0) {
+        unlink(work);
+        return 1;
+    }
+    return 0;
+}
+
+// for_each_vm visitor: adds the base of every ephemeral VM to the StrBuf CTX
+int ephemeral_base_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    EphemeralStore store;
+    (void)vm_name;
+    if (ephemeral_load(vm_dir, &store) == 0 && store.base[0]) {
+        sb_printf((StrBuf *)ctx, "%s\n", store.base);
+    }
+    return 0;
+}
+
+// Disk of a new ephemeral VM: a RAM overlay on BASE, or nothing at all
+// when QEMU is to make its own (snapshot=on)
+int ephemeral_disk_create(EphemeralStore *store, const char *base, int snapshot) {
+    char command[MAX_PATH * 3];
+    snprintf(store->base, sizeof(store->base), "%s", base);
+    store->snapshot = snapshot;
+    if (ephemeral_save(store) != 0) {
+        return 1;
+    }
+    if (snapshot) {
+        return 0;
+    }
+    snprintf(command, sizeof(command), "qemu-img create -q -f qcow2 -b \"%s\" -F %s \"%s/disk.qcow2\" %s >/dev/null",
+             base, disk_format(base), store->root, DEFAULT_DISK_SIZE);
+    return run_command(command);
+}
+
+// One-shot runs: `v4m run -- CMD` executes CMD in a disposable VM and
+// exits with its status. The VM is an ephemeral snapshot=on VM, so the
+// base image is never written, claimed from the warm pool (VMs named
+// warm-<distro>-N, booted ahead by --prewarm) or else created cold through
+// the usual provision/spawn path. Everything after that goes through the
+// guest agent: inputs are written with guest-file-*, the command runs via
+// guest-exec under sh with stdout/stderr redirected to guest files, and
+// those are read back while it runs so output streams rather than arriving
+// at exit. Our own progress messages go to stderr; stdout is the guest's.
+//   <vm>/claimed   directory made (atomically) by the run that took a warm VM
+volatile sig_atomic_t run_interrupted = 0;
+
+void run_handle_signal(int sig) {
+    (void)sig;
+    run_interrupted = 1;
+}
+
+void base64_encode(const unsigned char *data, size_t len, StrBuf *sb) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char quad[5] = {0};
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t n = (uint32_t)data[i] << 16;
+        if (i + 1 < len) n |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) n |= data[i + 2];
+        quad[0] = alphabet[(n >> 18) & 63];
+        quad[1] = alphabet[(n >> 12) & 63];
+        quad[2] = i + 1 < len ? alphabet[(n >> 6) & 63] : '=';
+        quad[3] = i + 2 < len ? alphabet[n & 63] : '=';
+        sb_printf(sb, "%s", quad);
+    }
+}
+
+// Decode up to the first character outside the alphabet (the closing quote
+// of a JSON string); returns the byte count, or -1 if OUT is too small
+ssize_t base64_decode(const char *text, unsigned char *out, size_t size) {
+    uint32_t bits = 0;
+    int held = 0;
+    size_t len = 0;
+    for (const char *p = text; ; p++) {
+        int value;
+        if (*p >= 'A' && *p <= 'Z') value = *p - 'A';
+        else if (*p >= 'a' && *p <= 'z') value = *p - 'a' + 26;
+        else if (*p >= '0' && *p <= '9') value = *p - '0' + 52;
+        else if (*p == '+') value = 62;
+        else if (*p == '/') value = 63;
+        else if (*p == '\\' && p[1] == '/') continue;  // JSON may escape the slash
+        else break;
+        bits = (bits << 6) | value;
+        held += 6;
+        if (held >= 8) {
+            held -= 8;
+            if (len >= size) return -1;
+            out[len++] = (unsigned char)(bits >> held);
+        }
+    }
+    return (ssize_t)len;
+}
+
+// Connect to the guest agent of VM_DIR, retrying until it answers a ping,
+// QEMU goes away or DEADLINE (monotonic) passes
+int run_agent_connect(const char *vm_dir, QMPConn *conn, double deadline) {
+    char sock_path[MAX_PATH + 16];
+    char resp[256];
+    snprintf(sock_path, sizeof(sock_path), "%s/qga.sock", vm_dir);
+    while (!run_interrupted && now_monotonic() < deadline && read_vm_pid(vm_dir) > 0) {
+        if (qmp_open(conn, sock_path, 0) == 0) {
+            if (qmp_execute(conn, "{\"execute\": \"guest-ping\"}", resp, sizeof(resp), 1000) == 0) {
+                return 0;
+            }
+            // A late answer would be taken for the next reply
+            qmp_close(conn);
+        }
+        usleep(RUN_POLL_MS * 1000);
+    }
+    return 1;
+}
+
+int run_file_open(QMPConn *conn, const char *path, const char *mode, int *handle) {
+    char resp[256];
+    double value;
+    StrBuf sb = {0};
+    sb_printf(&sb, "{\"execute\": \"guest-file-open\", \"arguments\": {\"path\": ");
+    json_write_string(&sb, path);
+    sb_printf(&sb, ", \"mode\": \"%s\"}}", mode);
+    int failed = sb.data == NULL || qmp_execute(conn, sb.data, resp, sizeof(resp), QMP_TIMEOUT_MS) != 0 ||
+                 json_number_in(resp, NULL, "return", &value) != 0;
+    sb_free(&sb);
+    if (!failed) *handle = (int)value;
+    return failed;
+}
+
+void run_file_close(QMPConn *conn, int handle) {
+    char request[128];
+    char resp[256];
+    snprintf(request, sizeof(request), "{\"execute\": \"guest-file-close\", \"arguments\": {\"handle\": %d}}", handle);
+    qmp_execute(conn, request, resp, sizeof(resp), QMP_TIMEOUT_MS);
+}
+
+// Copy the host file SRC to DEST in the guest
+int run_copy_in(QMPConn *conn, const char *src, const char *dest) {
+    TRACE_SCOPE("run_copy_in", src);
+    unsigned char chunk[RUN_CHUNK];
+    char resp[256];
+    int handle;
+    FILE *fp = fopen(src, "rb");
+    if (fp == NULL) {
+        return 1;
+    }
+    if (run_file_open(conn, dest, "w", &handle) != 0) {
+        fclose(fp);
+        return 1;
+    }
+    int failed = 0;
+    size_t n;
+    while (!failed && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        StrBuf sb = {0};
+        sb_printf(&sb, "{\"execute\": \"guest-file-write\", \"arguments\": {\"handle\": %d, \"buf-b64\": \"", handle);
+        base64_encode(chunk, n, &sb);
+        sb_printf(&sb, "\"}}");
+        failed = sb.data == NULL || qmp_execute(conn, sb.data, resp, sizeof(resp), QMP_TIMEOUT_MS) != 0;
+        sb_free(&sb);
+    }
+    failed |= ferror(fp);
+    fclose(fp);
+    run_file_close(conn, handle);
+    return failed;
+}
+
+// Forward whatever the guest file HANDLE has gained since the last call;
+// returns the byte count, -1 when the agent stops answering, or -2 when FD
+// is a pipe whose reader has gone.
+// qemu-ga reads with fread(), whose EOF is sticky (glibc 2.28 on): a seek to
+// where the file already is clears it, or nothing appended after the first
+// empty read would ever come back
+ssize_t run_drain(QMPConn *conn, int handle, int fd) {
+    char request[128];
+    char seek[160];
+    char *resp = malloc(QMP_BUF_SIZE);
+    unsigned char *data = malloc(RUN_CHUNK);
+    ssize_t total = 0;
+    snprintf(request, sizeof(request), "{\"execute\": \"guest-file-read\", \"arguments\": {\"handle\": %d, \"count\": %d}}",
+             handle, RUN_CHUNK);
+    snprintf(seek, sizeof(seek), "{\"execute\": \"guest-file-seek\", \"arguments\": {\"handle\": %d, \"offset\": 0, "
+             "\"whence\": \"cur\"}}", handle);
+    if (resp != NULL && qmp_execute(conn, seek, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0) {
+        total = -1;
+    }
+    while (resp != NULL && data != NULL && total >= 0) {
+        if (qmp_execute(conn, request, resp, QMP_BUF_SIZE, QMP_TIMEOUT_MS) != 0) {
+            total = -1;
+            break;
+        }
+        const char *buf = json_find_key(resp, NULL, "buf-b64");
+        ssize_t n = buf != NULL && *buf == '"' ? base64_decode(buf + 1, data, RUN_CHUNK) : 0;
+        if (n <= 0) break;
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(fd, data + written, n - written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && errno == EPIPE) total = -2;
+            if (w <= 0) break;
+            written += w;
+        }
+        if (total < 0) break;
+        total += n;
+        if (n < RUN_CHUNK) break;
+    }
+    free(resp);
+    free(data);
+    return total;
+}
+
+// Start ARGV in the guest with its output going to OUT_PATH and ERR_PATH
+int run_exec(QMPConn *conn, char **argv, int argc, const char *out_path, const char *err_path, int *pid) {
+    char resp[256];
+    char script[MAX_PATH * 3];
+    double value;
+    snprintf(script, sizeof(script), "cd %s && exec \"$@\" >%s 2>%s </dev/null", RUN_WORKDIR, out_path, err_path);
+    StrBuf sb = {0};
+    sb_printf(&sb, "{\"execute\": \"guest-exec\", \"arguments\": {\"path\": \"/bin/sh\", \"arg\": [\"-c\", ");
+    json_write_string(&sb, script);
+    sb_printf(&sb, ", \"sh\"");
+    for (int i = 0; i < argc; i++) {
+        sb_printf(&sb, ", ");
+        json_write_string(&sb, argv[i]);
+    }
+    sb_printf(&sb, "]}}");
+    int failed = sb.data == NULL || qmp_execute(conn, sb.data, resp, sizeof(resp), QMP_TIMEOUT_MS) != 0 ||
+                 json_number_in(resp, NULL, "pid", &value) != 0;
+    sb_free(&sb);
+    if (!failed) *pid = (int)value;
+    return failed;
+}
+
+// 1 once guest process PID has exited (STATUS is its exit code, or 128 +
+// signal), 0 while it runs, -1 if the agent does not answer
+int run_exec_status(QMPConn *conn, int pid, int *status) {
+    char request[128];
+    char resp[1024];
+    double value;
+    snprintf(request, sizeof(request), "{\"execute\": \"guest-exec-status\", \"arguments\": {\"pid\": %d}}", pid);
+    if (qmp_execute(conn, request, resp, sizeof(resp), QMP_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    const char *exited = json_find_key(resp, NULL, "exited");
+    if (exited == NULL || strncmp(exited, "true", 4) != 0) {
+        return 0;
+    }
+    if (json_number_in(resp, NULL, "signal", &value) == 0) {
+        *status = 128 + (int)value;
+    } else {
+        *status = json_number_in(resp, NULL, "exitcode", &value) == 0 ? (int)value : 1;
+    }
+    return 1;
+}
+
+// for_each_vm visitor over the warm pool of claim->distro: counts idle VMs,
+// or with claim->take set, claims the first one it can
+int run_claim_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    RunClaim *claim = ctx;
+    VMInfo info;
+    char marker[MAX_PATH + 16];
+    if (strncmp(vm_name, RUN_WARM_PREFIX, strlen(RUN_WARM_PREFIX)) != 0 ||
+        load_vm_info(vm_dir, &info) != 0 || strcmp(info.distro, claim->distro) != 0 ||
+        read_vm_pid(vm_dir) <= 0) {
+        return 0;
+    }
+    snprintf(marker, sizeof(marker), "%s/claimed", vm_dir);
+    if (!claim->take) {
+        if (!dir_exists(marker)) claim->idle++;
+        return 0;
+    }
+    if (mkdir(marker, 0700) != 0) {
+        return 0;
+    }
+    snprintf(claim->name, sizeof(claim->name), "%s", vm_name);
+    snprintf(claim->vm_dir, sizeof(claim->vm_dir), "%s", vm_dir);
+    return 1;
+}
+
+// Create and start an ephemeral snapshot VM; the guest is still booting
+int run_vm_create(const char *vm_name, const char *distro) {
+    char password[64];
+    char vm_mac[18];
+    char vm_dir[MAX_PATH];
+    generate_password(password, sizeof(password));
+    create_ephemeral = 1;
+    create_snapshot = 1;
+    if (provision_vm(vm_name, distro, DEFAULT_USER, password, vm_mac, sizeof(vm_mac)) != 0) {
+        return 1;
+    }
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    if (spawn_vm(vm_name, vm_mac, vm_dir) != 0) {
+        vm_destroy(vm_name);
+        return 1;
+    }
+    return 0;
+}
+
+void run_vm_discard(const char *vm_name, const char *vm_dir) {
+    StopTarget target;
+    memset(&target, 0, sizeof(target));
+    snprintf(target.name, sizeof(target.name), "%s", vm_name);
+    snprintf(target.vm_dir, sizeof(target.vm_dir), "%s", vm_dir);
+    stop_vms(&target, 1, 0, STOP_QUIT_TIMEOUT);
+    vm_destroy(vm_name);
+}
+
+// Top the warm pool of DISTRO up to COUNT idle VMs and wait until their
+// guest agents answer
+int run_prewarm(const char *distro, int count) {
+    char message[MAX_LINE];
+    char names[RUN_MAX_WARM][MAX_NAME];
+    int started = 0;
+    RunClaim claim;
+    memset(&claim, 0, sizeof(claim));
+    claim.distro = distro;
+    for_each_vm(run_claim_visit, &claim);
+    if (count > RUN_MAX_WARM) count = RUN_MAX_WARM;
+    
+    for (int n = 0; claim.idle + started < count && n < 1000; n++) {
+        char wanted[MAX_NAME];
+        char vm_dir[MAX_PATH];
+        snprintf(wanted, sizeof(wanted), "%s%s-%d", RUN_WARM_PREFIX, distro, n);
+        sanitize_vm_name(wanted, names[started], sizeof(names[started]));
+        vm_dir_path(names[started], vm_dir, sizeof(vm_dir));
+        if (dir_exists(vm_dir)) continue;
+        if (run_vm_create(names[started], distro) != 0) {
+            return 1;
+        }
+        started++;
+    }
+    
+    int failed = 0;
+    double deadline = now_monotonic() + RUN_AGENT_TIMEOUT;
+    for (int i = 0; i < started; i++) {
+        char vm_dir[MAX_PATH];
+        char vm_name[MAX_NAME];
+        QMPConn conn;
+        memcpy(vm_name, names[i], sizeof(vm_name));
+        vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+        if (run_agent_connect(vm_dir, &conn, deadline) != 0) {
+            snprintf(message, sizeof(message), "%s: the guest agent never answered", vm_name);
+            log_warning(message);
+            run_vm_discard(vm_name, vm_dir);
+            failed++;
+            continue;
+        }
+        qmp_close(&conn);
+    }
+    snprintf(message, sizeof(message), "Warm pool for %s: %d idle VM(s)", distro, claim.idle + started - failed);
+    log_success(message);
+    return failed ? 1 : 0;
+}
+
+// Copy the inputs in, run ARGV and stream its output; returns the exit
+// status to report
+int run_in_vm(QMPConn *conn, const char **copies, int copy_count, char **argv, int argc, double timeout, int out_fd) {
+    char message[MAX_LINE];
+    for (int c = 0; c < copy_count; c++) {
+        char src[MAX_PATH];
+        char dest[MAX_PATH + sizeof(RUN_WORKDIR)];
+        snprintf(src, sizeof(src), "%s", copies[c]);
+        char *colon = strchr(src, ':');
+        if (colon) {
+            *colon = '\0';
+            snprintf(dest, sizeof(dest), "%s", colon + 1);
+        } else {
+            const char *slash = strrchr(src, '/');
+            snprintf(dest, sizeof(dest), "%s/%s", RUN_WORKDIR, slash ? slash + 1 : src);
+        }
+        if (run_copy_in(conn, src, dest) != 0) {
+            snprintf(message, sizeof(message), "Failed to copy %s into the VM", src);
+            log_error(message);
+            return 1;
+        }
+    }
+    
+    // The output files exist before the command does, so they can be held
+    // open and read from while it writes
+    char out_path[MAX_PATH], err_path[MAX_PATH];
+    int out_handle, err_handle, pid;
+    snprintf(out_path, sizeof(out_path), "%s/.v4m-run-%d.out", RUN_WORKDIR, (int)getpid());
+    snprintf(err_path, sizeof(err_path), "%s/.v4m-run-%d.err", RUN_WORKDIR, (int)getpid());
+    if (run_copy_in(conn, "/dev/null", out_path) != 0 || run_copy_in(conn, "/dev/null", err_path) != 0 ||
+        run_file_open(conn, out_path, "r", &out_handle) != 0 || run_file_open(conn, err_path, "r", &err_handle) != 0) {
+        log_error("Failed to set up the command output in the VM");
+        return 1;
+    }
+    if (run_exec(conn, argv, argc, out_path, err_path, &pid) != 0) {
+        log_error("Failed to start the command in the VM");
+        return 1;
+    }
+    
+    int status = 1;
+    int exited = 0;
+    double deadline = timeout > 0 ? now_monotonic() + timeout : 0;
+    while (!run_interrupted) {
+        ssize_t out = run_drain(conn, out_handle, out_fd);
+        ssize_t err = out == -2 ? 0 : run_drain(conn, err_handle, STDERR_FILENO);
+        // Whoever reads the output has gone (`v4m run ... | head`): end the
+        // way a local command would, by SIGPIPE
+        if (out == -2 || err == -2) {
+            return 128 + SIGPIPE;
+        }
+        if (out < 0 || err < 0) {
+            log_error("Lost the guest agent");
+            return 1;
+        }
+        // One more drain after the exit picks up the tail
+        if (exited && out == 0 && err == 0) break;
+        if (!exited && (exited = run_exec_status(conn, pid, &status)) < 0) {
+            log_error("Lost the guest agent");
+            return 1;
+        }
+        if (!exited && deadline > 0 && now_monotonic() >= deadline) {
+            snprintf(message, sizeof(message), "Command timed out after %.0fs", timeout);
+            log_error(message);
+            return 124;
+        }
+        if (!exited && out == 0 && err == 0) usleep(RUN_POLL_MS * 1000);
+    }
+    run_file_close(conn, out_handle);
+    run_file_close(conn, err_handle);
+    return run_interrupted ? 130 : status;
+}
+
+// v4m run [--distro D] [--copy SRC[:DEST]]... [--timeout SEC] -- CMD [ARGS...]
+// v4m run --prewarm N [--distro D]
+int oneshot_command(int argc, char *argv[]) {
+    const char *distro = DEFAULT_DISTRO;
+    const char *copies[RUN_MAX_COPIES];
+    int copy_count = 0;
+    int prewarm = -1;
+    double timeout = 0;
+    char message[MAX_LINE];
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--distro") == 0 && i + 1 < argc) {
+            distro = argv[++i];
+        } else if (strcmp(argv[i], "--copy") == 0 && i + 1 < argc) {
+            if (copy_count == RUN_MAX_COPIES) {
+                snprintf(message, sizeof(message), "At most %d --copy options", RUN_MAX_COPIES);
+                log_error(message);
+                return 1;
+            }
+            copies[copy_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &prewarm) != 0) {
+                log_error("Invalid --prewarm (a positive number)");
+                return 1;
+            }
+        } else {
+            break;
+        }
+    }
+    if (prewarm < 0 && i >= argc) {
+        log_error("Usage: v4m run [--distro D] [--copy SRC[:DEST]] [--timeout SEC] -- CMD [ARGS...]");
+        return 1;
+    }
+    init_dirs();
+    if (prewarm >= 0) {
+        return run_prewarm(distro, prewarm);
+    }
+    
+    // Progress goes to stderr; stdout is kept for the command's own output
+    fflush(stdout);
+    int out_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    signal(SIGINT, run_handle_signal);
+    signal(SIGTERM, run_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    double started = now_monotonic();
+    RunClaim claim;
+    memset(&claim, 0, sizeof(claim));
+    claim.distro = distro;
+    claim.take = 1;
+    for_each_vm(run_claim_visit, &claim);
+    int warm = claim.name[0] != '\0';
+    if (!warm) {
+        snprintf(claim.name, sizeof(claim.name), "run-%d", (int)getpid());
+        vm_dir_path(claim.name, claim.vm_dir, sizeof(claim.vm_dir));
+        if (run_vm_create(claim.name, distro) != 0) {
+            close(out_fd);
+            return 1;
+        }
+    }
+    
+    QMPConn conn;
+    int status = 1;
+    double ready = 0;
+    if (run_agent_connect(claim.vm_dir, &conn, now_monotonic() + RUN_AGENT_TIMEOUT) != 0) {
+        log_error(run_interrupted ? "Interrupted" : "The guest agent never answered");
+    } else {
+        ready = now_monotonic() - started;
+        status = run_in_vm(&conn, copies, copy_count, argv + i, argc - i, timeout, out_fd);
+        qmp_close(&conn);
+    }
+    close(out_fd);
+    double teardown_start = now_monotonic();
+    run_vm_discard(claim.name, claim.vm_dir);
+    snprintf(message, sizeof(message), "%s VM ready in %.2fs, teardown %.2fs; exit status %d",
+             warm ? "Warm" : "Cold", ready, now_monotonic() - teardown_start, status);
+    log_info(message);
+    return status;
+}
+
+// Fleets: `v4m apply FILE` converges the VMs on this host to a fleet file.
+// A VM belongs to the fleet named in its vm-info.json; VMs of the fleet
+// that the file no longer lists are deleted with --prune (and only
+// reported without it), other VMs are never touched (a listed name that
+// already exists outside any fleet is adopted). Recreating a VM for a new
+// distro is a delete too and also needs --prune. Every
+// VM needing work gets one converge action, run in a forked worker with
+// its output in ~/.v4m/apply/<name>.log, at most --parallel at a time. A
+// VM's action starts once those of the VMs it comes after have finished,
+// so the waves of the plan overlap rather than wait on each other; boots
+// still go through the global boot queue.
+//
+// File format, one VM per line ('#' comments, blank lines ignored):
+//   fleet <name>                    required; VMs are owned by this name,
+//                                   not by the file's path
+//   <vm> [key=value ...]            distro, memory (MB or 4G), cpus, disk,
+//                                   pool, network, autostart=on|off,
+//                                   state=running|stopped, after=vm1,vm2
+const char *fleet_action_names[] = {"none", "create", "update", "replace", "delete", "conflict"};
+
+// Memory is MB when given as a bare number, else a size
+int fleet_parse_memory(const char *text, int *memory_mb) {
+    uint64_t bytes;
+    size_t len = strlen(text);
+    if (len > 0 && isdigit((unsigned char)text[len - 1])) {
+        *memory_mb = atoi(text);
+        return *memory_mb > 0 ? 0 : 1;
+    }
+    if (parse_size(text, &bytes) != 0 || bytes < 1024 * 1024) {
+        return 1;
+    }
+    *memory_mb = (int)(bytes / (1024 * 1024));
+    return 0;
+}
+
+int fleet_parse(const char *text, const char *source, Fleet *fleet) {
+    char message[MAX_LINE];
+    int line_number = 0;
+    for (const char *line = text; line && *line; ) {
+        const char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        char buf[MAX_LINE];
+        if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        line = end ? end + 1 : NULL;
+        line_number++;
+    
+        char *save;
+        char *token = strtok_r(buf, " \t\r", &save);
+        if (token == NULL || token[0] == '#') continue;
+        if (strcmp(token, "fleet") == 0) {
+            token = strtok_r(NULL, " \t\r", &save);
+            if (token == NULL || !name_is_safe(token)) {
+                snprintf(message, sizeof(message), "%s:%d: invalid fleet name", source, line_number);
+                log_error(message);
+                return 1;
+            }
+            snprintf(fleet->name, sizeof(fleet->name), "%s", token);
+            continue;
+        }
+    
+        char sanitized[MAX_NAME];
+        sanitize_vm_name(token, sanitized, sizeof(sanitized));
+        if (sanitized[0] == '\0' || strcmp(sanitized, token) != 0) {
+            snprintf(message, sizeof(message), "%s:%d: invalid VM name '%s'", source, line_number, token);
+            log_error(message);
+            return 1;
+        }
+        if (fleet_find(fleet, token) >= 0) {
+            snprintf(message, sizeof(message), "%s:%d: VM '%s' listed twice", source, line_number, token);
+            log_error(message);
+            return 1;
+        }
+        if (fleet->count == FLEET_MAX_VMS) {
+            snprintf(message, sizeof(message), "%s:%d: more than %d VMs", source, line_number, FLEET_MAX_VMS);
+            log_error(message);
+            return 1;
+        }
+        FleetVM *vm = &fleet->vms[fleet->count++];
+        memset(vm, 0, sizeof(*vm));
+        snprintf(vm->name, sizeof(vm->name), "%s", token);
+        snprintf(vm->distro, sizeof(vm->distro), "%s", DEFAULT_DISTRO);
+        snprintf(vm->disk_size, sizeof(vm->disk_size), "%s", DEFAULT_DISK_SIZE);
+        snprintf(vm->network, sizeof(vm->network), "%s", DEFAULT_NETWORK);
+        vm->memory_mb = atoi(DEFAULT_MEMORY);
+        vm->cpus = atoi(DEFAULT_CPUS);
+        vm->running = 1;
+        vm->pid = -1;
+    
+        while ((token = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            char *value = strchr(token, '=');
+            uint64_t bytes;
+            int bad = value == NULL;
+            if (!bad) {
+                *value++ = '\0';
+                if (strcmp(token, "distro") == 0) {
+                    snprintf(vm->distro, sizeof(vm->distro), "%s", value);
+                } else if (strcmp(token, "memory") == 0) {
+                    bad = fleet_parse_memory(value, &vm->memory_mb);
+                } else if (strcmp(token, "cpus") == 0) {
+                    bad = (vm->cpus = atoi(value)) <= 0;
+                } else if (strcmp(token, "disk") == 0) {
+                    bad = parse_size(value, &bytes) != 0;
+                    snprintf(vm->disk_size, sizeof(vm->disk_size), "%s", value);
+                } else if (strcmp(token, "pool") == 0) {
+                    snprintf(vm->pool, sizeof(vm->pool), "%s", value);
+                } else if (strcmp(token, "network") == 0) {
+                    bad = strcmp(value, "bridged") != 0 && strncmp(value, "bridged:", 8) != 0 &&
+                          strcmp(value, "shared") != 0 && strcmp(value, "user") != 0;
+                    snprintf(vm->network, sizeof(vm->network), "%s", value);
+                } else if (strcmp(token, "autostart") == 0) {
+                    bad = strcmp(value, "on") != 0 && strcmp(value, "off") != 0;
+                    vm->autostart = strcmp(value, "on") == 0;
+                } else if (strcmp(token, "state") == 0) {
+                    bad = strcmp(value, "running") != 0 && strcmp(value, "stopped") != 0;
+                    vm->running = strcmp(value, "running") == 0;
+                } else if (strcmp(token, "after") == 0) {
+                    snprintf(vm->after, sizeof(vm->after), "%s", value);
+                } else {
+                    bad = 1;
+                }
+            }
+            if (bad) {
+                snprintf(message, sizeof(message), "%s:%d: bad setting '%s%s%s' for %s", source, line_number,
+                         token, value ? "=" : "", value ? value : "", vm->name);
+                log_error(message);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int fleet_find(const Fleet *fleet, const char *name) {
+    for (int i = 0; i < fleet->count; i++) {
+        if (strcmp(fleet->vms[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Call FN for every fleet VM that VM must wait for; a nonzero return stops
+int fleet_each_dependency(Fleet *fleet, FleetVM *vm, int (*fn)(Fleet *fleet, FleetVM *vm, FleetVM *dep)) {
+    char after[MAX_LINE];
+    char *save;
+    snprintf(after, sizeof(after), "%s", vm->after);
+    for (char *name = strtok_r(after, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        int index = fleet_find(fleet, name);
+        if (index >= 0 && fn(fleet, vm, &fleet->vms[index]) != 0) return 1;
+    }
+    return 0;
+}
+
+int fleet_wave_visit(Fleet *fleet, FleetVM *vm, FleetVM *dep) {
+    (void)fleet;
+    if (dep->wave + 1 > vm->wave) vm->wave = dep->wave + 1;
+    return 0;
+}
+
+// Wave = 1 + the deepest chain of "after" below the VM. More passes than
+// VMs without settling means there is a cycle
+int fleet_waves(Fleet *fleet) {
+    char message[MAX_LINE];
+    for (int i = 0; i < fleet->count; i++) {
+        char after[MAX_LINE];
+        char *save;
+        snprintf(after, sizeof(after), "%s", fleet->vms[i].after);
+        for (char *name = strtok_r(after, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            char vm_dir[MAX_PATH];
+            vm_dir_path(name, vm_dir, sizeof(vm_dir));
+            if (fleet_find(fleet, name) < 0 && !dir_exists(vm_dir)) {
+                snprintf(message, sizeof(message), "%s comes after '%s', which is neither in the fleet nor an existing VM",
+                         fleet->vms[i].name, name);
+                log_error(message);
+                return 1;
+            }
+        }
+        fleet->vms[i].wave = 1;
+    }
+    for (int pass = 0; pass <= fleet->count; pass++) {
+        int changed = 0;
+        for (int i = 0; i < fleet->count; i++) {
+            int before = fleet->vms[i].wave;
+            fleet_each_dependency(fleet, &fleet->vms[i], fleet_wave_visit);
+            changed |= fleet->vms[i].wave != before;
+        }
+        if (!changed) return 0;
+    }
+    log_error("The fleet's 'after' dependencies form a cycle");
+    return 1;
+}
+
+void fleet_note(FleetVM *vm, const char *fmt, ...) {
+    char change[MAX_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(change, sizeof(change), fmt, ap);
+    va_end(ap);
+    size_t len = strlen(vm->changes);
+    snprintf(vm->changes + len, sizeof(vm->changes) - len, "%s%s", len ? ", " : "", change);
+}
+
+// Compare one VM with what is on disk and decide its action
+void fleet_plan_vm(Fleet *fleet, FleetVM *vm) {
+    char vm_dir[MAX_PATH];
+    VMInfo info;
+    vm_dir_path(vm->name, vm_dir, sizeof(vm_dir));
+    vm->changes[0] = '\0';
+    vm->restart = 0;
+    if (load_vm_info(vm_dir, &info) != 0) {
+        vm->action = FLEET_CREATE;
+        fleet_note(vm, "%s, %dMB, %d CPU(s), %s disk", vm->distro, vm->memory_mb, vm->cpus, vm->disk_size);
+        if (vm->pool[0]) fleet_note(vm, "pool %s", vm->pool);
+        if (strcmp(vm->network, DEFAULT_NETWORK) != 0) fleet_note(vm, "network %s", vm->network);
+        if (!vm->running) fleet_note(vm, "left stopped");
+        return;
+    }
+    
+    int owned = strcmp(info.fleet, fleet->name) == 0;
+    vm->was_running = read_vm_pid(vm_dir) > 0;
+    if (info.fleet[0] && !owned) {
+        vm->action = FLEET_CONFLICT;
+        fleet_note(vm, "belongs to fleet '%s'", info.fleet);
+        return;
+    }
+    if (strcmp(info.distro, vm->distro) != 0) {
+        vm->action = owned && fleet->prune ? FLEET_REPLACE : FLEET_CONFLICT;
+        fleet_note(vm, !owned ? "is %s, not %s; delete it to let the fleet create it" :
+                   fleet->prune ? "distro %s -> %s (recreated)" : "distro %s -> %s recreates it; apply with --prune",
+                   info.distro, vm->distro);
+        return;
+    }
+    
+    // Notes that change nothing (a smaller disk) do not make an update
+    int needed = 0;
+    if (!owned) {
+        fleet_note(vm, "adopted");
+        needed++;
+    }
+    if (info.memory_mb != vm->memory_mb) {
+        fleet_note(vm, "memory %d -> %dMB", info.memory_mb, vm->memory_mb);
+        vm->restart = 1;
+        needed++;
+    }
+    if (info.cpus != vm->cpus) {
+        fleet_note(vm, "cpus %d -> %d", info.cpus, vm->cpus);
+        vm->restart = 1;
+        needed++;
+    }
+    if (strcmp(info.network, vm->network) != 0) {
+        fleet_note(vm, "network %s -> %s", info.network, vm->network);
+        vm->restart = 1;
+        needed++;
+    }
+    uint64_t have = 0, want = 0;
+    parse_size(info.disk_size, &have);
+    parse_size(vm->disk_size, &want);
+    if (want > have) {
+        fleet_note(vm, "disk %s -> %s", info.disk_size, vm->disk_size);
+        vm->restart = 1;
+        needed++;
+    } else if (want < have) {
+        fleet_note(vm, "disk stays %s (disks are never shrunk)", info.disk_size);
+    }
+    if (vm->pool[0] && strcmp(info.pool, vm->pool) != 0) {
+        fleet_note(vm, "pool %s -> %s", info.pool, vm->pool);
+        needed++;
+    }
+    if (info.autostart != vm->autostart) {
+        fleet_note(vm, "autostart %s", vm->autostart ? "on" : "off");
+        needed++;
+    }
+    if (vm->running && !vm->was_running) {
+        fleet_note(vm, "start");
+        needed++;
+    } else if (!vm->running && vm->was_running) {
+        fleet_note(vm, "stop");
+        needed++;
+    } else if (vm->restart && vm->was_running) {
+        fleet_note(vm, "restart");
+    }
+    vm->action = needed ? FLEET_UPDATE : FLEET_NONE;
+}
+
+// VMs of this fleet that the file no longer lists; deleted only with --prune
+int fleet_orphan_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    Fleet *fleet = ctx;
+    VMInfo info;
+    if (fleet_find(fleet, vm_name) >= 0 || load_vm_info(vm_dir, &info) != 0 ||
+        strcmp(info.fleet, fleet->name) != 0 || fleet->count == FLEET_MAX_VMS) {
+        return 0;
+    }
+    if (!fleet->prune) {
+        char message[MAX_LINE];
+        snprintf(message, sizeof(message), "VM '%s' is no longer in fleet '%s'; kept (apply with --prune to delete it)",
+                 vm_name, fleet->name);
+        log_warning(message);
+        return 0;
+    }
+    FleetVM *vm = &fleet->vms[fleet->count++];
+    memset(vm, 0, sizeof(*vm));
+    snprintf(vm->name, sizeof(vm->name), "%s", vm_name);
+    snprintf(vm->distro, sizeof(vm->distro), "%s", info.distro);
+    vm->action = FLEET_DELETE;
+    vm->wave = 1;
+    vm->pid = -1;
+    vm->was_running = read_vm_pid(vm_dir) > 0;
+    snprintf(vm->changes, sizeof(vm->changes), "no longer in the fleet");
+    return 0;
+}
+
+// Mean of a lifecycle op from the host's own history, else FALLBACK
+double fleet_estimate_op(const LifecycleStats *stats, const char *op, double fallback) {
+    for (int i = 0; i < LIFECYCLE_OPS; i++) {
+        if (strcmp(lifecycle_ops[i], op) == 0 && stats->total[i] > 0) {
+            return stats->sum[i] / stats->total[i];
+        }
+    }
+    return fallback;
+}
+
+void fleet_estimate(Fleet *fleet) {
+    LifecycleStats stats;
+    memset(&stats, 0, sizeof(stats));
+    lifecycle_stats_update(&stats);
+    double create = fleet_estimate_op(&stats, "create", FLEET_EST_CREATE);
+    double boot = fleet_estimate_op(&stats, "start", 1) + fleet_estimate_op(&stats, "ready", FLEET_EST_BOOT);
+    double stop = fleet_estimate_op(&stats, "stop", FLEET_EST_STOP);
+    for (int i = 0; i < fleet->count; i++) {
+        FleetVM *vm = &fleet->vms[i];
+        int stopping = vm->was_running && (!vm->running || vm->restart || vm->action != FLEET_UPDATE);
+        int starting = vm->running && (!vm->was_running || vm->restart);
+        vm->estimate = 0;
+        if (vm->action == FLEET_NONE || vm->action == FLEET_CONFLICT) continue;
+        if (vm->action == FLEET_DELETE) {
+            vm->estimate = vm->was_running ? stop : 0.1;
+            continue;
+        }
+        if (vm->action == FLEET_CREATE || vm->action == FLEET_REPLACE) {
+            vm->estimate = create;
+            starting = vm->running;
+        }
+        if (stopping) vm->estimate += stop;
+        if (starting) vm->estimate += boot;
+    }
+}
+
+int fleet_dependency_pending(Fleet *fleet, FleetVM *vm, FleetVM *dep) {
+    (void)fleet;
+    (void)vm;
+    return dep->status != FLEET_DONE;
+}
+
+int fleet_dependency_failed(Fleet *fleet, FleetVM *vm, FleetVM *dep) {
+    (void)fleet;
+    (void)vm;
+    return dep->status == FLEET_FAILED || dep->status == FLEET_SKIPPED;
+}
+
+// Everything the VM's line asks for, in one pass: the order keeps each
+// step valid (stop before a disk resize, start last)
+int fleet_converge(const char *fleet_name, FleetVM *vm) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    VMInfo info;
+    vm_dir_path(vm->name, vm_dir, sizeof(vm_dir));
+    
+    int running = vm_is_active(vm_dir);
+    if (running && (vm->action != FLEET_UPDATE || !vm->running || vm->restart)) {
+        StopTarget target;
+        memset(&target, 0, sizeof(target));
+        snprintf(target.name, sizeof(target.name), "%s", vm->name);
+        snprintf(target.vm_dir, sizeof(target.vm_dir), "%s", vm_dir);
+        if (stop_vms(&target, 1, STOP_POWERDOWN_TIMEOUT, STOP_QUIT_TIMEOUT) != 0) {
+            log_error("VM did not stop");
+            return 1;
+        }
+        running = 0;
+    }
+    if (vm->action == FLEET_DELETE || vm->action == FLEET_REPLACE) {
+        if (vm_destroy(vm->name) != 0) {
+            log_error("Failed to delete the VM");
+            return 1;
+        }
+        if (vm->action == FLEET_DELETE) {
+            return 0;
+        }
+    }
+    
+    if (vm->action != FLEET_UPDATE) {
+        char password[64];
+        char vm_mac[18];
+        generate_password(password, sizeof(password));
+        snprintf(create_pool, sizeof(create_pool), "%s", vm->pool);
+        if (provision_vm(vm->name, vm->distro, DEFAULT_USER, password, vm_mac, sizeof(vm_mac)) != 0) {
+            return 1;
+        }
+    }
+    if (load_vm_info(vm_dir, &info) != 0) {
+        log_error("Failed to read VM info");
+        return 1;
+    }
+    if (vm->pool[0] && strcmp(info.pool, vm->pool) != 0) {
+        char *move_argv[] = {"move", vm->name, "--pool", vm->pool, NULL};
+        if (vm_move_command(4, move_argv) != 0 || load_vm_info(vm_dir, &info) != 0) {
+            return 1;
+        }
+    }
+    
+    uint64_t have = 0, want = 0;
+    parse_size(info.disk_size, &have);
+    parse_size(vm->disk_size, &want);
+    if (want > have) {
+        char disk[MAX_PATH];
+        char command[MAX_PATH * 2];
+        vm_disk_real_path(vm_dir, disk, sizeof(disk));
+        snprintf(command, sizeof(command), "qemu-img resize -f %s \"%s\" %s >/dev/null", info.disk_format, disk, vm->disk_size);
+        if (run_command(command) != 0) {
+            log_error("Failed to resize disk");
+            return 1;
+        }
+        snprintf(info.disk_size, sizeof(info.disk_size), "%s", vm->disk_size);
+    }
+    info.memory_mb = vm->memory_mb;
+    info.cpus = vm->cpus;
+    info.autostart = vm->autostart;
+    snprintf(info.network, sizeof(info.network), "%s", vm->network);
+    snprintf(info.fleet, sizeof(info.fleet), "%s", fleet_name);
+    if (save_vm_info(vm_dir, &info) != 0) {
+        log_error("Failed to write VM info");
+        return 1;
+    }
+    
+    if (vm->running && !running) {
+        return start_vm(vm->name, info.mac, vm_dir);
+    }
+    snprintf(message, sizeof(message), "VM '%s' converged", vm->name);
+    log_success(message);
+    return 0;
+}
+
+// Fork a worker for VM with its output going to ~/.v4m/apply/<name>.log
+pid_t fleet_spawn(const char *fleet_name, FleetVM *vm) {
+    char log_path[MAX_PATH];
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/apply", getenv("HOME"));
+    mkdir(log_path, 0755);
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/apply/%s.log", getenv("HOME"), vm->name);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+    }
+    int result = fleet_converge(fleet_name, vm);
+    fflush(stdout);
+    _exit(result == 0 ? 0 : 1);
+}
+
+// Run every action, each as soon as what it comes after is done and a
+// worker is free. With SIMULATE nothing is forked: the estimates stand in
+// for the work and the return value is the predicted wall time
+double fleet_run(Fleet *fleet, int parallel, int simulate) {
+    char message[MAX_LINE];
+    double clock = 0;
+    double started = now_monotonic();
+    int active = 0;
+    for (int i = 0; i < fleet->count; i++) {
+        FleetVM *vm = &fleet->vms[i];
+        vm->status = vm->action == FLEET_NONE || vm->action == FLEET_CONFLICT ? FLEET_DONE : FLEET_PENDING;
+    }
+    
+    for (;;) {
+        // Start what is ready, lowest wave first
+        for (int wave = 1; wave <= fleet->count && active < parallel; wave++) {
+            for (int i = 0; i < fleet->count && active < parallel; i++) {
+                FleetVM *vm = &fleet->vms[i];
+                if (vm->status != FLEET_PENDING || vm->wave != wave) continue;
+                if (fleet_each_dependency(fleet, vm, fleet_dependency_failed)) {
+                    vm->status = FLEET_SKIPPED;
+                    if (!simulate) {
+                        snprintf(message, sizeof(message), "  %-15s skipped: something it comes after failed", vm->name);
+                        log_warning(message);
+                    }
+                    continue;
+                }
+                if (fleet_each_dependency(fleet, vm, fleet_dependency_pending)) continue;
+                vm->started = simulate ? clock : now_monotonic() - started;
+                vm->pid = simulate ? 0 : fleet_spawn(fleet->name, vm);
+                vm->status = vm->pid < 0 ? FLEET_FAILED : FLEET_RUNNING;
+                if (vm->pid >= 0) active++;
+            }
+        }
+        if (active == 0) break;
+    
+        // Wait for the next action to finish
+        FleetVM *done = NULL;
+        int status = 0;
+        if (simulate) {
+            for (int i = 0; i < fleet->count; i++) {
+                FleetVM *vm = &fleet->vms[i];
+                if (vm->status != FLEET_RUNNING) continue;
+                if (done == NULL || vm->started + vm->estimate < done->started + done->estimate) done = vm;
+            }
+            clock = done->started + done->estimate;
+        } else {
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid < 0 && errno == EINTR) continue;
+            if (pid < 0) break;
+            for (int i = 0; i < fleet->count; i++) {
+                if (fleet->vms[i].status == FLEET_RUNNING && fleet->vms[i].pid == pid) done = &fleet->vms[i];
+            }
+            if (done == NULL) continue;
+        }
+        active--;
+        done->status = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? FLEET_DONE : FLEET_FAILED;
+        if (!simulate) {
+            double took = now_monotonic() - started - done->started;
+            if (done->status == FLEET_DONE) {
+                snprintf(message, sizeof(message), "  %-15s %s done in %.1fs", done->name, fleet_action_names[done->action], took);
+                log_success(message);
+            } else {
+                snprintf(message, sizeof(message), "  %-15s %s failed after %.1fs (see ~/.v4m/apply/%s.log)",
+                         done->name, fleet_action_names[done->action], took, done->name);
+                log_error(message);
+            }
+        }
+    }
+    return simulate ? clock : now_monotonic() - started;
+}
+
+void fleet_print_plan(const Fleet *fleet) {
+    printf("\n%-5s %-9s %-15s %s\n", "WAVE", "ACTION", "VM", "CHANGES");
+    printf("%-5s %-9s %-15s %s\n", "----", "------", "--", "-------");
+    for (int wave = 1; wave <= fleet->count; wave++) {
+        for (int i = 0; i < fleet->count; i++) {
+            const FleetVM *vm = &fleet->vms[i];
+            if (vm->wave != wave || vm->action == FLEET_NONE) continue;
+            const char *color = vm->action == FLEET_CREATE ? GREEN : vm->action == FLEET_UPDATE ? YELLOW : RED;
+            printf("%-5d %s%-9s" NC " %-15s %s\n", vm->wave, color, fleet_action_names[vm->action], vm->name, vm->changes);
+        }
+    }
+    printf("\n");
+}
+
+// apply FILE [--dry-run] [--parallel N] [--prune]
+int apply_command(int argc, char *argv[]) {
+    const char *path = NULL;
+    int dry_run = 0;
+    int parallel = FLEET_DEFAULT_PARALLEL;
+    int prune = 0;
+    char message[MAX_LINE];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        } else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+            parallel = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prune") == 0) {
+            prune = 1;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            snprintf(message, sizeof(message), "Unknown option: %s", argv[i]);
+            log_error(message);
+            return 1;
+        }
+    }
+    if (path == NULL || parallel < 1) {
+        log_error("Usage: v4m apply <fleet-file> [--dry-run] [--parallel N] [--prune]");
+        return 1;
+    }
+    if (!dry_run && check_root() != 0) {
+        return 1;
+    }
+    init_dirs();
+    
+    char *text;
+    size_t len;
+    if (read_file(path, &text, &len) != 0) {
+        snprintf(message, sizeof(message), "Cannot read %s", path);
+        log_error(message);
+        return 1;
+    }
+    Fleet fleet;
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.vms = calloc(FLEET_MAX_VMS, sizeof(FleetVM));
+    fleet.prune = prune;
+    int failed = fleet.vms == NULL || fleet_parse(text, path, &fleet) != 0 || fleet_waves(&fleet) != 0;
+    free(text);
+    if (!failed && fleet.name[0] == '\0') {
+        // The file name is no identity: two directories can both hold a fleet.conf
+        snprintf(message, sizeof(message), "%s: no 'fleet <name>' line", path);
+        log_error(message);
+        failed = 1;
+    }
+    if (failed) {
+        free(fleet.vms);
+        return 1;
+    }
+    
+    for (int i = 0; i < fleet.count; i++) {
+        fleet_plan_vm(&fleet, &fleet.vms[i]);
+    }
+    for_each_vm(fleet_orphan_visit, &fleet);
+    fleet_estimate(&fleet);
+    
+    int counts[FLEET_CONFLICT + 1] = {0};
+    for (int i = 0; i < fleet.count; i++) {
+        counts[fleet.vms[i].action]++;
+    }
+    if (counts[FLEET_NONE] == fleet.count) {
+        snprintf(message, sizeof(message), "Fleet '%s' is up to date (%d VM(s))", fleet.name, fleet.count);
+        log_success(message);
+        free(fleet.vms);
+        return 0;
+    }
+    fleet_print_plan(&fleet);
+    double estimate = fleet_run(&fleet, parallel, 1);
+    snprintf(message, sizeof(message), "Plan for fleet '%s': %d to create, %d to update, %d to replace, %d to delete, "
+             "%d unchanged, %d in conflict; about %.0fs at --parallel %d",
+             fleet.name, counts[FLEET_CREATE], counts[FLEET_UPDATE], counts[FLEET_REPLACE], counts[FLEET_DELETE],
+             counts[FLEET_NONE], counts[FLEET_CONFLICT], estimate, parallel);
+    log_info(message);
+    if (dry_run) {
+        free(fleet.vms);
+        return 0;
+    }
+    
+    double took = fleet_run(&fleet, parallel, 0);
+    int bad = counts[FLEET_CONFLICT];
+    for (int i = 0; i < fleet.count; i++) {
+        if (fleet.vms[i].status == FLEET_FAILED || fleet.vms[i].status == FLEET_SKIPPED) bad++;
+    }
+    free(fleet.vms);
+    if (bad > 0) {
+        snprintf(message, sizeof(message), "Fleet '%s' applied in %.1fs with %d VM(s) not converged", fleet.name, took, bad);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Fleet '%s' applied in %.1fs", fleet.name, took);
+    log_success(message);
+    return 0;
+}
+
+// Events: lifecycle changes are pushed to subscribers instead of being
+// found by polling `vm list`. Every event is one JSON line in a journal
+// with a host-wide sequence number; `v4m events --listen` tails the journal
+// and streams it as NDJSON over a Unix socket. A subscriber that says
+// {"since": N} first gets every retained event after N, then the live
+// stream, so reconnecting loses nothing. A subscriber that cannot keep up
+// is disconnected rather than buffered for, and catches up the same way.
+// VM supervisors write the runtime events (starting, ready, ip-acquired,
+// paused, resumed, stopped, crashed) from QEMU's exit status, QMP events on
+// a second monitor and the guest agent; the CLI writes created and deleted.
+//   ~/.v4m/events.seq      last sequence number handed out
+//   ~/.v4m/events.log      the journal, rotated to events.log.1 at
+//                          EVENTS_LOG_MAX
+//   ~/.v4m/events.sock     default subscriber socket
+volatile sig_atomic_t events_stop = 0;
+
+void events_handle_signal(int sig) {
+    (void)sig;
+    events_stop = 1;
+}
+
+// Append one event for VM_NAME; EXTRA_FMT (may be NULL) formats further
+// fields, starting with ", ". Returns the sequence number, 0 on failure
+uint64_t event_record(const char *vm_name, const char *event, const char *extra_fmt, ...) {
+    char seq_path[MAX_PATH];
+    char log_path[MAX_PATH];
+    char rotated[MAX_PATH + 8];
+    char stamp[32];
+    char extra[MAX_LINE] = "";
+    struct timeval tv;
+    struct tm tm;
+    struct stat st;
+    StrBuf sb = {0};
+    snprintf(seq_path, sizeof(seq_path), "%s/.v4m/events.seq", getenv("HOME"));
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/events.log", getenv("HOME"));
+    snprintf(rotated, sizeof(rotated), "%s.1", log_path);
+    if (extra_fmt) {
+        va_list ap;
+        va_start(ap, extra_fmt);
+        vsnprintf(extra, sizeof(extra), extra_fmt, ap);
+        va_end(ap);
+    }
+    
+    // The sequence file's lock also orders the journal: numbers are handed
+    // out and appended under it, so the journal is always sorted by seq
+    int seq_fd = open(seq_path, O_RDWR | O_CREAT, 0644);
+    if (seq_fd < 0) {
+        return 0;
+    }
+    flock(seq_fd, LOCK_EX);
+    char number[32] = "";
+    ssize_t n = pread(seq_fd, number, sizeof(number) - 1, 0);
+    uint64_t seq = (n > 0 ? strtoull(number, NULL, 10) : 0) + 1;
+    int len = snprintf(number, sizeof(number), "%llu\n", (unsigned long long)seq);
+    
+    // The number is spent before the event is written: a crash in between
+    // leaves a gap in the journal, never two events with one number
+    if (ftruncate(seq_fd, 0) != 0 || pwrite(seq_fd, number, len, 0) != len) {
+        flock(seq_fd, LOCK_UN);
+        close(seq_fd);
+        return 0;
+    }
+    if (stat(log_path, &st) == 0 && st.st_size >= EVENTS_LOG_MAX) {
+        rename(log_path, rotated);
+    }
+    
+    gettimeofday(&tv, NULL);
+    gmtime_r(&tv.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    sb_printf(&sb, "{\"seq\": %llu, \"time\": \"%s.%03dZ\", \"vm\": ", (unsigned long long)seq, stamp,
+              (int)(tv.tv_usec / 1000));
+    json_write_string(&sb, vm_name);
+    sb_printf(&sb, ", \"event\": \"%s\"%s}\n", event, extra);
+    
+    // One O_APPEND write per event, as with the lifecycle log
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || write(fd, sb.data, sb.len) != (ssize_t)sb.len) {
+        seq = 0;
+    }
+    if (fd >= 0) close(fd);
+    flock(seq_fd, LOCK_UN);
+    close(seq_fd);
+    sb_free(&sb);
+    return seq;
+}
+
+uint64_t event_seq_of(const char *line) {
+    double seq = 0;
+    json_number_in(line, NULL, "seq", &seq);
+    return (uint64_t)seq;
+}
+
+// The first non-loopback IPv4 address the guest agent reports
+int event_guest_ip(const char *vm_dir, char *ip, size_t size) {
+    char sock_path[MAX_PATH + 16];
+    char *resp = malloc(QMP_BUF_SIZE);
+    QMPConn conn;
+    int found = 0;
+    snprintf(sock_path, sizeof(sock_path), "%s/qga.sock", vm_dir);
+    if (resp == NULL || qmp_open(&conn, sock_path, 0) != 0) {
+        free(resp);
+        return 1;
+    }
+    if (qmp_execute(&conn, "{\"execute\": \"guest-network-get-interfaces\"}", resp, QMP_BUF_SIZE,
+                    EVENTS_AGENT_TIMEOUT_MS) == 0) {
+        // Each address is its own flat object inside "ip-addresses"
+        const char *p = resp;
+        while (!found && (p = strstr(p, "\"ip-address\"")) != NULL) {
+            char address[64] = "";
+            char type[16] = "";
+            const char *start = p;
+            const char *end = strchr(p, '}');
+            while (start > resp && *start != '{') start--;
+            json_string_in(start, end, "ip-address", address, sizeof(address));
+            json_string_in(start, end, "ip-address-type", type, sizeof(type));
+            if (strcmp(type, "ipv4") == 0 && strncmp(address, "127.", 4) != 0) {
+                snprintf(ip, size, "%s", address);
+                found = 1;
+            }
+            p++;
+        }
+    }
+    qmp_close(&conn);
+    free(resp);
+    return found ? 0 : 1;
+}
+
+void event_watch_init(EventWatch *watch, const char *vm_dir) {
+    const char *slash = strrchr(vm_dir, '/');
+    memset(watch, 0, sizeof(*watch));
+    snprintf(watch->vm_name, sizeof(watch->vm_name), "%s", slash ? slash + 1 : vm_dir);
+    snprintf(watch->vm_dir, sizeof(watch->vm_dir), "%s", vm_dir);
+    snprintf(watch->events_sock, sizeof(watch->events_sock), "%s/events.sock", vm_dir);
+    boot_watch_init(&watch->boot, vm_dir);
+    watch->qmp.fd = -1;
+    watch->started = now_monotonic();
+}
+
+void event_watch_close(EventWatch *watch) {
+    if (watch->qmp.fd >= 0) qmp_close(&watch->qmp);
+}
+
+// One supervisor tick: wait up to TIMEOUT_MS for QEMU to exit (EXIT_FD, -1
+// if unavailable) or send a QMP event, then record whatever changed
+void event_watch_poll(EventWatch *watch, int exit_fd, int timeout_ms) {
+    double now = now_monotonic();
+    if (watch->qmp.fd < 0 && now >= watch->next_connect) {
+        // The events monitor appears once QEMU is up; older VMs never get one
+        qmp_open(&watch->qmp, watch->events_sock, 1);
+        watch->next_connect = now + 1;
+    }
+    
+    struct pollfd fds[2];
+    int nfds = 0;
+    if (exit_fd >= 0) {
+        fds[nfds].fd = exit_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    if (watch->qmp.fd >= 0) {
+        fds[nfds].fd = watch->qmp.fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    // The serial log has no descriptor to wait on, so boot is checked often
+    if (!watch->ready && timeout_ms > EVENTS_BOOT_POLL_MS) {
+        timeout_ms = EVENTS_BOOT_POLL_MS;
+    }
+    if (poll(fds, nfds, timeout_ms) > 0 && watch->qmp.fd >= 0 && fds[nfds - 1].revents) {
+        char msg[QMP_BUF_SIZE];
+        if (qmp_fill(&watch->qmp) != 0) {
+            qmp_close(&watch->qmp);
+        }
+        while (watch->qmp.fd >= 0 && qmp_next_message(&watch->qmp, msg, sizeof(msg))) {
+            char name[64] = "";
+            json_string_in(msg, NULL, "event", name, sizeof(name));
+            if (strcmp(name, "STOP") == 0) {
+                event_record(watch->vm_name, "paused", NULL);
+            } else if (strcmp(name, "RESUME") == 0) {
+                event_record(watch->vm_name, "resumed", NULL);
+            } else if (strcmp(name, "GUEST_PANICKED") == 0) {
+                event_record(watch->vm_name, "crashed", ", \"reason\": \"guest-panicked\"");
+            }
+        }
+    }
+    
+    now = now_monotonic();
+    if (!watch->ready && boot_watch_poll(&watch->boot)) {
+        watch->ready = 1;
+        watch->next_ip_check = now;
+        event_record(watch->vm_name, "ready", ", \"boot_seconds\": %.1f", now - watch->started);
+    }
+    if (watch->ready && now >= watch->next_ip_check) {
+        // Re-checked now and then: DHCP may hand out a new lease
+        char ip[64];
+        if (event_guest_ip(watch->vm_dir, ip, sizeof(ip)) == 0 && strcmp(ip, watch->ip) != 0) {
+            snprintf(watch->ip, sizeof(watch->ip), "%s", ip);
+            event_record(watch->vm_name, "ip-acquired", ", \"ip\": \"%s\"", ip);
+        }
+        watch->next_ip_check = now_monotonic() + (watch->ip[0] ? EVENTS_IP_RECHECK : EVENTS_IP_RETRY);
+    }
+}
+
+// Send every line of PATH with a sequence number above *SINCE to FD,
+// advancing *SINCE. The first line of the retained history (*OLDEST still 0)
+// is preceded by a gap line if it is past *SINCE + 1: the journal no longer
+// goes back that far. Returns 1 if the subscriber went away
+int events_replay_file(const char *path, int fd, uint64_t *since, uint64_t *oldest) {
+    char line[MAX_LINE];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t seq = event_seq_of(line);
+        if (seq == 0) continue;
+        if (*oldest == 0 && seq > *since + 1) {
+            char gap[128];
+            int len = snprintf(gap, sizeof(gap), "{\"event\": \"gap\", \"since\": %llu, \"oldest\": %llu}\n",
+                               (unsigned long long)*since, (unsigned long long)seq);
+            if (send(fd, gap, len, MSG_NOSIGNAL) != len) {
+                fclose(fp);
+                return 1;
+            }
+        }
+        if (*oldest == 0) *oldest = seq;
+        if (seq <= *since) continue;
+        size_t len = strlen(line);
+        if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+            fclose(fp);
+            return 1;
+        }
+        *since = seq;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Catch a subscriber up from its "since", rotated journal first
+int events_replay(EventClient *client) {
+    char log_path[MAX_PATH];
+    char rotated[MAX_PATH + 8];
+    uint64_t oldest = 0;
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/events.log", getenv("HOME"));
+    snprintf(rotated, sizeof(rotated), "%s.1", log_path);
+    
+    // Blocking sends: a backlog is worth waiting for, the live stream is not
+    int flags = fcntl(client->fd, F_GETFL);
+    fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK);
+    int gone = events_replay_file(rotated, client->fd, &client->since, &oldest) ||
+               events_replay_file(log_path, client->fd, &client->since, &oldest);
+    fcntl(client->fd, F_SETFL, flags | O_NONBLOCK);
+    return gone;
+}
+
+// Read what the journal gained and hand complete lines to subscribers,
+// keeping TAIL->latest at the last sequence number seen. A rotation shows up as a new inode: the rest of the old file
+// is read first, then the new one from its start
+void events_tail(EventTail *tail, EventClient *clients, int *count) {
+    char log_path[MAX_PATH];
+    char chunk[RUN_CHUNK];
+    struct stat st;
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/events.log", getenv("HOME"));
+    int rotated = stat(log_path, &st) == 0 && tail->fd >= 0 && st.st_ino != tail->inode;
+    if (tail->fd < 0) {
+        tail->fd = open(log_path, O_RDONLY);
+        if (tail->fd < 0) return;
+        tail->inode = st.st_ino;
+        tail->len = 0;
+    }
+    
+    for (;;) {
+        ssize_t n = read(tail->fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            if (!rotated) break;
+            close(tail->fd);
+            tail->fd = -1;
+            events_tail(tail, clients, count);
+            return;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] != '\n') {
+                if (tail->len < sizeof(tail->line) - 2) tail->line[tail->len++] = chunk[i];
+                continue;
+            }
+            tail->line[tail->len++] = '\n';
+            tail->line[tail->len] = '\0';
+            uint64_t seq = event_seq_of(tail->line);
+            if (seq > 0) {
+                tail->latest = seq;
+                events_broadcast(tail->line, tail->len, seq, clients, count);
+            }
+            tail->len = 0;
+        }
+    }
+}
+
+void events_broadcast(const char *line, size_t len, uint64_t seq, EventClient *clients, int *count) {
+    char message[MAX_LINE];
+    for (int i = 0; i < *count; i++) {
+        EventClient *client = &clients[i];
+        if (!client->streaming || seq <= client->since) continue;
+        if (send(client->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len) {
+            client->since = seq;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            snprintf(message, sizeof(message), "Dropping a subscriber stuck at event %llu",
+                     (unsigned long long)client->since);
+            log_warning(message);
+        }
+        close(client->fd);
+        clients[i--] = clients[--*count];
+    }
+}
+
+// The hello line is optional: without one by the deadline, or with one
+// lacking "since", the subscriber gets live events only
+int events_client_ready(EventClient *client, uint64_t latest, double now) {
+    char *newline = memchr(client->hello, '\n', client->hello_len);
+    if (newline == NULL && client->hello_len < sizeof(client->hello) - 1 && now < client->deadline) {
+        return 0;
+    }
+    client->hello[client->hello_len] = '\0';
+    double since = 0;
+    client->streaming = 1;
+    if (json_number_in(client->hello, NULL, "since", &since) != 0) {
+        client->since = latest;
+        return 0;
+    }
+    client->since = since > 0 ? (uint64_t)since : 0;
+    return events_replay(client);
+}
+
+int events_serve(const char *sock_path) {
+    char address[MAX_PATH + 8];
+    char message[MAX_LINE];
+    snprintf(address, sizeof(address), "unix:%s", sock_path);
+    int listen_fd = metrics_listen(address);
+    if (listen_fd < 0) {
+        log_error("Failed to listen for event subscribers");
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Streaming events on %s", sock_path);
+    log_info(message);
+    fflush(stdout);
+    
+    signal(SIGINT, events_handle_signal);
+    signal(SIGTERM, events_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    EventClient *clients = calloc(EVENTS_MAX_CLIENTS, sizeof(EventClient));
+    EventTail *tail = calloc(1, sizeof(EventTail));
+    if (clients == NULL || tail == NULL) {
+        free(clients);
+        free(tail);
+        close(listen_fd);
+        return 1;
+    }
+    int count = 0;
+    
+    // Read through the journal once, so that live-only subscribers start
+    // after the last event already in it
+    tail->fd = -1;
+    events_tail(tail, NULL, &count);
+    
+    while (!events_stop) {
+        struct pollfd fds[EVENTS_MAX_CLIENTS + 1];
+        int nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        for (int i = 0; i < count; i++) {
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        poll(fds, nfds, EVENTS_POLL_MS);
+        double now = now_monotonic();
+    
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && count == EVENTS_MAX_CLIENTS) {
+                close(fd);
+            } else if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                memset(&clients[count], 0, sizeof(EventClient));
+                clients[count].fd = fd;
+                clients[count].deadline = now + EVENTS_HELLO_MS / 1000.0;
+                count++;
+            }
+        }
+    
+        // Hangups, and hello lines from subscribers still being set up
+        for (int f = 1; f < nfds; f++) {
+            EventClient *client = NULL;
+            for (int i = 0; i < count; i++) {
+                if (clients[i].fd == fds[f].fd) client = &clients[i];
+            }
+            if (client == NULL || fds[f].revents == 0) continue;
+            char buf[256];
+            ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                close(client->fd);
+                client->fd = -1;
+            } else if (n > 0 && !client->streaming) {
+                size_t room = sizeof(client->hello) - 1 - client->hello_len;
+                if ((size_t)n > room) n = room;
+                memcpy(client->hello + client->hello_len, buf, n);
+                client->hello_len += n;
+            }
+        }
+    
+        // Journal first, so a subscriber's replay and the broadcast meet
+        // without a hole between them
+        events_tail(tail, clients, &count);
+        for (int i = 0; i < count; i++) {
+            if (clients[i].fd >= 0 && !clients[i].streaming &&
+                events_client_ready(&clients[i], tail->latest, now) != 0) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+            if (clients[i].fd < 0) {
+                clients[i--] = clients[--count];
+            }
+        }
+    }
+    
+    for (int i = 0; i < count; i++) close(clients[i].fd);
+    if (tail->fd >= 0) close(tail->fd);
+    unlink(sock_path);
+    close(listen_fd);
+    free(clients);
+    free(tail);
+    return 0;
+}
+
+// Subscriber side: print the stream until the server goes away
+int events_follow(const char *sock_path, const char *since) {
+    char hello[64] = "{}\n";
+    char buf[RUN_CHUNK];
+    int fd = unix_connect(sock_path);
+    if (fd < 0) {
+        char message[MAX_LINE];
+        snprintf(message, sizeof(message), "No event stream at %s (start one with `v4m events --listen`)", sock_path);
+        log_error(message);
+        return 1;
+    }
+    if (since) {
+        snprintf(hello, sizeof(hello), "{\"since\": %llu}\n", strtoull(since, NULL, 10));
+    }
+    if (send(fd, hello, strlen(hello), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return 1;
+    }
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (fwrite(buf, 1, n, stdout) != (size_t)n) break;
+        fflush(stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+int events_command(int argc, char *argv[]) {
+    char sock_path[MAX_PATH];
+    const char *since = NULL;
+    int listen = 0;
+    snprintf(sock_path, sizeof(sock_path), "%s/.v4m/events.sock", getenv("HOME"));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--listen") == 0) {
+            listen = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                snprintf(sock_path, sizeof(sock_path), "%s", argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            snprintf(sock_path, sizeof(sock_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+            since = argv[++i];
+        } else {
+            log_error("Unknown option");
+            return 1;
+        }
+    }
+    init_dirs();
+    return listen ? events_serve(sock_path) : events_follow(sock_path, since);
+}
+
+// Metrics exporter
+volatile sig_atomic_t metrics_stop = 0;
+
+void metrics_handle_signal(int sig) {
+    (void)sig;
+    metrics_stop = 1;
+}
+
+int monitor_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    MonitorTable *table = ctx;
+    
+    for (int i = 0; i < table->count; i++) {
+        if (strcmp(table->vms[i].name, vm_name) == 0) {
+            table->vms[i].seen = 1;
+            return 0;
+        }
+    }
+    
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 16;
+        VMMonitor *vms = realloc(table->vms, capacity * sizeof(VMMonitor));
+        if (vms == NULL) return 1;
+        table->vms = vms;
+        table->capacity = capacity;
+    }
+    
+    VMMonitor *vm = &table->vms[table->count++];
+    memset(vm->name, 0, sizeof(vm->name));
+    memset(vm->vm_dir, 0, sizeof(vm->vm_dir));
+    strncpy(vm->name, vm_name, sizeof(vm->name) - 1);
+    strncpy(vm->vm_dir, vm_dir, sizeof(vm->vm_dir) - 1);
+    vm->pid = -1;
+    vm->seen = 1;
+    vm->qmp.fd = -1;
+    vm->qmp.len = 0;
+    vm->qga.fd = -1;
+    vm->qga.len = 0;
+    memset(&vm->sample, 0, sizeof(vm->sample));
+    memset(&vm->prev, 0, sizeof(vm->prev));
+    return 0;
+}
+
+void monitor_refresh(MonitorTable *table) {
+    for (int i = 0; i < table->count; i++) {
+        table->vms[i].seen = 0;
+    }
+    
+    for_each_vm(monitor_visit, table);
+    
+    // Drop VMs whose directories disappeared, keeping live connections for the rest
+    int kept = 0;
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].seen) {
+            qmp_close(&table->vms[i].qmp);
+            qmp_close(&table->vms[i].qga);
+            continue;
+        }
+        if (kept != i) {
+            memcpy(&table->vms[kept], &table->vms[i], sizeof(VMMonitor));
+        }
+        kept++;
+    }
+    table->count = kept;
+}
+
+void monitor_free(MonitorTable *table) {
+    for (int i = 0; i < table->count; i++) {
+        qmp_close(&table->vms[i].qmp);
+        qmp_close(&table->vms[i].qga);
+    }
+    free(table->vms);
+    table->vms = NULL;
+    table->count = table->capacity = 0;
+}
+
+void monitor_handle_reply(VMMonitor *vm, const char *msg) {
+    char id[32];
+    double value;
+    
+    if (json_string_in(msg, NULL, "id", id, sizeof(id)) != 0) {
+        return;
+    }
+    
+    if (strcmp(id, "blk") == 0) {
+        // Each device's own stats precede its "parent" (protocol layer) stats,
+        // so take the first occurrence of each counter per device
+        uint64_t rd_bytes = 0, wr_bytes = 0, rd_ops = 0, wr_ops = 0;
+        const char *p = json_find_key(msg, NULL, "device");
+        while (p != NULL) {
+            const char *next = json_find_key(p, NULL, "device");
+            if (json_number_in(p, next, "rd_bytes", &value) == 0) rd_bytes += value;
+            if (json_number_in(p, next, "wr_bytes", &value) == 0) wr_bytes += value;
+            if (json_number_in(p, next, "rd_operations", &value) == 0) rd_ops += value;
+            if (json_number_in(p, next, "wr_operations", &value) == 0) wr_ops += value;
+            p = next;
+        }
+        vm->sample.rd_bytes = rd_bytes;
+        vm->sample.wr_bytes = wr_bytes;
+        vm->sample.rd_ops = rd_ops;
+        vm->sample.wr_ops = wr_ops;
+    } else if (strcmp(id, "balloon") == 0) {
+        if (json_number_in(msg, NULL, "actual", &value) == 0) {
+            vm->sample.balloon_actual = value;
+        }
+    } else if (strcmp(id, "gstats") == 0) {
+        if (json_number_in(msg, NULL, "stat-free-memory", &value) == 0) {
+            vm->sample.balloon_free = value;
+        }
+        if (json_number_in(msg, NULL, "stat-total-memory", &value) == 0) {
+            vm->sample.balloon_total = value;
+        }
+    } else if (strcmp(id, "net") == 0) {
+        uint64_t rx = 0, tx = 0;
+        const char *p = json_find_key(msg, NULL, "name");
+        while (p != NULL) {
+            const char *next = json_find_key(p, NULL, "name");
+            if (strncmp(p, "\"lo\"", 4) != 0) {
+                if (json_number_in(p, next, "rx-bytes", &value) == 0) rx += value;
+                if (json_number_in(p, next, "tx-bytes", &value) == 0) tx += value;
+            }
+            p = next;
+        }
+        vm->sample.rx_bytes = rx;
+        vm->sample.tx_bytes = tx;
+        vm->sample.has_net = 1;
+    }
+}
+
+int monitor_send_queries(VMMonitor *vm) {
+    char sock_path[MAX_PATH + 16];
+    
+    if (vm->qmp.fd < 0) {
+        snprintf(sock_path, sizeof(sock_path), "%s/metrics.sock", vm->vm_dir);
+        if (qmp_open(&vm->qmp, sock_path, 1) == 0) {
+            // Guest memory statistics are only refreshed when polling is enabled
+            char resp[1024];
+            qmp_execute(&vm->qmp,
+                "{\"execute\": \"qom-set\", \"arguments\": {\"path\": \"/machine/peripheral/balloon0\", "
+                "\"property\": \"guest-stats-polling-interval\", \"value\": 5}}",
+                resp, sizeof(resp), QMP_TIMEOUT_MS);
+        }
+    }
+    // There is only one guest agent channel, so it is held for a single
+    // scrape and handed back to run, trim and the event stream in between
+    snprintf(sock_path, sizeof(sock_path), "%s/qga.sock", vm->vm_dir);
+    qmp_open(&vm->qga, sock_path, 0);
+    
+    // Never queue more work behind an unanswered request
+    if (vm->qmp.fd >= 0 && vm->qmp.inflight > 0 && ++vm->qmp.missed > 3) qmp_close(&vm->qmp);
+    
+    if (vm->qmp.fd >= 0 && vm->qmp.inflight == 0) {
+        if (qmp_send(&vm->qmp, "{\"execute\": \"query-blockstats\", \"id\": \"blk\"}") != 0 ||
+            qmp_send(&vm->qmp, "{\"execute\": \"query-balloon\", \"id\": \"balloon\"}") != 0 ||
+            qmp_send(&vm->qmp, "{\"execute\": \"qom-get\", \"arguments\": {\"path\": "
+                     "\"/machine/peripheral/balloon0\", \"property\": \"guest-stats\"}, \"id\": \"gstats\"}") != 0) {
+            qmp_close(&vm->qmp);
+        } else {
+            vm->qmp.inflight = 3;
+            vm->qmp.missed = 0;
+        }
+    }
+    if (vm->qga.fd >= 0 && vm->qga.inflight == 0) {
+        if (qmp_send(&vm->qga, "{\"execute\": \"guest-network-get-interfaces\", \"id\": \"net\"}") != 0) {
+            qmp_close(&vm->qga);
+        } else {
+            vm->qga.inflight = 1;
+            vm->qga.missed = 0;
+        }
+    }
+    return vm->qmp.inflight + vm->qga.inflight;
+}
+
+void monitor_sample(MonitorTable *table, int timeout_ms) {
+    struct stat st;
+    char disk_path[MAX_PATH + 16];
+    int pending = 0;
+    
+    // Cheap local reads first, then fire every QMP/QGA query without waiting
+    double now = now_monotonic();
+    for (int i = 0; i < table->count; i++) {
+        VMMonitor *vm = &table->vms[i];
+        VMSample *sample = &vm->sample;
+        
+        vm->prev = vm->sample;
+        sample->timestamp = now;
+        
+        snprintf(disk_path, sizeof(disk_path), "%s/disk.qcow2", vm->vm_dir);
+        if (stat(disk_path, &st) == 0) {
+            sample->disk_size = st.st_size;
+            sample->disk_allocated = (uint64_t)st.st_blocks * 512;
+        }
+        
+        vm->pid = read_vm_pid(vm->vm_dir);
+        sample->running = vm->pid > 0 &&
+            read_process_stats(vm->pid, &sample->cpu_seconds, &sample->rss_bytes) == 0;
+        sample->has_steal = sample->running && read_process_steal(vm->pid, &sample->steal_seconds) == 0;
+        
+        if (!sample->running) {
+            qmp_close(&vm->qmp);
+            qmp_close(&vm->qga);
+            continue;
+        }
+        pending += monitor_send_queries(vm);
+    }
+    
+    // Gather all replies in one poll loop
+    TRACE_SCOPE("qmp-batch", "monitor_sample");
+    struct pollfd *fds = calloc(table->count * 2 + 1, sizeof(struct pollfd));
+    QMPConn **conns = calloc(table->count * 2 + 1, sizeof(QMPConn *));
+    VMMonitor **owners = calloc(table->count * 2 + 1, sizeof(VMMonitor *));
+    char *msg = malloc(QMP_BUF_SIZE);
+    double deadline = now_monotonic() + timeout_ms / 1000.0;
+    
+    while (pending > 0 && fds && conns && owners && msg) {
+        int nfds = 0;
+        for (int i = 0; i < table->count; i++) {
+            QMPConn *pair[2] = {&table->vms[i].qmp, &table->vms[i].qga};
+            for (int j = 0; j < 2; j++) {
+                if (pair[j]->fd < 0 || pair[j]->inflight == 0) continue;
+                fds[nfds].fd = pair[j]->fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                conns[nfds] = pair[j];
+                owners[nfds] = &table->vms[i];
+                nfds++;
+            }
+        }
+        
+        int wait_ms = (int)((deadline - now_monotonic()) * 1000);
+        if (nfds == 0 || wait_ms <= 0) break;
+        int ready = poll(fds, nfds, wait_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) continue;
+            QMPConn *conn = conns[i];
+            if (qmp_fill(conn) != 0) {
+                pending -= conn->inflight;
+                qmp_close(conn);
+                continue;
+            }
+            while (qmp_next_message(conn, msg, QMP_BUF_SIZE)) {
+                if (json_find_key(msg, NULL, "event") != NULL && json_find_key(msg, NULL, "id") == NULL) continue;
+                monitor_handle_reply(owners[i], msg);
+                if (conn->inflight > 0) {
+                    conn->inflight--;
+                    pending--;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        qmp_close(&table->vms[i].qga);
+    }
+    
+    free(fds);
+    free(conns);
+    free(owners);
+    free(msg);
+}
+
+void lifecycle_stats_update(LifecycleStats *stats) {
+    char log_path[MAX_PATH];
+    char line[256];
+    snprintf(log_path, sizeof(log_path), "%s/.v4m/lifecycle.log", getenv("HOME"));
+    
+    FILE *fp = fopen(log_path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    
+    // Only read what was appended since the last collection
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) < stats->offset) {
+        memset(stats, 0, sizeof(*stats));
+    }
+    fseek(fp, stats->offset, SEEK_SET);
+    
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[strlen(line) - 1] != '\n') break;
+        stats->offset += strlen(line);
+        
+        char op[32];
+        double seconds;
+        if (sscanf(line, "%*s %31s %lf", op, &seconds) != 2) continue;
+        
+        for (int i = 0; i < LIFECYCLE_OPS; i++) {
+            if (strcmp(op, lifecycle_ops[i]) != 0) continue;
+            int bucket = 0;
+            while (bucket < LIFECYCLE_BUCKETS && seconds > lifecycle_buckets[bucket]) bucket++;
+            stats->counts[i][bucket]++;
+            stats->total[i]++;
+            stats->sum[i] += seconds;
+        }
+    }
+    fclose(fp);
+}
+
+void metrics_header(StrBuf *page, const char *name, const char *type, const char *help) {
+    sb_printf(page, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_render(StrBuf *page, MonitorTable *table, LifecycleStats *lifecycle, double collect_seconds) {
+    page->len = 0;
+    int running = 0;
+    
+    metrics_header(page, "v4m_vm_up", "gauge", "Whether the VM's QEMU process is running.");
+    for (int i = 0; i < table->count; i++) {
+        running += table->vms[i].sample.running;
+        sb_printf(page, "v4m_vm_up{vm=\"%s\"} %d\n", table->vms[i].name, table->vms[i].sample.running);
+    }
+    
+    metrics_header(page, "v4m_vm_disk_size_bytes", "gauge", "Apparent size of disk.qcow2.");
+    for (int i = 0; i < table->count; i++) {
+        sb_printf(page, "v4m_vm_disk_size_bytes{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.disk_size);
+    }
+    metrics_header(page, "v4m_vm_disk_allocated_bytes", "gauge", "Host blocks allocated to disk.qcow2.");
+    for (int i = 0; i < table->count; i++) {
+        sb_printf(page, "v4m_vm_disk_allocated_bytes{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.disk_allocated);
+    }
+    
+    metrics_header(page, "v4m_vm_cpu_seconds_total", "counter", "CPU time consumed by the QEMU process.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_cpu_seconds_total{vm=\"%s\"} %.3f\n", table->vms[i].name,
+                  table->vms[i].sample.cpu_seconds);
+    }
+    metrics_header(page, "v4m_vm_resident_memory_bytes", "gauge", "Resident set size of the QEMU process.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_resident_memory_bytes{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.rss_bytes);
+    }
+    
+    metrics_header(page, "v4m_vm_block_read_bytes_total", "counter", "Bytes read by the guest from block devices.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_block_read_bytes_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.rd_bytes);
+    }
+    metrics_header(page, "v4m_vm_block_written_bytes_total", "counter", "Bytes written by the guest to block devices.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_block_written_bytes_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.wr_bytes);
+    }
+    metrics_header(page, "v4m_vm_block_read_ops_total", "counter", "Read requests completed by block devices.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_block_read_ops_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.rd_ops);
+    }
+    metrics_header(page, "v4m_vm_block_write_ops_total", "counter", "Write requests completed by block devices.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running) continue;
+        sb_printf(page, "v4m_vm_block_write_ops_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.wr_ops);
+    }
+    
+    metrics_header(page, "v4m_vm_network_receive_bytes_total", "counter", "Bytes received by guest interfaces (guest agent).");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running || !table->vms[i].sample.has_net) continue;
+        sb_printf(page, "v4m_vm_network_receive_bytes_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.rx_bytes);
+    }
+    metrics_header(page, "v4m_vm_network_transmit_bytes_total", "counter", "Bytes sent by guest interfaces (guest agent).");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running || !table->vms[i].sample.has_net) continue;
+        sb_printf(page, "v4m_vm_network_transmit_bytes_total{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.tx_bytes);
+    }
+    
+    metrics_header(page, "v4m_vm_balloon_actual_bytes", "gauge", "Memory currently assigned to the guest by the balloon.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running || table->vms[i].sample.balloon_actual == 0) continue;
+        sb_printf(page, "v4m_vm_balloon_actual_bytes{vm=\"%s\"} %llu\n", table->vms[i].name,
+                  (unsigned long long)table->vms[i].sample.balloon_actual);
+    }
+    metrics_header(page, "v4m_vm_guest_free_memory_bytes", "gauge", "Free memory reported by the balloon driver.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running || table->vms[i].sample.balloon_free <= 0) continue;
+        sb_printf(page, "v4m_vm_guest_free_memory_bytes{vm=\"%s\"} %lld\n", table->vms[i].name,
+                  (long long)table->vms[i].sample.balloon_free);
+    }
+    metrics_header(page, "v4m_vm_guest_total_memory_bytes", "gauge", "Total memory reported by the balloon driver.");
+    for (int i = 0; i < table->count; i++) {
+        if (!table->vms[i].sample.running || table->vms[i].sample.balloon_total <= 0) continue;
+        sb_printf(page, "v4m_vm_guest_total_memory_bytes{vm=\"%s\"} %lld\n", table->vms[i].name,
+                  (long long)table->vms[i].sample.balloon_total);
+    }
+    
+    for (int op = 0; op < LIFECYCLE_OPS; op++) {
+        char name[64];
+        snprintf(name, sizeof(name), "v4m_lifecycle_%s_seconds", lifecycle_ops[op]);
+        metrics_header(page, name, "histogram", "Latency of VM lifecycle operations.");
+        
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LIFECYCLE_BUCKETS; b++) {
+            cumulative += lifecycle->counts[op][b];
+            sb_printf(page, "%s_bucket{le=\"%g\"} %llu\n", name, lifecycle_buckets[b],
+                      (unsigned long long)cumulative);
+        }
+        sb_printf(page, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)lifecycle->total[op]);
+        sb_printf(page, "%s_sum %.3f\n", name, lifecycle->sum[op]);
+        sb_printf(page, "%s_count %llu\n", name, (unsigned long long)lifecycle->total[op]);
+    }
+    
+    double load[3] = {0, 0, 0};
+    getloadavg(load, 3);
+    metrics_header(page, "v4m_host_load1", "gauge", "Host one-minute load average.");
+    sb_printf(page, "v4m_host_load1 %.2f\n", load[0]);
+    metrics_header(page, "v4m_vms", "gauge", "Number of VMs by state.");
+    sb_printf(page, "v4m_vms{state=\"running\"} %d\n", running);
+    sb_printf(page, "v4m_vms{state=\"stopped\"} %d\n", table->count - running);
+    metrics_header(page, "v4m_collect_duration_seconds", "gauge", "Time spent in the last collection cycle.");
+    sb_printf(page, "v4m_collect_duration_seconds %.6f\n", collect_seconds);
+}
+
+int metrics_listen(const char *address) {
+    int fd;
+    
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+        
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        char host[MAX_NAME] = "127.0.0.1";
+        const char *colon = strrchr(address, ':');
+        const char *port = colon ? colon + 1 : address;
+        if (colon && colon != address) {
+            size_t len = colon - address;
+            if (len >= sizeof(host)) len = sizeof(host) - 1;
+            memcpy(host, address, len);
+            host[len] = '\0';
+        }
+        
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+        
+        fd = socket(res->ai_family, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+            if (fd >= 0) close(fd);
+            freeaddrinfo(res);
+            return -1;
+        }
+        freeaddrinfo(res);
+    }
+    
+    if (listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+void metrics_serve_client(int listen_fd, StrBuf *page) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    
+    char request[2048];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) break;
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n <= 0) break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[len] = '\0';
+    
+    StrBuf response = {0};
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        sb_printf(&response, "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %zu\r\n\r\n", page->len);
+        sb_printf(&response, "%.*s", (int)page->len, page->data ? page->data : "");
+    } else {
+        sb_printf(&response, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    }
+    
+    size_t sent = 0;
+    while (sent < response.len) {
+        ssize_t n = send(fd, response.data + sent, response.len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    sb_free(&response);
+    close(fd);
+}
+
+int metrics_command(int argc, char *argv[]) {
+    const char *listen_addr = DEFAULT_METRICS_LISTEN;
+    int interval = DEFAULT_METRICS_INTERVAL;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_addr = argv[++i];
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+            if (interval < 1) interval = 1;
+        } else {
+            log_error("Unknown option");
+            return 1;
+        }
+    }
+    
+    init_dirs();
+    int listen_fd = metrics_listen(listen_addr);
+    if (listen_fd < 0) {
+        log_error("Failed to listen for metrics requests");
+        return 1;
+    }
+    
+    char message[MAX_LINE];
+    snprintf(message, sizeof(message), "Serving metrics on %s every %ds", listen_addr, interval);
+    log_info(message);
+    
+    signal(SIGINT, metrics_handle_signal);
+    signal(SIGTERM, metrics_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    MonitorTable table = {0};
+    LifecycleStats lifecycle;
+    StrBuf page = {0};
+    double next_collect = 0;
+    memset(&lifecycle, 0, sizeof(lifecycle));
+    
+    // One loop drives both collection and scrapes; scrapes serve the cached page
+    while (!metrics_stop) {
+        double now = now_monotonic();
+        if (now >= next_collect) {
+            monitor_refresh(&table);
+            monitor_sample(&table, 1000);
+            lifecycle_stats_update(&lifecycle);
+            metrics_render(&page, &table, &lifecycle, now_monotonic() - now);
+            next_collect = now + interval;
+        }
+        
+        int wait_ms = (int)((next_collect - now_monotonic()) * 1000);
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, wait_ms > 0 ? wait_ms : 0) > 0) {
+            metrics_serve_client(listen_fd, &page);
+        }
+    }
+    
+    if (strncmp(listen_addr, "unix:", 5) == 0) {
+        unlink(listen_addr + 5);
+    }
+    close(listen_fd);
+    monitor_free(&table);
+    sb_free(&page);
+    return 0;
+}
+
+// Top dashboard
+const char *top_columns[TOP_COLUMNS] = {"name", "cpu", "steal", "mem", "iops", "disk", "net"};
+const char top_keys[TOP_COLUMNS] = {'a', 'c', 's', 'm', 'i', 'd', 'n'};
+volatile sig_atomic_t top_stop = 0;
+volatile sig_atomic_t top_resized = 0;
+int top_sort_column = 1;
+int top_sort_reverse = 0;
+struct termios top_saved_termios;
+int top_raw_mode = 0;
+
+void top_handle_signal(int sig) {
+    if (sig == SIGWINCH) {
+        top_resized = 1;
+    } else {
+        top_stop = 1;
+    }
+}
+
+void top_restore_terminal() {
+    if (top_raw_mode) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &top_saved_termios);
+        top_raw_mode = 0;
+    }
+    // Show the cursor again and leave the alternate screen
+    printf("\033[?25h\033[?1049l");
+    fflush(stdout);
+}
+
+void format_size(double bytes, char *out, size_t size) {
+    const char *units = "BKMGTP";
+    int unit = 0;
+    while (bytes >= 1024 && unit < 5) {
+        bytes /= 1024;
+        unit++;
+    }
+    if (unit == 0) {
+        snprintf(out, size, "%.0f%c", bytes, units[unit]);
+    } else {
+        snprintf(out, size, bytes < 10 ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+    }
+}
+
+double top_rate(uint64_t current, uint64_t previous, double seconds) {
+    if (seconds <= 0 || current < previous) {
+        return 0;
+    }
+    return (current - previous) / seconds;
+}
+
+void top_compute_rows(MonitorTable *table, TopRow *rows) {
+    for (int i = 0; i < table->count; i++) {
+        VMMonitor *vm = &table->vms[i];
+        VMSample *cur = &vm->sample;
+        VMSample *prev = &vm->prev;
+        TopRow *row = &rows[i];
+        
+        memset(row, 0, sizeof(*row));
+        row->name = vm->name;
+        row->running = cur->running;
+        if (!cur->running) continue;
+        
+        row->mem_bytes = cur->rss_bytes;
+        row->has_steal = cur->has_steal;
+        row->has_net = cur->has_net;
+        
+        // Rates need two consecutive samples of the same running process
+        double dt = cur->timestamp - prev->timestamp;
+        if (!prev->running || prev->timestamp == 0 || dt <= 0) continue;
+        
+        if (cur->cpu_seconds >= prev->cpu_seconds) {
+            row->cpu_pct = (cur->cpu_seconds - prev->cpu_seconds) / dt * 100;
+        }
+        if (cur->has_steal && prev->has_steal && cur->steal_seconds >= prev->steal_seconds) {
+            row->steal_pct = (cur->steal_seconds - prev->steal_seconds) / dt * 100;
+        }
+        row->iops = top_rate(cur->rd_ops + cur->wr_ops, prev->rd_ops + prev->wr_ops, dt);
+        row->disk_bps = top_rate(cur->rd_bytes + cur->wr_bytes, prev->rd_bytes + prev->wr_bytes, dt);
+        row->net_bps = top_rate(cur->rx_bytes + cur->tx_bytes, prev->rx_bytes + prev->tx_bytes, dt);
+    }
+}
+
+double top_column_value(const TopRow *row, int column) {
+    switch (column) {
+        case 1: return row->cpu_pct;
+        case 2: return row->steal_pct;
+        case 3: return row->mem_bytes;
+        case 4: return row->iops;
+        case 5: return row->disk_bps;
+        case 6: return row->net_bps;
+    }
+    return 0;
+}
+
+int top_compare_rows(const void *a, const void *b) {
+    const TopRow *ra = a;
+    const TopRow *rb = b;
+    int result;
+    
+    if (ra->running != rb->running) {
+        return rb->running - ra->running;
+    }
+    if (top_sort_column == 0) {
+        result = strcmp(ra->name, rb->name);
+    } else {
+        // Numeric columns sort busiest first
+        double va = top_column_value(ra, top_sort_column);
+        double vb = top_column_value(rb, top_sort_column);
+        result = va < vb ? 1 : va > vb ? -1 : strcmp(ra->name, rb->name);
+    }
+    return top_sort_reverse ? -result : result;
+}
+
+void top_sort_rows(TopRow *rows, int count, int column, int reverse) {
+    top_sort_column = column;
+    top_sort_reverse = reverse;
+    qsort(rows, count, sizeof(TopRow), top_compare_rows);
+}
+
+void top_draw(StrBuf *frame, TopRow *rows, int count, int column, int reverse, double interval) {
+    struct winsize ws;
+    int max_rows = 40;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4) {
+        max_rows = ws.ws_row - 4;
+    }
+    
+    int running = 0;
+    double total_cpu = 0;
+    for (int i = 0; i < count; i++) {
+        running += rows[i].running;
+        total_cpu += rows[i].cpu_pct;
+    }
+    
+    double load[3] = {0, 0, 0};
+    getloadavg(load, 3);
+    time_t now = time(NULL);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+    
+    frame->len = 0;
+    sb_printf(frame, "v4m top - %s  VMs: %d (%d running)  CPU: %.0f%%  load: %.2f %.2f %.2f  every %.0fs\n",
+              clock, count, running, total_cpu, load[0], load[1], load[2], interval);
+    sb_printf(frame, "sort: a name  c cpu  s steal  m mem  i iops  d disk  n net  r reverse  q quit\n");
+    
+    const char *headers[TOP_COLUMNS] = {"NAME", "CPU%", "STEAL%", "MEM", "IOPS", "DISK/s", "NET/s"};
+    const int widths[TOP_COLUMNS] = {-24, 7, 7, 8, 8, 9, 9};
+    for (int c = 0; c < TOP_COLUMNS; c++) {
+        const char *marker = c == column ? (reverse ? "^" : "v") : "";
+        char label[32];
+        snprintf(label, sizeof(label), "%s%s", headers[c], marker);
+        sb_printf(frame, c == column ? "\033[7m%*s\033[0m " : "%*s ", widths[c], label);
+    }
+    sb_printf(frame, "\n");
+    
+    for (int i = 0; i < count && i < max_rows; i++) {
+        TopRow *row = &rows[i];
+        char mem[16], disk[16], net[16];
+        
+        if (!row->running) {
+            sb_printf(frame, "%-24.24s %7s %7s %8s %8s %9s %9s\n", row->name, "-", "-", "-", "-", "-", "stopped");
+            continue;
+        }
+        format_size(row->mem_bytes, mem, sizeof(mem));
+        format_size(row->disk_bps, disk, sizeof(disk));
+        format_size(row->net_bps, net, sizeof(net));
+        
+        char steal[16];
+        if (row->has_steal) snprintf(steal, sizeof(steal), "%.1f", row->steal_pct);
+        else snprintf(steal, sizeof(steal), "-");
+        
+        sb_printf(frame, "%-24.24s %7.1f %7s %8s %8.0f %9s %9s\n", row->name, row->cpu_pct, steal,
+                  mem, row->iops, disk, row->has_net ? net : "-");
+    }
+}
+
+void top_present(StrBuf *frame, StrBuf *shown, int full) {
+    // Rewrite only the lines that differ from what is already on screen
+    StrBuf out = {0};
+    const char *cur = frame->data ? frame->data : "";
+    const char *old = (!full && shown->data) ? shown->data : "";
+    const char *cur_end = cur + frame->len;
+    const char *old_end = old + ((!full && shown->data) ? shown->len : 0);
+    int line = 1;
+    
+    if (full) {
+        sb_printf(&out, "\033[2J");
+    }
+    while (cur < cur_end || old < old_end) {
+        const char *cur_nl = cur < cur_end ? memchr(cur, '\n', cur_end - cur) : NULL;
+        const char *old_nl = old < old_end ? memchr(old, '\n', old_end - old) : NULL;
+        size_t cur_len = cur < cur_end ? (size_t)((cur_nl ? cur_nl : cur_end) - cur) : 0;
+        size_t old_len = old < old_end ? (size_t)((old_nl ? old_nl : old_end) - old) : 0;
+        
+        if (cur >= cur_end) {
+            sb_printf(&out, "\033[%d;1H\033[K", line);
+        } else if (full || cur_len != old_len || memcmp(cur, old, cur_len) != 0) {
+            sb_printf(&out, "\033[%d;1H%.*s\033[K", line, (int)cur_len, cur);
+        }
+        
+        cur = cur < cur_end ? (cur_nl ? cur_nl + 1 : cur_end) : cur_end;
+        old = old < old_end ? (old_nl ? old_nl + 1 : old_end) : old_end;
+        line++;
+    }
+    
+    if (out.len > 0 && write(STDOUT_FILENO, out.data, out.len) < 0) {
+        // Terminal went away; the main loop exits on the next signal
+    }
+    sb_free(&out);
+    
+    shown->len = 0;
+    sb_printf(shown, "%.*s", (int)frame->len, frame->data ? frame->data : "");
+}
+
+int top_command(int argc, char *argv[]) {
+    double interval = 1;
+    int column = 1;
+    int reverse = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = atof(argv[++i]);
+            if (interval < 0.2) interval = 0.2;
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            column = -1;
+            for (int c = 0; c < TOP_COLUMNS; c++) {
+                if (strcmp(argv[i], top_columns[c]) == 0) column = c;
+            }
+            if (column < 0) {
+                log_error("Unknown sort column (name, cpu, steal, mem, iops, disk, net)");
+                return 1;
+            }
+        } else {
+            log_error("Unknown option");
+            return 1;
+        }
+    }
+    
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &top_saved_termios) == 0) {
+        struct termios raw = top_saved_termios;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        top_raw_mode = 1;
+    }
+    
+    signal(SIGINT, top_handle_signal);
+    signal(SIGTERM, top_handle_signal);
+    signal(SIGWINCH, top_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Alternate screen, hidden cursor
+    printf("\033[?1049h\033[?25l");
+    fflush(stdout);
+    
+    MonitorTable table = {0};
+    TopRow *rows = NULL;
+    int row_capacity = 0;
+    StrBuf frame = {0};
+    StrBuf shown = {0};
+    double next_sample = 0;
+    int full_redraw = 1;
+    
+    while (!top_stop) {
+        double now = now_monotonic();
+        int redraw = 0;
+        
+        if (now >= next_sample) {
+            monitor_refresh(&table);
+            monitor_sample(&table, (int)(interval * 500));
+            if (table.count > row_capacity) {
+                row_capacity = table.count * 2;
+                TopRow *grown = realloc(rows, row_capacity * sizeof(TopRow));
+                if (grown == NULL) break;
+                rows = grown;
+            }
+            top_compute_rows(&table, rows);
+            next_sample = now + interval;
+            redraw = 1;
+        }
+        
+        int wait_ms = (int)((next_sample - now_monotonic()) * 1000);
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (!redraw && top_raw_mode && poll(&pfd, 1, wait_ms > 0 ? wait_ms : 0) > 0) {
+            char key;
+            if (read(STDIN_FILENO, &key, 1) == 1) {
+                if (key == 'q' || key == 'Q') break;
+                if (key == 'r') reverse = !reverse;
+                for (int c = 0; c < TOP_COLUMNS; c++) {
+                    if (key == top_keys[c]) column = c;
+                }
+                redraw = 1;
+            }
+        } else if (!redraw && !top_raw_mode && wait_ms > 0) {
+            usleep(wait_ms * 1000);
+        }
+        
+        if (top_resized) {
+            top_resized = 0;
+            full_redraw = 1;
+            redraw = 1;
+        }
+        if (redraw) {
+            top_sort_rows(rows, table.count, column, reverse);
+            top_draw(&frame, rows, table.count, column, reverse, interval);
+            top_present(&frame, &shown, full_redraw);
+            full_redraw = 0;
+        }
+    }
+    
+    top_restore_terminal();
+    monitor_free(&table);
+    free(rows);
+    sb_free(&frame);
+    sb_free(&shown);
+    return 0;
+}
+
+// Boot profiler
+BootProfile boot_profile;
+
+// Guest milestones in the order they normally appear on the serial console
+const struct {
+    const char *pattern;
+    const char *milestone;
+} boot_markers[] = {
+    {"UEFI firmware", "firmware"},
+    {"BdsDxe", "firmware"},
+    {"GNU GRUB", "bootloader"},
+    {"EFI stub:", "kernel-load"},
+    {"Booting Linux on physical CPU", "kernel"},
+    {"Linux version", "kernel"},
+    {"systemd[1]:", "systemd"},
+    {"Welcome to ", "systemd"},
+    {"running 'init-local'", "cloud-init-local"},
+    {"running 'init'", "cloud-init-network"},
+    {"running 'modules:config'", "cloud-init-config"},
+    {"running 'modules:final'", "cloud-init-final"},
+    {"Reached target Multi-User System", "multi-user-target"},
+    {"Reached target multi-user.target", "multi-user-target"},
+    {"finished at", "ready"},
+};
+
+int boot_phase_begin(const char *name) {
+    if (!boot_profile.enabled || boot_profile.count >= BOOT_MAX_PHASES) {
+        return -1;
+    }
+    
+    BootPhase *phase = &boot_profile.phases[boot_profile.count];
+    strncpy(phase->name, name, sizeof(phase->name) - 1);
+    strncpy(phase->category, "host", sizeof(phase->category) - 1);
+    phase->start = now_monotonic() - boot_profile.origin;
+    phase->duration = 0;
+    return boot_profile.count++;
+}
+
+void boot_phase_end(int phase) {
+    if (phase < 0 || phase >= boot_profile.count) {
+        return;
+    }
+    BootPhase *p = &boot_profile.phases[phase];
+    p->duration = now_monotonic() - boot_profile.origin - p->start;
+}
+
+void boot_mark(const char *name) {
+    if (!boot_profile.enabled || boot_profile.count >= BOOT_MAX_PHASES) {
+        return;
+    }
+    
+    // Only the first occurrence of a milestone counts
+    for (int i = 0; i < boot_profile.count; i++) {
+        if (strcmp(boot_profile.phases[i].category, "guest") == 0 &&
+            strcmp(boot_profile.phases[i].name, name) == 0) {
+            return;
+        }
+    }
+    
+    double now = now_monotonic() - boot_profile.origin;
+    
+    // The previous guest milestone lasts until this one
+    for (int i = boot_profile.count - 1; i >= 0; i--) {
+        if (strcmp(boot_profile.phases[i].category, "guest") == 0) {
+            boot_profile.phases[i].duration = now - boot_profile.phases[i].start;
+            break;
+        }
+    }
+    
+    BootPhase *phase = &boot_profile.phases[boot_profile.count++];
+    strncpy(phase->name, name, sizeof(phase->name) - 1);
+    strncpy(phase->category, "guest", sizeof(phase->category) - 1);
+    phase->start = now;
+    phase->duration = 0;
+}
+
+void strip_ansi(char *line) {
+    char *src = line;
+    char *dst = line;
+    while (*src) {
+        if (*src == '\033') {
+            src++;
+            if (*src == '[') {
+                src++;
+                while (*src && !isalpha((unsigned char)*src)) src++;
+                if (*src) src++;
+            }
+            continue;
+        }
+        if (*src != '\r') *dst++ = *src;
+        src++;
+    }
+    *dst = '\0';
+}
+
+void boot_watch_init(BootWatch *watch, const char *vm_dir) {
+    snprintf(watch->serial_log, sizeof(watch->serial_log), "%s/serial.log", vm_dir);
+    watch->offset = 0;
+    watch->line_len = 0;
+}
+
+// Consume whatever the serial log gained since the last call, marking boot
+// milestones on the way. Returns 1 once cloud-init reported it finished
+int boot_watch_poll(BootWatch *watch) {
+    FILE *fp = fopen(watch->serial_log, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    fseek(fp, watch->offset, SEEK_SET);
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        watch->offset++;
+        if (c != '\n' && watch->line_len < sizeof(watch->line) - 1) {
+            watch->line[watch->line_len++] = c;
+            continue;
+        }
+        if (c != '\n') continue;
+        
+        char *line = watch->line;
+        line[watch->line_len] = '\0';
+        watch->line_len = 0;
+        strip_ansi(line);
+        
+        for (size_t i = 0; i < sizeof(boot_markers) / sizeof(boot_markers[0]); i++) {
+            if (strstr(line, boot_markers[i].pattern) == NULL) continue;
+            if (strcmp(boot_markers[i].milestone, "ready") == 0 && strstr(line, "Cloud-init") == NULL) continue;
+            
+            boot_mark(boot_markers[i].milestone);
+            if (strcmp(boot_markers[i].milestone, "ready") == 0) {
+                fclose(fp);
+                return 1;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int wait_for_boot(const char *vm_dir, int timeout_sec) {
+    TRACE_SCOPE("wait_for_boot", vm_dir);
+    BootWatch *watch = malloc(sizeof(BootWatch));
+    if (watch == NULL) {
+        return 2;
+    }
+    boot_watch_init(watch, vm_dir);
+    double deadline = now_monotonic() + timeout_sec;
+    
+    int result = 2;
+    while (now_monotonic() < deadline) {
+        if (boot_watch_poll(watch)) {
+            result = 0;
+            break;
+        }
+        if (read_vm_pid(vm_dir) <= 0) {
+            result = 1;
+            break;
+        }
+        usleep(50000);
+    }
+    free(watch);
+    return result;
+}
+
+int boot_profile_save(const char *vm_dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/boot-profile.tsv", vm_dir);
+    
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return 1;
+    }
+    fprintf(fp, "# category\tname\tstart\tduration\n");
+    for (int i = 0; i < boot_profile.count; i++) {
+        BootPhase *phase = &boot_profile.phases[i];
+        fprintf(fp, "%s\t%s\t%.6f\t%.6f\n", phase->category, phase->name, phase->start, phase->duration);
+    }
+    fclose(fp);
+    return 0;
+}
+
+int boot_profile_load(const char *vm_dir, BootProfile *profile) {
+    char path[MAX_PATH];
+    char line[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/boot-profile.tsv", vm_dir);
+    
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    
+    memset(profile, 0, sizeof(*profile));
+    while (fgets(line, sizeof(line), fp) && profile->count < BOOT_MAX_PHASES) {
+        if (line[0] == '#') continue;
+        BootPhase *phase = &profile->phases[profile->count];
+        if (sscanf(line, "%15[^\t]\t%63[^\t]\t%lf\t%lf", phase->category, phase->name,
+                   &phase->start, &phase->duration) == 4) {
+            profile->count++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+void boot_profile_print(BootProfile *profile) {
+    double total = 0;
+    for (int i = 0; i < profile->count; i++) {
+        double end = profile->phases[i].start + profile->phases[i].duration;
+        if (end > total) total = end;
+    }
+    
+    printf("\n" YELLOW "Boot Profile:" NC "\n");
+    printf("  %-6s %-22s %10s %10s %6s\n", "WHERE", "PHASE", "START", "DURATION", "SHARE");
+    for (int i = 0; i < profile->count; i++) {
+        BootPhase *phase = &profile->phases[i];
+        double share = total > 0 ? phase->duration / total * 100 : 0;
+        printf("  %-6s %-22s %9.2fs %9.2fs %5.1f%%\n", phase->category, phase->name,
+               phase->start, phase->duration, share);
+    }
+    printf("  %-6s %-22s %10s %9.2fs\n\n", "", "create-to-ready", "", total);
+}
+
+int boot_profile_write_trace(BootProfile *profile, const char *vm_name, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return 1;
+    }
+    
+    // Chrome trace event format: host steps on one track, guest milestones on another
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"%s\"}},\n", vm_name);
+    fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"host\"}},\n");
+    fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"guest\"}}");
+    for (int i = 0; i < profile->count; i++) {
+        BootPhase *phase = &profile->phases[i];
+        int guest = strcmp(phase->category, "guest") == 0;
+        fprintf(fp, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                "\"ts\": %.0f, \"dur\": %.0f}",
+                phase->name, phase->category, guest ? 2 : 1, phase->start * 1e6, phase->duration * 1e6);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 0;
+}
+
+int boot_report_command(int argc, char *argv[]) {
+    const char *vm_name = NULL;
+    const char *trace_path = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (argv[i][0] != '-' && vm_name == NULL) {
+            vm_name = argv[i];
+        } else {
+            log_error("Unknown option");
+            return 1;
+        }
+    }
+    if (vm_name == NULL) {
+        log_error("VM name required");
+        return 1;
+    }
+    
+    char vm_dir[MAX_PATH];
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    if (!name_is_safe(vm_name) || !dir_exists(vm_dir)) {
+        log_error("VM not found");
+        return 1;
+    }
+    
+    BootProfile profile;
+    if (boot_profile_load(vm_dir, &profile) != 0) {
+        log_error("No boot profile recorded for this VM (create it with --profile-boot)");
+        return 1;
+    }
+    boot_profile_print(&profile);
+    
+    if (trace_path != NULL) {
+        if (boot_profile_write_trace(&profile, vm_name, trace_path) != 0) {
+            log_error("Failed to write trace file");
+            return 1;
+        }
+        char message[MAX_LINE];
+        snprintf(message, sizeof(message), "Chrome trace written to %s", trace_path);
+        log_success(message);
+    }
+    return 0;
+}
+
+// Boot scheduler: at most boot_slots VMs go through first boot at once,
+// across every v4m process. A slot is an flock on ~/.v4m/boot-slots/N.lock,
+// held from spawn until the guest reports ready (or the holder exits), so
+// crashed starters never leak slots. On Linux the limit shrinks while the
+// host is already stalled on I/O (PSI io "some" avg10):
+//   below BOOT_PSI_LOW    all slots
+//   below BOOT_PSI_HIGH   half of them
+//   above                 one VM at a time
+int boot_slots = 0;
+
+// A positive whole number, as taken by --max-booting and --prewarm
+int parse_count(const char *text, int *count) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value <= 0 || value > INT_MAX) {
+        return 1;
+    }
+    *count = (int)value;
+    return 0;
+}
+
+int io_pressure(double *some_avg10) {
+#ifdef __APPLE__
+    (void)some_avg10;
+    return 1;
+#else
+    FILE *fp = fopen("/proc/pressure/io", "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    int found = fscanf(fp, "some avg10=%lf", some_avg10) == 1;
+    fclose(fp);
+    return found ? 0 : 1;
+#endif
+}
+
+// Slots currently on offer; PRESSURE is -1 when the host does not report PSI
+int boot_slot_limit(double *pressure) {
+    int slots = boot_slots > 0 ? boot_slots : DEFAULT_BOOT_SLOTS;
+    const char *env = getenv("V4M_MAX_BOOTING");
+    if (boot_slots <= 0 && env != NULL) {
+        parse_count(env, &slots);
+    }
+    
+    *pressure = -1;
+    if (io_pressure(pressure) != 0) {
+        *pressure = -1;
+        return slots;
+    }
+    if (*pressure >= BOOT_PSI_HIGH) return 1;
+    if (*pressure >= BOOT_PSI_LOW) return slots / 2 > 0 ? slots / 2 : 1;
+    return slots;
+}
+
+// Take a slot if fewer than the current limit are held. Slot files past the
+// limit are still counted (another starter may use a larger limit, or the
+// limit just shrank). Returns the locked fd, or -1 with BOOTING filled in
+int boot_slot_try(int *booting, int *limit, double *pressure) {
+    char path[MAX_PATH];
+    *limit = boot_slot_limit(pressure);
+    int ceiling = boot_slots > 0 ? boot_slots : DEFAULT_BOOT_SLOTS;
+    if (*limit > ceiling) ceiling = *limit;
+    
+    snprintf(path, sizeof(path), "%s/.v4m/boot-slots", getenv("HOME"));
+    mkdir(path, 0755);
+    
+    int candidate = -1;
+    *booting = 0;
+    for (int i = 0;; i++) {
+        snprintf(path, sizeof(path), "%s/.v4m/boot-slots/%d.lock", getenv("HOME"), i);
+        int fd = open(path, O_RDWR | O_CLOEXEC | (i < ceiling ? O_CREAT : 0), 0644);
+        if (fd < 0) {
+            break;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            (*booting)++;
+            close(fd);
+        } else if (candidate < 0 && i < ceiling) {
+            candidate = fd;
+        } else {
+            close(fd);
+        }
+    }
+    if (candidate >= 0 && *booting >= *limit) {
+        close(candidate);
+        candidate = -1;
+    }
+    return candidate;
+}
+
+// Block until a slot is free; WAITED gets the time spent queued
+int boot_slot_acquire(double *waited) {
+    TRACE_SCOPE("boot_slot_acquire", NULL);
+    char message[MAX_LINE];
+    double started = now_monotonic();
+    int reported = 0;
+    int booting, limit;
+    double pressure;
+    
+    for (;;) {
+        int fd = boot_slot_try(&booting, &limit, &pressure);
+        if (fd >= 0) {
+            *waited = now_monotonic() - started;
+            return fd;
+        }
+        if (!reported) {
+            if (pressure >= 0) {
+                snprintf(message, sizeof(message), "Waiting for a boot slot (%d booting, limit %d, io pressure %.1f%%)...",
+                         booting, limit, pressure);
+            } else {
+                snprintf(message, sizeof(message), "Waiting for a boot slot (%d booting, limit %d)...", booting, limit);
+            }
+            log_info(message);
+            reported = 1;
+        }
+        usleep(BOOT_QUEUE_POLL_MS * 1000);
+    }
+}
+
+void boot_slot_release(int slot_fd) {
+    if (slot_fd >= 0) close(slot_fd);
+}
+
+// Tracing
+int trace_enabled = 0;
+char trace_path[MAX_PATH];
+uint64_t trace_origin_ns;
+uint64_t trace_id;
+TraceBuffer *trace_buffers = NULL;
+uint32_t trace_next_id = 0;
+int trace_next_tid = 0;
+__thread TraceBuffer *trace_local = NULL;
+__thread uint32_t trace_current = 0;
+
+uint64_t trace_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int trace_start(const char *path) {
+    // Open once up front so a bad path fails before any work is done
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return 1;
+    }
+    fclose(fp);
+    
+    strncpy(trace_path, path, sizeof(trace_path) - 1);
+    trace_origin_ns = trace_clock_ns();
+    trace_id = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL) ^ trace_origin_ns;
+    trace_enabled = 1;
+    atexit(trace_flush);
+    return 0;
+}
+
+TraceBuffer *trace_buffer_new() {
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->tid = trace_local ? trace_local->tid : __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+    
+    // Lock-free push onto the global list; buffers are never unlinked
+    buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return buffer;
+}
+
+TraceSpan trace_start_span(const char *name, const char *detail) {
+    TraceSpan span;
+    span.name = name;
+    span.detail = detail;
+    span.id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+    span.parent = trace_current;
+    trace_current = span.id;
+    span.start_ns = trace_clock_ns();
+    return span;
+}
+
+void trace_finish_span(TraceSpan *span) {
+    uint64_t end_ns = trace_clock_ns();
+    trace_current = span->parent;
+    
+    if (trace_local == NULL || trace_local->count == TRACE_BUFFER_EVENTS) {
+        TraceBuffer *buffer = trace_buffer_new();
+        if (buffer == NULL) return;
+        trace_local = buffer;
+    }
+    
+    TraceEvent *event = &trace_local->events[trace_local->count];
+    event->name = span->name;
+    event->start_ns = span->start_ns;
+    event->duration_ns = end_ns - span->start_ns;
+    event->id = span->id;
+    event->parent = span->parent;
+    event->detail[0] = '\0';
+    if (span->detail != NULL) {
+        // QMP spans carry the whole command; keep just its name
+        if (span->detail[0] != '{' ||
+            json_string_in(span->detail, NULL, "execute", event->detail, sizeof(event->detail)) != 0) {
+            strncpy(event->detail, span->detail, sizeof(event->detail) - 1);
+        }
+    }
+    
+    // Publish after the event is fully written
+    __atomic_store_n(&trace_local->count, trace_local->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_write_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (const char *p = text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if ((unsigned char)*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void trace_flush() {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = 0;
+    
+    FILE *fp = fopen(trace_path, "w");
+    if (fp == NULL) {
+        return;
+    }
+    
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"trace_id\": \"%016llx\"}, \"traceEvents\": [\n",
+            (unsigned long long)trace_id);
+    fprintf(fp, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"v4m\"}}",
+            (int)getpid());
+    
+    for (TraceBuffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+        int count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count; i++) {
+            TraceEvent *event = &buffer->events[i];
+            fprintf(fp, ",\n  {\"name\": ");
+            trace_write_string(fp, event->name);
+            fprintf(fp, ", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"id\": %u, \"parent\": %u, \"detail\": ",
+                    (int)getpid(), buffer->tid,
+                    (event->start_ns - trace_origin_ns) / 1000.0, event->duration_ns / 1000.0,
+                    event->id, event->parent);
+            trace_write_string(fp, event->detail);
+            fprintf(fp, "}}");
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+int run_command(const char *command) {
+    // Name the span after the program being spawned
+    char program[64];
+    size_t len = strcspn(command, " ");
+    if (len >= sizeof(program)) len = sizeof(program) - 1;
+    memcpy(program, command, len);
+    program[len] = '\0';
+    
+    TRACE_SCOPE("spawn", program);
+    return system(command);
+}
+
+// VM metadata (vm-info.json) shared by every command
+int read_file(const char *path, char **data, size_t *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || (*data = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return 1;
+    }
+    size_t total = 0;
+    while (total < (size_t)st.st_size) {
+        ssize_t n = read(fd, *data + total, st.st_size - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += n;
+    }
+    close(fd);
+    (*data)[total] = '\0';
+    *len = total;
+    return 0;
+}
+
+// Fill INFO from a parsed document, upgrading older schemas on the way
+int vm_info_from_json(const JsonDoc *doc, VMInfo *info) {
+    memset(info, 0, sizeof(*info));
+    info->schema = (int)json_get_number(doc, 0, "schema", 1);
+    if (info->schema > VM_INFO_SCHEMA) {
+        return 1;
+    }
+    
+    snprintf(info->name, sizeof(info->name), "%s", json_get_string(doc, 0, "name", ""));
+    snprintf(info->distro, sizeof(info->distro), "%s", json_get_string(doc, 0, "distro", ""));
+    snprintf(info->username, sizeof(info->username), "%s", json_get_string(doc, 0, "username", ""));
+    snprintf(info->password, sizeof(info->password), "%s", json_get_string(doc, 0, "password", ""));
+    snprintf(info->mac, sizeof(info->mac), "%s", json_get_string(doc, 0, "mac", ""));
+    snprintf(info->disk_size, sizeof(info->disk_size), "%s", json_get_string(doc, 0, "disk_size", DEFAULT_DISK_SIZE));
+    snprintf(info->created, sizeof(info->created), "%s", json_get_string(doc, 0, "created", ""));
+    
+    if (info->schema == 1) {
+        // 1 -> 2: numeric strings become numbers
+        info->memory_mb = atoi(json_get_string(doc, 0, "memory", DEFAULT_MEMORY));
+        info->cpus = atoi(json_get_string(doc, 0, "cpus", DEFAULT_CPUS));
+    } else {
+        info->memory_mb = (int)json_get_number(doc, 0, "memory", atoi(DEFAULT_MEMORY));
+        info->cpus = (int)json_get_number(doc, 0, "cpus", atoi(DEFAULT_CPUS));
+    }
+    if (info->memory_mb <= 0) info->memory_mb = atoi(DEFAULT_MEMORY);
+    if (info->cpus <= 0) info->cpus = atoi(DEFAULT_CPUS);
+    
+    int autostart = json_get(doc, 0, "autostart");
+    info->autostart = autostart >= 0 && doc->nodes[autostart].type == JSON_TRUE;
+    snprintf(info->pool, sizeof(info->pool), "%s", json_get_string(doc, 0, "pool", "default"));
+    snprintf(info->network, sizeof(info->network), "%s", json_get_string(doc, 0, "network", DEFAULT_NETWORK));
+    snprintf(info->fleet, sizeof(info->fleet), "%s", json_get_string(doc, 0, "fleet", ""));
+    const char *format = json_get_string(doc, 0, "disk_format", "qcow2");
+    snprintf(info->disk_format, sizeof(info->disk_format), "%s", strcmp(format, "raw") == 0 ? "raw" : "qcow2");
+    return 0;
+}
+
+int load_vm_info(const char *vm_dir, VMInfo *info) {
+    char path[MAX_PATH];
+    char *data;
+    size_t len;
+    JsonDoc doc;
+    
+    memset(info, 0, sizeof(*info));
+    snprintf(path, sizeof(path), "%s/vm-info.json", vm_dir);
+    if (read_file(path, &data, &len) != 0) {
+        return 1;
+    }
+    int result = json_parse(&doc, data, len) != 0 || vm_info_from_json(&doc, info) != 0;
+    json_free(&doc);
+    free(data);
+    return result;
+}
+
+int save_vm_info(const char *vm_dir, const VMInfo *info) {
+    char path[MAX_PATH];
+    StrBuf sb = {0};
+    
+    sb_printf(&sb, "{\n    \"schema\": %d,\n    \"name\": ", VM_INFO_SCHEMA);
+    json_write_string(&sb, info->name);
+    sb_printf(&sb, ",\n    \"distro\": ");
+    json_write_string(&sb, info->distro);
+    sb_printf(&sb, ",\n    \"username\": ");
+    json_write_string(&sb, info->username);
+    sb_printf(&sb, ",\n    \"password\": ");
+    json_write_string(&sb, info->password);
+    sb_printf(&sb, ",\n    \"mac\": ");
+    json_write_string(&sb, info->mac);
+    sb_printf(&sb, ",\n    \"memory\": %d,\n    \"cpus\": %d,\n    \"disk_size\": ", info->memory_mb, info->cpus);
+    json_write_string(&sb, info->disk_size);
+    sb_printf(&sb, ",\n    \"created\": ");
+    json_write_string(&sb, info->created);
+    sb_printf(&sb, ",\n    \"autostart\": %s,\n    \"pool\": ", info->autostart ? "true" : "false");
+    json_write_string(&sb, info->pool[0] ? info->pool : "default");
+    sb_printf(&sb, ",\n    \"network\": ");
+    json_write_string(&sb, info->network[0] ? info->network : DEFAULT_NETWORK);
+    if (info->fleet[0]) {
+        sb_printf(&sb, ",\n    \"fleet\": ");
+        json_write_string(&sb, info->fleet);
+    }
+    sb_printf(&sb, ",\n    \"disk_format\": \"%s\"", strcmp(info->disk_format, "raw") == 0 ? "raw" : "qcow2");
+    sb_printf(&sb, "\n}\n");
+    
+    snprintf(path, sizeof(path), "%s/vm-info.json", vm_dir);
+    int result = sb.data == NULL || write_file_atomic(path, sb.data, sb.len) != 0;
+    sb_free(&sb);
+    return result;
+}
+
+// State layout:
+//   ~/.v4m/vms/<xx>/<name>   VM directories, xx = low byte of FNV-1a(name)
+//   ~/.v4m/vms/index         sorted names of live VMs, rebuildable from the shards
+//   ~/.v4m/tombstones/       deleted VMs, renamed out of the live tree before removal
+unsigned int vm_shard(const char *vm_name) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = vm_name; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return hash & 0xff;
+}
+
+void vm_dir_path(const char *vm_name, char *vm_dir, size_t size) {
+    snprintf(vm_dir, size, "%s/.v4m/vms/%02x/%s", getenv("HOME"), vm_shard(vm_name), vm_name);
+}
+
+int state_lock() {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/.v4m/vms/index.lock", getenv("HOME"));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        flock(fd, LOCK_EX);
+    }
+    return fd;
+}
+
+void state_unlock(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+// Index contents minus the header; readers need no lock since writers rename
+int index_read(StrBuf *names) {
+    char path[MAX_PATH];
+    char *data;
+    size_t len;
+    size_t header_len = strlen(STATE_INDEX_HEADER);
+    
+    memset(names, 0, sizeof(*names));
+    snprintf(path, sizeof(path), "%s/.v4m/vms/index", getenv("HOME"));
+    if (read_file(path, &data, &len) != 0) {
+        return 1;
+    }
+    if (len < header_len || strncmp(data, STATE_INDEX_HEADER, header_len) != 0) {
+        free(data);
+        return 1;
+    }
+    memmove(data, data + header_len, len - header_len + 1);
+    names->data = data;
+    names->len = len - header_len;
+    names->cap = len + 1;
+    return 0;
+}
+
+int index_write(const char *names, size_t len) {
+    char path[MAX_PATH];
+    StrBuf sb = {0};
+    snprintf(path, sizeof(path), "%s/.v4m/vms/index", getenv("HOME"));
+    sb_printf(&sb, "%s%.*s", STATE_INDEX_HEADER, (int)len, names ? names : "");
+    int result = sb.data == NULL || write_file_atomic(path, sb.data, sb.len) != 0;
+    sb_free(&sb);
+    return result;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int index_rebuild_locked() {
+    char vms_dir[MAX_PATH];
+    char target[MAX_PATH];
+    snprintf(vms_dir, sizeof(vms_dir), "%s/.v4m/vms", getenv("HOME"));
+    
+    // Move VMs from the old flat layout into their shard. A shard never holds
+    // vm-info.json itself, which tells the two apart.
+    DIR *dir = opendir(vms_dir);
+    struct dirent *entry;
+    char path[sizeof(vms_dir) + sizeof(entry->d_name) + 16];
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s/vm-info.json", vms_dir, entry->d_name);
+        if (!file_exists(path)) continue;
+        
+        snprintf(path, sizeof(path), "%s/%02x", vms_dir, vm_shard(entry->d_name));
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/%s", vms_dir, entry->d_name);
+        vm_dir_path(entry->d_name, target, sizeof(target));
+        if (!dir_exists(target)) rename(path, target);
+    }
+    if (dir != NULL) closedir(dir);
+    
+    char **names = NULL;
+    int count = 0;
+    int capacity = 0;
+    for (unsigned int shard = 0; shard < 256; shard++) {
+        snprintf(path, sizeof(path), "%s/%02x", vms_dir, shard);
+        dir = opendir(path);
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                char **grown = realloc(names, capacity * sizeof(char *));
+                if (grown == NULL) break;
+                names = grown;
+            }
+            names[count++] = strdup(entry->d_name);
+        }
+        if (dir != NULL) closedir(dir);
+    }
+    
+    StrBuf sb = {0};
+    if (count > 1) qsort(names, count, sizeof(char *), compare_names);
+    for (int i = 0; i < count; i++) {
+        sb_printf(&sb, "%s\n", names[i]);
+        free(names[i]);
+    }
+    free(names);
+    int result = index_write(sb.data, sb.len);
+    sb_free(&sb);
+    return result == 0 ? count : -1;
+}
+
+int index_rebuild() {
+    int lock = state_lock();
+    int count = index_rebuild_locked();
+    state_unlock(lock);
+    return count;
+}
+
+// Add or drop one name, keeping the index sorted
+int index_update(const char *vm_name, int add) {
+    StrBuf names;
+    StrBuf updated = {0};
+    int lock = state_lock();
+    
+    if (index_read(&names) != 0) {
+        // Missing or damaged: the shards are the source of truth
+        int count = index_rebuild_locked();
+        state_unlock(lock);
+        return count < 0;
+    }
+    
+    int inserted = !add;
+    char *line = names.data;
+    while (line < names.data + names.len) {
+        char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        int cmp = strncmp(line, vm_name, len);
+        if (cmp == 0 && vm_name[len] != '\0') cmp = -1;
+        
+        if (!inserted && cmp >= 0) {
+            sb_printf(&updated, "%s\n", vm_name);
+            inserted = 1;
+        }
+        if (cmp != 0 && len > 0) sb_printf(&updated, "%.*s\n", (int)len, line);
+        line += len + 1;
+    }
+    if (!inserted) sb_printf(&updated, "%s\n", vm_name);
+    
+    int result = index_write(updated.data, updated.len);
+    state_unlock(lock);
+    sb_free(&names);
+    sb_free(&updated);
+    return result;
+}
+
+// Create the (empty) VM directory in its shard and publish it in the index
+int vm_dir_create(const char *vm_name) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/.v4m/vms/%02x", getenv("HOME"), vm_shard(vm_name));
+    mkdir(path, 0755);
+    vm_dir_path(vm_name, path, sizeof(path));
+    if (mkdir(path, 0755) != 0) {
+        return 1;
+    }
+    return index_update(vm_name, 1);
+}
+
+// Deleting is a rename into the tombstone area plus an index update; the
+// tree itself is removed afterwards and never blocks the name
+int vm_tombstone(const char *vm_name, char *tombstone, size_t size) {
+    char vm_dir[MAX_PATH];
+    vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+    snprintf(tombstone, size, "%s/.v4m/tombstones/%s.%ld.%d", getenv("HOME"), vm_name, (long)time(NULL), (int)getpid());
+    
+    // Neither the RAM store nor the directory may go while QEMU still has
+    // them open, and a supervisor would start it again
+    if (vm_is_active(vm_dir)) {
+        StopTarget target;
+        memset(&target, 0, sizeof(target));
+        snprintf(target.name, sizeof(target.name), "%s", vm_name);
+        snprintf(target.vm_dir, sizeof(target.vm_dir), "%s", vm_dir);
+        if (stop_vms(&target, 1, 0, STOP_QUIT_TIMEOUT) != 0) {
+            return 1;
+        }
+    }
+    
+    // RAM storage is freed here; only the symlink goes to the tombstone area
+    ephemeral_release(vm_dir);
+    if (rename(vm_dir, tombstone) != 0) {
+        if (errno != ENOENT) return 1;
+    } else {
+        event_record(vm_name, "deleted", NULL);
+    }
+    return index_update(vm_name, 0);
+}
+
+int vm_destroy(const char *vm_name) {
+    char tombstone[MAX_PATH];
+    if (vm_tombstone(vm_name, tombstone, sizeof(tombstone)) != 0) {
+        return 1;
+    }
+    return reaper_spawn();
+}
+
+// Background reaper: empties the tombstone area at idle I/O priority so a
+// delete returns as soon as its rename is done
+void reaper_lower_priority() {
+#ifdef __APPLE__
+    setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE);
+#elif defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS, self, IOPRIO_CLASS_IDLE
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+    setpriority(PRIO_PROCESS, 0, 10);
+}
+
+// Like remove_tree, but big files are shrunk in steps first so freeing a
+// fragmented image never turns into one long burst of metadata I/O
+int reaper_remove(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : 1;
+    }
+    
+    // A disk on another storage pool goes with the VM that links to it
+    const char *base = strrchr(path, '/');
+    if (S_ISLNK(st.st_mode) && base != NULL && strcmp(base + 1, "disk.qcow2") == 0) {
+        char target[MAX_PATH];
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n > 0) {
+            target[n] = '\0';
+            reaper_remove(target);
+        }
+    }
+    
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            return 1;
+        }
+        int result = 0;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            char child[MAX_PATH];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            result |= reaper_remove(child);
+        }
+        closedir(dir);
+        return (rmdir(path) == 0 ? 0 : 1) | result;
+    }
+    
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_blocks * 512 > REAPER_TRUNCATE_STEP) {
+        int fd = open(path, O_WRONLY);
+        if (fd >= 0) {
+            off_t size = st.st_size;
+            while (size > REAPER_TRUNCATE_STEP) {
+                size -= REAPER_TRUNCATE_STEP;
+                if (ftruncate(fd, size) != 0) break;
+                usleep(REAPER_STEP_PAUSE_US);
+            }
+            close(fd);
+        }
+    }
+    return unlink(path) == 0 ? 0 : 1;
+}
+
+// Returns the number of entries removed in one pass; entries that could not
+// be removed are counted in FAILED and left for a later reaper
+int reaper_sweep(const char *tombstones, int *failed) {
+    char path[MAX_PATH];
+    int removed = 0;
+    *failed = 0;
+    
+    DIR *dir = opendir(tombstones);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", tombstones, entry->d_name);
+        if (reaper_remove(path) == 0) {
+            removed++;
+        } else {
+            (*failed)++;
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    return removed;
+}
+
+int reaper_sweep_pending(const char *tombstones) {
+    int pending = 0;
+    DIR *dir = opendir(tombstones);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') pending++;
+    }
+    if (dir != NULL) closedir(dir);
+    return pending;
+}
+
+void reaper_run() {
+    char tombstones[MAX_PATH];
+    char lock_path[MAX_PATH + 16];
+    snprintf(tombstones, sizeof(tombstones), "%s/.v4m/tombstones", getenv("HOME"));
+    snprintf(lock_path, sizeof(lock_path), "%s/.reaper.lock", tombstones);
+    
+    for (;;) {
+        // One reaper at a time; the one holding the lock picks up new entries
+        int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            if (fd >= 0) close(fd);
+            return;
+        }
+        // Sweep until a pass makes no progress, so an entry that cannot be
+        // removed does not keep the reaper spinning
+        int stuck = 0;
+        while (reaper_sweep(tombstones, &stuck) > 0) {
+        }
+        close(fd);
+        
+        // A tombstone added while the lock was being released would otherwise
+        // wait for the next delete
+        if (reaper_sweep_pending(tombstones) <= stuck) {
+            return;
+        }
+    }
+}
+
+// Detach a reaper (double fork, new session) and return immediately
+int reaper_spawn() {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return 1;
+    }
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+        reaper_lower_priority();
+        reaper_run();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+int reindex_command() {
+    char message[MAX_LINE];
+    init_dirs();
+    int count = index_rebuild();
+    if (count < 0) {
+        log_error("Failed to rebuild the VM index");
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Index rebuilt: %d VM(s)", count);
+    log_success(message);
+    return 0;
+}
+
+void sanitize_vm_name(const char *name, char *out, size_t size) {
+    size_t len = 0;
+    for (const char *p = name; *p && len < size - 1; p++) {
+        char c = tolower((unsigned char)*p);
+        if (!isalnum((unsigned char)c)) c = '-';
+        // Collapse runs of dashes and drop a leading one
+        if (c == '-' && (len == 0 || out[len - 1] == '-')) continue;
+        out[len++] = c;
+    }
+    while (len > 0 && out[len - 1] == '-') len--;
+    out[len] = '\0';
+}
+
+// VM and image names from the command line become path components under
+// ~/.v4m; anything that could step out of its directory ("", ".", "..",
+// a '/') is refused
+int name_is_safe(const char *name) {
+    if (!isalnum((unsigned char)name[0])) {
+        return 0;
+    }
+    for (const char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && strchr("-_.", *p) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int collect_vm_visit(const char *vm_name, const char *vm_dir, void *ctx) {
+    VMList *list = ctx;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        VMEntry *items = realloc(list->items, capacity * sizeof(VMEntry));
+        if (items == NULL) return 1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    VMEntry *entry = &list->items[list->count++];
+    snprintf(entry->name, sizeof(entry->name), "%s", vm_name);
+    snprintf(entry->dir, sizeof(entry->dir), "%s", vm_dir);
+    return 0;
+}
+
+// All VMs sorted by name (the index is kept sorted)
+int collect_vms(VMList *list) {
+    memset(list, 0, sizeof(*list));
+    for_each_vm(collect_vm_visit, list);
+    return list->count;
+}
+
+void free_vm_list(VMList *list) {
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// Virtual size from the qcow2 header (big-endian u64 at offset 24); raw
+// images are their own size
+int disk_virtual_size(const char *path, uint64_t *size) {
+    unsigned char header[32];
+    struct stat st;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    ssize_t n = read(fd, header, sizeof(header));
+    int result = fstat(fd, &st);
+    close(fd);
+    if (result != 0) {
+        return 1;
+    }
+    
+    if (n == (ssize_t)sizeof(header) && memcmp(header, "QFI\xfb", 4) == 0) {
+        *size = 0;
+        for (int i = 24; i < 32; i++) {
+            *size = (*size << 8) | header[i];
+        }
+    } else {
+        *size = st.st_size;
+    }
+    return 0;
+}
+
+int parse_mac(const char *text, unsigned char mac[6]) {
+    unsigned int b[6];
+    if (sscanf(text, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+        return 1;
+    }
+    for (int i = 0; i < 6; i++) mac[i] = (unsigned char)b[i];
+    return 0;
+}
+
+// Snapshot of the host neighbour table, read in-process instead of
+// pinging NAME.local for every VM
+int arp_table_load(ArpEntry **entries) {
+    int count = 0;
+    int capacity = 0;
+    *entries = NULL;
+    
+#ifdef __APPLE__
+    int mib[6] = {CTL_NET, PF_ROUTE, 0, AF_INET, NET_RT_FLAGS, RTF_LLINFO};
+    size_t needed = 0;
+    if (sysctl(mib, 6, NULL, &needed, NULL, 0) != 0 || needed == 0) {
+        return 0;
+    }
+    char *buf = malloc(needed);
+    if (buf == NULL || sysctl(mib, 6, buf, &needed, NULL, 0) != 0) {
+        free(buf);
+        return 0;
+    }
+    for (char *next = buf; next < buf + needed; ) {
+        struct rt_msghdr *rtm = (struct rt_msghdr *)next;
+        struct sockaddr_in *sin = (struct sockaddr_in *)(rtm + 1);
+        size_t sin_len = sin->sin_len > 0 ? (1 + ((sin->sin_len - 1) | (sizeof(uint32_t) - 1))) : sizeof(uint32_t);
+        struct sockaddr_dl *sdl = (struct sockaddr_dl *)((char *)sin + sin_len);
+        next += rtm->rtm_msglen;
+        if (sdl->sdl_family != AF_LINK || sdl->sdl_alen != 6) continue;
+        
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            ArpEntry *grown = realloc(*entries, capacity * sizeof(ArpEntry));
+            if (grown == NULL) break;
+            *entries = grown;
+        }
+        inet_ntop(AF_INET, &sin->sin_addr, (*entries)[count].ip, sizeof((*entries)[count].ip));
+        memcpy((*entries)[count].mac, LLADDR(sdl), 6);
+        count++;
+    }
+    free(buf);
+#else
+    char line[MAX_LINE];
+    FILE *fp = fopen("/proc/net/arp", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    // IP address  HW type  Flags  HW address  Mask  Device
+    while (fgets(line, sizeof(line), fp)) {
+        char ip[64];
+        char hw[64];
+        if (sscanf(line, "%63s %*s %*s %63s", ip, hw) != 2) continue;
+        
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            ArpEntry *grown = realloc(*entries, capacity * sizeof(ArpEntry));
+            if (grown == NULL) break;
+            *entries = grown;
+        }
+        if (parse_mac(hw, (*entries)[count].mac) != 0) continue;
+        snprintf((*entries)[count].ip, sizeof((*entries)[count].ip), "%s", ip);
+        count++;
+    }
+    fclose(fp);
+#endif
+    return count;
+}
+
+int arp_lookup(const ArpEntry *entries, int count, const char *mac_text, char *ip, size_t size) {
+    unsigned char mac[6];
+    if (parse_mac(mac_text, mac) != 0) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (memcmp(entries[i].mac, mac, 6) == 0) {
+            snprintf(ip, size, "%s", entries[i].ip);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int get_vm_ip(const char *vm_name, const char *mac, char *ip, size_t size) {
+    ArpEntry *entries;
+    int count = arp_table_load(&entries);
+    int result = arp_lookup(entries, count, mac, ip, size);
+    free(entries);
+    if (result == 0) {
+        return 0;
+    }
+    
+    // Not in the neighbour cache yet: fall back to mDNS via the system resolver
+    char host[MAX_NAME + 8];
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    snprintf(host, sizeof(host), "%s.local", vm_name);
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+        return 1;
+    }
+    inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, ip, size);
+    freeaddrinfo(res);
+    return 0;
+}
+
+int confirm(const char *prompt, const char *expected) {
+    char answer[MAX_NAME];
+    printf("%s", prompt);
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) == NULL) {
+        return 0;
+    }
+    answer[strcspn(answer, "\n")] = '\0';
+    if (expected != NULL) {
+        return strcmp(answer, expected) == 0;
+    }
+    return strcmp(answer, "y") == 0 || strcmp(answer, "Y") == 0;
+}
+
+// Resolve NAME to its directory, reporting the usual errors
+int require_vm(int argc, char *argv[], char *vm_dir, size_t size) {
+    char message[MAX_LINE];
+    if (argc < 2 || argv[1][0] == '\0') {
+        log_error("VM name required");
+        return 1;
+    }
+    vm_dir_path(argv[1], vm_dir, size);
+    if (!name_is_safe(argv[1]) || !dir_exists(vm_dir)) {
+        snprintf(message, sizeof(message), "VM '%s' not found", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    return 0;
+}
+
+int vm_list_command() {
+    VMList list;
+    ArpEntry *arp = NULL;
+    int arp_count = -1;
+    
+    init_dirs();
+    printf("\n" YELLOW "Virtual Machines:" NC "\n\n");
+    
+    if (collect_vms(&list) == 0) {
+        printf("  No VMs found\n");
+        return 0;
+    }
+    
+    printf("%-15s %-10s %-5s %-8s %-10s %-10s %-15s %-10s\n", "NAME", "DISTRO", "CPUS", "MEMORY", "DISK SIZE", "DISK USED", "IP", "STATUS");
+    printf("%-15s %-10s %-5s %-8s %-10s %-10s %-15s %-10s\n", "----", "------", "-----", "------", "---------", "---------", "--", "------");
+    
+    for (int i = 0; i < list.count; i++) {
+        VMInfo info;
+        char disk[MAX_PATH + 16];
+        char memory[16];
+        char disk_size[16] = "-";
+        char disk_used[16] = "-";
+        char ip[64] = "-";
+        struct stat st;
+        uint64_t virtual_size;
+        
+        if (load_vm_info(list.items[i].dir, &info) != 0) continue;
+        
+        int memory_gb = info.memory_mb / 1024;
+        if (memory_gb == 0) snprintf(memory, sizeof(memory), "<1GB");
+        else snprintf(memory, sizeof(memory), "%dGB", memory_gb);
+        
+        snprintf(disk, sizeof(disk), "%s/disk.qcow2", list.items[i].dir);
+        if (stat(disk, &st) == 0) {
+            format_size((double)st.st_blocks * 512, disk_used, sizeof(disk_used));
+            if (disk_virtual_size(disk, &virtual_size) == 0) {
+                format_size((double)virtual_size, disk_size, sizeof(disk_size));
+            } else {
+                snprintf(disk_size, sizeof(disk_size), "%s", info.disk_size);
+            }
+        }
+        
+        int running = read_vm_pid(list.items[i].dir) > 0;
+        if (running) {
+            // One neighbour table read serves every running VM
+            if (arp_count < 0) arp_count = arp_table_load(&arp);
+            if (arp_lookup(arp, arp_count, info.mac, ip, sizeof(ip)) != 0) snprintf(ip, sizeof(ip), "-");
+        }
+        
+        // A live supervisor without QEMU is waiting out a crash backoff
+        const char *status = GRAY "stopped" NC;
+        if (running) {
+            status = GREEN "running" NC;
+        } else {
+            char supervisor_file[MAX_PATH + 16];
+            snprintf(supervisor_file, sizeof(supervisor_file), "%s/supervisor.pid", list.items[i].dir);
+            if (read_pid_file(supervisor_file) > 0) status = YELLOW "restarting" NC;
+        }
+        
+        printf("%-15s %-10s %-5d %-8s %-10s %-10s %-15s %s\n", list.items[i].name, info.distro, info.cpus,
+               memory, disk_size, disk_used, ip, status);
+    }
+    
+    free(arp);
+    free_vm_list(&list);
+    return 0;
+}
+
+int vm_start_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    VMInfo info;
+    
+    if (require_vm(argc, argv, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--max-booting") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &boot_slots) != 0) {
+                log_error("Invalid --max-booting (a positive number)");
+                return 1;
+            }
+        } else {
+            snprintf(message, sizeof(message), "Unknown option: %s", argv[i]);
+            log_error(message);
+            return 1;
+        }
+    }
+    // A supervisor waiting out a crash backoff will bring QEMU back itself
+    if (vm_is_active(vm_dir)) {
+        snprintf(message, sizeof(message), "VM '%s' is already running", argv[1]);
+        log_warning(message);
+        return 0;
+    }
+    if (load_vm_info(vm_dir, &info) != 0) {
+        log_error("VM info file not found");
+        return 1;
+    }
+    if (check_root() != 0) {
+        return 1;
+    }
+    return start_vm(argv[1], info.mac, vm_dir);
+}
+
+// vm stop NAME... | --all [--timeout SEC] [--quit-timeout SEC]
+int vm_stop_command(int argc, char *argv[]) {
+    char message[MAX_LINE];
+    double powerdown_timeout = STOP_POWERDOWN_TIMEOUT;
+    double quit_timeout = STOP_QUIT_TIMEOUT;
+    int all = 0;
+    VMList list = {0};
+    
+    StopTarget *targets = calloc(argc > 1 ? argc : 1, sizeof(StopTarget));
+    if (targets == NULL) {
+        log_error("Out of memory");
+        return 1;
+    }
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            powerdown_timeout = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--quit-timeout") == 0 && i + 1 < argc) {
+            quit_timeout = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--all") == 0) {
+            all = 1;
+        } else if (argv[i][0] == '-') {
+            snprintf(message, sizeof(message), "Unknown option: %s", argv[i]);
+            log_error(message);
+            free(targets);
+            return 1;
+        } else {
+            char *one[] = {argv[0], argv[i]};
+            if (require_vm(2, one, targets[count].vm_dir, sizeof(targets[count].vm_dir)) != 0) {
+                free(targets);
+                return 1;
+            }
+            snprintf(targets[count].name, sizeof(targets[count].name), "%s", argv[i]);
+            count++;
+        }
+    }
+    if (all) {
+        collect_vms(&list);
+        StopTarget *grown = realloc(targets, (count + list.count + 1) * sizeof(StopTarget));
+        if (grown == NULL) {
+            log_error("Out of memory");
+            free(targets);
+            free_vm_list(&list);
+            return 1;
+        }
+        targets = grown;
+        for (int i = 0; i < list.count; i++) {
+            if (!vm_is_active(list.items[i].dir)) continue;
+            memset(&targets[count], 0, sizeof(StopTarget));
+            snprintf(targets[count].name, sizeof(targets[count].name), "%s", list.items[i].name);
+            snprintf(targets[count].vm_dir, sizeof(targets[count].vm_dir), "%s", list.items[i].dir);
+            count++;
+        }
+        free_vm_list(&list);
+    } else if (count == 0) {
+        log_error("VM name required");
+        free(targets);
+        return 1;
+    }
+    
+    int running = 0;
+    for (int i = 0; i < count; i++) {
+        if (vm_is_active(targets[i].vm_dir)) running++;
+    }
+    if (running == 0) {
+        if (count == 1) {
+            snprintf(message, sizeof(message), "VM '%s' is not running", targets[0].name);
+            log_warning(message);
+        } else {
+            log_info("No running VMs to stop");
+        }
+        // Clears stale pid files
+        stop_vms(targets, count, powerdown_timeout, quit_timeout);
+        free(targets);
+        return 0;
+    }
+    
+    if (count == 1) {
+        snprintf(message, sizeof(message), "Stopping VM '%s'...", targets[0].name);
+    } else {
+        snprintf(message, sizeof(message), "Stopping %d VM(s)...", running);
+    }
+    log_info(message);
+    double started = now_monotonic();
+    int failed = stop_vms(targets, count, powerdown_timeout, quit_timeout);
+    double elapsed = now_monotonic() - started;
+    
+    if (count == 1) {
+        if (failed) {
+            snprintf(message, sizeof(message), "VM '%s' did not stop", targets[0].name);
+            log_error(message);
+        } else {
+            snprintf(message, sizeof(message), "VM '%s' stopped (%s, %.2fs)", targets[0].name, targets[0].result, targets[0].seconds);
+            log_success(message);
+        }
+        free(targets);
+        return failed ? 1 : 0;
+    }
+    
+    printf("\n%-15s %-12s %s\n", "NAME", "RESULT", "TIME");
+    printf("%-15s %-12s %s\n", "----", "------", "----");
+    for (int i = 0; i < count; i++) {
+        if (strcmp(targets[i].result, "not running") == 0) continue;
+        printf("%-15s %-12s %.2fs\n", targets[i].name, targets[i].result, targets[i].seconds);
+    }
+    printf("\n");
+    free(targets);
+    if (failed) {
+        snprintf(message, sizeof(message), "%d VM(s) did not stop", failed);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Stopped %d VM(s) in %.2fs", running, elapsed);
+    log_success(message);
+    return 0;
+}
+
+int vm_delete_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    char prompt[MAX_LINE];
+    
+    if (require_vm(argc, argv, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    
+    int active = vm_is_active(vm_dir);
+    if (active) {
+        snprintf(message, sizeof(message), "VM '%s' is currently running", argv[1]);
+        log_warning(message);
+        snprintf(prompt, sizeof(prompt), "Stop and delete VM '%s'? This action cannot be undone (y/N): ", argv[1]);
+    } else {
+        snprintf(prompt, sizeof(prompt), "Delete VM '%s'? This action cannot be undone (y/N): ", argv[1]);
+    }
+    if (!confirm(prompt, NULL)) {
+        log_info("Delete cancelled");
+        return 0;
+    }
+    
+    // The disk is about to go away, so there is no point in a clean guest
+    // shutdown. The supervisor leaves once it sees the stop request
+    if (active) {
+        StopTarget target;
+        memset(&target, 0, sizeof(target));
+        snprintf(target.name, sizeof(target.name), "%s", argv[1]);
+        snprintf(target.vm_dir, sizeof(target.vm_dir), "%s", vm_dir);
+        if (stop_vms(&target, 1, 0, STOP_QUIT_TIMEOUT) != 0) {
+            snprintf(message, sizeof(message), "VM '%s' is still running; not deleting it", argv[1]);
+            log_error(message);
+            return 1;
+        }
+    }
+    if (vm_destroy(argv[1]) != 0) {
+        snprintf(message, sizeof(message), "Failed to delete VM '%s'", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "VM '%s' deleted", argv[1]);
+    log_success(message);
+    return 0;
+}
+
+int vm_ip_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    char ip[64];
+    VMInfo info;
+    
+    if (require_vm(argc, argv, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    if (read_vm_pid(vm_dir) <= 0) {
+        snprintf(message, sizeof(message), "VM '%s' is not running", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    load_vm_info(vm_dir, &info);
+    if (get_vm_ip(argv[1], info.mac, ip, sizeof(ip)) != 0) {
+        snprintf(message, sizeof(message), "Could not determine IP for VM '%s'. Try: ssh user@%s.local", argv[1], argv[1]);
+        log_error(message);
+        return 1;
+    }
+    printf("%s\n", ip);
+    return 0;
+}
+
+int vm_console_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    char sock_path[MAX_PATH + 16];
+    char message[MAX_LINE];
+    struct stat st;
+    
+    if (require_vm(argc, argv, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    if (read_vm_pid(vm_dir) <= 0) {
+        snprintf(message, sizeof(message), "VM '%s' is not running", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    snprintf(sock_path, sizeof(sock_path), "%s/console.sock", vm_dir);
+    int fd = -1;
+    if (stat(sock_path, &st) != 0 || !S_ISSOCK(st.st_mode) || (fd = unix_connect(sock_path)) < 0) {
+        snprintf(message, sizeof(message), "Console socket not found for VM '%s'", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    
+    snprintf(message, sizeof(message), "Connecting to console for VM '%s'", argv[1]);
+    log_info(message);
+    log_info("Press Ctrl+] to disconnect");
+    printf("\n");
+    fflush(stdout);
+    
+    // Raw mode so Ctrl+C and friends reach the guest; Ctrl+] detaches
+    struct termios saved;
+    int raw = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (raw) {
+        struct termios t = saved;
+        cfmakeraw(&t);
+        tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    }
+    
+    char buf[4096];
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    int done = 0;
+    while (!done && poll(fds, 2, -1) > 0) {
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) break;
+            char *detach = memchr(buf, 0x1d, n);
+            if (detach != NULL) {
+                n = detach - buf;
+                done = 1;
+            }
+            if (n > 0 && send(fd, buf, n, MSG_NOSIGNAL) != n) break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0 || write(STDOUT_FILENO, buf, n) != n) break;
+        }
+    }
+    
+    if (raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+    close(fd);
+    printf("\n");
+    log_info("Disconnected from console");
+    return 0;
+}
+
+// vm autostart NAME on|off
+int vm_autostart_command(int argc, char *argv[]) {
+    char vm_dir[MAX_PATH];
+    char message[MAX_LINE];
+    VMInfo info;
+    
+    if (require_vm(argc, argv, vm_dir, sizeof(vm_dir)) != 0) {
+        return 1;
+    }
+    if (argc < 3 || (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0)) {
+        log_error("Usage: v4m vm autostart <name> on|off");
+        return 1;
+    }
+    if (load_vm_info(vm_dir, &info) != 0) {
+        log_error("VM info file not found");
+        return 1;
+    }
+    info.autostart = strcmp(argv[2], "on") == 0;
+    if (save_vm_info(vm_dir, &info) != 0) {
+        log_error("Failed to save VM info");
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Autostart %s for VM '%s'", info.autostart ? "enabled" : "disabled", argv[1]);
+    log_success(message);
+    return 0;
+}
+
+// autostart [--max-booting N] [--stagger SEC]: start every autostart VM
+// that is not running, admitting each through the boot queue and keeping
+// its slot until the guest is ready. Meant for a launchd/systemd unit at
+// host boot
+int autostart_command(int argc, char *argv[]) {
+    char message[MAX_LINE];
+    double stagger = AUTOSTART_STAGGER;
+    VMList list;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stagger") == 0 && i + 1 < argc) {
+            stagger = atof(argv[++i]);
+            if (stagger < 0) stagger = 0;
+        } else if (strcmp(argv[i], "--max-booting") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &boot_slots) != 0) {
+                log_error("Invalid --max-booting (a positive number)");
+                return 1;
+            }
+        } else {
+            snprintf(message, sizeof(message), "Unknown option: %s", argv[i]);
+            log_error(message);
+            return 1;
+        }
+    }
+    if (check_root() != 0) {
+        return 1;
+    }
+    init_dirs();
+    collect_vms(&list);
+    
+    // Queue in index order
+    BootTicket *tickets = calloc(list.count + 1, sizeof(BootTicket));
+    if (tickets == NULL) {
+        log_error("Out of memory");
+        free_vm_list(&list);
+        return 1;
+    }
+    int queued = 0;
+    for (int i = 0; i < list.count; i++) {
+        VMInfo info;
+        if (load_vm_info(list.items[i].dir, &info) != 0 || !info.autostart) continue;
+        if (vm_is_active(list.items[i].dir)) continue;
+        tickets[queued].vm = i;
+        tickets[queued].slot_fd = -1;
+        queued++;
+    }
+    if (queued == 0) {
+        log_info("No autostart VMs to start");
+        free(tickets);
+        free_vm_list(&list);
+        return 0;
+    }
+    snprintf(message, sizeof(message), "Starting %d autostart VM(s)...", queued);
+    log_info(message);
+    
+    double started = now_monotonic();
+    double last_admit = 0;
+    int next = 0;
+    int booting = 0;
+    int ready = 0;
+    int failed = 0;
+    while (next < queued || booting > 0) {
+        // Admit while slots are free, no faster than one per STAGGER seconds
+        while (next < queued && (last_admit == 0 || now_monotonic() - last_admit >= stagger)) {
+            int held, limit;
+            double pressure;
+            int fd = boot_slot_try(&held, &limit, &pressure);
+            if (fd < 0) break;
+            
+            BootTicket *t = &tickets[next++];
+            VMEntry *vm = &list.items[t->vm];
+            VMInfo info;
+            t->waited = now_monotonic() - started;
+            if (load_vm_info(vm->dir, &info) != 0 || spawn_vm(vm->name, info.mac, vm->dir) != 0) {
+                boot_slot_release(fd);
+                failed++;
+                continue;
+            }
+            record_lifecycle("queue", t->waited);
+            t->slot_fd = fd;
+            t->admitted = now_monotonic();
+            last_admit = t->admitted;
+            boot_watch_init(&t->watch, vm->dir);
+            booting++;
+        }
+        
+        for (int i = 0; i < next; i++) {
+            BootTicket *t = &tickets[i];
+            if (t->slot_fd < 0) continue;
+            VMEntry *vm = &list.items[t->vm];
+            double booted = now_monotonic() - t->admitted;
+            if (boot_watch_poll(&t->watch)) {
+                record_lifecycle("ready", booted);
+                snprintf(message, sizeof(message), "  %s ready: queued %.1fs, boot %.1fs", vm->name, t->waited, booted);
+                log_success(message);
+                ready++;
+            } else if (read_vm_pid(vm->dir) <= 0) {
+                // QEMU died (the supervisor may be backing off to retry it);
+                // a crash loop must not pin the slot for BOOT_READY_TIMEOUT
+                snprintf(message, sizeof(message), "  %s exited before it was ready, releasing its boot slot", vm->name);
+                log_warning(message);
+                failed++;
+            } else if (booted >= BOOT_READY_TIMEOUT) {
+                snprintf(message, sizeof(message), "  %s not ready after %ds, releasing its boot slot", vm->name, BOOT_READY_TIMEOUT);
+                log_warning(message);
+            } else {
+                continue;
+            }
+            boot_slot_release(t->slot_fd);
+            t->slot_fd = -1;
+            booting--;
+        }
+        usleep(BOOT_QUEUE_POLL_MS * 1000);
+    }
+    free(tickets);
+    free_vm_list(&list);
+    
+    snprintf(message, sizeof(message), "%d of %d autostart VM(s) ready in %.1fs", ready, queued, now_monotonic() - started);
+    log_success(message);
+    if (failed > 0) {
+        snprintf(message, sizeof(message), "%d VM(s) failed to start", failed);
+        log_error(message);
+        return 1;
+    }
+    return 0;
+}
+
+// True while any download lock in DISTRO_DIR is held
+int distro_download_busy(const char *distro_dir) {
+    DIR *dir = opendir(distro_dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    int busy = 0;
+    struct dirent *entry;
+    while (!busy && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] != '.' || len < 6 || strcmp(entry->d_name + len - 5, ".lock") != 0) continue;
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/%s", distro_dir, entry->d_name);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) continue;
+        busy = flock(fd, LOCK_EX | LOCK_NB) != 0;
+        close(fd);
+    }
+    closedir(dir);
+    return busy;
+}
+
+// Path of the image file inside a distro directory
+int find_distro_image(const char *distro_dir, char *path, size_t size) {
+    DIR *dir = opendir(distro_dir);
+    if (dir == NULL) {
+        return 1;
+    }
+    int found = 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *ext = strrchr(entry->d_name, '.');
+        if (ext == NULL || (strcmp(ext, ".qcow2") != 0 && strcmp(ext, ".img") != 0 && strcmp(ext, ".manifest") != 0)) continue;
+        snprintf(path, size, "%s/%s", distro_dir, entry->d_name);
+        found = 0;
+        if (strcmp(ext, ".manifest") == 0) break;
+    }
+    closedir(dir);
+    return found;
+}
+
+int image_list_command() {
+    char distros_dir[MAX_PATH];
+    snprintf(distros_dir, sizeof(distros_dir), "%s/.v4m/distros", getenv("HOME"));
+    
+    init_dirs();
+    printf(YELLOW "Available Images:" NC "\n");
+    
+    DIR *dir = opendir(distros_dir);
+    int shown = 0;
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char distro_dir[sizeof(distros_dir) + sizeof(entry->d_name)];
+        char image[MAX_PATH];
+        char size[16];
+        struct stat st;
+        
+        if (entry->d_name[0] == '.') continue;
+        snprintf(distro_dir, sizeof(distro_dir), "%s/%s", distros_dir, entry->d_name);
+        if (find_distro_image(distro_dir, image, sizeof(image)) != 0 || stat(image, &st) != 0) continue;
+        
+        // Store images show their logical size; chunk usage is in `image store`
+        char *text;
+        char *body;
+        uint64_t logical;
+        char id[65];
+        HttpValidators validators;
+        char base[MAX_PATH];
+        snprintf(base, sizeof(base), "%s", image);
+        size_t base_len = strlen(base);
+        if (base_len > 9 && strcmp(base + base_len - 9, ".manifest") == 0) base[base_len - 9] = '\0';
+        const char *note = http_validators_load(base, &validators) == 0 && validators.stale ?
+                           YELLOW " update available" NC : "";
+        char layout[16];
+        image_layout_get(base, layout, sizeof(layout));
+        if (store_manifest_read(image, &text, &body, &logical, id) == 0) {
+            free(text);
+            format_size((double)logical, size, sizeof(size));
+            printf("  %s (%s, %s, in store)%s\n", entry->d_name, size, layout, note);
+        } else {
+            format_size((double)st.st_blocks * 512, size, sizeof(size));
+            printf("  %s (%s, %s)%s\n", entry->d_name, size, layout, note);
+        }
+        shown++;
+    }
+    if (dir != NULL) closedir(dir);
+    
+    if (shown == 0) {
+        printf("  No images found\n");
+    }
+    return 0;
+}
+
+// image pull <distro> [--layout upstream|tuned|raw]
+int image_pull_command(int argc, char *argv[]) {
+    char distro_path[MAX_PATH];
+    const char *layout = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc && image_layout_valid(argv[i + 1])) {
+            layout = argv[++i];
+        } else {
+            log_error("Usage: image pull <distro> [--layout upstream|tuned|raw]");
+            return 1;
+        }
+    }
+    if (argc < 2 || argv[1][0] == '-') {
+        char names[MAX_LINE];
+        char message[MAX_LINE * 2];
+        registry_names(names, sizeof(names));
+        snprintf(message, sizeof(message), "Distro name required (%s)", names);
+        log_error(message);
+        return 1;
+    }
+    init_dirs();
+    if (layout == NULL) {
+        return ensure_distro(argv[1], distro_path, sizeof(distro_path));
+    }
+    
+    // A base that is already cached is converted where it is
+    const char *url = get_distro_url(argv[1]);
+    if (url != NULL) {
+        snprintf(distro_path, sizeof(distro_path), "%s/.v4m/distros/%s/%s", getenv("HOME"), argv[1], strrchr(url, '/') + 1);
+        char manifest[MAX_PATH + 16];
+        snprintf(manifest, sizeof(manifest), "%s.manifest", distro_path);
+        if (file_exists(manifest) || file_exists(distro_path)) {
+            return image_relayout(argv[1], layout);
+        }
+    }
+    snprintf(pull_layout, sizeof(pull_layout), "%s", layout);
+    return ensure_distro(argv[1], distro_path, sizeof(distro_path));
+}
+
+int image_delete_command(int argc, char *argv[]) {
+    char distro_dir[MAX_PATH];
+    char message[MAX_LINE];
+    if (argc < 2) {
+        log_error("Distro name required");
+        return 1;
+    }
+    snprintf(distro_dir, sizeof(distro_dir), "%s/.v4m/distros/%s", getenv("HOME"), argv[1]);
+    if (!name_is_safe(argv[1]) || !dir_exists(distro_dir)) {
+        snprintf(message, sizeof(message), "Image '%s' not found", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    if (distro_download_busy(distro_dir)) {
+        snprintf(message, sizeof(message), "Image '%s' is being downloaded; try again when it finishes", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    if (remove_tree(distro_dir) != 0) {
+        snprintf(message, sizeof(message), "Failed to delete image '%s'", argv[1]);
+        log_error(message);
+        return 1;
+    }
+    snprintf(message, sizeof(message), "Image '%s' deleted", argv[1]);
+    log_success(message);
+    
+    // Drop chunks no other image shares
+    StoreStats stats;
+    if (store_walk(1, &stats) == 0 && stats.dup_chunks > 0) {
+        char freed[16];
+        format_size((double)stats.dup_bytes, freed, sizeof(freed));
+        snprintf(message, sizeof(message), "Freed %s from the image store", freed);
+        log_info(message);
+    }
+    return 0;
+}
+
+// Import converts whole-file images left by older versions into the store
+int image_store_command(int argc, char *argv[]) {
+    const char *action = argc > 1 ? argv[1] : "stats";
+    char message[MAX_LINE];
+    StoreStats stats;
+    init_dirs();
+    
+    if (strcmp(action, "import") == 0) {
+        char distros_dir[MAX_PATH];
+        snprintf(distros_dir, sizeof(distros_dir), "%s/.v4m/distros", getenv("HOME"));
+        DIR *dir = opendir(distros_dir);
+        struct dirent *entry;
+        int imported = 0;
+        int failed = 0;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            char distro_dir[MAX_PATH + sizeof(entry->d_name)];
+            char image[MAX_PATH];
+            char manifest[MAX_PATH + 16];
+            if (entry->d_name[0] == '.') continue;
+            snprintf(distro_dir, sizeof(distro_dir), "%s/%s", distros_dir, entry->d_name);
+            if (find_distro_image(distro_dir, image, sizeof(image)) != 0) continue;
+            size_t len = strlen(image);
+            if (len > 9 && strcmp(image + len - 9, ".manifest") == 0) continue;
+            if (distro_download_busy(distro_dir)) {
+                snprintf(message, sizeof(message), "  Skipping '%s': download in progress", entry->d_name);
+                log_warning(message);
+                continue;
+            }
+            snprintf(manifest, sizeof(manifest), "%s.manifest", image);
+            if (store_ingest(image, manifest, &stats) != 0) {
+                unlink(manifest);
+                snprintf(message, sizeof(message), "  Failed to import '%s'", entry->d_name);
+                log_error(message);
+                failed = 1;
+                continue;
+            }
+            unlink(image);
+            char added[16];
+            format_size((double)stats.stored_bytes, added, sizeof(added));
+            snprintf(message, sizeof(message), "  Imported '%s' (%s added, %d of %d chunks already present)",
+                     entry->d_name, added, stats.dup_chunks, stats.new_chunks + stats.dup_chunks);
+            log_info(message);
+            imported++;
+        }
+        if (dir != NULL) closedir(dir);
+        snprintf(message, sizeof(message), "Imported %d image(s) into the store", imported);
+        log_success(message);
+        return failed;
+    }
+    
+    if (strcmp(action, "gc") == 0) {
+        if (store_walk(1, &stats) != 0) {
+            log_error("Failed to lock the image store");
+            return 1;
+        }
+        char freed[16];
+        format_size((double)stats.dup_bytes, freed, sizeof(freed));
+        snprintf(message, sizeof(message), "Removed %d unreferenced chunk(s), %s freed", stats.dup_chunks, freed);
+        log_success(message);
+        return 0;
+    }
+    
+    if (strcmp(action, "stats") != 0) {
+        log_error("Usage: image store [stats|import|gc]");
+        return 1;
+    }
+    if (store_walk(0, &stats) != 0) {
+        log_error("Failed to lock the image store");
+        return 1;
+    }
+    
+    // Dedup compares what the images hold (minus zero runs, which are holes)
+    // with the unique chunks; compression compares those with the files on disk
+    char logical[16], zero[16], unique[16], stored[16];
+    uint64_t data_bytes = stats.logical_bytes - stats.zero_bytes;
+    format_size((double)stats.logical_bytes, logical, sizeof(logical));
+    format_size((double)stats.zero_bytes, zero, sizeof(zero));
+    format_size((double)stats.new_bytes, unique, sizeof(unique));
+    format_size((double)stats.stored_bytes, stored, sizeof(stored));
+    printf(YELLOW "Image store:" NC "\n");
+    printf("  Images:       %d (%s, %s of it zeroes)\n", stats.images, logical, zero);
+    printf("  Chunks:       %d unique (%s)\n", stats.new_chunks, unique);
+    printf("  On disk:      %s\n", stored);
+    printf("  Dedup:        %.2fx\n", stats.new_bytes > 0 ? (double)data_bytes / stats.new_bytes : 1.0);
+    printf("  Compression:  %.2fx\n", stats.stored_bytes > 0 ? (double)stats.new_bytes / stats.stored_bytes : 1.0);
+    printf("  Overall:      %.2fx\n", stats.stored_bytes > 0 ? (double)stats.logical_bytes / stats.stored_bytes : 1.0);
+    return 0;
+}
+
+int image_command(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "list") == 0) {
+        return image_list_command();
+    }
+    if (argc > 1 && strcmp(argv[1], "pull") == 0) {
+        return image_pull_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "delete") == 0) {
+        return image_delete_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "update") == 0) {
+        return image_update_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return image_bench_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "registry") == 0) {
+        return image_registry_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "check") == 0) {
+        return image_check_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "sums") == 0) {
+        return image_sums_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "store") == 0) {
+        return image_store_command(argc - 1, argv + 1);
+    }
+    log_error("Unknown image command");
+    return 1;
+}
+
+int purge_command() {
+    char distros_dir[MAX_PATH];
+    char message[MAX_LINE];
+    VMList list;
+    
+    init_dirs();
+    snprintf(distros_dir, sizeof(distros_dir), "%s/.v4m/distros", getenv("HOME"));
+    
+    int vm_count = collect_vms(&list);
+    int running_vms = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (read_vm_pid(list.items[i].dir) > 0) running_vms++;
+    }
+    
+    int image_count = 0;
+    DIR *dir = opendir(distros_dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') image_count++;
+    }
+    if (dir != NULL) closedir(dir);
+    
+    if (vm_count == 0 && image_count == 0) {
+        log_info("No VMs or images found to purge");
+        free_vm_list(&list);
+        return 0;
+    }
+    
+    printf("\n");
+    log_warning("PURGE ALL DATA");
+    printf("This will permanently delete:\n");
+    if (vm_count > 0) printf("  • %d VM(s) (including %d running)\n", vm_count, running_vms);
+    if (image_count > 0) printf("  • %d distro image(s)\n", image_count);
+    printf("  • All VM data and configurations\n\n");
+    log_error("This action cannot be undone!");
+    printf("\n");
+    
+    if (!confirm("Type 'DELETE ALL' to confirm purge: ", "DELETE ALL")) {
+        log_info("Purge cancelled");
+        free_vm_list(&list);
+        return 0;
+    }
+    
+    printf("\n");
+    log_info("Purging all VMs and images...");
+    
+    int failed = 0;
+    if (running_vms > 0) {
+        // Everything is being deleted, so skip the guest powerdown and quit at once
+        StopTarget *targets = calloc(list.count, sizeof(StopTarget));
+        for (int i = 0; targets != NULL && i < list.count; i++) {
+            snprintf(targets[i].name, sizeof(targets[i].name), "%s", list.items[i].name);
+            snprintf(targets[i].vm_dir, sizeof(targets[i].vm_dir), "%s", list.items[i].dir);
+        }
+        snprintf(message, sizeof(message), "Stopping %d VM(s)...", running_vms);
+        log_info(message);
+        if (targets == NULL || stop_vms(targets, list.count, 0, STOP_QUIT_TIMEOUT) != 0) {
+            log_warning("  Some VMs did not exit");
+        }
+        free(targets);
+    }
+    
+    if (vm_count > 0) {
+        snprintf(message, sizeof(message), "Deleting %d VM(s)...", vm_count);
+        log_info(message);
+        for (int i = 0; i < list.count; i++) {
+            char tombstone[MAX_PATH];
+            if (vm_tombstone(list.items[i].name, tombstone, sizeof(tombstone)) != 0) {
+                failed = 1;
+                continue;
+            }
+            snprintf(message, sizeof(message), "  Deleted VM '%s'", list.items[i].name);
+            log_info(message);
+        }
+    }
+    
+    if (image_count > 0) {
+        char tombstone[MAX_PATH];
+        snprintf(message, sizeof(message), "Deleting %d image(s)...", image_count);
+        log_info(message);
+        snprintf(tombstone, sizeof(tombstone), "%s/.v4m/tombstones/distros.%ld.%d", getenv("HOME"), (long)time(NULL), (int)getpid());
+        failed |= rename(distros_dir, tombstone) != 0;
+        mkdir(distros_dir, 0755);
+        char store_dir[MAX_PATH];
+        store_path(store_dir, sizeof(store_dir), "");
+        snprintf(tombstone, sizeof(tombstone), "%s/.v4m/tombstones/store.%ld.%d", getenv("HOME"), (long)time(NULL), (int)getpid());
+        if (rename(store_dir, tombstone) != 0 && errno != ENOENT) failed = 1;
+        log_info("  Deleted all distro images");
+    }
+    free_vm_list(&list);
+    
+    // Files are unlinked in the background at idle I/O priority
+    reaper_spawn();
+    
+    printf("\n");
+    if (failed) {
+        log_error("Purge finished with errors; some files could not be removed");
+        return 1;
+    }
+    log_success("Purge completed successfully");
+    log_info("All VMs and images have been removed");
+    return 0;
+}
+
+#ifdef V4M_BENCH
+// Benchmark harness and QEMU stand-ins, compiled only with -DV4M_BENCH
+//
+// `v4m bench` builds a throwaway HOME and a bin directory in which
+// qemu-system-aarch64, qemu-img and hdiutil are links back to this binary,
+// so the real create/start/stop code paths run with no network and no
+// hardware virtualization.
+
+const struct {
+    double at;
+    const char *line;
+} stub_serial_script[] = {
+    {0.05, "UEFI firmware (version edk2-stable202302 built at 00:00:00 on Mar  1 2023)"},
+    {0.10, "BdsDxe: loading Boot0001 \"UEFI Misc Device\" from PciRoot(0x0)/Pci(0x1,0x0)"},
+    {0.15, "EFI stub: Booting Linux Kernel..."},
+    {0.20, "[    0.000000] Booting Linux on physical CPU 0x0000000000 [0x610f0000]"},
+    {0.21, "[    0.000000] Linux version 6.1.0-18-cloud-arm64 (debian-kernel@lists.debian.org)"},
+    {0.40, "[    2.104521] systemd[1]: systemd 252.22-1~deb12u1 running in system mode"},
+    {0.41, "Welcome to \033[1mDebian GNU/Linux 12 (bookworm)\033[0m!"},
+    {0.50, "[    3.612300] cloud-init[412]: Cloud-init v. 22.4.2 running 'init-local' at Mon, 01 Jan 2024 00:00:03 +0000. Up 3.58 seconds."},
+    {0.60, "[    4.881733] cloud-init[455]: Cloud-init v. 22.4.2 running 'init' at Mon, 01 Jan 2024 00:00:04 +0000. Up 4.85 seconds."},
+    {0.70, "[  \033[0;32mOK  \033[0m] Reached target \033[0;1;39mMulti-User System\033[0m."},
+    {0.75, "[    6.004121] cloud-init[602]: Cloud-init v. 22.4.2 running 'modules:config' at Mon, 01 Jan 2024 00:00:06 +0000. Up 6.00 seconds."},
+    {0.85, "[    7.112000] cloud-init[650]: Cloud-init v. 22.4.2 running 'modules:final' at Mon, 01 Jan 2024 00:00:07 +0000. Up 7.10 seconds."},
+    {1.00, "[    9.104000] cloud-init[650]: Cloud-init v. 22.4.2 finished at Mon, 01 Jan 2024 00:00:09 +0000. Datasource DataSourceNoCloud [seed=/dev/vdb][dsmode=net].  Up 9.10 seconds"},
+};
+
+volatile sig_atomic_t stub_stop = 0;
+
+void stub_handle_signal(int sig) {
+    (void)sig;
+    stub_stop = 1;
+}
+
+// Extract KEY=VALUE from a comma separated QEMU option string
+int stub_option_value(const char *spec, const char *key, char *out, size_t size) {
+    size_t key_len = strlen(key);
+    const char *p = spec;
+    while (p != NULL && *p) {
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            p += key_len + 1;
+            size_t len = strcspn(p, ",");
+            if (len >= size) len = size - 1;
+            memcpy(out, p, len);
+            out[len] = '\0';
+            return 0;
+        }
+        p = strchr(p, ',');
+        if (p) p++;
+    }
+    return 1;
+}
+
+void stub_send_event(QMPConn *clients, int count, const char *event) {
+    struct timeval tv;
+    char msg[256];
+    gettimeofday(&tv, NULL);
+    snprintf(msg, sizeof(msg), "{\"timestamp\": {\"seconds\": %ld, \"microseconds\": %ld}, \"event\": \"%s\"}",
+             (long)tv.tv_sec, (long)tv.tv_usec, event);
+    for (int i = 0; i < count; i++) {
+        if (clients[i].fd >= 0) qmp_send(&clients[i], msg);
+    }
+}
+
+int stub_qemu_main(int argc, char *argv[]) {
+    char qmp_path[MAX_PATH] = "";
+    char events_path[MAX_PATH] = "";
+    char metrics_path[MAX_PATH] = "";
+    char pid_path[MAX_PATH] = "";
+    char serial_log[MAX_PATH] = "";
+    char disk_path[MAX_PATH] = "";
+    char mirror_target[MAX_PATH] = "";
+    char qga_path[MAX_PATH] = "";
+    char mirror_job_id[MAX_NAME] = "";
+    char drive_id[MAX_NAME] = "virtio0";
+    char disk_node[MAX_NAME] = "#block163";
+    char added_node[MAX_NAME] = "";
+    char mirror_node[MAX_NAME] = "";
+    int mirror_job = 0;
+    FILE *guest_files[8] = {0};
+    
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-qmp") == 0 && strncmp(argv[i + 1], "unix:", 5) == 0) {
+            // The first monitor takes commands, a second one only listens and
+            // a third feeds the exporter
+            char *path = !qmp_path[0] ? qmp_path : !events_path[0] ? events_path : metrics_path;
+            size_t len = strcspn(argv[i + 1] + 5, ",");
+            if (len >= MAX_PATH) len = MAX_PATH - 1;
+            memcpy(path, argv[i + 1] + 5, len);
+            path[len] = '\0';
+        } else if (strcmp(argv[i], "-pidfile") == 0) {
+            strncpy(pid_path, argv[i + 1], sizeof(pid_path) - 1);
+        } else if (strcmp(argv[i], "-chardev") == 0 && strstr(argv[i + 1], "id=serial0")) {
+            stub_option_value(argv[i + 1], "logfile", serial_log, sizeof(serial_log));
+        } else if (strcmp(argv[i], "-chardev") == 0 && strstr(argv[i + 1], "id=qga0")) {
+            stub_option_value(argv[i + 1], "path", qga_path, sizeof(qga_path));
+        } else if (strcmp(argv[i], "-drive") == 0 && strstr(argv[i + 1], "if=virtio") && !strstr(argv[i + 1], "media=cdrom")) {
+            stub_option_value(argv[i + 1], "file", disk_path, sizeof(disk_path));
+            stub_option_value(argv[i + 1], "id", drive_id, sizeof(drive_id));
+        }
+    }
+    
+    // QEMU holds the disk open, so it follows the file across renames. The
+    // descriptor is inherited so the cp behind copy_file() can read /dev/fd/N
+    int disk_fd = disk_path[0] ? open(disk_path, O_RDWR) : -1;
+    char disk_data[32];
+    snprintf(disk_data, sizeof(disk_data), "/dev/fd/%d", disk_fd);
+    
+    const char *boot_env = getenv("V4M_STUB_BOOT_MS");
+    const char *shutdown_env = getenv("V4M_STUB_SHUTDOWN_MS");
+    const char *crash_env = getenv("V4M_STUB_CRASH_MS");
+    double boot_seconds = (boot_env ? atoi(boot_env) : 2000) / 1000.0;
+    double shutdown_seconds = shutdown_env ? atoi(shutdown_env) / 1000.0 : boot_seconds / 4;
+    double crash_seconds = crash_env ? atoi(crash_env) / 1000.0 : 0;
+    
+    signal(SIGTERM, stub_handle_signal);
+    signal(SIGINT, stub_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    int listen_fd = -1;
+    if (qmp_path[0]) {
+        char address[MAX_PATH + 8];
+        snprintf(address, sizeof(address), "unix:%s", qmp_path);
+        listen_fd = metrics_listen(address);
+    }
+    int events_fd = -1;
+    if (events_path[0]) {
+        char address[MAX_PATH + 8];
+        snprintf(address, sizeof(address), "unix:%s", events_path);
+        events_fd = metrics_listen(address);
+    }
+    int metrics_fd = -1;
+    if (metrics_path[0]) {
+        char address[MAX_PATH + 8];
+        snprintf(address, sizeof(address), "unix:%s", metrics_path);
+        metrics_fd = metrics_listen(address);
+    }
+    // The guest agent answers on its own socket, without a greeting
+    int qga_fd = -1;
+    if (qga_path[0]) {
+        char address[MAX_PATH + 8];
+        snprintf(address, sizeof(address), "unix:%s", qga_path);
+        qga_fd = metrics_listen(address);
+    }
+    if (serial_log[0]) {
+        FILE *fp = fopen(serial_log, "w");
+        if (fp) fclose(fp);
+    }
+    if (pid_path[0]) {
+        FILE *fp = fopen(pid_path, "w");
+        if (fp) {
+            fprintf(fp, "%d\n", (int)getpid());
+            fclose(fp);
+        }
+    }
+    
+    // Like a QEMU chardev, each socket serves one client at a time: the
+    // next one waits in the backlog until the current one disconnects
+    QMPConn *clients = calloc(8, sizeof(QMPConn));
+    int listeners[4] = {listen_fd, events_fd, metrics_fd, qga_fd};
+    int served_by[8];
+    char *msg = malloc(QMP_BUF_SIZE);
+    if (clients == NULL || msg == NULL) return 1;
+    for (int i = 0; i < 8; i++) clients[i].fd = -1;
+    
+    size_t script_len = sizeof(stub_serial_script) / sizeof(stub_serial_script[0]);
+    size_t next_line = 0;
+    double started = now_monotonic();
+    double shutdown_at = 0;
+    uint64_t io_ops = 0;
+    
+    while (!stub_stop) {
+        double now = now_monotonic();
+        
+        // Scripted boot: emit every console line that is due
+        if (serial_log[0] && next_line < script_len &&
+            now - started >= stub_serial_script[next_line].at * boot_seconds) {
+            FILE *fp = fopen(serial_log, "a");
+            while (next_line < script_len && now - started >= stub_serial_script[next_line].at * boot_seconds) {
+                if (fp) fprintf(fp, "%s\r\n", stub_serial_script[next_line].line);
+                next_line++;
+            }
+            if (fp) fclose(fp);
+        }
+        if (shutdown_at > 0 && now >= shutdown_at) {
+            stub_send_event(clients, 8, "SHUTDOWN");
+            break;
+        }
+        if (crash_seconds > 0 && now - started >= crash_seconds) {
+            // Die the way a crashing QEMU would, without cleaning up
+            kill(getpid(), SIGKILL);
+        }
+        
+        double wake = shutdown_at > 0 ? shutdown_at : now + 1;
+        if (crash_seconds > 0 && started + crash_seconds < wake) wake = started + crash_seconds;
+        if (next_line < script_len) {
+            double due = started + stub_serial_script[next_line].at * boot_seconds;
+            if (due < wake) wake = due;
+        }
+        
+        struct pollfd fds[12];
+        int nfds = 0;
+        for (int l = 0; l < 4; l++) {
+            int busy = 0;
+            for (int i = 0; i < 8; i++) {
+                if (clients[i].fd >= 0 && served_by[i] == listeners[l]) busy = 1;
+            }
+            if (listeners[l] < 0 || busy) continue;
+            fds[nfds].fd = listeners[l];
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        for (int i = 0; i < 8; i++) {
+            if (clients[i].fd < 0) continue;
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        int wait_ms = (int)((wake - now) * 1000);
+        if (poll(fds, nfds, wait_ms > 0 ? wait_ms : 0) <= 0) continue;
+        
+        for (int f = 0; f < nfds; f++) {
+            if (fds[f].revents == 0) continue;
+            
+            if (fds[f].fd == listen_fd || fds[f].fd == events_fd || fds[f].fd == metrics_fd || fds[f].fd == qga_fd) {
+                int fd = accept(fds[f].fd, NULL, NULL);
+                int slot = -1;
+                for (int i = 0; i < 8 && fd >= 0; i++) {
+                    if (clients[i].fd < 0) { slot = i; break; }
+                }
+                if (slot < 0) {
+                    if (fd >= 0) close(fd);
+                    continue;
+                }
+                clients[slot].fd = fd;
+                clients[slot].len = 0;
+                served_by[slot] = fds[f].fd;
+                if (fds[f].fd == qga_fd) continue;
+                qmp_send(&clients[slot], "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, \"minor\": 2, "
+                         "\"major\": 8}, \"package\": \"v4m-stub\"}, \"capabilities\": []}}");
+                continue;
+            }
+            
+            QMPConn *client = NULL;
+            for (int i = 0; i < 8; i++) {
+                if (clients[i].fd == fds[f].fd) client = &clients[i];
+            }
+            if (client == NULL) continue;
+            if (qmp_fill(client) != 0) {
+                qmp_close(client);
+                continue;
+            }
+            
+            while (qmp_next_message(client, msg, QMP_BUF_SIZE)) {
+                char command[64] = "";
+                char id[64] = "";
+                char reply[QMP_BUF_SIZE];
+                char id_field[96] = "";
+                json_string_in(msg, NULL, "execute", command, sizeof(command));
+                if (json_string_in(msg, NULL, "id", id, sizeof(id)) == 0) {
+                    snprintf(id_field, sizeof(id_field), ", \"id\": \"%s\"", id);
+                }
+                
+                io_ops += 37;
+                if (strcmp(command, "query-status") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {\"status\": \"running\", \"running\": true}%s}", id_field);
+                } else if (strcmp(command, "query-blockstats") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": [{\"device\": \"%s\", \"stats\": "
+                             "{\"rd_bytes\": %llu, \"wr_bytes\": %llu, \"rd_operations\": %llu, \"wr_operations\": %llu}}]%s}",
+                             drive_id, (unsigned long long)io_ops * 4096, (unsigned long long)io_ops * 2048,
+                             (unsigned long long)io_ops, (unsigned long long)io_ops / 2, id_field);
+                } else if (strcmp(command, "query-balloon") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {\"actual\": 4294967296}%s}", id_field);
+                } else if (strcmp(command, "system_powerdown") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    if (shutdown_at == 0) shutdown_at = now_monotonic() + shutdown_seconds;
+                } else if (strcmp(command, "quit") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    qmp_send(client, reply);
+                    stub_stop = 1;
+                    break;
+                } else if (strcmp(command, "stop") == 0 || strcmp(command, "cont") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    qmp_send(client, reply);
+                    stub_send_event(clients, 8, strcmp(command, "stop") == 0 ? "STOP" : "RESUME");
+                    continue;
+                } else if (strcmp(command, "query-block") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": [{\"device\": \"%s\", \"inserted\": "
+                             "{\"file\": \"%s\", \"node-name\": \"%s\", \"drv\": \"%s\"}}]%s}",
+                             drive_id, disk_path, disk_node, disk_format(disk_data), id_field);
+                } else if (strcmp(command, "blockdev-add") == 0) {
+                    // Node names are unique for the life of the process, like QEMU's
+                    char name[MAX_NAME] = "";
+                    json_string_in(msg, NULL, "node-name", name, sizeof(name));
+                    if (strcmp(name, disk_node) == 0 || strcmp(name, added_node) == 0) {
+                        snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"GenericError\", "
+                                 "\"desc\": \"Duplicate nodes with node-name='%s'\"}%s}", name, id_field);
+                    } else {
+                        json_string_in(msg, NULL, "filename", mirror_target, sizeof(mirror_target));
+                        snprintf(added_node, sizeof(added_node), "%s", name);
+                        snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    }
+                } else if (strcmp(command, "blockdev-del") == 0) {
+                    added_node[0] = '\0';
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                } else if (strcmp(command, "drive-mirror") == 0 || strcmp(command, "blockdev-mirror") == 0) {
+                    char device[MAX_NAME] = "";
+                    json_string_in(msg, NULL, "device", device, sizeof(device));
+                    if (strcmp(command, "drive-mirror") == 0) {
+                        json_string_in(msg, NULL, "target", mirror_target, sizeof(mirror_target));
+                        snprintf(mirror_node, sizeof(mirror_node), "#block%d", 200 + (int)(io_ops % 800));
+                    } else {
+                        json_string_in(msg, NULL, "target", mirror_node, sizeof(mirror_node));
+                    }
+                    json_string_in(msg, NULL, "job-id", mirror_job_id, sizeof(mirror_job_id));
+                    // The copy is instant, so the job is ready as soon as it starts
+                    mirror_job = strcmp(device, disk_node) == 0 && mirror_target[0] &&
+                                 copy_file(disk_data, mirror_target) == 0;
+                    if (mirror_job) {
+                        snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    } else {
+                        snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"GenericError\", "
+                                 "\"desc\": \"Cannot mirror to the target\"}%s}", id_field);
+                    }
+                } else if (strcmp(command, "query-block-jobs") == 0) {
+                    struct stat st;
+                    long long len = mirror_job && fstat(disk_fd, &st) == 0 ? (long long)st.st_size : 0;
+                    if (mirror_job) {
+                        snprintf(reply, sizeof(reply), "{\"return\": [{\"device\": \"%s\", \"type\": \"mirror\", "
+                                 "\"len\": %lld, \"offset\": %lld, \"ready\": true}]%s}", mirror_job_id, len, len, id_field);
+                    } else {
+                        snprintf(reply, sizeof(reply), "{\"return\": []%s}", id_field);
+                    }
+                } else if (strcmp(command, "block-job-complete") == 0 || strcmp(command, "block-job-cancel") == 0) {
+                    if (mirror_job && strcmp(command, "block-job-complete") == 0) {
+                        int fd = open(mirror_target, O_RDWR);
+                        if (fd >= 0) {
+                            dup2(fd, disk_fd);
+                            close(fd);
+                        }
+                        snprintf(disk_path, sizeof(disk_path), "%s", mirror_target);
+                        snprintf(disk_node, sizeof(disk_node), "%s", mirror_node);
+                        if (strcmp(mirror_node, added_node) == 0) added_node[0] = '\0';
+                    }
+                    mirror_job = 0;
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                } else if (strcmp(command, "guest-fstrim") == 0) {
+                    // Discards reach the host file as holes
+                    uint64_t punched = 0;
+                    disk_punch_zeroes(disk_data, &punched);
+                    snprintf(reply, sizeof(reply), "{\"return\": {\"paths\": [{\"path\": \"/\", \"trimmed\": %llu, "
+                             "\"minimum\": 0}]}%s}", (unsigned long long)punched, id_field);
+                } else if (strcmp(command, "guest-file-open") == 0) {
+                    // The "guest" is this host: paths are used as they are
+                    char path[MAX_PATH] = "";
+                    char mode[8] = "r";
+                    int slot = -1;
+                    json_string_in(msg, NULL, "path", path, sizeof(path));
+                    json_string_in(msg, NULL, "mode", mode, sizeof(mode));
+                    for (int h = 0; h < 8 && slot < 0; h++) {
+                        if (guest_files[h] == NULL) slot = h;
+                    }
+                    if (slot >= 0 && (guest_files[slot] = fopen(path, mode)) != NULL) {
+                        snprintf(reply, sizeof(reply), "{\"return\": %d%s}", 1000 + slot, id_field);
+                    } else {
+                        snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"GenericError\", "
+                                 "\"desc\": \"failed to open file '%s'\"}%s}", path, id_field);
+                    }
+                } else if (strcmp(command, "guest-file-write") == 0 || strcmp(command, "guest-file-read") == 0 ||
+                           strcmp(command, "guest-file-seek") == 0 || strcmp(command, "guest-file-close") == 0) {
+                    double handle = 0;
+                    json_number_in(msg, NULL, "handle", &handle);
+                    int slot = (int)handle - 1000;
+                    FILE *fp = slot >= 0 && slot < 8 ? guest_files[slot] : NULL;
+                    unsigned char data[RUN_CHUNK];
+                    ssize_t n = 0;
+                    if (fp == NULL) {
+                        snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"GenericError\", "
+                                 "\"desc\": \"handle '%d' has not been found\"}%s}", (int)handle, id_field);
+                    } else if (strcmp(command, "guest-file-write") == 0) {
+                        const char *buf = json_find_key(msg, NULL, "buf-b64");
+                        n = buf != NULL && *buf == '"' ? base64_decode(buf + 1, data, sizeof(data)) : 0;
+                        if (n > 0) n = (ssize_t)fwrite(data, 1, n, fp);
+                        fflush(fp);
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"count\": %d, \"eof\": false}%s}", (int)n, id_field);
+                    } else if (strcmp(command, "guest-file-seek") == 0) {
+                        char whence[8] = "set";
+                        double offset = 0;
+                        json_number_in(msg, NULL, "offset", &offset);
+                        json_string_in(msg, NULL, "whence", whence, sizeof(whence));
+                        fseek(fp, (long)offset, strcmp(whence, "cur") == 0 ? SEEK_CUR :
+                                                strcmp(whence, "end") == 0 ? SEEK_END : SEEK_SET);
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"position\": %ld, \"eof\": false}%s}",
+                                 ftell(fp), id_field);
+                    } else if (strcmp(command, "guest-file-read") == 0) {
+                        // Like qemu-ga: plain fread(), so EOF sticks until a seek
+                        StrBuf sb = {0};
+                        n = (ssize_t)fread(data, 1, sizeof(data), fp);
+                        base64_encode(data, n, &sb);
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"count\": %d, \"buf-b64\": \"%s\", \"eof\": %s}%s}",
+                                 (int)n, sb.data ? sb.data : "", feof(fp) ? "true" : "false", id_field);
+                        sb_free(&sb);
+                    } else {
+                        fclose(fp);
+                        guest_files[slot] = NULL;
+                        snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                    }
+                } else if (strcmp(command, "guest-exec") == 0) {
+                    JsonDoc doc;
+                    ArgList exec_args = {0};
+                    pid_t child = -1;
+                    if (json_parse(&doc, msg, strlen(msg)) == 0) {
+                        int arguments = json_get(&doc, 0, "arguments");
+                        int arg = json_get(&doc, arguments, "arg");
+                        arg_add(&exec_args, "%s", json_get_string(&doc, arguments, "path", "/bin/false"));
+                        for (int a = arg >= 0 ? doc.nodes[arg].child : -1; a >= 0; a = doc.nodes[a].next) {
+                            if (doc.nodes[a].type == JSON_STRING) arg_add(&exec_args, "%s", doc.nodes[a].string);
+                        }
+                        child = fork();
+                        if (child == 0) {
+                            execvp(exec_args.items[0], exec_args.items);
+                            _exit(127);
+                        }
+                    }
+                    json_free(&doc);
+                    arg_free(&exec_args);
+                    if (child > 0) {
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"pid\": %d}%s}", (int)child, id_field);
+                    } else {
+                        snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"GenericError\", "
+                                 "\"desc\": \"Failed to execute child process\"}%s}", id_field);
+                    }
+                } else if (strcmp(command, "guest-network-get-interfaces") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": [{\"name\": \"lo\", \"ip-addresses\": "
+                             "[{\"ip-address-type\": \"ipv4\", \"ip-address\": \"127.0.0.1\", \"prefix\": 8}]}, "
+                             "{\"name\": \"eth0\", \"hardware-address\": \"52:54:00:12:34:56\", \"ip-addresses\": "
+                             "[{\"ip-address-type\": \"ipv4\", \"ip-address\": \"10.0.2.15\", \"prefix\": 24}]}]%s}",
+                             id_field);
+                } else if (strcmp(command, "guest-exec-status") == 0) {
+                    double child = 0;
+                    int status = 0;
+                    json_number_in(msg, NULL, "pid", &child);
+                    if (waitpid((pid_t)child, &status, WNOHANG) != (pid_t)child) {
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"exited\": false}%s}", id_field);
+                    } else if (WIFSIGNALED(status)) {
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"exited\": true, \"signal\": %d}%s}",
+                                 WTERMSIG(status), id_field);
+                    } else {
+                        snprintf(reply, sizeof(reply), "{\"return\": {\"exited\": true, \"exitcode\": %d}%s}",
+                                 WEXITSTATUS(status), id_field);
+                    }
+                } else if (strcmp(command, "qmp_capabilities") == 0 || strcmp(command, "qom-set") == 0 ||
+                           strcmp(command, "blockdev-del") == 0 || strcmp(command, "guest-ping") == 0) {
+                    snprintf(reply, sizeof(reply), "{\"return\": {}%s}", id_field);
+                } else {
+                    snprintf(reply, sizeof(reply), "{\"error\": {\"class\": \"CommandNotFound\", "
+                             "\"desc\": \"The command %s has not been found\"}%s}", command, id_field);
+                }
+                qmp_send(client, reply);
+            }
+        }
+    }
+    
+    for (int i = 0; i < 8; i++) qmp_close(&clients[i]);
+    for (int i = 0; i < 8; i++) {
+        if (guest_files[i]) fclose(guest_files[i]);
+    }
+    if (listen_fd >= 0) close(listen_fd);
+    if (events_fd >= 0) close(events_fd);
+    if (metrics_fd >= 0) close(metrics_fd);
+    if (qga_fd >= 0) close(qga_fd);
+    if (qmp_path[0]) unlink(qmp_path);
+    if (events_path[0]) unlink(events_path);
+    if (metrics_path[0]) unlink(metrics_path);
+    if (qga_path[0]) unlink(qga_path);
+    if (pid_path[0]) unlink(pid_path);
+    free(clients);
+    free(msg);
+    return 0;
+}
+
+int stub_qemu_img_main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return 1;
+    }
+    if (strcmp(argv[1], "resize") == 0) {
+        return argc >= 4 && file_exists(argv[argc - 2]) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "info") == 0) {
+        printf("image: %s\nfile format: qcow2\nvirtual size: 20 GiB (21474836480 bytes)\n", argv[argc - 1]);
+        return 0;
+    }
+    if (strcmp(argv[1], "create") == 0) {
+        // Last positional arguments are FILE [SIZE]
+        const char *file = argv[argc - 1];
+        if (argc >= 4 && isdigit((unsigned char)argv[argc - 1][0])) file = argv[argc - 2];
+        return create_sparse_file(file, 1024 * 1024);
+    }
+    if (strcmp(argv[1], "convert") == 0 && argc >= 4) {
+        char command[MAX_PATH * 3];
+        snprintf(command, sizeof(command), "cp \"%s\" \"%s\"", argv[argc - 2], argv[argc - 1]);
+        return system(command) == 0 ? 0 : 1;
+    }
+    return 0;
+}
+
+int stub_hdiutil_main(int argc, char *argv[]) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            return create_sparse_file(argv[i + 1], 64 * 1024);
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    const char *op;
+    double *samples;
+    int count;
+    int failures;
+    double total;
+} BenchOp;
+
+typedef struct {
+    int scale;
+    char op[32];
+    double p50_ms;
+} BenchBaseline;
+
+double bench_percentile(BenchOp *op, double pct) {
+    if (op->count == 0) {
+        return 0;
+    }
+    qsort(op->samples, op->count, sizeof(double), compare_doubles);
+    int index = (int)(pct / 100.0 * (op->count - 1) + 0.5);
+    return op->samples[index] * 1000;
+}
+
+void bench_record(BenchOp *op, double seconds, int ok) {
+    op->samples[op->count++] = seconds;
+    op->total += seconds;
+    if (!ok) op->failures++;
+}
+
+void bench_report(StrBuf *results, int scale, BenchOp *op) {
+    double p50 = bench_percentile(op, 50);
+    double p95 = bench_percentile(op, 95);
+    double max = bench_percentile(op, 100);
+    sb_printf(results, "%s    {\"scale\": %d, \"op\": \"%s\", \"count\": %d, \"failures\": %d, "
+              "\"total_s\": %.6f, \"throughput_per_s\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"max_ms\": %.3f}",
+              results->len ? ",\n" : "", scale, op->op, op->count, op->failures, op->total,
+              op->total > 0 ? op->count / op->total : 0, p50, p95, max);
+}
+
+int bench_load_baseline(const char *path, BenchBaseline *entries, int max) {
+    char line[MAX_LINE];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    
+    // Results are written one per line, so the baseline can be read back with sscanf
+    int count = 0;
+    while (fgets(line, sizeof(line), fp) && count < max) {
+        const char *entry = strstr(line, "{\"scale\"");
+        if (entry == NULL) continue;
+        if (sscanf(entry, "{\"scale\": %d, \"op\": \"%31[^\"]\", \"count\": %*d, \"failures\": %*d, "
+                   "\"total_s\": %*f, \"throughput_per_s\": %*f, \"p50_ms\": %lf",
+                   &entries[count].scale, entries[count].op, &entries[count].p50_ms) == 3) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+int bench_command(int argc, char *argv[]) {
+    int scales[16] = {1, 10, 100, 1000};
+    int scale_count = 4;
+    int boot_ms = 100;
+    int keep = 0;
+    int metadata_files = 10000;
+    double threshold = 20;
+    const char *output_path = NULL;
+    const char *baseline_path = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scales") == 0 && i + 1 < argc) {
+            char list[MAX_LINE];
+            strncpy(list, argv[++i], sizeof(list) - 1);
+            list[sizeof(list) - 1] = '\0';
+            scale_count = 0;
+            for (char *tok = strtok(list, ","); tok && scale_count < 16; tok = strtok(NULL, ",")) {
+                if (atoi(tok) > 0) scales[scale_count++] = atoi(tok);
+            }
+        } else if (strcmp(argv[i], "--boot-ms") == 0 && i + 1 < argc) {
+            boot_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--metadata-files") == 0 && i + 1 < argc) {
+            metadata_files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            keep = 1;
+        } else {
+            log_error("Unknown option");
+            return 1;
+        }
+    }
+    
+    // Sandbox: private HOME plus stand-in tools ahead of the real ones on PATH
+    char root[MAX_PATH] = "/tmp/v4m-bench-XXXXXX";
+    char self[MAX_PATH];
+    char path[MAX_PATH];
+    if (mkdtemp(root) == NULL || self_executable_path(self, sizeof(self)) != 0) {
+        log_error("Failed to set up benchmark sandbox");
+        return 1;
+    }
+    
+    const char *tools[] = {"qemu-system-aarch64", "qemu-img", "hdiutil"};
+    snprintf(path, sizeof(path), "%s/bin", root);
+    mkdir(path, 0755);
+    for (size_t i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+        snprintf(path, sizeof(path), "%s/bin/%s", root, tools[i]);
+        if (symlink(self, path) != 0) {
+            log_error("Failed to link stand-in tools");
+            return 1;
+        }
+    }
+    
+    char env_value[MAX_LINE];
+    snprintf(env_value, sizeof(env_value), "%s/bin:%s", root, getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    setenv("PATH", env_value, 1);
+    snprintf(env_value, sizeof(env_value), "%s/home", root);
+    mkdir(env_value, 0755);
+    setenv("HOME", env_value, 1);
+    snprintf(env_value, sizeof(env_value), "%d", boot_ms);
+    setenv("V4M_STUB_BOOT_MS", env_value, 1);
+    init_dirs();
+    
+    // Pre-seed the distro cache so no download happens
+    const char *url = get_distro_url(DEFAULT_DISTRO);
+    snprintf(path, sizeof(path), "%s/.v4m/distros/%s", getenv("HOME"), DEFAULT_DISTRO);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/.v4m/distros/%s/%s", getenv("HOME"), DEFAULT_DISTRO, strrchr(url, '/') + 1);
+    create_sparse_file(path, 1024 * 1024);
+    
+    int max_scale = 1;
+    for (int s = 0; s < scale_count; s++) {
+        if (scales[s] > max_scale) max_scale = scales[s];
+    }
+    char (*macs)[18] = calloc(max_scale, 18);
+    const char *op_names[] = {"create", "start", "list", "stop", "delete"};
+    StrBuf results = {0};
+    BenchOp ops[5];
+    for (int o = 0; o < 5; o++) {
+        ops[o].op = op_names[o];
+        ops[o].samples = calloc(max_scale > 5 ? max_scale : 5, sizeof(double));
+    }
+    
+    // Operation chatter goes to /dev/null; only the report reaches stdout
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    
+    for (int s = 0; s < scale_count; s++) {
+        int n = scales[s];
+        char vm_name[MAX_NAME];
+        char vm_dir[MAX_PATH];
+        double t;
+        
+        fprintf(stderr, "bench: %d VM(s)\n", n);
+        dup2(devnull, STDOUT_FILENO);
+        for (int o = 0; o < 5; o++) {
+            ops[o].count = ops[o].failures = 0;
+            ops[o].total = 0;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            snprintf(vm_name, sizeof(vm_name), "bench-%d-%d", n, i);
+            t = now_monotonic();
+            int ok = provision_vm(vm_name, DEFAULT_DISTRO, DEFAULT_USER, "bench", macs[i], 18) == 0;
+            bench_record(&ops[0], now_monotonic() - t, ok);
+        }
+        for (int i = 0; i < n; i++) {
+            snprintf(vm_name, sizeof(vm_name), "bench-%d-%d", n, i);
+            vm_dir_path(vm_name, vm_dir, sizeof(vm_dir));
+            t = now_monotonic();
+            int ok = start_vm(vm_name, macs[i], vm_dir) == 0;
+            bench_record(&ops[1], now_monotonic() - t, ok);
+        }
+        for (int i = 0; i < 5; i++) {
+            t = now_monotonic();
+            int ok = vm_list_command() == 0;
+            bench_record(&ops[2], now_monotonic() - t, ok);
+        }
+        // One parallel stop of the whole set, as `vm stop --all` does; each
+        // sample is that VM's own powerdown-to-exit time
+        StopTarget *targets = calloc(n, sizeof(StopTarget));
+        for (int i = 0; targets != NULL && i < n; i++) {
+            snprintf(targets[i].name, sizeof(targets[i].name), "bench-%d-%d", n, i);
+            vm_dir_path(targets[i].name, targets[i].vm_dir, sizeof(targets[i].vm_dir));
+        }
+        if (targets != NULL) {
+            stop_vms(targets, n, STOP_POWERDOWN_TIMEOUT, STOP_QUIT_TIMEOUT);
+            for (int i = 0; i < n; i++) {
+                bench_record(&ops[3], targets[i].seconds, strcmp(targets[i].result, "powerdown") == 0);
+            }
+            free(targets);
+        }
+        for (int i = 0; i < n; i++) {
+            snprintf(vm_name, sizeof(vm_name), "bench-%d-%d", n, i);
+            t = now_monotonic();
+            char tombstone[MAX_PATH];
+            int ok = vm_tombstone(vm_name, tombstone, sizeof(tombstone)) == 0;
+            bench_record(&ops[4], now_monotonic() - t, ok);
+        }
+        
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        for (int o = 0; o < 5; o++) {
+            bench_report(&results, n, &ops[o]);
+        }
+    }
+    
+    // Metadata: write then parse many vm-info.json files
+    if (metadata_files > 0) {
+        BenchOp meta[2] = {{"write-metadata", NULL, 0, 0, 0}, {"parse-metadata", NULL, 0, 0, 0}};
+        VMInfo info;
+        char vm_dir[MAX_PATH];
+        
+        fprintf(stderr, "bench: %d metadata files\n", metadata_files);
+        meta[0].samples = calloc(metadata_files, sizeof(double));
+        meta[1].samples = calloc(metadata_files, sizeof(double));
+        memset(&info, 0, sizeof(info));
+        snprintf(info.distro, sizeof(info.distro), "%s", DEFAULT_DISTRO);
+        snprintf(info.username, sizeof(info.username), "%s", DEFAULT_USER);
+        snprintf(info.password, sizeof(info.password), "bench\"pass\\word");
+        snprintf(info.mac, sizeof(info.mac), "52:54:00:12:34:56");
+        snprintf(info.disk_size, sizeof(info.disk_size), "%s", DEFAULT_DISK_SIZE);
+        snprintf(info.created, sizeof(info.created), "2024-01-01T00:00:00Z");
+        info.memory_mb = atoi(DEFAULT_MEMORY);
+        info.cpus = atoi(DEFAULT_CPUS);
+        snprintf(path, sizeof(path), "%s/metadata", root);
+        mkdir(path, 0755);
+        
+        for (int i = 0; i < metadata_files; i++) {
+            snprintf(info.name, sizeof(info.name), "meta-%d", i);
+            snprintf(vm_dir, sizeof(vm_dir), "%s/metadata/%s", root, info.name);
+            mkdir(vm_dir, 0755);
+            double t = now_monotonic();
+            int ok = save_vm_info(vm_dir, &info) == 0;
+            bench_record(&meta[0], now_monotonic() - t, ok);
+        }
+        for (int i = 0; i < metadata_files; i++) {
+            VMInfo loaded;
+            snprintf(vm_dir, sizeof(vm_dir), "%s/metadata/meta-%d", root, i);
+            double t = now_monotonic();
+            int ok = load_vm_info(vm_dir, &loaded) == 0;
+            bench_record(&meta[1], now_monotonic() - t, ok && strcmp(loaded.password, info.password) == 0);
+        }
+        bench_report(&results, metadata_files, &meta[0]);
+        bench_report(&results, metadata_files, &meta[1]);
+        free(meta[0].samples);
+        free(meta[1].samples);
+    }
+    close(devnull);
+    close(saved_stdout);
+    
+    struct utsname host;
+    uname(&host);
+    StrBuf report = {0};
+    sb_printf(&report, "{\n  \"version\": 1,\n  \"host\": {\"system\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", "
+              "\"cpus\": %ld},\n  \"stub_boot_ms\": %d,\n  \"results\": [\n%s\n  ]\n}\n",
+              host.sysname, host.release, host.machine, sysconf(_SC_NPROCESSORS_ONLN), boot_ms,
+              results.data ? results.data : "");
+    
+    if (output_path != NULL) {
+        FILE *fp = fopen(output_path, "w");
+        if (fp == NULL) {
+            log_error("Failed to write benchmark results");
+        } else {
+            fputs(report.data, fp);
+            fclose(fp);
+        }
+    } else {
+        fputs(report.data, stdout);
+    }
+    
+    // Compare p50 latency against a stored run
+    int regressions = 0;
+    if (baseline_path != NULL) {
+        BenchBaseline baseline[256];
+        BenchBaseline current[256];
+        int base_count = bench_load_baseline(baseline_path, baseline, 256);
+        char tmp_path[MAX_PATH];
+        snprintf(tmp_path, sizeof(tmp_path), "%s/results.json", root);
+        FILE *fp = fopen(tmp_path, "w");
+        if (fp) {
+            fputs(report.data, fp);
+            fclose(fp);
+        }
+        int cur_count = bench_load_baseline(tmp_path, current, 256);
+        
+        if (base_count < 0) {
+            log_error("Failed to read baseline");
+            regressions = 1;
+        }
+        fprintf(stderr, "\n%-8s %-8s %12s %12s %9s\n", "SCALE", "OP", "BASE p50", "NOW p50", "CHANGE");
+        for (int c = 0; c < cur_count; c++) {
+            for (int b = 0; b < base_count; b++) {
+                if (baseline[b].scale != current[c].scale || strcmp(baseline[b].op, current[c].op) != 0) continue;
+                double change = baseline[b].p50_ms > 0 ?
+                    (current[c].p50_ms - baseline[b].p50_ms) / baseline[b].p50_ms * 100 : 0;
+                int regressed = change > threshold;
+                regressions += regressed;
+                fprintf(stderr, "%-8d %-8s %10.3fms %10.3fms %+8.1f%%%s\n", current[c].scale, current[c].op,
+                        baseline[b].p50_ms, current[c].p50_ms, change, regressed ? "  REGRESSION" : "");
+            }
+        }
+    }
+    
+    if (!keep) {
+        remove_tree(root);
+    } else {
+        fprintf(stderr, "bench: sandbox kept at %s\n", root);
+    }
+    
+    for (int o = 0; o < 5; o++) free(ops[o].samples);
+    free(macs);
+    sb_free(&results);
+    sb_free(&report);
+    return regressions > 0 ? 1 : 0;
+}
+#endif
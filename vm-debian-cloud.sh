@@ -16,6 +16,12 @@ VM_MONITOR_SOCKET=".vm_monitor"
 
 # File paths - Use stable Debian 12 instead of unstable 13 (trixie)
 CLOUD_IMAGE_URL="https://cloud.debian.org/images/cloud/bookworm/latest/debian-12-generic-arm64.qcow2"
+# A mirror from the v4m distro registry (~/.v4m/distros.conf) takes precedence;
+# file:// mirrors are skipped, only the C front end pulls from them
+if [ -f "$HOME/.v4m/distros.conf" ]; then
+    REGISTRY_URL=$(awk -v d="debian12" '$1 == d && $2 == "aarch64" && $6 !~ /^file:/ { print $6; exit }' "$HOME/.v4m/distros.conf")
+    CLOUD_IMAGE_URL="${REGISTRY_URL:-$CLOUD_IMAGE_URL}"
+fi
 CLOUD_IMAGE="debian-12-generic-arm64.qcow2"
 VM_DISK="${VM_NAME}.qcow2"
 CLOUD_INIT_ISO="${VM_NAME}-cloud-init.iso"